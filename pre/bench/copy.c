@@ -0,0 +1,42 @@
+/* rep movsb, rep stosb, repne scasb によるブロックの転送と文字列の走査
+ * (-O2 のコンパイラは memcpy, memset, strlen をこれらの命令に展開する) */
+
+#define SIZE 16384
+#define ROUNDS 3000
+
+static char a[SIZE];
+static char b[SIZE];
+
+static void copy(void* dst, const void* src, unsigned long n)
+{
+    __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static void fill(void* dst, int c, unsigned long n)
+{
+    __asm__ volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(c) : "memory");
+}
+
+static unsigned long length(const char* s)
+{
+    unsigned long n = -1;
+
+    __asm__ volatile("repne scasb" : "+D"(s), "+c"(n) : "a"(0) : "memory");
+    return ~n - 1;
+}
+
+int main(void)
+{
+    unsigned int sum = 0;
+    int i;
+
+    for (i = 0; i < ROUNDS; i++) {
+        fill(a, 'a' + i % 26, SIZE);
+        a[SIZE - 1 - i] = 0;
+        copy(b, a, SIZE);
+        sum = sum * 31;
+        sum += length(b);
+        sum += b[i];
+    }
+    return sum;
+}
@@ -0,0 +1,41 @@
+/* CRC32: 1ビットずつ計算する CRC32 を同じバッファに繰り返しかける */
+
+#define SIZE 4096
+#define ROUNDS 16
+
+static unsigned char buffer[SIZE];
+
+static unsigned int crc32(const unsigned char* p, const unsigned char* end,
+                          unsigned int crc)
+{
+    int j;
+
+    crc = ~crc;
+    for (; p < end; p++) {
+        crc ^= *p;
+        for (j = 0; j < 8; j++) {
+            if (crc & 1) {
+                crc = (crc >> 1) ^ 0xedb88320;
+            } else {
+                crc >>= 1;
+            }
+        }
+    }
+    return ~crc;
+}
+
+int main(void)
+{
+    unsigned char* p = buffer;
+    unsigned int crc = 0;
+    int i;
+
+    for (i = 0; i < SIZE; i++) {
+        *p++ = i ^ (i >> 8);
+    }
+
+    for (i = 0; i < ROUNDS; i++) {
+        crc = crc32(buffer, buffer + SIZE, crc);
+    }
+    return crc;
+}
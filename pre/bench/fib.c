@@ -0,0 +1,14 @@
+/* 再帰呼び出しによるフィボナッチ数 */
+
+static int fib(int n)
+{
+    if (n < 2) {
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+}
+
+int main(void)
+{
+    return fib(27);
+}
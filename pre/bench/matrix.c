@@ -0,0 +1,54 @@
+/* 行列の積: 整数の正方行列の積を繰り返し計算する */
+
+#define N 48
+#define ROUNDS 6
+
+static int a[N * N];
+static int b[N * N];
+static int c[N * N];
+
+int main(void)
+{
+    int sum = 0;
+    int* p;
+    int* q;
+    int i, j, k, r;
+
+    p = a;
+    q = b;
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < N; j++) {
+            *p++ = i + j;
+            *q++ = i * 2 - j + 1;
+        }
+    }
+
+    for (r = 0; r < ROUNDS; r++) {
+        int* out = c;
+        int* row = a;
+
+        for (i = 0; i < N; i++) {
+            for (j = 0; j < N; j++) {
+                int* x = row;
+                int* y = b + j;
+                int value = 0;
+
+                for (k = 0; k < N; k++) {
+                    value += *x * *y;
+                    x++;
+                    y += N;
+                }
+                *out++ = value;
+            }
+            row += N;
+        }
+
+        /* 次の周回の入力を結果に依存させる */
+        *(a + r * (N + 1)) = *(c + (N - 1 - r) * N + r);
+    }
+
+    for (p = c; p < c + N * N; p += N + 1) {
+        sum += *p;
+    }
+    return sum;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# mixgen で生成したゲストを px86 -q で実行し、ミックスごとの
+# 1命令あたりの時間を CSV で出力する
+#
+# usage: mix.sh [-n 回数] [px86 のパス] [mixgen のパス]
+#
+# 列: mix,instructions,min_s,ns_per_insn
+# 時間は n 回のうち最短のもの。命令数はループの制御の命令も含む。
+
+RUNS=3
+if [ "$1" = "-n" ]; then
+    RUNS=$2
+    shift 2
+fi
+PX86=${1:-../px86}
+MIXGEN=${2:-./mixgen}
+BIN=${TMPDIR:-/tmp}/mix.$$.bin
+
+# 名前と mixgen に渡す種類:重み
+MIXES="
+mov_rr mov_rr
+mov_mod0 mov_mod0
+mov_mod1 mov_mod1
+mov_mod2 mov_mod2
+add add
+push_pop push_pop
+cmp_jcc cmp_jcc
+call_ret call_ret
+mixed mov_rr:4 mov_mod1:3 add:2 push_pop:1 cmp_jcc:1 call_ret:1
+"
+
+echo "mix,instructions,min_s,ns_per_insn"
+
+echo "$MIXES" | while read -r name spec; do
+    [ -z "$name" ] && continue
+
+    # ループが 1KB を超えるとブロックキャッシュ(eip の下位 10 ビットで引く)
+    # の衝突で毎回デコードし直すことになるので、展開は 100 命令に留める
+    # shellcheck disable=SC2086
+    "$MIXGEN" -n 100 -i 200000 "$BIN" $spec > /dev/null || exit 1
+
+    min=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        output=$("$PX86" -q "$BIN")
+        end=$(date +%s%N)
+        time=$((end - start))
+        if [ -z "$min" ] || [ $time -lt "$min" ]; then
+            min=$time
+        fi
+        i=$((i + 1))
+    done
+
+    count=$(echo "$output" | sed -n 's/^Instructions = //p')
+    awk -v name="$name" -v count="${count:-0}" -v ns="$min" 'BEGIN {
+        printf("%s,%.0f,%.6f,%.3f\n", name, count, ns / 1e9,
+               count > 0 ? ns / count : 0)
+    }'
+done
+
+rm -f "$BIN"
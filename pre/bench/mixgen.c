@@ -0,0 +1,272 @@
+/* 命令の組み合わせ(ミックス)ごとの実行時間を測るためのゲストを生成する
+ *
+ * usage: mixgen [-n 命令数] [-i 周回数] output.bin 種類[:重み]...
+ *
+ * 0x7c00 に読み込まれるフラットなバイナリを出力する。中身は、指定した
+ * 種類の命令を重みの比率で並べて展開したループで、最後に 0 番地へ
+ * ジャンプして終了する。ループの制御には ecx を、メモリの読み書きには
+ * ebx と ebp が指す領域を使う。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define LOAD_ADDRESS 0x7c00
+
+/* メモリのオペランドが指す領域(コードのページとは重ならない) */
+#define DATA_ADDRESS 0x1000
+
+#define MAX_CODE (1024 * 1024 - LOAD_ADDRESS)
+
+typedef struct {
+    uint8_t code[MAX_CODE];
+    uint32_t size;
+} Buffer;
+
+static void emit8(Buffer* b, uint8_t value)
+{
+    if (b->size >= MAX_CODE) {
+        fprintf(stderr, "mixgen: code is too large\n");
+        exit(1);
+    }
+    b->code[b->size++] = value;
+}
+
+static void emit32(Buffer* b, uint32_t value)
+{
+    emit8(b, value);
+    emit8(b, value >> 8);
+    emit8(b, value >> 16);
+    emit8(b, value >> 24);
+}
+
+/* 呼び出される ret だけの関数のアドレス(ループの後ろに置く) */
+static uint32_t ret_address;
+
+/* 1つ分の命令を出力し、その命令数を返す
+ *
+ * seq は同じ種類の中での通し番号で、レジスタや読み書きを交互に変える。
+ */
+typedef int emit_func_t(Buffer* b, uint32_t seq);
+
+/* mov r32, r32 (eax, edx, esi, edi の間) */
+static int emit_mov_rr(Buffer* b, uint32_t seq)
+{
+    static const uint8_t regs[] = { 0, 2, 6, 7 };
+    uint8_t dst = regs[seq & 3];
+    uint8_t src = regs[(seq + 1) & 3];
+
+    emit8(b, 0x89);
+    emit8(b, 0xC0 | src << 3 | dst);
+    return 1;
+}
+
+/* mov eax, [ebx] / mov [ebx], eax (mod = 0) */
+static int emit_mov_mod0(Buffer* b, uint32_t seq)
+{
+    emit8(b, seq & 1 ? 0x89 : 0x8B);
+    emit8(b, 0x03);
+    return 1;
+}
+
+/* mov eax, [ebp+disp8] / mov [ebp+disp8], eax (mod = 1) */
+static int emit_mov_mod1(Buffer* b, uint32_t seq)
+{
+    emit8(b, seq & 1 ? 0x89 : 0x8B);
+    emit8(b, 0x45);
+    emit8(b, (seq & 0x1f) * 4);
+    return 1;
+}
+
+/* mov eax, [ebp+disp32] / mov [ebp+disp32], eax (mod = 2) */
+static int emit_mov_mod2(Buffer* b, uint32_t seq)
+{
+    emit8(b, seq & 1 ? 0x89 : 0x8B);
+    emit8(b, 0x85);
+    emit32(b, 0x100 + (seq & 0x3f) * 4);
+    return 1;
+}
+
+/* add r32, r32 */
+static int emit_add(Buffer* b, uint32_t seq)
+{
+    emit8(b, 0x01);
+    emit8(b, 0xC0 | (seq & 1 ? 2 : 0) << 3 | (seq & 1 ? 0 : 2));
+    return 1;
+}
+
+/* push eax; pop edx */
+static int emit_push_pop(Buffer* b, uint32_t seq)
+{
+    emit8(b, 0x50);
+    emit8(b, 0x5A);
+    return 2;
+}
+
+/* cmp eax, edx; jz/jnz +0(分岐してもしなくても次の命令に進む) */
+static int emit_cmp_jcc(Buffer* b, uint32_t seq)
+{
+    emit8(b, 0x3B);
+    emit8(b, 0xC2);
+    emit8(b, seq & 1 ? 0x75 : 0x74);
+    emit8(b, 0x00);
+    return 2;
+}
+
+/* call ret_address(ret だけの関数) */
+static int emit_call_ret(Buffer* b, uint32_t seq)
+{
+    uint32_t next = LOAD_ADDRESS + b->size + 5;
+
+    emit8(b, 0xE8);
+    emit32(b, ret_address - next);
+    return 2;
+}
+
+typedef struct {
+    const char* name;
+    emit_func_t* emit;
+} MixKind;
+
+static const MixKind kinds[] = {
+    { "mov_rr", emit_mov_rr },
+    { "mov_mod0", emit_mov_mod0 },
+    { "mov_mod1", emit_mov_mod1 },
+    { "mov_mod2", emit_mov_mod2 },
+    { "add", emit_add },
+    { "push_pop", emit_push_pop },
+    { "cmp_jcc", emit_cmp_jcc },
+    { "call_ret", emit_call_ret },
+};
+
+#define KINDS_COUNT (sizeof(kinds) / sizeof(kinds[0]))
+
+static void usage(void)
+{
+    size_t i;
+
+    fprintf(stderr, "usage: mixgen [-n count] [-i iterations] output.bin kind[:weight]...\n");
+    fprintf(stderr, "kinds:");
+    for (i = 0; i < KINDS_COUNT; i++) {
+        fprintf(stderr, " %s", kinds[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    static Buffer buffer;
+    Buffer* b = &buffer;
+    uint32_t weights[KINDS_COUNT] = { 0 };
+    uint32_t emitted[KINDS_COUNT] = { 0 };
+    uint32_t total_weight = 0;
+    uint32_t count = 1000;
+    uint32_t iterations = 10000;
+    uint32_t instructions = 0;
+    uint32_t loop, i;
+    const char* output;
+    FILE* file;
+    int arg = 1;
+
+    while (arg < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) {
+            count = strtoul(argv[arg + 1], NULL, 0);
+        } else if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc) {
+            iterations = strtoul(argv[arg + 1], NULL, 0);
+        } else {
+            usage();
+        }
+        arg += 2;
+    }
+
+    if (argc - arg < 2 || count == 0 || iterations == 0) {
+        usage();
+    }
+    output = argv[arg++];
+
+    for (; arg < argc; arg++) {
+        const char* colon = strchr(argv[arg], ':');
+        size_t length = colon ? (size_t)(colon - argv[arg]) : strlen(argv[arg]);
+
+        for (i = 0; i < KINDS_COUNT; i++) {
+            if (strlen(kinds[i].name) == length
+                && strncmp(kinds[i].name, argv[arg], length) == 0) {
+                break;
+            }
+        }
+        if (i == KINDS_COUNT) {
+            fprintf(stderr, "mixgen: unknown kind %s\n", argv[arg]);
+            usage();
+        }
+        weights[i] += colon ? strtoul(colon + 1, NULL, 0) : 1;
+        total_weight += colon ? strtoul(colon + 1, NULL, 0) : 1;
+    }
+
+    if (total_weight == 0) {
+        usage();
+    }
+
+    /* 先頭で ret だけの関数を飛び越す */
+    emit8(b, 0xEB);                                   /* jmp short +1 */
+    emit8(b, 0x01);
+    ret_address = LOAD_ADDRESS + b->size;
+    emit8(b, 0xC3);                                   /* ret */
+
+    emit8(b, 0xB9);                                   /* mov ecx, iterations */
+    emit32(b, iterations);
+    emit8(b, 0xBB);                                   /* mov ebx, DATA_ADDRESS */
+    emit32(b, DATA_ADDRESS);
+    emit8(b, 0xBD);                                   /* mov ebp, DATA_ADDRESS */
+    emit32(b, DATA_ADDRESS);
+
+    loop = LOAD_ADDRESS + b->size;
+
+    /* 重みの比率を保つように、出力した数が重みに比べて最も少ない種類を
+     * 順に選ぶ(同じ比率なら種類の順に交互に並ぶ) */
+    for (i = 0; i < count; i++) {
+        size_t k, best = KINDS_COUNT;
+
+        for (k = 0; k < KINDS_COUNT; k++) {
+            if (weights[k] == 0) {
+                continue;
+            }
+            if (best == KINDS_COUNT
+                || (uint64_t)emitted[k] * weights[best]
+                   < (uint64_t)emitted[best] * weights[k]) {
+                best = k;
+            }
+        }
+
+        instructions += kinds[best].emit(b, emitted[best]);
+        emitted[best]++;
+    }
+
+    /* sub ecx, 1; jnz loop */
+    emit8(b, 0x83);
+    emit8(b, 0xE9);
+    emit8(b, 0x01);
+    emit8(b, 0x0F);
+    emit8(b, 0x85);
+    emit32(b, loop - (LOAD_ADDRESS + b->size + 4));
+    instructions += 2;
+
+    /* jmp 0(プログラムの終了) */
+    emit8(b, 0xE9);
+    emit32(b, 0 - (LOAD_ADDRESS + b->size + 4));
+
+    file = fopen(output, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "mixgen: cannot open %s\n", output);
+        return 1;
+    }
+    fwrite(b->code, 1, b->size, file);
+    fclose(file);
+
+    /* ループ1周あたりの命令数(ループの制御を含む) */
+    printf("%u\n", instructions);
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+/* ゲストと同じ main をホストで実行して時間を測る
+ *
+ * usage: name.native [回数]
+ *
+ * main(bench_main に名前を変えてリンクする)を指定した回数だけ呼び、
+ * 戻り値と最短の実行時間(秒)を出力する。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int bench_main(void);
+
+int main(int argc, char* argv[])
+{
+    int repeat = argc > 1 ? atoi(argv[1]) : 5;
+    double best = 0;
+    unsigned int result = 0;
+    int i;
+
+    for (i = 0; i < repeat; i++) {
+        struct timespec start, end;
+        double time;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = bench_main();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (i == 0 || time < best) {
+            best = time;
+        }
+    }
+
+    printf("%08x %.9f\n", result, best);
+    return 0;
+}
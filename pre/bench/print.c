@@ -0,0 +1,46 @@
+/* シリアルポートへの大量の出力: 番号付きの行を出力して文字の合計を返す
+ *
+ * 1文字ごとに out dx, al を実行するので、エミュレータの出力の速さを測る。
+ * 数字は割り算を使わずに、10進の桁の配列を繰り上げて作る。 */
+
+#define LINES 20000
+
+static const char text[] = ": the quick brown fox jumps over the lazy dog\n";
+
+static void put_char(char c)
+{
+    __asm__ volatile ("outb %%al, %%dx" : : "a"(c), "d"(0x3f8));
+}
+
+int main(void)
+{
+    char digits[5] = { '0', '0', '0', '0', '0' };
+    unsigned int sum = 0;
+    int line;
+
+    for (line = 0; line < LINES; line++) {
+        const char* p;
+        char* d;
+
+        put_char('#');
+        for (d = digits; d != digits + 5; d++) {
+            put_char(*d);
+            sum += *d;
+        }
+        for (p = text; *p != '\0'; p++) {
+            put_char(*p);
+            sum += *p;
+        }
+
+        /* 次の番号にする(下の桁から繰り上げる) */
+        for (d = digits + 4; ; d--) {
+            if (*d != '9') {
+                (*d)++;
+                break;
+            }
+            *d = '0';
+        }
+    }
+
+    return sum;
+}
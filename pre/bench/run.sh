@@ -0,0 +1,63 @@
+#!/bin/sh
+# ベンチマークのゲストを px86 -q で繰り返し実行し、結果を CSV で出力する
+#
+# usage: run.sh [-n 回数] [px86 のパス]
+#
+# 列: name,runs,instructions,mean_s,stddev_s,min_s,mips,eax,status
+# mips は平均の実行時間から求める。eax が期待値と違えば status は FAIL。
+
+RUNS=5
+if [ "$1" = "-n" ]; then
+    RUNS=$2
+    shift 2
+fi
+PX86=${1:-../px86}
+DIR=$(dirname "$0")
+
+# 名前と、main の戻り値(EAX)の期待値
+BENCHMARKS="
+sort 000950f5
+crc32 e161f1f0
+search 00002398
+matrix 00553f18
+fib 0002ff42
+print 054d44f0
+copy dd056e80
+"
+
+echo "name,runs,instructions,mean_s,stddev_s,min_s,mips,eax,status"
+
+echo "$BENCHMARKS" | while read -r name expected; do
+    [ -z "$name" ] && continue
+
+    times=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        output=$("$PX86" -q "$DIR/$name.bin")
+        end=$(date +%s%N)
+        times="$times $((end - start))"
+        i=$((i + 1))
+    done
+
+    count=$(echo "$output" | sed -n 's/^Instructions = //p')
+    eax=$(echo "$output" | sed -n 's/^EAX = //p')
+    status=ok
+    [ "$eax" != "$expected" ] && status=FAIL
+
+    echo "$times" | awk -v name="$name" -v count="${count:-0}" \
+                        -v eax="$eax" -v status="$status" '{
+        sum = 0; min = $1
+        for (i = 1; i <= NF; i++) {
+            sum += $i
+            if ($i < min) min = $i
+        }
+        mean = sum / NF
+        var = 0
+        for (i = 1; i <= NF; i++) var += ($i - mean) ^ 2
+        stddev = NF > 1 ? sqrt(var / (NF - 1)) : 0
+        mips = mean > 0 ? count / (mean / 1e3) : 0
+        printf("%s,%d,%.0f,%.6f,%.6f,%.6f,%.2f,%s,%s\n", name, NF, count,
+               mean / 1e9, stddev / 1e9, min / 1e9, mips, eax, status)
+    }'
+done
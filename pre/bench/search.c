@@ -0,0 +1,59 @@
+/* 文字列検索: 生成した文章の中から単語を素朴な方法で探して数える */
+
+#define SIZE 16384
+#define ROUNDS 16
+
+static char text[SIZE + 1];
+
+static const char* const words[] = { "emulator", "x86", "register", "opcode" };
+
+static int count_matches(const char* haystack, const char* needle)
+{
+    int count = 0;
+
+    for (; *haystack != '\0'; haystack++) {
+        const char* h = haystack;
+        const char* n = needle;
+
+        while (*n != '\0' && *h == *n) {
+            h++;
+            n++;
+        }
+        if (*n == '\0') {
+            count++;
+        }
+    }
+    return count;
+}
+
+int main(void)
+{
+    unsigned int seed = 1;
+    char* p = text;
+    char* end = text + SIZE;
+    int total = 0;
+    int i;
+
+    /* 単語を擬似乱数の順に空白で区切って並べる */
+    while (p < end) {
+        const char* word;
+
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        word = *(words + (seed & 3));
+
+        while (*word != '\0' && p < end) {
+            *p++ = *word++;
+        }
+        if (p < end) {
+            *p++ = ' ';
+        }
+    }
+    *end = '\0';
+
+    for (i = 0; i < ROUNDS; i++) {
+        total += count_matches(text, *(words + (i & 3)));
+    }
+    return total;
+}
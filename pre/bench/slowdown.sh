@@ -0,0 +1,66 @@
+#!/bin/sh
+# 同じ C のプログラムをエミュレータとホストで実行して、速度の比を CSV で出力する
+#
+# usage: slowdown.sh [-n 回数] [px86 のパス]
+#
+# make all native で作った name.bin(ゲスト)と name.native(ホスト)を比べる。
+# 列: program,emulated_s,native_s,slowdown,eax,status
+# 時間はどちらも n 回のうち最短のもの。エミュレータの時間はプロセスの
+# 起動を含み、ホストの時間は main の呼び出しだけを測る。最後の行は
+# slowdown の幾何平均。
+
+RUNS=3
+if [ "$1" = "-n" ]; then
+    RUNS=$2
+    shift 2
+fi
+PX86=${1:-../px86}
+DIR=$(dirname "$0")
+
+PROGRAMS="
+sort
+crc32
+search
+matrix
+fib
+slowdown/abs
+slowdown/my_add
+slowdown/for
+slowdown/mydiv
+"
+
+echo "program,emulated_s,native_s,slowdown,eax,status"
+
+for name in $PROGRAMS; do
+    min=""
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        output=$("$PX86" -q "$DIR/$name.bin")
+        end=$(date +%s%N)
+        time=$((end - start))
+        if [ -z "$min" ] || [ $time -lt "$min" ]; then
+            min=$time
+        fi
+        i=$((i + 1))
+    done
+
+    eax=$(echo "$output" | sed -n 's/^EAX = //p')
+    set -- $("$DIR/$name.native" "$RUNS")
+    status=ok
+    [ "$eax" != "$1" ] && status=FAIL
+
+    awk -v name="$name" -v ns="$min" -v native="$2" \
+        -v eax="$eax" -v status="$status" 'BEGIN {
+        printf("%s,%.6f,%.6f,%.1f,%s,%s\n", name, ns / 1e9, native,
+               native > 0 ? ns / 1e9 / native : 0, eax, status)
+    }'
+done | awk -F, '{
+    print
+    if ($4 > 0) {
+        sum += log($4)
+        n++
+    }
+} END {
+    printf("geomean,,,%.1f,,\n", n > 0 ? exp(sum / n) : 0)
+}'
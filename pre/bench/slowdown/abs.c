@@ -0,0 +1,16 @@
+/* exec-abs の abs を繰り返し呼ぶ */
+
+#include "../../../exec-abs/abs.c"
+
+#define ITERATIONS 400000
+
+int main(void)
+{
+    unsigned int sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        sum += abs(i - ITERATIONS / 2);
+    }
+    return sum;
+}
@@ -0,0 +1,15 @@
+/* pasm-for の func(10回のループ)を繰り返し呼ぶ */
+
+#include "../../../pasm-for/pasm-for.c"
+
+#define ITERATIONS 100000
+
+int main(void)
+{
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        func();
+    }
+    return i;
+}
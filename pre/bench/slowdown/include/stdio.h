@@ -0,0 +1,11 @@
+/* ゲスト用の stdio.h
+ *
+ * ゲストには libc がないので、サンプルの printf は何もしない。
+ * ホスト用のビルドではこのディレクトリを使わない。
+ */
+#ifndef STDIO_H_
+#define STDIO_H_
+
+#define printf(...) 0
+
+#endif
@@ -0,0 +1,16 @@
+/* exec-my-add の my_add を繰り返し呼ぶ */
+
+#include "../../../exec-my-add/my_add.c"
+
+#define ITERATIONS 400000
+
+int main(void)
+{
+    int sum = 0;
+    int i;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        sum = my_add(sum, i & 0xff);
+    }
+    return sum;
+}
@@ -0,0 +1,22 @@
+/* pasm-mydiv の mydiv を繰り返し呼ぶ
+ *
+ * 元の main は printf を使うので、名前を変えて使わない。 */
+
+#define main mydiv_main
+#include "../../../pasm-mydiv/mydiv.c"
+#undef main
+
+#define ITERATIONS 200000
+
+int main(void)
+{
+    unsigned int sum = 0;
+    int q, r;
+    int i;
+
+    for (i = 1; i <= ITERATIONS; i++) {
+        mydiv(i * 7 - ITERATIONS, i, &q, &r);
+        sum += q + r;
+    }
+    return sum;
+}
@@ -0,0 +1,43 @@
+/* 挿入ソート: 擬似乱数で作った整数の配列を整列して検算値を返す
+ *
+ * SIB のアドレッシングを使わないように、配列は添字ではなくポインタで
+ * たどる。 */
+
+#define COUNT 2000
+
+static int data[COUNT];
+
+static unsigned int next_random(unsigned int x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+int main(void)
+{
+    unsigned int seed = 2463534242u;
+    int* end = data + COUNT;
+    int* p;
+    int* q;
+    int sum = 0;
+
+    for (p = data; p < end; p++) {
+        seed = next_random(seed);
+        *p = seed & 0xffff;
+    }
+
+    for (p = data + 1; p < end; p++) {
+        int value = *p;
+        for (q = p - 1; q >= data && *q > value; q--) {
+            q[1] = *q;
+        }
+        q[1] = value;
+    }
+
+    for (p = data; p < end; p += 100) {
+        sum += *p;
+    }
+    return sum;
+}
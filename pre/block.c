@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "emulator_function.h"
+#include "bus.h"
+#include "mmu.h"
+
+BlockCache* create_block_cache(void)
+{
+    BlockCache* cache = calloc(1, sizeof(BlockCache));
+
+#ifdef ENABLE_JIT
+    cache->jit = create_jit_cache();
+#endif
+
+    return cache;
+}
+
+void destroy_block_cache(BlockCache* cache)
+{
+    destroy_jit_cache(cache->jit);
+    free(cache);
+}
+
+void flush_block_cache(BlockCache* cache)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        cache->blocks[i].count = 0;
+    }
+    memset(cache->code_pages, 0, sizeof(cache->code_pages));
+    memset(cache->code_lines, 0, sizeof(cache->code_lines));
+
+    flush_jit_cache(cache->jit);
+}
+
+void invalidate_blocks(BlockCache* cache, uint32_t start, uint32_t end)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        Block* block = &cache->blocks[i];
+
+        if (block->count > 0 && block->start < end && start < block->end) {
+            block->count = 0;
+        }
+    }
+}
+
+/* ビットマップの first 番目から last 番目までのビットを立てる */
+static void set_bits(uint8_t* bitmap, uint32_t first, uint32_t last)
+{
+    uint32_t i;
+
+    for (i = first; i <= last; i++) {
+        bitmap[i >> 3] |= 1 << (i & 7);
+    }
+}
+
+/* コードのある範囲に印を付ける */
+static void mark_code(BlockCache* cache, CodeRange* range)
+{
+    uint32_t start = range->start;
+    uint32_t end = range->end < MEMORY_SIZE ? range->end : MEMORY_SIZE;
+
+    if (start >= end) {
+        return;
+    }
+
+    set_bits(cache->code_pages, start >> CODE_PAGE_SHIFT, (end - 1) >> CODE_PAGE_SHIFT);
+    memset(&cache->code_lines[start >> CODE_LINE_SHIFT], 1,
+           ((end - 1) >> CODE_LINE_SHIFT) - (start >> CODE_LINE_SHIFT) + 1);
+}
+
+/* ブロックの命令がある物理アドレスの範囲を求める */
+static void locate_code(Emulator* emu, Block* block)
+{
+    uint32_t length = block->end - block->start;
+    uint32_t first;
+
+    memset(block->code, 0, sizeof(block->code));
+
+    if (!(emu->cr0 & CR0_PG)) {
+        block->code[0].start = block->start;
+        block->code[0].end = block->end;
+        return;
+    }
+
+    /* 先頭のページに収まる長さ */
+    first = PAGE_SIZE - (block->start & (PAGE_SIZE - 1));
+    if (first > length) {
+        first = length;
+    }
+
+    block->code[0].start = to_physical(emu, block->start, FALSE);
+    block->code[0].end = block->code[0].start + first;
+
+    if (first < length) {
+        block->code[1].start = to_physical(emu, block->start + first, FALSE);
+        block->code[1].end = block->code[1].start + (length - first);
+    }
+}
+
+/* ブロックの命令が [start, end) に重なるか */
+static int overlaps_code(Block* block, uint32_t start, uint32_t end)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (block->code[i].start < end && start < block->code[i].end) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+void write_code(Emulator* emu, uint32_t address, int size)
+{
+    BlockCache* cache = emu->block_cache;
+    uint32_t last = address + size - 1;
+    uint32_t page;
+    int i;
+
+    /* 同じページでもコードのない範囲への書き込み(スタックなど)は無視する */
+    if (last >= MEMORY_SIZE
+        || (!cache->code_lines[address >> CODE_LINE_SHIFT]
+            && !cache->code_lines[last >> CODE_LINE_SHIFT])) {
+        return;
+    }
+
+    cache->smc_writes++;
+
+    /* 重なるブロックを無効にして、残ったブロックで書き込んだページの
+     * 印を付けなおす(追い出されたブロックの古い印もここで消える) */
+    for (page = address >> CODE_PAGE_SHIFT; page <= last >> CODE_PAGE_SHIFT; page++) {
+        cache->code_pages[page >> 3] &= ~(1 << (page & 7));
+        memset(&cache->code_lines[page << (CODE_PAGE_SHIFT - CODE_LINE_SHIFT)], 0,
+               1 << (CODE_PAGE_SHIFT - CODE_LINE_SHIFT));
+    }
+
+    for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        Block* block = &cache->blocks[i];
+
+        if (block->count == 0) {
+            continue;
+        }
+
+        if (overlaps_code(block, address, address + size)) {
+            block->count = 0;
+            cache->smc_invalidations++;
+            if (block == cache->running) {
+                emu->block_invalidated = TRUE;
+            }
+        } else {
+            mark_code(cache, &block->code[0]);
+            mark_code(cache, &block->code[1]);
+        }
+    }
+}
+
+/* ポーリングのループに含めてよい命令か
+ *
+ * メモリ、スタック、I/O ポートに書き込まない命令だけを許す。レジスタと
+ * フラグは書き換えてもよい(周回ごとに同じ値になるかは is_idle_loop で
+ * 確かめる)。メモリを読むなら *memory を TRUE にする。
+ */
+static int is_idle_instruction(Instruction* insn, int* memory)
+{
+    uint8_t op = insn->opecode;
+    int modrm_memory = (insn->format & OPF_MODRM) && insn->modrm.mod != 3;
+    int allowed;
+
+    if (op < 0x40 && (op & 7) <= 5) {
+        /* ALU 命令(r/m に書き込むのは cmp とレジスタへの演算だけ) */
+        allowed = (op & 7) > 1 || (op >> 3) == 7 || !modrm_memory;
+    } else {
+        switch (op) {
+        case 0x81:
+        case 0x83:
+            allowed = insn->modrm.opecode == 7 || !modrm_memory;
+            break;
+        case 0x88:
+        case 0x89:
+        case 0xC1:
+        case 0xD1:
+        case 0xD3:
+            allowed = !modrm_memory;
+            break;
+        case 0x84: case 0x85: case 0x8A: case 0x8B: case 0x8D:
+        case 0x90: case 0xA1: case 0xEC:
+        case 0xB0: case 0xB1: case 0xB2: case 0xB3:
+        case 0xB4: case 0xB5: case 0xB6: case 0xB7:
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+        case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+            allowed = TRUE;
+            break;
+        default:
+            allowed = FALSE;
+            break;
+        }
+    }
+
+    if ((modrm_memory && op != 0x8D) || op == 0xA1) {
+        *memory = TRUE;
+    }
+    return allowed;
+}
+
+/* ブロックがポーリングのループの候補か調べる(IDLE_* を返す) */
+static int classify_idle(Block* block)
+{
+    Instruction* last = &block->instructions[block->count - 1];
+    int memory = FALSE;
+    uint32_t target;
+    int i;
+
+    for (i = 0; i < block->count - 1; i++) {
+        if (!is_idle_instruction(&block->instructions[i], &memory)) {
+            return 0;
+        }
+    }
+
+    /* 最後は先頭に戻る分岐(比較と融合した条件分岐、jmp, jcc) */
+    if (last->fused_opecode != 0) {
+        if (!is_idle_instruction(last, &memory)) {
+            return 0;
+        }
+        target = block->end + last->branch;
+    } else if (last->opecode == 0xEB || last->opecode == 0xE9
+               || (last->opecode >= 0x70 && last->opecode <= 0x7F)) {
+        target = block->end + last->imm;
+    } else {
+        return 0;
+    }
+
+    if (target != block->start) {
+        return 0;
+    }
+    return IDLE_LOOP | (memory ? IDLE_READS_MEMORY : 0);
+}
+
+int is_idle_loop(Emulator* emu, Block* block, uint32_t* wakeups)
+{
+    IdleLoop* loop = &emu->idle_loop;
+    uint32_t eflags;
+    int same;
+
+    /* ループを抜けたか、MMIO を読んでいる(値が勝手に変わるかもしれない) */
+    if (emu->eip != block->start
+        || ((block->idle & IDLE_READS_MEMORY)
+            && emu->bus != NULL && emu->bus->device_count > 0)) {
+        loop->eip = 0;
+        return FALSE;
+    }
+
+    eflags = get_eflags(emu);
+    same = loop->eip == block->start
+           && loop->retired + block->retired == emu->retired
+           && loop->unstable_reads == emu->unstable_reads
+           && loop->eflags == eflags
+           && memcmp(loop->registers, emu->registers, sizeof(loop->registers)) == 0;
+
+    *wakeups = loop->wakeups;
+
+    loop->eip = block->start;
+    loop->retired = emu->retired;
+    memcpy(loop->registers, emu->registers, sizeof(loop->registers));
+    loop->eflags = eflags;
+    loop->unstable_reads = emu->unstable_reads;
+    loop->wakeups = __atomic_load_n(&emu->wakeups, __ATOMIC_SEQ_CST);
+
+    return same;
+}
+
+/* address から始まる基本ブロックをデコードする */
+static void build_block(Emulator* emu, Block* block, uint32_t address)
+{
+    block->start = address;
+    block->count = 0;
+    block->retired = 0;
+    block->hits = 0;
+    block->native = NULL;
+    block->native_count = 0;
+
+    while (block->count < BLOCK_MAX_INSTRUCTIONS
+           && ((emu->cr0 & CR0_PG) || address < MEMORY_SIZE)) {
+        Instruction* insn = &block->instructions[block->count];
+
+        /* ページングが有効なら、ブロックは1つのページに収まる命令で終える */
+        if ((emu->cr0 & CR0_PG) && block->count > 0
+            && (address & PAGE_MASK) != (block->start & PAGE_MASK)) {
+            break;
+        }
+
+        if (!decode_instruction(emu, address, insn)) {
+            break;
+        }
+
+        address += insn->length;
+        block->retired++;
+
+        /* 比較の直後の条件分岐は比較命令と融合する */
+        if (block->count > 0 && fuse_instructions(insn - 1, insn)) {
+            break;
+        }
+
+        block->count++;
+
+        if (insn->format & OPF_BRANCH) {
+            break;
+        }
+    }
+
+    block->end = address;
+    end_instructions(&block->instructions[block->count]);
+    block->idle = block->count > 0 ? classify_idle(block) : 0;
+#ifdef LOOP_IDIOMS
+    recognize_idiom(block);
+#endif
+
+    /* 書き換えを検出できるように、命令のある範囲に印を付ける */
+    if (block->count > 0) {
+        locate_code(emu, block);
+        mark_code(emu->block_cache, &block->code[0]);
+        mark_code(emu->block_cache, &block->code[1]);
+    }
+}
+
+Block* lookup_block(Emulator* emu)
+{
+    Block* block = &emu->block_cache->blocks[emu->eip & (BLOCK_CACHE_SIZE - 1)];
+
+    if (block->count == 0 || block->start != emu->eip) {
+        build_block(emu, block, emu->eip);
+    }
+
+    return block->count > 0 ? block : NULL;
+}
+
+/* 命令の書き換えでブロックを先頭から executed 個の命令で終えたときに、
+ * 実行しなかった命令を emu->retired から引く */
+static void end_invalidated_block(Emulator* emu, Block* block, int executed)
+{
+    int retired = 0;
+    int i;
+
+    for (i = 0; i < executed; i++) {
+        retired += block->instructions[i].fused_opecode != 0 ? 2 : 1;
+    }
+
+    emu->retired -= block->retired - retired;
+    emu->block_invalidated = FALSE;
+}
+
+void execute_block(Emulator* emu, Block* block)
+{
+    BlockCache* cache = emu->block_cache;
+    Instruction* stop;
+
+    emu->retired += block->retired;
+    cache->running = block;
+
+#ifdef LOOP_IDIOMS
+    if (block->idiom.kind != IDIOM_NONE) {
+        run_idiom(emu, block);
+    }
+#endif
+
+#ifdef ENABLE_JIT
+    /* 変換済みのコードは RAM を直接読み書きするので、
+     * ROM や MMIO があるときやページングが有効なときは変換しない */
+    if (block->native == NULL && ++block->hits == JIT_THRESHOLD
+        && (emu->bus == NULL || emu->bus->device_count == 0)
+        && !(emu->cr0 & CR0_PG)) {
+        jit_compile(emu->block_cache, block);
+    }
+
+    if (block->native != NULL) {
+        int executed;
+
+        /* 変換済みのコードは emu->eflags を直接読み書きする */
+        flush_eflags(emu);
+        executed = block->native(emu, emu->memory);
+
+        if (emu->block_invalidated) {
+            end_invalidated_block(emu, block, executed);
+        } else if (block->native_count < block->count) {
+            /* 変換できなかった残りの命令はインタプリタで実行する */
+            stop = execute_instructions(emu, &block->instructions[block->native_count]);
+            if (stop != NULL) {
+                end_invalidated_block(emu, block, stop - block->instructions + 1);
+            }
+        }
+        cache->running = NULL;
+        return;
+    }
+#endif
+
+    stop = execute_instructions(emu, block->instructions);
+    if (stop != NULL) {
+        end_invalidated_block(emu, block, stop - block->instructions + 1);
+    }
+    cache->running = NULL;
+}
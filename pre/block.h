@@ -0,0 +1,148 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "instruction.h"
+#include "jit.h"
+#include "idiom.h"
+
+/* 1つの基本ブロックに含める命令の最大数 */
+#define BLOCK_MAX_INSTRUCTIONS 32
+
+/* ブロックキャッシュのエントリ数(2のべき乗) */
+#define BLOCK_CACHE_SIZE 1024
+
+/* 自己書き換えを検出する単位(ページと、ページ内の 64 バイトごとの範囲) */
+#define CODE_PAGE_SHIFT 12
+#define CODE_LINE_SHIFT 6
+
+/* 物理アドレス address のページにキャッシュしたコードがあるか
+ * (複数バイトの書き込みでは先頭と末尾のアドレスを調べる) */
+#define IS_CODE_PAGE(cache, address) \
+    ((cache) != NULL && (address) < MEMORY_SIZE \
+     && ((cache)->code_pages[(address) >> (CODE_PAGE_SHIFT + 3)] \
+         >> (((address) >> CODE_PAGE_SHIFT) & 7) & 1))
+
+/* ポーリングのループの候補(Block の idle) */
+#define IDLE_LOOP         (1 << 0) /* 先頭に戻る分岐で終わり、書き込まない */
+#define IDLE_READS_MEMORY (1 << 1) /* メモリを読む */
+
+/* 物理アドレスの範囲 [start, end) */
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} CodeRange;
+
+/* デコード済みの基本ブロック
+ *
+ * 分岐命令(OPF_BRANCH)までの命令をデコードした結果を並べたもの。
+ * 途中に未実装の命令があればその直前でブロックを終える。
+ */
+typedef struct Block {
+    /* 先頭の命令のアドレス */
+    uint32_t start;
+
+    /* 最後の命令の次のアドレス */
+    uint32_t end;
+
+    /* 命令のバイト列がある物理アドレスの範囲
+     * ページをまたがなければ code[1] は空 */
+    CodeRange code[2];
+
+    /* 命令数(0 なら空きエントリ) */
+    int count;
+
+    /* 実行したときに進める命令数(融合した命令は2命令と数える) */
+    int retired;
+
+    /* 実行された回数 */
+    uint32_t hits;
+
+    /* ポーリングのループの候補か(IDLE_* の組み合わせ、候補でなければ 0) */
+    int idle;
+
+    /* まとめて実行できるループか(LOOP_IDIOMS のときだけ調べる) */
+    Idiom idiom;
+
+    /* 機械語に変換したコードと、変換できた先頭からの命令数 */
+    jit_func_t* native;
+    int native_count;
+
+    /* 最後に終端(end_instructions)を置く */
+    Instruction instructions[BLOCK_MAX_INSTRUCTIONS + 1];
+} Block;
+
+/* EIP をキーにしたデコード済みブロックのキャッシュ(ダイレクトマップ) */
+typedef struct BlockCache {
+    Block blocks[BLOCK_CACHE_SIZE];
+
+    /* 変換済みコードのキャッシュ(ENABLE_JIT でなければ NULL) */
+    JitCache* jit;
+
+    /* キャッシュしたコードを含む物理ページのビットマップと、
+     * 64バイトの範囲ごとの印(変換済みのコードからも1回の比較で引けるように
+     * 1バイトずつ持つ) */
+    uint8_t code_pages[(MEMORY_SIZE >> CODE_PAGE_SHIFT) / 8];
+    uint8_t code_lines[MEMORY_SIZE >> CODE_LINE_SHIFT];
+
+    /* コードへの書き込みの回数と、それで無効にしたブロックの数 */
+    uint64_t smc_writes;
+    uint64_t smc_invalidations;
+
+    /* execute_block で実行中のブロック(なければ NULL) */
+    struct Block* running;
+
+    /* ループをまとめて実行した回数と、まとめた周回数(IDIOM_* ごと) */
+    uint64_t idiom_hits[IDIOM_COUNT];
+    uint64_t idiom_iterations[IDIOM_COUNT];
+} BlockCache;
+
+BlockCache* create_block_cache(void);
+void destroy_block_cache(BlockCache* cache);
+
+/* キャッシュの全エントリを無効にする */
+void flush_block_cache(BlockCache* cache);
+
+/* [start, end) の範囲に重なるブロックを無効にする */
+void invalidate_blocks(BlockCache* cache, uint32_t start, uint32_t end);
+
+/* 物理アドレス address からの size バイトへの書き込みを知らせる
+ *
+ * IS_CODE_PAGE のページへの書き込みで呼ぶ。書き込んだ範囲に重なる
+ * ブロックだけを無効にする。実行中のブロックを無効にしたときは
+ * emu->block_invalidated を立て、そのブロックは書き込んだ命令で終えて、
+ * 次の命令から書き換え後のコードをデコードしなおす。
+ */
+void write_code(Emulator* emu, uint32_t address, int size);
+
+/* emu->eip から始まるブロックを取得する
+ *
+ * キャッシュになければデコードして登録する。
+ * 先頭の命令が未実装なら NULL を返す。
+ */
+Block* lookup_block(Emulator* emu);
+
+/* ポーリングのループ(block->idle)を1周実行した後に呼ぶ
+ *
+ * 前の周回を終えたときとレジスタ、フラグが同じで、その間に値が変わり
+ * うる I/O ポートも読んでいなければ、ループは何かが変わるまで同じことを
+ * 繰り返すだけなので TRUE を返す。wakeups には前の周回を終えたときの
+ * emu->wakeups を入れる(wait_for_change に渡す)。
+ */
+int is_idle_loop(Emulator* emu, Block* block, uint32_t* wakeups);
+
+/* ブロックの命令を順に実行する
+ *
+ * ENABLE_JIT を定義してビルドすると、JIT_THRESHOLD 回実行された
+ * ブロックはホストの機械語に変換して実行する。
+ *
+ * LOOP_IDIOMS を定義してビルドすると、決まった形のバイト単位の
+ * ループ(idiom.h)は最後の1周の手前までホストでまとめて実行する。
+ *
+ * 呼び出しのとき emu->eip は block->start を指している必要がある。
+ */
+void execute_block(Emulator* emu, Block* block);
+
+#endif
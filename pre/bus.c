@@ -0,0 +1,179 @@
+#include <stdlib.h>
+
+#include "bus.h"
+#include "emulator_function.h"
+
+/* 先頭から直接読み書きできる RAM の終端を計算しなおす
+ *
+ * 先頭の RAM にデバイスの領域が重なっていれば、その手前までにする。
+ */
+static void update_ram_limit(Emulator* emu)
+{
+    MemoryBus* bus = emu->bus;
+    uint64_t limit = bus->regions[0].end;
+    int i;
+
+    for (i = 1; i < bus->count; i++) {
+        if (bus->regions[i].start < limit) {
+            limit = bus->regions[i].start;
+        }
+    }
+
+    emu->ram_limit = limit;
+}
+
+static int add_region(Emulator* emu, BusRegion* region)
+{
+    MemoryBus* bus = emu->bus;
+
+    if (bus->count == BUS_MAX_REGIONS) {
+        return FALSE;
+    }
+
+    bus->regions[bus->count++] = *region;
+    if (region->data == NULL || !region->writable) {
+        bus->device_count++;
+    }
+    update_ram_limit(emu);
+
+    return TRUE;
+}
+
+void init_memory_bus(Emulator* emu, uint32_t ram_size)
+{
+    MemoryBus* bus = calloc(1, sizeof(MemoryBus));
+
+    bus->regions[0].start = 0;
+    bus->regions[0].end = ram_size;
+    bus->regions[0].data = emu->memory;
+    bus->regions[0].writable = TRUE;
+    bus->count = 1;
+
+    emu->bus = bus;
+    update_ram_limit(emu);
+}
+
+void destroy_memory_bus(Emulator* emu)
+{
+    free(emu->bus);
+    emu->bus = NULL;
+    emu->ram_limit = 0;
+}
+
+int map_rom(Emulator* emu, uint32_t start, uint32_t size, uint8_t* data)
+{
+    BusRegion region = { start, (uint64_t)start + size, data, FALSE };
+
+    return add_region(emu, &region);
+}
+
+int map_mmio(Emulator* emu, uint32_t start, uint32_t size,
+             bus_read_t* read, bus_write_t* write, void* opaque)
+{
+    BusRegion region = { start, (uint64_t)start + size, NULL, FALSE,
+                         read, write, opaque };
+
+    return add_region(emu, &region);
+}
+
+/* address から size バイトを含む領域を探す
+ *
+ * どの領域にも含まれなければ NULL を返す。先に見つかった領域に一部だけ
+ * 重なるときは *split を TRUE にする(1バイトずつに分けて読み書きする)。
+ */
+static BusRegion* find_region(Emulator* emu, uint32_t address, int size, int* split)
+{
+    MemoryBus* bus = emu->bus;
+    uint64_t end = (uint64_t)address + size;
+    int i;
+
+    *split = FALSE;
+    if (bus == NULL) {
+        return NULL;
+    }
+
+    /* 後から登録した領域ほど優先する */
+    for (i = bus->count - 1; i >= 0; i--) {
+        BusRegion* region = &bus->regions[i];
+        if (region->start <= address && end <= region->end) {
+            return region;
+        }
+        if (region->start < end && address < region->end) {
+            *split = TRUE;
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static uint32_t load(const uint8_t* p, int size)
+{
+    return size == 1 ? p[0] : size == 2 ? load16(p) : load32(p);
+}
+
+static void store(uint8_t* p, uint32_t value, int size)
+{
+    if (size == 1) {
+        p[0] = value;
+    } else if (size == 2) {
+        store16(p, value);
+    } else {
+        store32(p, value);
+    }
+}
+
+uint32_t bus_read(Emulator* emu, uint32_t address, int size)
+{
+    int split;
+    BusRegion* region = find_region(emu, address, size, &split);
+    uint32_t value = 0;
+    int i;
+
+    if (region == NULL) {
+        if (split) {
+            for (i = 0; i < size; i++) {
+                value |= bus_read(emu, address + i, 1) << (i * 8);
+            }
+            return value;
+        }
+
+        /* 割り当てのないアドレス */
+        return load(emu->memory + address, size);
+    }
+
+    if (region->data == NULL) {
+        if (region->read == NULL) {
+            return 0xffffffff >> (32 - size * 8);
+        }
+        return region->read(region->opaque, address - region->start, size);
+    }
+
+    return load(region->data + (address - region->start), size);
+}
+
+void bus_write(Emulator* emu, uint32_t address, uint32_t value, int size)
+{
+    int split;
+    BusRegion* region = find_region(emu, address, size, &split);
+    int i;
+
+    if (region == NULL) {
+        if (split) {
+            for (i = 0; i < size; i++) {
+                bus_write(emu, address + i, value >> (i * 8), 1);
+            }
+            return;
+        }
+
+        store(emu->memory + address, value, size);
+    } else if (region->data == NULL) {
+        if (region->write != NULL) {
+            region->write(region->opaque, address - region->start, value, size);
+        }
+    } else if (region->writable) {
+        store(region->data + (address - region->start), value, size);
+    }
+
+    /* ROM への書き込みは無視する */
+}
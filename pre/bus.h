@@ -0,0 +1,192 @@
+#ifndef BUS_H_
+#define BUS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "emulator.h"
+
+/* 登録できる領域の数 */
+#define BUS_MAX_REGIONS 16
+
+/* デバイスの読み書き関数
+ *
+ * offset は領域の先頭からの位置、size は 1, 2, 4 のいずれか。
+ */
+typedef uint32_t bus_read_t(void* opaque, uint32_t offset, int size);
+typedef void bus_write_t(void* opaque, uint32_t offset, uint32_t value, int size);
+
+/* アドレス空間の領域 */
+typedef struct {
+    /* 先頭と終端(終端は含まない) */
+    uint64_t start;
+    uint64_t end;
+
+    /* RAM・ROM の中身(MMIO なら NULL) */
+    uint8_t* data;
+
+    /* 書き込めるか(ROM なら FALSE) */
+    int writable;
+
+    /* MMIO の読み書き関数 */
+    bus_read_t* read;
+    bus_write_t* write;
+    void* opaque;
+} BusRegion;
+
+/* メモリバス
+ *
+ * 先頭から emu->ram_limit までの RAM はバスを通さずに直接読み書きし、
+ * それ以外のアクセスだけ領域表を引く。
+ */
+typedef struct MemoryBus {
+    BusRegion regions[BUS_MAX_REGIONS];
+    int count;
+
+    /* RAM 以外の領域の数 */
+    int device_count;
+} MemoryBus;
+
+/* emu->memory の先頭 ram_size バイトを RAM としてバスを作る */
+void init_memory_bus(Emulator* emu, uint32_t ram_size);
+void destroy_memory_bus(Emulator* emu);
+
+/* ROM を start 番地から size バイトの領域に割り当てる
+ *
+ * 読み込みは data から行い、書き込みは無視する。
+ * 領域表が一杯なら FALSE を返す。
+ */
+int map_rom(Emulator* emu, uint32_t start, uint32_t size, uint8_t* data);
+
+/* デバイスのレジスタを start 番地から size バイトの領域に割り当てる */
+int map_mmio(Emulator* emu, uint32_t start, uint32_t size,
+             bus_read_t* read, bus_write_t* write, void* opaque);
+
+/* 領域表を引いて読み書きする(RAM の外へのアクセス)
+ *
+ * どの領域にも含まれないアドレスは emu->memory を直接読み書きする。
+ * ガードページがあればゲストのフォールトになる。
+ */
+uint32_t bus_read(Emulator* emu, uint32_t address, int size);
+void bus_write(Emulator* emu, uint32_t address, uint32_t value, int size);
+
+/* ホストのメモリ p からリトルエンディアンの値を読み書きする
+ *
+ * リトルエンディアンのホストではアラインされていないアドレスへの
+ * 1回の読み書きになる。
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+static inline uint16_t load16(const uint8_t* p)
+{
+    uint16_t value;
+    memcpy(&value, p, 2);
+    return value;
+}
+
+static inline uint32_t load32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static inline uint64_t load64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return value;
+}
+
+static inline void store16(uint8_t* p, uint16_t value)
+{
+    memcpy(p, &value, 2);
+}
+
+static inline void store32(uint8_t* p, uint32_t value)
+{
+    memcpy(p, &value, 4);
+}
+
+static inline void store64(uint8_t* p, uint64_t value)
+{
+    memcpy(p, &value, 8);
+}
+
+#else
+
+static inline uint16_t load16(const uint8_t* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline uint32_t load32(const uint8_t* p)
+{
+    return load16(p) | (uint32_t)load16(p + 2) << 16;
+}
+
+static inline uint64_t load64(const uint8_t* p)
+{
+    return load32(p) | (uint64_t)load32(p + 4) << 32;
+}
+
+static inline void store16(uint8_t* p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static inline void store32(uint8_t* p, uint32_t value)
+{
+    store16(p, value);
+    store16(p + 2, value >> 16);
+}
+
+static inline void store64(uint8_t* p, uint64_t value)
+{
+    store32(p, value);
+    store32(p + 4, value >> 32);
+}
+
+#endif
+
+/* address から size バイトがバスを通さずに読み書きできる RAM か */
+#define IS_RAM(emu, address, size) \
+    ((uint64_t)(address) + (size) <= (emu)->ram_limit)
+
+/* 物理アドレスの読み書き(RAM なら直接、それ以外はバスを通す) */
+static inline uint32_t read_physical8(Emulator* emu, uint32_t address)
+{
+    if (IS_RAM(emu, address, 1)) {
+        return emu->memory[address];
+    }
+    return bus_read(emu, address, 1);
+}
+
+static inline uint32_t read_physical32(Emulator* emu, uint32_t address)
+{
+    if (IS_RAM(emu, address, 4)) {
+        return load32(emu->memory + address);
+    }
+    return bus_read(emu, address, 4);
+}
+
+static inline void write_physical8(Emulator* emu, uint32_t address, uint32_t value)
+{
+    if (IS_RAM(emu, address, 1)) {
+        emu->memory[address] = value;
+    } else {
+        bus_write(emu, address, value, 1);
+    }
+}
+
+static inline void write_physical32(Emulator* emu, uint32_t address, uint32_t value)
+{
+    if (IS_RAM(emu, address, 4)) {
+        store32(emu->memory + address, value);
+    } else {
+        bus_write(emu, address, value, 4);
+    }
+}
+
+#endif
@@ -2,26 +2,170 @@
 #define EMULATOR_H_
 
 #include <stdint.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+/* メモリは1MB */
+#define MEMORY_SIZE (1024 * 1024)
+
+/* TLB のエントリ数(2のべき乗) */
+#define TLB_SIZE 64
+
+struct BlockCache;
+struct MemoryBus;
+struct InstructionSet;
+struct IoPorts;
+struct Serial;
+struct Scheduler;
+struct Pit;
 
 enum Register { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI, REGISTERS_COUNT,
                 AL = EAX, CL = ECX, DL = EDX, BL = EBX,
                 AH = AL + 4, CH = CL + 4, DH = DL + 4, BH = BL + 4 };
 
+/* 常に 0 のレジスタ(実効アドレスにベースやインデックスがないとき使う) */
+#define ZERO_REGISTER REGISTERS_COUNT
+
+/* TLB のエントリ
+ *
+ * タグは線形アドレスのページの先頭。書き込みは dirty ビットを立てた
+ * ページだけ write_tag で引けるようにする。
+ */
 typedef struct {
-    /* 汎用レジスタ */
+    uint32_t read_tag;
+    uint32_t write_tag;
+
+    /* 物理アドレス - 線形アドレス */
+    uint32_t offset;
+} TlbEntry;
+
+/* ポーリングのループを見つけるために覚えておく、前の周回を終えたときの状態 */
+typedef struct {
+    /* ループの先頭(0 なら覚えていない) */
+    uint32_t eip;
+
+    uint64_t retired;
     uint32_t registers[REGISTERS_COUNT];
+    uint32_t eflags;
+    uint32_t unstable_reads;
+    uint32_t wakeups;
+} IdleLoop;
+
+typedef struct Emulator {
+    /* 汎用レジスタ(後ろに実効アドレスの計算で使う ZERO_REGISTER を置く) */
+    uint32_t registers[REGISTERS_COUNT + 1];
 
     /* EFLAGSレジスタ */
     uint32_t eflags;
 
+    /* フラグの遅延評価用(LAZY_EFLAGS)
+     * 最後にフラグを更新した演算の種類(FLAGS_OP_*)とオペランド、結果 */
+    uint32_t flags_op;
+    uint32_t flags_v1;
+    uint32_t flags_v2;
+    uint64_t flags_result;
+
     /* メモリ(バイト列) */
     uint8_t* memory;
 
+    /* コントロールレジスタ */
+    uint32_t cr0;
+    uint32_t cr2;
+    uint32_t cr3;
+
+    /* 線形アドレスから物理アドレスへの変換結果のキャッシュ */
+    TlbEntry tlb[TLB_SIZE];
+    uint64_t tlb_hits;
+    uint64_t tlb_misses;
+
+    /* 先頭からこの番地までは RAM としてメモリを直接読み書きできる */
+    uint32_t ram_limit;
+
+    /* RAM 以外の領域(ROM, MMIO)を含むアドレス空間 */
+    struct MemoryBus* bus;
+
     /* プログラムカウンタ */
     uint32_t eip;
 
+    /* 実行した命令数(ブロック単位で数えるので、ブロックの途中で
+     * 止まったときは実行していない命令も含む) */
+    uint64_t retired;
+
+    /* write_code が実行中のブロックを無効にした(書き込んだ命令でブロックを
+     * 終える) */
+    int block_invalidated;
+
     /* 割り込み番号 */
     int32_t int_index;
+
+    /* 要求されているハードウェア割り込み(IRQ 番号のビット)
+     * デバイスのスレッドからも変更するので raise_irq, lower_irq で操作する */
+    uint32_t irq_lines;
+
+    /* 受け付けると消える割り込みの要求(pulse_irq、タイマーなど) */
+    uint32_t irq_pulses;
+
+    /* 次のイベントの時刻を emu->retired で表したもの(なければ UINT64_MAX) */
+    uint64_t next_event;
+
+    /* 命令数を指定した実行(px86_run)が止まる emu->retired(0 なら止まらない)
+     * まとめて実行するループ(idiom.h)はこれと next_event を越えない */
+    uint64_t retired_limit;
+
+    /* hlt で止まっていた間などに進めた仮想時間
+     * (仮想時間 = retired + idle_time、scheduler.h の virtual_time) */
+    uint64_t idle_time;
+
+    /* hlt で割り込みを待っているか */
+    int halted;
+
+    /* 割り込みを待ってホストのスレッドが眠っている間、他のスレッドからの
+     * 割り込みの要求で起こす(raise_irq) */
+    int sleeping;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+
+    /* 別のスレッドから割り込みを要求できるデバイスの数
+     * (0 ならイベントのほかに hlt から起こすものはない) */
+    int async_sources;
+
+    /* wake_emulator を呼んだ回数(眠る前に見た値と比べて、その間の
+     * デバイスの変化を見逃さないようにする) */
+    uint32_t wakeups;
+
+    /* 読む値が時間とともに変わるかもしれない I/O ポートを読んだ回数
+     * (set_io_pollable していないデバイスと、受信データを取り出す読み込み) */
+    uint32_t unstable_reads;
+
+    /* ポーリングのループの検出(block.c の is_idle_loop) */
+    IdleLoop idle_loop;
+
+    /* 時刻を決めて実行するイベントのキュー */
+    struct Scheduler* scheduler;
+
+    /* メモリの外にアクセスしたときのアドレス */
+    uint32_t fault_address;
+
+    /* デコード済みブロックのキャッシュ */
+    struct BlockCache* block_cache;
+
+    /* 命令セット(デコードで引く表) */
+    const struct InstructionSet* isa;
+
+    /* I/O ポートに割り当てたデバイス */
+    struct IoPorts* io_ports;
+
+    /* COM1 につないだシリアルポート(なければ NULL) */
+    struct Serial* serial;
+
+    /* IRQ 0 につないだタイマー(なければ NULL) */
+    struct Pit* pit;
+
+#ifdef OPCODE_STATS
+    /* 命令ごとの実行回数とサイクル数(stats.h) */
+    OpcodeStats opcode_stats[STATS_SIZE];
+#endif
 } Emulator;
 
 #endif
@@ -1,27 +1,22 @@
 #include "emulator_function.h"
+#include "bus.h"
+#include "mmu.h"
+#include "block.h"
 #include "debug.h"
 
 uint32_t get_code8(Emulator* emu, int index)
 {
-    return emu->memory[emu->eip + index];
+    return get_memory8(emu, emu->eip + index);
 }
 
 int32_t get_sign_code8(Emulator* emu, int index)
 {
-    return (int8_t)emu->memory[emu->eip + index];
+    return (int8_t)get_memory8(emu, emu->eip + index);
 }
 
 uint32_t get_code32(Emulator* emu, int index)
 {
-    int i;
-    uint32_t ret = 0;
-
-    /* リトルエンディアンでメモリの値を取得する */
-    for (i = 0; i < 4; i++) {
-        ret |= get_code8(emu, index + i) << (i * 8);
-    }
-
-    return ret;
+    return get_memory32(emu, emu->eip + index);
 }
 
 int32_t get_sign_code32(Emulator* emu, int index)
@@ -61,57 +56,155 @@ void set_register32(Emulator* emu, int index, uint32_t value)
 
 void set_memory8(Emulator* emu, uint32_t address, uint32_t value)
 {
-    emu->memory[address] = value & 0xFF;
+    if (emu->cr0 & CR0_PG) {
+        address = to_physical(emu, address, TRUE);
+    }
+    write_physical8(emu, address, value & 0xFF);
+
+    if (IS_CODE_PAGE(emu->block_cache, address)) {
+        write_code(emu, address, 1);
+    }
 }
 
 void set_memory32(Emulator* emu, uint32_t address, uint32_t value)
 {
     dprintf("set 0x%08x to [0x%08x]\n", value, address);
 
-    int i;
+    if (emu->cr0 & CR0_PG) {
+        if (CROSSES_PAGE(address, 4)) {
+            /* ページをまたぐときは1バイトずつ変換する */
+            int i;
+            for (i = 0; i < 4; i++) {
+                set_memory8(emu, address + i, value >> (i * 8));
+            }
+            return;
+        }
+        address = to_physical(emu, address, TRUE);
+    }
+
+    /* RAM ならリトルエンディアンのまま1回で書き込む */
+    write_physical32(emu, address, value);
 
-    /* リトルエンディアンでメモリの値を設定する */
-    for (i = 0; i < 4; i++) {
-        set_memory8(emu, address + i, value >> (i * 8));
+    /* デコード済みの命令を書き換えていないか */
+    if (IS_CODE_PAGE(emu->block_cache, address)
+        || IS_CODE_PAGE(emu->block_cache, address + 3)) {
+        write_code(emu, address, 4);
     }
 }
 
 uint32_t get_memory8(Emulator* emu, uint32_t address)
 {
-    return emu->memory[address];
+    if (emu->cr0 & CR0_PG) {
+        address = to_physical(emu, address, FALSE);
+    }
+    return read_physical8(emu, address);
 }
 
 uint32_t get_memory32(Emulator* emu, uint32_t address)
 {
-    int i;
-    uint32_t ret = 0;
-
-    /* リトルエンディアンでメモリの値を取得する */
-    for (i = 0; i < 4; i++) {
-        ret |= get_memory8(emu, address + i) << (8 * i);
+    if (emu->cr0 & CR0_PG) {
+        if (CROSSES_PAGE(address, 4)) {
+            int i;
+            uint32_t ret = 0;
+            for (i = 0; i < 4; i++) {
+                ret |= get_memory8(emu, address + i) << (8 * i);
+            }
+            return ret;
+        }
+        address = to_physical(emu, address, FALSE);
     }
-
-    return ret;
+    return read_physical32(emu, address);
 }
 
 void push32(Emulator* emu, uint32_t value)
 {
-    int32_t address = get_register32(emu, ESP) - 4;
-    set_register32(emu, ESP, address);
+    uint32_t address = emu->registers[ESP] - 4;
+
+    emu->registers[ESP] = address;
     set_memory32(emu, address, value);
 }
 
 uint32_t pop32(Emulator* emu)
 {
-    uint32_t address = get_register32(emu, ESP);
-    uint32_t ret = get_memory32(emu, address);
-    set_register32(emu, ESP, address + 4);
+    uint32_t address = emu->registers[ESP];
+
+    emu->registers[ESP] = address + 4;
+    return get_memory32(emu, address);
+}
+
+#ifdef LAZY_EFLAGS
+
+/* 遅延評価しているフラグを計算する */
+static int lazy_carry(Emulator* emu)
+{
+    return (emu->flags_result >> 32) != 0;
+}
+
+static int lazy_zero(Emulator* emu)
+{
+    return (emu->flags_result & 0xffffffffu) == 0;
+}
+
+static int lazy_sign(Emulator* emu)
+{
+    return (emu->flags_result >> 31) & 1;
+}
+
+static int lazy_overflow(Emulator* emu)
+{
+    int sign1 = emu->flags_v1 >> 31;
+    int sign2 = emu->flags_v2 >> 31;
+    int signr = (emu->flags_result >> 31) & 1;
+
+    if (emu->flags_op == FLAGS_OP_ADD) {
+        return sign1 == sign2 && sign1 != signr;
+    } else {
+        return sign1 != sign2 && sign1 != signr;
+    }
+}
+
+void flush_eflags(Emulator* emu)
+{
+    uint32_t flags = 0;
+
+    if (emu->flags_op == FLAGS_OP_NONE) {
+        return;
+    }
+
+    flags |= lazy_carry(emu) ? CARRY_FLAG : 0;
+    flags |= lazy_zero(emu) ? ZERO_FLAG : 0;
+    flags |= lazy_sign(emu) ? SIGN_FLAG : 0;
+    flags |= lazy_overflow(emu) ? OVERFLOW_FLAG : 0;
+
+    emu->eflags &= ~(CARRY_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG);
+    emu->eflags |= flags;
+    emu->flags_op = FLAGS_OP_NONE;
+}
+
+#else
+
+void flush_eflags(Emulator* emu)
+{
+}
+
+#endif
+
+uint32_t get_eflags(Emulator* emu)
+{
+    flush_eflags(emu);
+    return emu->eflags;
+}
 
-    return ret;
+void set_eflags(Emulator* emu, uint32_t value)
+{
+    emu->flags_op = FLAGS_OP_NONE;
+    emu->eflags = value;
 }
 
 void set_carry(Emulator* emu, int is_carry)
 {
+    flush_eflags(emu);
+
     if (is_carry) {
         emu->eflags |= CARRY_FLAG;
     } else {
@@ -121,6 +214,8 @@ void set_carry(Emulator* emu, int is_carry)
 
 void set_zero(Emulator* emu, int is_zero)
 {
+    flush_eflags(emu);
+
     if (is_zero) {
         emu->eflags |= ZERO_FLAG;
     } else {
@@ -130,6 +225,8 @@ void set_zero(Emulator* emu, int is_zero)
 
 void set_sign(Emulator* emu, int is_sign)
 {
+    flush_eflags(emu);
+
     if (is_sign) {
         emu->eflags |= SIGN_FLAG;
     } else {
@@ -137,6 +234,41 @@ void set_sign(Emulator* emu, int is_sign)
     }
 }
 
+void wake_emulator(Emulator* emu)
+{
+    pthread_mutex_lock(&emu->idle_mutex);
+    __atomic_fetch_add(&emu->wakeups, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&emu->idle_cond);
+    pthread_mutex_unlock(&emu->idle_mutex);
+}
+
+void interrupt(Emulator* emu)
+{
+    int32_t index = emu->int_index;
+
+    if (index < 0) {
+        uint32_t pulses = __atomic_load_n(&emu->irq_pulses, __ATOMIC_ACQUIRE);
+        uint32_t lines = __atomic_load_n(&emu->irq_lines, __ATOMIC_ACQUIRE) | pulses;
+        int irq;
+
+        if (lines == 0 || !is_interrupt(emu)) {
+            return;
+        }
+        irq = __builtin_ctz(lines);
+        if (pulses & (1u << irq)) {
+            __atomic_fetch_and(&emu->irq_pulses, ~(1u << irq), __ATOMIC_RELEASE);
+        }
+        index = IRQ_VECTOR_BASE + irq;
+    }
+    emu->int_index = -1;
+    emu->halted = FALSE;
+
+    push32(emu, get_eflags(emu));
+    push32(emu, emu->eip);
+    emu->eip = get_memory32(emu, index * 4);
+    set_interrupt(emu, FALSE);
+}
+
 void set_interrupt(Emulator* emu, int is_interrupt)
 {
     if (is_interrupt) {
@@ -146,8 +278,19 @@ void set_interrupt(Emulator* emu, int is_interrupt)
     }
 }
 
+void set_direction(Emulator* emu, int is_direction)
+{
+    if (is_direction) {
+        emu->eflags |= DIRECTION_FLAG;
+    } else {
+        emu->eflags &= ~DIRECTION_FLAG;
+    }
+}
+
 void set_overflow(Emulator* emu, int is_overflow)
 {
+    flush_eflags(emu);
+
     if (is_overflow) {
         emu->eflags |= OVERFLOW_FLAG;
     } else {
@@ -157,16 +300,31 @@ void set_overflow(Emulator* emu, int is_overflow)
 
 int is_carry(Emulator* emu)
 {
+#ifdef LAZY_EFLAGS
+    if (emu->flags_op != FLAGS_OP_NONE) {
+        return lazy_carry(emu);
+    }
+#endif
     return (emu->eflags & CARRY_FLAG) != 0;
 }
 
 int is_zero(Emulator* emu)
 {
+#ifdef LAZY_EFLAGS
+    if (emu->flags_op != FLAGS_OP_NONE) {
+        return lazy_zero(emu);
+    }
+#endif
     return (emu->eflags & ZERO_FLAG) != 0;
 }
 
 int is_sign(Emulator* emu)
 {
+#ifdef LAZY_EFLAGS
+    if (emu->flags_op != FLAGS_OP_NONE) {
+        return lazy_sign(emu);
+    }
+#endif
     return (emu->eflags & SIGN_FLAG) != 0;
 }
 
@@ -175,13 +333,51 @@ int is_interrupt(Emulator* emu)
     return (emu->eflags & INTERRUPT_FLAG) != 0;
 }
 
+int is_direction(Emulator* emu)
+{
+    return (emu->eflags & DIRECTION_FLAG) != 0;
+}
+
+int is_less_or_equal(Emulator* emu)
+{
+#ifdef LAZY_EFLAGS
+    if (emu->flags_op == FLAGS_OP_SUB) {
+        return (int32_t)emu->flags_v1 <= (int32_t)emu->flags_v2;
+    }
+#endif
+    return is_zero(emu) || is_less(emu);
+}
+
 int is_overflow(Emulator* emu)
 {
+#ifdef LAZY_EFLAGS
+    if (emu->flags_op != FLAGS_OP_NONE) {
+        return lazy_overflow(emu);
+    }
+#endif
     return (emu->eflags & OVERFLOW_FLAG) != 0;
 }
 
+int is_less(Emulator* emu)
+{
+#ifdef LAZY_EFLAGS
+    /* 比較の直後なら符号付きで比べるだけでよい */
+    if (emu->flags_op == FLAGS_OP_SUB) {
+        return (int32_t)emu->flags_v1 < (int32_t)emu->flags_v2;
+    }
+#endif
+    return is_sign(emu) != is_overflow(emu);
+}
+
 void update_eflags_add(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result)
 {
+#ifdef LAZY_EFLAGS
+    /* フラグは読まれるときに計算する */
+    emu->flags_op = FLAGS_OP_ADD;
+    emu->flags_v1 = v1;
+    emu->flags_v2 = v2;
+    emu->flags_result = result;
+#else
     /* 各値の符号を取得 */
     int sign1 = v1 >> 31;
     int sign2 = v2 >> 31;
@@ -198,10 +394,17 @@ void update_eflags_add(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result)
 
     /* 演算結果がオーバーフローしていたらOverflowフラグ設定 */
     set_overflow(emu, sign1 == sign2 && sign1 != signr);
+#endif
 }
 
 void update_eflags_sub(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result)
 {
+#ifdef LAZY_EFLAGS
+    emu->flags_op = FLAGS_OP_SUB;
+    emu->flags_v1 = v1;
+    emu->flags_v2 = v2;
+    emu->flags_result = result;
+#else
     /* 各値の符号を取得 */
     int sign1 = v1 >> 31;
     int sign2 = v2 >> 31;
@@ -213,12 +416,28 @@ void update_eflags_sub(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result)
     /* 演算結果にcarryがあればCarryフラグ設定 */
     set_carry(emu, result >> 32);
 
-    /* 演算結果が0ならばZeroフラグ設定 */
-    set_zero(emu, result == 0);
+    /* 演算結果が0ならばZeroフラグ設定(sbb の借りで上位に桁が残っても下位32bitで見る) */
+    set_zero(emu, (result & 0xffffffffu) == 0);
 
     /* 演算結果に符合があればSignフラグ設定 */
     set_sign(emu, signr);
 
     /* 演算結果がオーバーフローしていたらOverflowフラグ設定 */
     set_overflow(emu, sign1 != sign2 && sign1 != signr);
+#endif
+}
+
+void update_eflags_sbb(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result)
+{
+    update_eflags_sub(emu, v1, v2, result);
+#ifdef LAZY_EFLAGS
+    /* is_less の近道を使わせず、SF != OF で判定させる */
+    emu->flags_op = FLAGS_OP_SBB;
+#endif
+}
+
+void update_eflags_logic(Emulator* emu, uint32_t result)
+{
+    /* result + 0 の加算と同じフラグになる */
+    update_eflags_add(emu, result, 0, result);
 }
@@ -14,8 +14,15 @@
 #define ZERO_FLAG (1 << 6)
 #define SIGN_FLAG (1 << 7)
 #define INTERRUPT_FLAG (1 << 9)
+#define DIRECTION_FLAG (1 << 10)
 #define OVERFLOW_FLAG (1 << 11)
 
+/* 遅延評価しているフラグの演算の種類 */
+#define FLAGS_OP_NONE (0) /* eflags の値がそのまま正しい */
+#define FLAGS_OP_ADD (1)
+#define FLAGS_OP_SUB (2)
+#define FLAGS_OP_SBB (3) /* 借りがあるので v1 < v2 では比較できない */
+
 /* プログラムカウンタから相対位置にある符号無し8bit値を取得 */
 uint32_t get_code8(Emulator* emu, int index);
 
@@ -58,11 +65,76 @@ void push32(Emulator* emu, uint32_t value);
 /* スタックから32bit値を取りだす */
 uint32_t pop32(Emulator* emu);
 
+/* IRQ n の割り込みベクタの番号は IRQ_VECTOR_BASE + n */
+#define IRQ_VECTOR_BASE 0x20
+
+/* IRQ irq の割り込みを要求する・要求を取り下げる(どのスレッドからでもよい)
+ *
+ * 要求はレベルで、デバイスが取り下げるまで残る。wake_emulator は
+ * hlt やポーリングのループで眠っているスレッドを起こす。割り込みを
+ * 要求しなくても、別のスレッドでデバイスの状態(ゲストが読む値)を
+ * 変えたときは wake_emulator を呼ぶ。
+ */
+void wake_emulator(Emulator* emu);
+
+static inline void raise_irq(Emulator* emu, int irq)
+{
+    __atomic_fetch_or(&emu->irq_lines, 1u << irq, __ATOMIC_SEQ_CST);
+
+    /* hlt で眠っていれば起こす */
+    if (__atomic_load_n(&emu->sleeping, __ATOMIC_SEQ_CST)) {
+        wake_emulator(emu);
+    }
+}
+
+static inline void lower_irq(Emulator* emu, int irq)
+{
+    __atomic_fetch_and(&emu->irq_lines, ~(1u << irq), __ATOMIC_RELEASE);
+}
+
+/* IRQ irq の割り込みを1回だけ要求する(受け付けると消える) */
+static inline void pulse_irq(Emulator* emu, int irq)
+{
+    __atomic_fetch_or(&emu->irq_pulses, 1u << irq, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&emu->sleeping, __ATOMIC_SEQ_CST)) {
+        wake_emulator(emu);
+    }
+}
+
+/* 受け付けるべき割り込みがあるか */
+static inline int has_interrupt(Emulator* emu)
+{
+    return emu->int_index > -1
+           || (__atomic_load_n(&emu->irq_lines, __ATOMIC_ACQUIRE)
+               | __atomic_load_n(&emu->irq_pulses, __ATOMIC_ACQUIRE)) != 0;
+}
+
+/* 割り込みを起こす
+ *
+ * emu->int_index(ソフトウェア割り込み)があればそれを、なければ IF が
+ * 立っているときに番号の小さい IRQ を受け付ける。EFLAGS と EIP を
+ * スタックに積み、IF を下ろして割り込みベクタのハンドラに飛ぶ。
+ * hlt で止まっていれば再開する。
+ */
+void interrupt(Emulator* emu);
+
+/* 遅延評価しているフラグを計算して eflags に書き込む
+ *
+ * LAZY_EFLAGS でビルドしたときに、emu->eflags を直接読み書きする前に呼ぶ。
+ */
+void flush_eflags(Emulator* emu);
+
+/* EFLAGS全体の取得・設定 */
+uint32_t get_eflags(Emulator* emu);
+void set_eflags(Emulator* emu, uint32_t value);
+
 /* EFLAGの各フラグ設定用関数 */
 void set_carry(Emulator* emu, int is_carry);
 void set_zero(Emulator* emu, int is_zero);
 void set_sign(Emulator* emu, int is_sign);
 void set_interrupt(Emulator* emu, int is_overflow);
+void set_direction(Emulator* emu, int is_direction);
 void set_overflow(Emulator* emu, int is_overflow);
 
 /* EFLAGの各フラグ取得用関数 */
@@ -70,10 +142,19 @@ int32_t is_carry(Emulator* emu);
 int32_t is_zero(Emulator* emu);
 int32_t is_sign(Emulator* emu);
 int32_t is_interrupt(Emulator* emu);
+int32_t is_direction(Emulator* emu);
 int32_t is_overflow(Emulator* emu);
 
+/* 符号付き比較の結果(SF != OF, ZF || SF != OF) */
+int32_t is_less(Emulator* emu);
+int32_t is_less_or_equal(Emulator* emu);
+
 /* 加減算によるEFLAGSの更新関数 */
 void update_eflags_add(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result);
 void update_eflags_sub(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result);
+void update_eflags_sbb(Emulator* emu, uint32_t v1, uint32_t v2, uint64_t result);
+
+/* 論理演算によるEFLAGSの更新関数(CF と OF は 0 になる) */
+void update_eflags_logic(Emulator* emu, uint32_t result);
 
 #endif
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "idiom.h"
+#include "block.h"
+#include "emulator_function.h"
+#include "bus.h"
+#include "mmu.h"
+
+static const char* idiom_names[IDIOM_COUNT] = {
+    "none", "memcpy", "memset", "strlen"
+};
+
+/* [ebp + disp] のオペランドなら disp をセットして TRUE を返す */
+static int local_operand(ModRM* modrm, int32_t* disp)
+{
+    if (modrm->mod == 3 || modrm->base != EBP || modrm->index != ZERO_REGISTER) {
+        return FALSE;
+    }
+    *disp = modrm->disp;
+    return TRUE;
+}
+
+/* mov r32, [ebp + disp] ならレジスタの番号を返す(違えば -1) */
+static int load_local(Instruction* insn, int32_t* disp)
+{
+    if (insn->opecode != 0x8B || !local_operand(&insn->modrm, disp)) {
+        return -1;
+    }
+    return insn->modrm.reg_index;
+}
+
+/* mov rA, [ebp + a]; mov rB, [ebp + b]; add rB, rA の3命令なら
+ * 2つの変数の和を入れた rB の番号を返す(違えば -1) */
+static int match_sum(Instruction* insn, int32_t* a, int32_t* b)
+{
+    int ra = load_local(&insn[0], a);
+    int rb = load_local(&insn[1], b);
+    ModRM* modrm = &insn[2].modrm;
+
+    if (ra < 0 || rb < 0 || ra == rb || modrm->mod != 3) {
+        return -1;
+    }
+    if ((insn[2].opecode == 0x01 && modrm->rm == rb && modrm->reg_index == ra)
+        || (insn[2].opecode == 0x03 && modrm->reg_index == rb && modrm->rm == ra)) {
+        return rb;
+    }
+    return -1;
+}
+
+/* 2つの変数の一方が counter なら、もう一方を other にセットする */
+static int other_local(int32_t a, int32_t b, int32_t counter, int32_t* other)
+{
+    if (a == counter && b != counter) {
+        *other = b;
+        return TRUE;
+    }
+    if (b == counter && a != counter) {
+        *other = a;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* [r32] を指す ModR/M ならレジスタの番号を返す(違えば -1) */
+static int register_pointer(ModRM* modrm)
+{
+    if (modrm->mod == 3 || modrm->base == ZERO_REGISTER
+        || modrm->index != ZERO_REGISTER || modrm->disp != 0) {
+        return -1;
+    }
+    return modrm->base;
+}
+
+/* movzx r32, byte [rP] か mov r8, [rP] で、r8 が r32 の下位バイトなら
+ * rP の番号を返し、読み込んだレジスタを *reg にセットする */
+static int load_byte(Instruction* insn, int* reg)
+{
+    if (!(insn->opecode == 0x0F && insn->opecode2 == 0xB6) && insn->opecode != 0x8A) {
+        return -1;
+    }
+    if (insn->modrm.reg_index >= 4) {
+        return -1;
+    }
+    *reg = insn->modrm.reg_index;
+    return register_pointer(&insn->modrm);
+}
+
+/* mov byte [rP], r8 ならば rP の番号を返す */
+static int store_byte(Instruction* insn, int reg)
+{
+    if (insn->opecode != 0x88 || insn->modrm.reg_index != reg) {
+        return -1;
+    }
+    return register_pointer(&insn->modrm);
+}
+
+/* add dword [ebp + counter], 1 か */
+static int is_increment(Instruction* insn, int32_t* counter)
+{
+    return insn->opecode == 0x83 && insn->modrm.opecode == 0
+           && insn->imm == 1 && local_operand(&insn->modrm, counter);
+}
+
+/* first 番目からが mov r, [ebp + counter]; cmp r, [ebp + limit]; jl/jb で
+ * ブロックの先頭に戻り、ブロックが終わるか */
+static int match_loop_end(Block* block, int first, int32_t counter, Idiom* idiom)
+{
+    Instruction* insn = &block->instructions[first];
+    int32_t disp;
+    int reg = load_local(&insn[0], &disp);
+
+    if (reg < 0 || disp != counter || insn[1].opecode != 0x3B
+        || insn[1].modrm.reg_index != reg || !local_operand(&insn[1].modrm, &idiom->limit)) {
+        return FALSE;
+    }
+
+    /* 比較と融合した jl か、融合していない jb */
+    if (block->count == first + 2 && insn[1].fused_opecode == 0x7C) {
+        idiom->is_unsigned = FALSE;
+        return block->end + insn[1].branch == block->start;
+    }
+    if (block->count == first + 3 && insn[1].fused_opecode == 0
+        && insn[2].opecode == 0x72) {
+        idiom->is_unsigned = TRUE;
+        return block->end + insn[2].imm == block->start;
+    }
+    return FALSE;
+}
+
+/* 読み込み元と書き込み先のアドレスを1つずつ計算して1バイト写す */
+static int match_memcpy(Block* block, Idiom* idiom)
+{
+    Instruction* insn = block->instructions;
+    int32_t a1, b1, a2, b2, p1, p2;
+    int r1, r2, value, from, to;
+
+    if (block->count < 11 || !is_increment(&insn[8], &idiom->counter)) {
+        return FALSE;
+    }
+
+    r1 = match_sum(&insn[0], &a1, &b1);
+    r2 = match_sum(&insn[3], &a2, &b2);
+    if (r1 < 0 || r2 < 0
+        || insn[3].modrm.reg_index == r1 || insn[4].modrm.reg_index == r1
+        || !other_local(a1, b1, idiom->counter, &p1)
+        || !other_local(a2, b2, idiom->counter, &p2)) {
+        return FALSE;
+    }
+
+    from = load_byte(&insn[6], &value);
+    to = store_byte(&insn[7], value);
+    if (from < 0 || to < 0 || value == to) {
+        return FALSE;
+    }
+    if (from == r1 && to == r2) {
+        idiom->src = p1;
+        idiom->dest = p2;
+    } else if (from == r2 && to == r1) {
+        idiom->src = p2;
+        idiom->dest = p1;
+    } else {
+        return FALSE;
+    }
+
+    return match_loop_end(block, 9, idiom->counter, idiom);
+}
+
+/* 書き込み先のアドレスを計算して変数の値の下位バイトを書く */
+static int match_memset(Block* block, Idiom* idiom)
+{
+    Instruction* insn = block->instructions;
+    int32_t a, b;
+    int to, value;
+
+    if (block->count < 8 || !is_increment(&insn[5], &idiom->counter)) {
+        return FALSE;
+    }
+
+    to = match_sum(&insn[0], &a, &b);
+    if (to < 0 || !other_local(a, b, idiom->counter, &idiom->dest)) {
+        return FALSE;
+    }
+
+    /* mov r32, [ebp + c] か、char の変数の movzx r32, byte [ebp + c] */
+    value = insn[3].modrm.reg_index;
+    if (!(insn[3].opecode == 0x8B || insn[3].opecode == 0x8A
+          || (insn[3].opecode == 0x0F && insn[3].opecode2 == 0xB6))
+        || value >= 4 || value == to || !local_operand(&insn[3].modrm, &idiom->value)) {
+        return FALSE;
+    }
+
+    if (store_byte(&insn[4], value) != to) {
+        return FALSE;
+    }
+
+    return match_loop_end(block, 6, idiom->counter, idiom);
+}
+
+/* 添字を進めてから読んだバイトが 0 でなければ先頭に戻る */
+static int match_strlen(Block* block, Idiom* idiom)
+{
+    Instruction* insn = block->instructions;
+    int32_t a, b;
+    int from, value;
+
+    if (block->count != 7 || !is_increment(&insn[0], &idiom->counter)) {
+        return FALSE;
+    }
+
+    from = match_sum(&insn[1], &a, &b);
+    if (from < 0 || !other_local(a, b, idiom->counter, &idiom->src)
+        || load_byte(&insn[4], &value) != from) {
+        return FALSE;
+    }
+
+    /* test r8, r8; jne */
+    return insn[5].opecode == 0x84 && insn[5].modrm.mod == 3
+           && insn[5].modrm.reg_index == value && insn[5].modrm.rm == value
+           && insn[6].opecode == 0x75 && block->end + insn[6].imm == block->start;
+}
+
+void recognize_idiom(Block* block)
+{
+    Idiom* idiom = &block->idiom;
+
+    memset(idiom, 0, sizeof(Idiom));
+
+    if (match_memcpy(block, idiom)) {
+        idiom->kind = IDIOM_MEMCPY;
+    } else if (match_memset(block, idiom)) {
+        idiom->kind = IDIOM_MEMSET;
+    } else if (match_strlen(block, idiom)) {
+        idiom->kind = IDIOM_STRLEN;
+    } else {
+        idiom->kind = IDIOM_NONE;
+    }
+}
+
+/* [ebp + disp] の変数の値を読む(RAM になければ FALSE) */
+static int read_local(Emulator* emu, int32_t disp, uint32_t* value)
+{
+    uint32_t address = get_register32(emu, EBP) + disp;
+
+    if (!IS_RAM(emu, address, 4)) {
+        return FALSE;
+    }
+    *value = load32(emu->memory + address);
+    return TRUE;
+}
+
+/* [start, start + size) が [ebp + disp] の変数のどれかに重なるか */
+static int overlaps_locals(Emulator* emu, uint32_t start, uint32_t size,
+                           const int32_t* locals, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        uint32_t address = get_register32(emu, EBP) + locals[i];
+
+        if ((uint64_t)address + 4 > start && address < (uint64_t)start + size) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* [start, start + size) がループのブロックの命令に重なるか */
+static int overlaps_block(Block* block, uint32_t start, uint32_t size)
+{
+    return block->code[0].start < (uint64_t)start + size && start < block->code[0].end;
+}
+
+/* まとめて書き込んだ範囲にあるキャッシュしたコードを捨てる
+ *
+ * write_code は範囲の両端しか調べないので、64 バイトの範囲ごとに呼ぶ。
+ */
+static void wrote_memory(Emulator* emu, uint32_t start, uint32_t size)
+{
+    BlockCache* cache = emu->block_cache;
+    uint32_t end = start + size;
+    uint32_t line;
+
+    for (line = start >> CODE_LINE_SHIFT; line <= (end - 1) >> CODE_LINE_SHIFT; line++) {
+        uint32_t first = line << CODE_LINE_SHIFT;
+        uint32_t last = first + (1 << CODE_LINE_SHIFT);
+
+        if (cache->code_lines[line]) {
+            first = first > start ? first : start;
+            last = last < end ? last : end;
+            write_code(emu, first, last - first);
+        }
+    }
+}
+
+/* 添字 i から上限 n までの周回のうち、最後の1周を除いた数 */
+static uint32_t remaining_iterations(Idiom* idiom, uint32_t i, uint32_t n)
+{
+    int64_t rest;
+
+    if (idiom->is_unsigned) {
+        rest = (int64_t)n - (int64_t)i;
+    } else {
+        rest = (int64_t)(int32_t)n - (int64_t)(int32_t)i;
+    }
+    return rest > 1 ? rest - 1 : 0;
+}
+
+/* 添字の変数を i にする */
+static void set_counter(Emulator* emu, Idiom* idiom, uint32_t i)
+{
+    uint32_t address = get_register32(emu, EBP) + idiom->counter;
+
+    store32(emu->memory + address, i);
+    wrote_memory(emu, address, 4);
+}
+
+/* まとめて実行した周回数を返す(max 周まで) */
+static uint32_t run_memcpy(Emulator* emu, Block* block, Idiom* idiom, uint32_t max)
+{
+    const int32_t locals[] = { idiom->counter, idiom->dest, idiom->src, idiom->limit };
+    uint32_t i, n, dest, src, size;
+
+    if (!read_local(emu, idiom->counter, &i) || !read_local(emu, idiom->limit, &n)
+        || !read_local(emu, idiom->dest, &dest) || !read_local(emu, idiom->src, &src)) {
+        return 0;
+    }
+
+    size = remaining_iterations(idiom, i, n);
+    if (size > max) {
+        size = max;
+    }
+    dest += i;
+    src += i;
+
+    /* 読み込む範囲は添字、書き込む範囲は全ての変数と命令に重ならない */
+    if (size == 0 || !IS_RAM(emu, dest, size) || !IS_RAM(emu, src, size)
+        || overlaps_locals(emu, src, size, locals, 1)
+        || overlaps_locals(emu, dest, size, locals, 4)
+        || overlaps_block(block, dest, size)) {
+        return 0;
+    }
+
+    /* 前から1バイトずつ写すのと結果が変わる重なり方(dest が src の
+     * 少し後ろ)は memmove にできない */
+    if (src < dest && dest < src + size) {
+        uint32_t k;
+
+        for (k = 0; k < size; k++) {
+            emu->memory[dest + k] = emu->memory[src + k];
+        }
+    } else {
+        memmove(emu->memory + dest, emu->memory + src, size);
+    }
+    wrote_memory(emu, dest, size);
+
+    set_counter(emu, idiom, i + size);
+    return size;
+}
+
+static uint32_t run_memset(Emulator* emu, Block* block, Idiom* idiom, uint32_t max)
+{
+    const int32_t locals[] = { idiom->counter, idiom->dest, idiom->limit, idiom->value };
+    uint32_t i, n, dest, value, size;
+
+    if (!read_local(emu, idiom->counter, &i) || !read_local(emu, idiom->limit, &n)
+        || !read_local(emu, idiom->dest, &dest) || !read_local(emu, idiom->value, &value)) {
+        return 0;
+    }
+
+    size = remaining_iterations(idiom, i, n);
+    if (size > max) {
+        size = max;
+    }
+    dest += i;
+
+    if (size == 0 || !IS_RAM(emu, dest, size)
+        || overlaps_locals(emu, dest, size, locals, 4)
+        || overlaps_block(block, dest, size)) {
+        return 0;
+    }
+
+    memset(emu->memory + dest, value & 0xff, size);
+    wrote_memory(emu, dest, size);
+
+    set_counter(emu, idiom, i + size);
+    return size;
+}
+
+static uint32_t run_strlen(Emulator* emu, Block* block, Idiom* idiom, uint32_t max)
+{
+    uint32_t i, src, start, size;
+    uint8_t* zero;
+
+    if (!read_local(emu, idiom->counter, &i) || !read_local(emu, idiom->src, &src)) {
+        return 0;
+    }
+
+    /* 次の周回で読むバイトから 0 を探す(RAM の中に見つからなければ
+     * 1周ずつ実行する) */
+    start = src + i + 1;
+    if (start >= emu->ram_limit) {
+        return 0;
+    }
+    zero = memchr(emu->memory + start, 0, emu->ram_limit - start);
+    if (zero == NULL) {
+        return 0;
+    }
+
+    /* 0 の手前までが読み飛ばせる周回(毎周書き込む添字の変数が途中に
+     * あると、読む値が変わる) */
+    size = zero - (emu->memory + start);
+    if (size > max) {
+        size = max;
+    }
+    if (size == 0 || overlaps_locals(emu, start, size + 1, &idiom->counter, 1)) {
+        return 0;
+    }
+
+    set_counter(emu, idiom, i + size);
+    return size;
+}
+
+void run_idiom(Emulator* emu, Block* block)
+{
+    BlockCache* cache = emu->block_cache;
+    Idiom* idiom = &block->idiom;
+    uint64_t limit = emu->next_event;
+    uint64_t max;
+    uint32_t iterations;
+
+    if (emu->cr0 & CR0_PG) {
+        return;
+    }
+
+    /* 次のイベントや命令数で止まるところを越えない周回数まで */
+    if (emu->retired_limit != 0 && emu->retired_limit < limit) {
+        limit = emu->retired_limit;
+    }
+    if (limit <= emu->retired) {
+        return;
+    }
+    max = (limit - emu->retired) / block->retired;
+    if (max > UINT32_MAX) {
+        max = UINT32_MAX;
+    }
+
+    switch (idiom->kind) {
+    case IDIOM_MEMCPY:
+        iterations = run_memcpy(emu, block, idiom, max);
+        break;
+    case IDIOM_MEMSET:
+        iterations = run_memset(emu, block, idiom, max);
+        break;
+    case IDIOM_STRLEN:
+        iterations = run_strlen(emu, block, idiom, max);
+        break;
+    default:
+        return;
+    }
+
+    if (iterations > 0) {
+        emu->retired += (uint64_t)iterations * block->retired;
+        cache->idiom_hits[idiom->kind]++;
+        cache->idiom_iterations[idiom->kind] += iterations;
+    }
+}
+
+void dump_idiom_stats(BlockCache* cache)
+{
+    int kind;
+
+    for (kind = IDIOM_NONE + 1; kind < IDIOM_COUNT; kind++) {
+        if (cache->idiom_hits[kind] > 0) {
+            printf("idiom %s: hits = %llu, iterations = %llu\n", idiom_names[kind],
+                   (unsigned long long)cache->idiom_hits[kind],
+                   (unsigned long long)cache->idiom_iterations[kind]);
+        }
+    }
+}
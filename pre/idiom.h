@@ -0,0 +1,69 @@
+#ifndef IDIOM_H_
+#define IDIOM_H_
+
+/* 決まった形のバイト単位のループをホストでまとめて実行する
+ *
+ * gcc -O0 が添字のループに出力する次の形のブロック(ループの本体と
+ * 条件が1つのブロックになり、先頭に戻る分岐で終わる)を見分ける。
+ * 添字もポインタも [ebp + disp] のローカル変数で、ループの中では
+ * レジスタに値を持ち越さない。
+ *
+ *   memcpy: for (i = ...; i < n; i++) dest[i] = src[i];
+ *   memset: for (i = ...; i < n; i++) dest[i] = c;
+ *   strlen: while (s[++i] != 0);   (for (i = 0; s[i]; i++); の本体)
+ *
+ * LOOP_IDIOMS を定義してビルドしたときだけ使う。ブロックの先頭で、
+ * 最後の1周を残した周回を memmove, memset, memchr でまとめて済ませ、
+ * 添字の変数を進めておく。最後の1周はブロックをそのまま実行するので、
+ * レジスタとフラグは1周ずつ実行したときと同じになる。まとめた周回の
+ * 命令も emu->retired に数え、次のイベント(emu->next_event)や命令数で
+ * 止まるところ(emu->retired_limit)を越える分はまとめない。
+ */
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+struct Block;
+struct BlockCache;
+
+/* ループの種類 */
+enum {
+    IDIOM_NONE,
+    IDIOM_MEMCPY,
+    IDIOM_MEMSET,
+    IDIOM_STRLEN,
+    IDIOM_COUNT
+};
+
+/* 見分けたループ(変数は全て EBP からの位置) */
+typedef struct {
+    /* IDIOM_* */
+    int kind;
+
+    /* 上限との比較が符号無し(jb)か、符号付き(jl)か */
+    int is_unsigned;
+
+    /* 添字、書き込み先と読み込み元のポインタ、上限、memset で書く値 */
+    int32_t counter;
+    int32_t dest;
+    int32_t src;
+    int32_t limit;
+    int32_t value;
+} Idiom;
+
+/* デコードしたブロックがどのループか調べて block->idiom にセットする */
+void recognize_idiom(struct Block* block);
+
+/* block->idiom のループを最後の1周の手前までまとめて実行する
+ *
+ * 呼び出しのとき emu->eip は block->start を指している必要がある。
+ * ページングが有効なとき、RAM の外にかかるとき、書き込みがループの
+ * 変数や命令に重なるときは何もしない。
+ */
+void run_idiom(Emulator* emu, struct Block* block);
+
+/* ループの種類ごとにまとめて実行した回数と周回数を標準出力に出力する */
+void dump_idiom_stats(struct BlockCache* cache);
+
+#endif
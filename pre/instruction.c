@@ -7,196 +7,420 @@
 #include "emulator.h"
 #include "emulator_function.h"
 #include "io.h"
+#include "mmu.h"
+#include "bus.h"
+#include "block.h"
+#include "stats.h"
 
 #include "modrm.h"
 
 #include "debug.h"
 
-/* x86命令の配列、opecode番目の関数がx86の
-   opcodeに対応した命令となっている */
-instruction_func_t* instructions[256];
-
-static void mov_r8_imm8(Emulator* emu)
+static void mov_r8_imm8(Emulator* emu, Instruction* insn)
 {
-    uint8_t reg = get_code8(emu, 0) - 0xB0;
-    set_register8(emu, reg, get_code8(emu, 1));
-    emu->eip += 2;
+    uint8_t reg = insn->opecode - 0xB0;
+    set_register8(emu, reg, insn->imm);
 }
 
-static void mov_r32_imm32(Emulator* emu)
+static void mov_r32_imm32(Emulator* emu, Instruction* insn)
 {
-    uint8_t reg = get_code8(emu, 0) - 0xB8;
-    set_register32(emu, reg, get_code32(emu, 1));
-    emu->eip += 5;
+    uint8_t reg = insn->opecode - 0xB8;
+    set_register32(emu, reg, insn->imm);
 }
 
-static void mov_r8_rm8(Emulator* emu)
+static void mov_r8_rm8(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t rm8 = get_rm8(emu, &modrm);
-    set_r8(emu, &modrm, rm8);
+    uint32_t rm8 = get_rm8(emu, &insn->modrm);
+    set_r8(emu, &insn->modrm, rm8);
 }
 
-static void mov_r32_rm32(Emulator* emu)
+static void mov_r32_rm32(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
-    set_r32(emu, &modrm, rm32);
+    uint32_t rm32 = get_rm32(emu, &insn->modrm);
+    set_r32(emu, &insn->modrm, rm32);
 }
 
-static void add_rm32_r32(Emulator* emu)
+static void add_rm32_r32(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    dprintf("eip 0x%08x\n", emu->eip);
-    parse_modrm(emu, &modrm);
-    dprintf("eip 0x%08x\n", emu->eip);
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
+    ModRM* modrm = &insn->modrm;
+    uint32_t r32 = get_r32(emu, modrm);
+    uint32_t rm32 = get_rm32(emu, modrm);
     uint64_t result = (uint64_t)rm32 + (uint64_t)r32;
     dprintf("mod %d, reg %d, rm %d, r32 %d, rm32 %d\n",
-            modrm.mod, modrm.reg_index, modrm.rm, r32, rm32);
-    set_rm32(emu, &modrm, result);
+            modrm->mod, modrm->reg_index, modrm->rm, r32, rm32);
+    set_rm32(emu, modrm, result);
     update_eflags_add(emu, rm32, r32, result);
 }
 
-static void mov_rm8_r8(Emulator* emu)
+static void mov_rm8_r8(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r8 = get_r8(emu, &modrm);
-    set_rm8(emu, &modrm, r8);
+    uint32_t r8 = get_r8(emu, &insn->modrm);
+    set_rm8(emu, &insn->modrm, r8);
 }
 
-static void mov_rm32_r32(Emulator* emu)
+static void mov_rm32_r32(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_r32(emu, &modrm);
-    set_rm32(emu, &modrm, r32);
+    uint32_t r32 = get_r32(emu, &insn->modrm);
+    set_rm32(emu, &insn->modrm, r32);
 }
 
-static void inc_r32(Emulator* emu)
+/* inc は add と同じくフラグを更新するが、CF は変えない */
+static void inc_r32(Emulator* emu, Instruction* insn)
 {
-    uint8_t reg = get_code8(emu, 0) - 0x40;
-    set_register32(emu, reg, get_register32(emu, reg) + 1);
-    emu->eip += 1;
+    uint8_t reg = insn->opecode - 0x40;
+    uint32_t value = get_register32(emu, reg);
+    int carry = is_carry(emu);
+
+    set_register32(emu, reg, value + 1);
+    update_eflags_add(emu, value, 1, (uint64_t)value + 1);
+    set_carry(emu, carry);
+}
+
+static void dec_r32(Emulator* emu, Instruction* insn)
+{
+    uint8_t reg = insn->opecode - 0x48;
+    uint32_t value = get_register32(emu, reg);
+    int carry = is_carry(emu);
+
+    set_register32(emu, reg, value - 1);
+    update_eflags_sub(emu, value, 1, (uint64_t)value - 1);
+    set_carry(emu, carry);
 }
 
-static void push_r32(Emulator* emu)
+static void push_r32(Emulator* emu, Instruction* insn)
 {
-    uint8_t reg = get_code8(emu, 0) - 0x50;
+    uint8_t reg = insn->opecode - 0x50;
     push32(emu, get_register32(emu, reg));
-    emu->eip += 1;
 }
 
-static void pop_r32(Emulator* emu)
+static void pop_r32(Emulator* emu, Instruction* insn)
 {
-    uint8_t reg = get_code8(emu, 0) - 0x58;
+    uint8_t reg = insn->opecode - 0x58;
     set_register32(emu, reg, pop32(emu));
-    emu->eip += 1;
 }
 
-static void push_imm32(Emulator* emu)
+static void push_imm32(Emulator* emu, Instruction* insn)
 {
-    uint32_t value = get_code32(emu, 1);
-    push32(emu, value);
-    emu->eip += 5;
+    push32(emu, insn->imm);
 }
 
-static void push_imm8(Emulator* emu)
+static void push_imm8(Emulator* emu, Instruction* insn)
 {
-    uint8_t value = get_code8(emu, 1);
-    push32(emu, value);
-    emu->eip += 2;
+    push32(emu, insn->imm);
 }
 
-static void add_rm32_imm8(Emulator* emu, ModRM* modrm)
+/* ALU 命令の演算の種類(オペコードの 3-5 ビット目、または ModR/M の reg) */
+#define ALU_ADD 0
+#define ALU_OR  1
+#define ALU_ADC 2
+#define ALU_SBB 3
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_XOR 6
+#define ALU_CMP 7
+
+/* v1 と v2 を op で演算してフラグを更新し、結果を返す
+ *
+ * 8bit の演算はオペランドを 24 ビット左にずらして渡す(one = 1 << 24)。
+ * こうすると 32bit の演算と同じ方法でフラグを求められる。
+ */
+static uint32_t alu(Emulator* emu, int op, uint32_t v1, uint32_t v2, uint32_t one)
 {
-    uint32_t rm32 = get_rm32(emu, modrm);
-    uint32_t imm8 = (int32_t)get_sign_code8(emu, 0);
-    emu->eip += 1;
-    set_rm32(emu, modrm, rm32 + imm8);
+    uint64_t result;
+
+    switch (op) {
+    case ALU_ADD:
+        result = (uint64_t)v1 + v2;
+        update_eflags_add(emu, v1, v2, result);
+        break;
+    case ALU_ADC:
+        result = (uint64_t)v1 + v2 + (is_carry(emu) ? one : 0);
+        update_eflags_add(emu, v1, v2, result);
+        break;
+    case ALU_SBB:
+        result = (uint64_t)v1 - v2 - (is_carry(emu) ? one : 0);
+        update_eflags_sbb(emu, v1, v2, result);
+        break;
+    case ALU_SUB:
+    case ALU_CMP:
+        result = (uint64_t)v1 - v2;
+        update_eflags_sub(emu, v1, v2, result);
+        break;
+    case ALU_OR:
+        result = v1 | v2;
+        update_eflags_logic(emu, result);
+        break;
+    case ALU_AND:
+        result = v1 & v2;
+        update_eflags_logic(emu, result);
+        break;
+    default: /* ALU_XOR */
+        result = v1 ^ v2;
+        update_eflags_logic(emu, result);
+        break;
+    }
+
+    return result;
 }
 
-static void sub_rm32_imm8_(Emulator* emu, ModRM* modrm, int set)
+static void sub_rm32_imm8_(Emulator* emu, Instruction* insn, int set)
 {
-    uint32_t rm32 = get_rm32(emu, modrm);
-    uint32_t imm8 = (int32_t)get_sign_code8(emu, 0);
-    emu->eip += 1;
+    uint32_t rm32 = get_rm32(emu, &insn->modrm);
+    uint32_t imm8 = insn->imm;
     uint64_t result = (uint64_t)rm32 - (uint64_t)imm8;
     if (set) {
-        set_rm32(emu, modrm, result);
+        set_rm32(emu, &insn->modrm, result);
     }
     update_eflags_sub(emu, rm32, imm8, result);
 }
 
-static void sub_rm32_imm8(Emulator* emu, ModRM* modrm)
+static void sub_rm32_imm8(Emulator* emu, Instruction* insn)
 {
-    sub_rm32_imm8_(emu, modrm, TRUE);
+    sub_rm32_imm8_(emu, insn, TRUE);
 }
 
-static void cmp_rm32_imm8(Emulator* emu, ModRM* modrm)
+static void cmp_rm32_imm8(Emulator* emu, Instruction* insn)
 {
-    sub_rm32_imm8_(emu, modrm, FALSE);
+    sub_rm32_imm8_(emu, insn, FALSE);
 }
 
-static void code_83(Emulator* emu)
+static void code_83(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-
-    switch (modrm.opecode) {
-    case 0:
-        add_rm32_imm8(emu, &modrm);
-        break;
+    switch (insn->modrm.opecode) {
     case 5:
-        sub_rm32_imm8(emu, &modrm);
+        sub_rm32_imm8(emu, insn);
         break;
     case 7:
-        cmp_rm32_imm8(emu, &modrm);
+        cmp_rm32_imm8(emu, insn);
         break;
 
     default:
-        printf("83: modrm opecode == %x is not implemented\n", modrm.opecode);
-        exit(0);
+        set_rm32(emu, &insn->modrm,
+                 alu(emu, insn->modrm.opecode, get_rm32(emu, &insn->modrm), insn->imm, 1));
+        break;
     }
 }
 
-static void mov_rm32_imm32(Emulator* emu)
+/* op rm32, r32 (00-3F の xx001) */
+static void alu_rm32_r32(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t value = get_code32(emu, 0);
-    emu->eip += 4;
-    set_rm32(emu, &modrm, value);
+    int op = insn->opecode >> 3;
+    uint32_t result = alu(emu, op, get_rm32(emu, &insn->modrm),
+                          get_r32(emu, &insn->modrm), 1);
+    if (op != ALU_CMP) {
+        set_rm32(emu, &insn->modrm, result);
+    }
+}
+
+/* op r32, rm32 (00-3F の xx011) */
+static void alu_r32_rm32(Emulator* emu, Instruction* insn)
+{
+    int op = insn->opecode >> 3;
+    uint32_t result = alu(emu, op, get_r32(emu, &insn->modrm),
+                          get_rm32(emu, &insn->modrm), 1);
+    if (op != ALU_CMP) {
+        set_r32(emu, &insn->modrm, result);
+    }
+}
+
+/* op eax, imm32 (00-3F の xx101) */
+static void alu_eax_imm32(Emulator* emu, Instruction* insn)
+{
+    int op = insn->opecode >> 3;
+    uint32_t result = alu(emu, op, get_register32(emu, EAX), insn->imm, 1);
+    if (op != ALU_CMP) {
+        set_register32(emu, EAX, result);
+    }
+}
+
+/* op rm8, r8 (00-3F の xx000) */
+static void alu_rm8_r8(Emulator* emu, Instruction* insn)
+{
+    int op = insn->opecode >> 3;
+    uint32_t result = alu(emu, op, get_rm8(emu, &insn->modrm) << 24,
+                          get_r8(emu, &insn->modrm) << 24, 1 << 24);
+    if (op != ALU_CMP) {
+        set_rm8(emu, &insn->modrm, result >> 24);
+    }
+}
+
+/* op r8, rm8 (00-3F の xx010) */
+static void alu_r8_rm8(Emulator* emu, Instruction* insn)
+{
+    int op = insn->opecode >> 3;
+    uint32_t result = alu(emu, op, get_r8(emu, &insn->modrm) << 24,
+                          get_rm8(emu, &insn->modrm) << 24, 1 << 24);
+    if (op != ALU_CMP) {
+        set_r8(emu, &insn->modrm, result >> 24);
+    }
+}
+
+/* op al, imm8 (00-3F の xx100) */
+static void alu_al_imm8(Emulator* emu, Instruction* insn)
+{
+    int op = insn->opecode >> 3;
+    uint32_t result = alu(emu, op, get_register8(emu, AL) << 24,
+                          insn->imm << 24, 1 << 24);
+    if (op != ALU_CMP) {
+        set_register8(emu, AL, result >> 24);
+    }
+}
+
+/* op rm32, imm32 */
+static void code_81(Emulator* emu, Instruction* insn)
+{
+    int op = insn->modrm.opecode;
+    uint32_t result = alu(emu, op, get_rm32(emu, &insn->modrm), insn->imm, 1);
+    if (op != ALU_CMP) {
+        set_rm32(emu, &insn->modrm, result);
+    }
 }
 
-static void in_al_dx(Emulator* emu)
+static void test_rm8_r8(Emulator* emu, Instruction* insn)
+{
+    uint32_t rm8 = get_rm8(emu, &insn->modrm);
+    uint32_t r8 = get_r8(emu, &insn->modrm);
+    update_eflags_logic(emu, (rm8 & r8) << 24);
+}
+
+static void test_rm32_r32(Emulator* emu, Instruction* insn)
+{
+    uint32_t rm32 = get_rm32(emu, &insn->modrm);
+    uint32_t r32 = get_r32(emu, &insn->modrm);
+    update_eflags_logic(emu, rm32 & r32);
+}
+
+static void imul_r32_rm32_imm(Emulator* emu, Instruction* insn)
+{
+    int64_t result = (int64_t)(int32_t)get_rm32(emu, &insn->modrm) * (int32_t)insn->imm;
+    set_r32(emu, &insn->modrm, result);
+    update_eflags_logic(emu, result);
+    set_carry(emu, result != (int32_t)result);
+    set_overflow(emu, result != (int32_t)result);
+}
+
+static void imul_r32_rm32(Emulator* emu, Instruction* insn)
+{
+    int64_t result = (int64_t)(int32_t)get_r32(emu, &insn->modrm)
+                     * (int32_t)get_rm32(emu, &insn->modrm);
+    set_r32(emu, &insn->modrm, result);
+    update_eflags_logic(emu, result);
+    set_carry(emu, result != (int32_t)result);
+    set_overflow(emu, result != (int32_t)result);
+}
+
+static void movzx_r32_rm8(Emulator* emu, Instruction* insn)
+{
+    set_r32(emu, &insn->modrm, get_rm8(emu, &insn->modrm));
+}
+
+static void movzx_r32_rm16(Emulator* emu, Instruction* insn)
+{
+    set_r32(emu, &insn->modrm, get_rm16(emu, &insn->modrm));
+}
+
+static void movsx_r32_rm8(Emulator* emu, Instruction* insn)
+{
+    set_r32(emu, &insn->modrm, (int8_t)get_rm8(emu, &insn->modrm));
+}
+
+static void movsx_r32_rm16(Emulator* emu, Instruction* insn)
+{
+    set_r32(emu, &insn->modrm, (int16_t)get_rm16(emu, &insn->modrm));
+}
+
+/* シフトとローテート(C1 /n imm8, D1 /n 1, D3 /n cl) */
+static void shift_rm32(Emulator* emu, Instruction* insn, uint8_t count)
+{
+    uint32_t value = get_rm32(emu, &insn->modrm);
+    uint32_t result;
+    int carry;
+
+    count &= 0x1f;
+    if (count == 0) {
+        /* シフト数が 0 ならフラグも変えない */
+        return;
+    }
+
+    switch (insn->modrm.opecode) {
+    case 0: /* rol */
+        result = value << count | value >> (32 - count);
+        carry = result & 1;
+        break;
+    case 1: /* ror */
+        result = value >> count | value << (32 - count);
+        carry = result >> 31;
+        break;
+    case 4: /* shl */
+    case 6:
+        result = value << count;
+        carry = (value >> (32 - count)) & 1;
+        break;
+    case 5: /* shr */
+        result = value >> count;
+        carry = (value >> (count - 1)) & 1;
+        break;
+    case 7: /* sar */
+        result = (int32_t)value >> count;
+        carry = ((int32_t)value >> (count - 1)) & 1;
+        break;
+    default:
+        printf("not implemented: %02X /%d\n", insn->opecode, insn->modrm.opecode);
+        exit(1);
+    }
+
+    set_rm32(emu, &insn->modrm, result);
+
+    if (insn->modrm.opecode <= 1) {
+        /* ローテートは CF と OF だけを変える */
+        set_carry(emu, carry);
+    } else {
+        update_eflags_logic(emu, result);
+        set_carry(emu, carry);
+    }
+    set_overflow(emu, (result >> 31) != (value >> 31));
+}
+
+static void code_c1(Emulator* emu, Instruction* insn)
+{
+    shift_rm32(emu, insn, insn->imm);
+}
+
+static void code_d1(Emulator* emu, Instruction* insn)
+{
+    shift_rm32(emu, insn, 1);
+}
+
+static void code_d3(Emulator* emu, Instruction* insn)
+{
+    shift_rm32(emu, insn, get_register8(emu, CL));
+}
+
+static void mov_rm8_imm8(Emulator* emu, Instruction* insn)
+{
+    set_rm8(emu, &insn->modrm, insn->imm);
+}
+
+static void mov_rm32_imm32(Emulator* emu, Instruction* insn)
+{
+    set_rm32(emu, &insn->modrm, insn->imm);
+}
+
+static void in_al_dx(Emulator* emu, Instruction* insn)
 {
     uint16_t address = get_register32(emu, EDX) & 0xffff;
-    uint8_t value = io_in8(address);
+    uint8_t value = io_in8(emu, address);
     set_register8(emu, AL, value);
-    emu->eip += 1;
 }
 
-static void out_dx_al(Emulator* emu)
+static void out_dx_al(Emulator* emu, Instruction* insn)
 {
     uint16_t address = get_register32(emu, EDX) & 0xffff;
     uint8_t value = get_register8(emu, AL);
-    io_out8(address, value);
-    emu->eip += 1;
+    io_out8(emu, address, value);
 }
 
-static void idiv_rm32(Emulator* emu, ModRM* modrm)
+static void div_rm32(Emulator* emu, ModRM* modrm)
 {
     uint32_t div = get_rm32(emu, modrm);
     uint32_t eax = get_register32(emu, EAX);
@@ -222,125 +446,190 @@ static void idiv_rm32(Emulator* emu, ModRM* modrm)
     set_register32(emu, EDX, (uint32_t)rem);
 }
 
-static void code_f7(Emulator* emu)
+static void idiv_rm32(Emulator* emu, ModRM* modrm)
+{
+    int32_t div = get_rm32(emu, modrm);
+    uint32_t eax = get_register32(emu, EAX);
+    uint32_t edx = get_register32(emu, EDX);
+
+    int64_t divsrc, quot, rem;
+
+    if (div == 0) {
+        printf("Divide Error: Divide 0!");
+        exit(1);
+    }
+
+    divsrc = (int64_t)((uint64_t)edx << 32 | eax);
+    if (divsrc == INT64_MIN && div == -1) {
+        printf("Divide Error: quot > 0x7FFFFFFF");
+        exit(1);
+    }
+    quot = divsrc / div;
+    rem = divsrc % div;
+
+    if (quot != (int32_t)quot) {
+        printf("Divide Error: quot > 0x7FFFFFFF");
+        exit(1);
+    }
+
+    set_register32(emu, EAX, (uint32_t)quot);
+    set_register32(emu, EDX, (uint32_t)rem);
+}
+
+static void mul_rm32(Emulator* emu, ModRM* modrm)
+{
+    uint64_t result = (uint64_t)get_register32(emu, EAX) * get_rm32(emu, modrm);
+
+    set_register32(emu, EAX, result);
+    set_register32(emu, EDX, result >> 32);
+    set_carry(emu, (result >> 32) != 0);
+    set_overflow(emu, (result >> 32) != 0);
+}
+
+static void imul_rm32(Emulator* emu, ModRM* modrm)
+{
+    int64_t result = (int64_t)(int32_t)get_register32(emu, EAX)
+                     * (int32_t)get_rm32(emu, modrm);
+
+    set_register32(emu, EAX, result);
+    set_register32(emu, EDX, (uint64_t)result >> 32);
+    set_carry(emu, result != (int32_t)result);
+    set_overflow(emu, result != (int32_t)result);
+}
+
+static void code_f7(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
+    ModRM* modrm = &insn->modrm;
+    uint32_t value;
 
-    switch (modrm.opecode) {
+    switch (modrm->opecode) {
+    case 2: /* not */
+        set_rm32(emu, modrm, ~get_rm32(emu, modrm));
+        break;
+    case 3: /* neg */
+        value = get_rm32(emu, modrm);
+        set_rm32(emu, modrm, -value);
+        update_eflags_sub(emu, 0, value, (uint64_t)0 - value);
+        break;
+    case 4:
+        mul_rm32(emu, modrm);
+        break;
+    case 5:
+        imul_rm32(emu, modrm);
+        break;
+    case 6:
+        div_rm32(emu, modrm);
+        break;
     case 7:
-        idiv_rm32(emu, &modrm);
+        idiv_rm32(emu, modrm);
         break;
     default:
-        printf("not implemented: F7 /%d\n", modrm.opecode);
+        printf("not implemented: F7 /%d\n", modrm->opecode);
         exit(1);
     }
 }
 
+/* inc, dec は add, sub と同じくフラグを更新するが、CF は変えない */
 static void inc_rm32(Emulator* emu, ModRM* modrm)
 {
     uint32_t value = get_rm32(emu, modrm);
+    int carry = is_carry(emu);
+
     set_rm32(emu, modrm, value + 1);
+    update_eflags_add(emu, value, 1, (uint64_t)value + 1);
+    set_carry(emu, carry);
 }
 
-static void code_ff(Emulator* emu)
+static void dec_rm32(Emulator* emu, ModRM* modrm)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
+    uint32_t value = get_rm32(emu, modrm);
+    int carry = is_carry(emu);
+
+    set_rm32(emu, modrm, value - 1);
+    update_eflags_sub(emu, value, 1, (uint64_t)value - 1);
+    set_carry(emu, carry);
+}
 
-    switch (modrm.opecode) {
+static void code_ff(Emulator* emu, Instruction* insn)
+{
+    switch (insn->modrm.opecode) {
     case 0:
-        inc_rm32(emu, &modrm);
+        inc_rm32(emu, &insn->modrm);
+        break;
+    case 1:
+        dec_rm32(emu, &insn->modrm);
+        break;
+    case 6: /* push */
+        push32(emu, get_rm32(emu, &insn->modrm));
         break;
     default:
-        printf("not implemented: FF /%d\n", modrm.opecode);
+        printf("not implemented: FF /%d\n", insn->modrm.opecode);
         exit(1);
     }
 }
 
-static void call_rel32(Emulator* emu)
+static void call_rel32(Emulator* emu, Instruction* insn)
 {
-    int32_t diff = get_sign_code32(emu, 1);
-    push32(emu, emu->eip + 5);
-    emu->eip += (diff + 5);
+    push32(emu, emu->eip);
+    emu->eip += insn->imm;
 }
 
-static void ret(Emulator* emu)
+static void ret(Emulator* emu, Instruction* insn)
 {
     emu->eip = pop32(emu);
 }
 
-static void leave(Emulator* emu)
+static void leave(Emulator* emu, Instruction* insn)
 {
     uint32_t ebp = get_register32(emu, EBP);
     set_register32(emu, ESP, ebp);
     set_register32(emu, EBP, pop32(emu));
-
-    emu->eip += 1;
-}
-
-static void short_jump(Emulator* emu)
-{
-    int8_t diff = get_sign_code8(emu, 1);
-    emu->eip += (diff + 2);
 }
 
-static void near_jump(Emulator* emu)
+static void short_jump(Emulator* emu, Instruction* insn)
 {
-    int32_t diff = get_sign_code32(emu, 1);
-    emu->eip += (diff + 5);
+    emu->eip += insn->imm;
 }
 
-static void cmp_al_imm8(Emulator* emu)
+static void near_jump(Emulator* emu, Instruction* insn)
 {
-    uint8_t value = get_code8(emu, 1);
-    uint8_t al = get_register8(emu, AL);
-    uint64_t result = (uint64_t)al - (uint64_t)value;
-    update_eflags_sub(emu, al, value, result);
-    emu->eip += 2;
+    emu->eip += insn->imm;
 }
 
-static void cmp_eax_imm32(Emulator* emu)
+static void cmp_eax_imm32(Emulator* emu, Instruction* insn)
 {
-    uint32_t value = get_code32(emu, 1);
+    uint32_t value = insn->imm;
     uint32_t eax = get_register32(emu, EAX);
     uint64_t result = (uint64_t)eax - (uint64_t)value;
     update_eflags_sub(emu, eax, value, result);
-    emu->eip += 5;
 }
 
-static void cmp_r32_rm32(Emulator* emu)
+static void cmp_r32_rm32(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
+    uint32_t r32 = get_r32(emu, &insn->modrm);
+    uint32_t rm32 = get_rm32(emu, &insn->modrm);
     uint64_t result = (uint64_t)r32 - (uint64_t)rm32;
     update_eflags_sub(emu, r32, rm32, result);
 }
 
-static void lea(Emulator* emu)
+static void lea(Emulator* emu, Instruction* insn)
 {
-    emu->eip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t address = calc_memory_address(emu, &modrm);
-    set_r32(emu, &modrm, address);
+    uint32_t address = calc_memory_address(emu, &insn->modrm);
+    set_r32(emu, &insn->modrm, address);
 }
 
 #define DEFINE_JX(flag, is_flag) \
-static void j ## flag(Emulator* emu) \
+static void j ## flag(Emulator* emu, Instruction* insn) \
 { \
-    int diff = is_flag(emu) ? get_sign_code8(emu, 1) : 0; \
-    emu->eip += (diff + 2); \
+    if (is_flag(emu)) { \
+        emu->eip += insn->imm; \
+    } \
 } \
-static void jn ## flag(Emulator* emu) \
+static void jn ## flag(Emulator* emu, Instruction* insn) \
 { \
-    int diff = is_flag(emu) ? 0 : get_sign_code8(emu, 1); \
-    emu->eip += (diff + 2); \
+    if (!is_flag(emu)) { \
+        emu->eip += insn->imm; \
+    } \
 }
 
 DEFINE_JX(c, is_carry)
@@ -350,126 +639,944 @@ DEFINE_JX(o, is_overflow)
 
 #undef DEFINE_JX
 
-static void jl(Emulator* emu)
+static void jl(Emulator* emu, Instruction* insn)
 {
-    int diff = (is_sign(emu) != is_overflow(emu)) ? get_sign_code8(emu, 1) : 0;
-    emu->eip += (diff + 2);
+    if (is_less(emu)) {
+        emu->eip += insn->imm;
+    }
 }
 
-static void jle(Emulator* emu)
+static void jle(Emulator* emu, Instruction* insn)
 {
-    int diff = (is_zero(emu) || (is_sign(emu) != is_overflow(emu))) ? get_sign_code8(emu, 1) : 0;
-    emu->eip += (diff + 2);
+    if (is_less_or_equal(emu)) {
+        emu->eip += insn->imm;
+    }
 }
 
-static void mov_eax_moffs(Emulator* emu)
+static void jge(Emulator* emu, Instruction* insn)
 {
-    uint32_t address = get_code32(emu, 1);
-    uint32_t value = get_memory32(emu, address);
-    set_register32(emu, EAX, value);
+    if (!is_less(emu)) {
+        emu->eip += insn->imm;
+    }
+}
+
+static void jg(Emulator* emu, Instruction* insn)
+{
+    if (!is_less_or_equal(emu)) {
+        emu->eip += insn->imm;
+    }
+}
+
+static void jbe(Emulator* emu, Instruction* insn)
+{
+    if (is_carry(emu) || is_zero(emu)) {
+        emu->eip += insn->imm;
+    }
+}
+
+static void ja(Emulator* emu, Instruction* insn)
+{
+    if (!is_carry(emu) && !is_zero(emu)) {
+        emu->eip += insn->imm;
+    }
+}
 
-    emu->eip += 5;
+static void mov_eax_moffs(Emulator* emu, Instruction* insn)
+{
+    uint32_t value = get_memory32(emu, insn->imm);
+    set_register32(emu, EAX, value);
 }
 
-static void mov_moffs_eax(Emulator* emu)
+static void mov_moffs_eax(Emulator* emu, Instruction* insn)
 {
     uint32_t value = get_register32(emu, EAX);
-    uint32_t address = get_code32(emu, 1);
-    set_memory32(emu, address, value);
+    set_memory32(emu, insn->imm, value);
+}
 
-    emu->eip += 5;
+static void nop(Emulator* emu, Instruction* insn)
+{
 }
 
-static void cwd(Emulator* emu)
+static void cwd(Emulator* emu, Instruction* insn)
 {
     uint32_t eax = get_register32(emu, EAX);
     set_register32(emu, EDX, (eax >> 31) ? 0xffffffff : 0x00000000);
-
-    emu->eip += 1;
 }
 
-static void swi(Emulator* emu)
+static void swi(Emulator* emu, Instruction* insn)
 {
-    emu->int_index = get_code8(emu, 1);
-    emu->eip += 2;
+    emu->int_index = insn->imm;
 }
 
-static void iretd(Emulator* emu)
+static void iretd(Emulator* emu, Instruction* insn)
 {
     emu->eip = pop32(emu);
-    emu->eflags = pop32(emu);
+    set_eflags(emu, pop32(emu));
 }
 
-void init_instructions(void)
+/* 割り込みが来るまで止まる(待つのは実行ループの wait_for_interrupt) */
+static void hlt(Emulator* emu, Instruction* insn)
 {
-    int32_t i;
+    emu->halted = TRUE;
+}
+
+static void cli(Emulator* emu, Instruction* insn)
+{
+    set_interrupt(emu, FALSE);
+}
+
+static void sti(Emulator* emu, Instruction* insn)
+{
+    set_interrupt(emu, TRUE);
+}
+
+static void cld(Emulator* emu, Instruction* insn)
+{
+    set_direction(emu, FALSE);
+}
 
-    memset(instructions, 0, sizeof(instructions));
+static void std(Emulator* emu, Instruction* insn)
+{
+    set_direction(emu, TRUE);
+}
 
-    instructions[0x01] = add_rm32_r32;
+/* 文字列命令(movs, cmps, stos, lods, scas)
+ *
+ * オペコードの最下位ビットが 0 ならバイト、1 ならダブルワードを扱う。
+ * rep(F3), repne(F2) が付いていれば ECX が 0 になるまで繰り返し、cmps と
+ * scas は ZF が条件に合わなくなったところでも止める。割り込みは繰り返しを
+ * 終えてから受け付ける。
+ *
+ * DF が 0 で RAM に収まる範囲は、ページごとにホストの memmove, memset,
+ * memchr などでまとめて処理する。
+ */
+
+/* 1要素のバイト数 */
+static int string_size(Instruction* insn)
+{
+    return (insn->opecode & 1) ? 4 : 1;
+}
 
-    instructions[0x3B] = cmp_r32_rm32;
-    instructions[0x3C] = cmp_al_imm8;
-    instructions[0x3D] = cmp_eax_imm32;
+/* 1要素ごとに ESI, EDI を進める量 */
+static uint32_t string_delta(Emulator* emu, int size)
+{
+    return is_direction(emu) ? -size : size;
+}
 
-    for (i = 0; i < 8; i++) {
-        instructions[0x40 + i] = inc_r32;
+static uint32_t get_string(Emulator* emu, uint32_t address, int size)
+{
+    return size == 1 ? get_memory8(emu, address) : get_memory32(emu, address);
+}
+
+static void set_string(Emulator* emu, uint32_t address, uint32_t value, int size)
+{
+    if (size == 1) {
+        set_memory8(emu, address, value);
+    } else {
+        set_memory32(emu, address, value);
     }
+}
 
-    for (i = 0; i < 8; i++) {
-        instructions[0x50 + i] = push_r32;
+static uint32_t load_string(const uint8_t* p, int size)
+{
+    return size == 1 ? *p : load32(p);
+}
+
+/* 比較(cmps, scas)でフラグを更新する */
+static void compare_string(Emulator* emu, uint32_t v1, uint32_t v2, int size)
+{
+    if (size == 1) {
+        alu(emu, ALU_CMP, v1 << 24, v2 << 24, 1 << 24);
+    } else {
+        alu(emu, ALU_CMP, v1, v2, 1);
     }
+}
+
+/* repe は ZF が 0 に、repne は ZF が 1 になったら繰り返しを止める */
+static int stop_repeat(Emulator* emu, Instruction* insn)
+{
+    return (insn->prefix == 0xF3 && !is_zero(emu))
+           || (insn->prefix == 0xF2 && is_zero(emu));
+}
+
+/* まとめて処理する要素の数(address からページの終わりまでに収まり、
+ * count を超えない。DF が 1 か、繰り返さないときは 0) */
+static uint32_t string_chunk(Emulator* emu, Instruction* insn, uint32_t address,
+                             int size, uint32_t count)
+{
+    uint32_t n = (PAGE_SIZE - (address & (PAGE_SIZE - 1))) / size;
+
+    if (insn->prefix == 0 || is_direction(emu)) {
+        return 0;
+    }
+    return n < count ? n : count;
+}
+
+/* 線形アドレス address からの size バイト(1つのページに収まる)を直接
+ * 読み書きするホストのポインタ(RAM でなければ NULL) */
+static uint8_t* string_pointer(Emulator* emu, uint32_t address, uint32_t size, int write)
+{
+    uint32_t physical = address;
+
+    if (emu->cr0 & CR0_PG) {
+        physical = to_physical(emu, address, write);
+    }
+    if (!IS_RAM(emu, physical, size)) {
+        return NULL;
+    }
+    return emu->memory + physical;
+}
+
+/* 直接書き込んだ範囲(1つのページに収まる)のキャッシュしたコードを捨てる
+ *
+ * write_code は範囲の両端しか調べないので、64 バイトの範囲ごとに呼ぶ。
+ */
+static void wrote_string(Emulator* emu, uint8_t* p, uint32_t size)
+{
+    BlockCache* cache = emu->block_cache;
+    uint32_t start = p - emu->memory;
+    uint32_t line;
+
+    if (!IS_CODE_PAGE(cache, start)) {
+        return;
+    }
+
+    for (line = start >> CODE_LINE_SHIFT;
+         line <= (start + size - 1) >> CODE_LINE_SHIFT; line++) {
+        if (cache->code_lines[line]) {
+            write_code(emu, line << CODE_LINE_SHIFT, 1 << CODE_LINE_SHIFT);
+        }
+    }
+}
+
+/* 残りの回数を ECX に書き戻す */
+static void set_repeat(Emulator* emu, Instruction* insn, uint32_t count)
+{
+    if (insn->prefix != 0) {
+        set_register32(emu, ECX, count);
+    }
+}
+
+static void movs(Emulator* emu, Instruction* insn)
+{
+    int size = string_size(insn);
+    uint32_t delta = string_delta(emu, size);
+    uint32_t count = insn->prefix != 0 ? get_register32(emu, ECX) : 1;
+
+    while (count > 0) {
+        uint32_t esi = get_register32(emu, ESI);
+        uint32_t edi = get_register32(emu, EDI);
+        uint32_t n = string_chunk(emu, insn, esi, size, count);
+        uint32_t m = string_chunk(emu, insn, edi, size, count);
+        uint8_t* src = NULL;
+        uint8_t* dst = NULL;
+
+        n = m < n ? m : n;
+        if (n > 1) {
+            src = string_pointer(emu, esi, n * size, FALSE);
+            dst = string_pointer(emu, edi, n * size, TRUE);
+        }
+
+        /* 前から1要素ずつ写すのと結果が変わる重なり方(dst が src の
+         * 少し後ろ)は memmove にできない */
+        if (src != NULL && dst != NULL && !(src < dst && dst < src + n * size)) {
+            memmove(dst, src, n * size);
+            wrote_string(emu, dst, n * size);
+        } else {
+            n = 1;
+            set_string(emu, edi, get_string(emu, esi, size), size);
+        }
+
+        set_register32(emu, ESI, esi + n * delta);
+        set_register32(emu, EDI, edi + n * delta);
+        count -= n;
+        set_repeat(emu, insn, count);
+    }
+}
+
+static void cmps(Emulator* emu, Instruction* insn)
+{
+    int size = string_size(insn);
+    uint32_t delta = string_delta(emu, size);
+    uint32_t count = insn->prefix != 0 ? get_register32(emu, ECX) : 1;
+
+    while (count > 0) {
+        uint32_t esi = get_register32(emu, ESI);
+        uint32_t edi = get_register32(emu, EDI);
+        uint32_t n = 0;
+        uint8_t* src = NULL;
+        uint8_t* dst = NULL;
+
+        /* repe は違う要素を探す */
+        if (insn->prefix == 0xF3) {
+            uint32_t m = string_chunk(emu, insn, edi, size, count);
+
+            n = string_chunk(emu, insn, esi, size, count);
+            n = m < n ? m : n;
+        }
+        if (n > 1) {
+            src = string_pointer(emu, esi, n * size, FALSE);
+            dst = string_pointer(emu, edi, n * size, FALSE);
+        }
+
+        if (src != NULL && dst != NULL) {
+            uint32_t i = 0;
+
+            while (i < n - 1 && memcmp(src + i * size, dst + i * size, size) == 0) {
+                i++;
+            }
+            compare_string(emu, load_string(src + i * size, size),
+                           load_string(dst + i * size, size), size);
+            n = i + 1;
+        } else {
+            n = 1;
+            compare_string(emu, get_string(emu, esi, size),
+                           get_string(emu, edi, size), size);
+        }
+
+        set_register32(emu, ESI, esi + n * delta);
+        set_register32(emu, EDI, edi + n * delta);
+        count -= n;
+        set_repeat(emu, insn, count);
+
+        if (stop_repeat(emu, insn)) {
+            break;
+        }
+    }
+}
+
+static void stos(Emulator* emu, Instruction* insn)
+{
+    int size = string_size(insn);
+    uint32_t delta = string_delta(emu, size);
+    uint32_t count = insn->prefix != 0 ? get_register32(emu, ECX) : 1;
+    uint32_t value = size == 1 ? get_register8(emu, AL) : get_register32(emu, EAX);
+
+    while (count > 0) {
+        uint32_t edi = get_register32(emu, EDI);
+        uint32_t n = string_chunk(emu, insn, edi, size, count);
+        uint8_t* dst = n > 1 ? string_pointer(emu, edi, n * size, TRUE) : NULL;
+
+        if (dst != NULL) {
+            if (size == 1) {
+                memset(dst, value, n);
+            } else {
+                uint32_t i;
+
+                for (i = 0; i < n; i++) {
+                    store32(dst + i * 4, value);
+                }
+            }
+            wrote_string(emu, dst, n * size);
+        } else {
+            n = 1;
+            set_string(emu, edi, value, size);
+        }
+
+        set_register32(emu, EDI, edi + n * delta);
+        count -= n;
+        set_repeat(emu, insn, count);
+    }
+}
+
+static void lods(Emulator* emu, Instruction* insn)
+{
+    int size = string_size(insn);
+    uint32_t delta = string_delta(emu, size);
+    uint32_t count = insn->prefix != 0 ? get_register32(emu, ECX) : 1;
+
+    while (count > 0) {
+        uint32_t esi = get_register32(emu, ESI);
+        uint32_t value = get_string(emu, esi, size);
+
+        if (size == 1) {
+            set_register8(emu, AL, value);
+        } else {
+            set_register32(emu, EAX, value);
+        }
+
+        set_register32(emu, ESI, esi + delta);
+        count--;
+        set_repeat(emu, insn, count);
+    }
+}
+
+static void scas(Emulator* emu, Instruction* insn)
+{
+    int size = string_size(insn);
+    uint32_t delta = string_delta(emu, size);
+    uint32_t count = insn->prefix != 0 ? get_register32(emu, ECX) : 1;
+    uint32_t value = size == 1 ? get_register8(emu, AL) : get_register32(emu, EAX);
+
+    while (count > 0) {
+        uint32_t edi = get_register32(emu, EDI);
+        uint32_t n = 0;
+        uint8_t* p = NULL;
+
+        /* repne scasb(strlen, memchr)は memchr で探す */
+        if (insn->prefix == 0xF2 && size == 1) {
+            n = string_chunk(emu, insn, edi, size, count);
+        }
+        if (n > 1) {
+            p = string_pointer(emu, edi, n, FALSE);
+        }
+
+        if (p != NULL) {
+            uint8_t* found = memchr(p, value, n);
+
+            if (found != NULL) {
+                n = found - p + 1;
+            }
+            compare_string(emu, value, p[n - 1], size);
+        } else {
+            n = 1;
+            compare_string(emu, value, get_string(emu, edi, size), size);
+        }
+
+        set_register32(emu, EDI, edi + n * delta);
+        count -= n;
+        set_repeat(emu, insn, count);
+
+        if (stop_repeat(emu, insn)) {
+            break;
+        }
+    }
+}
+
+static void mov_r32_cr(Emulator* emu, Instruction* insn)
+{
+    uint32_t value = get_control_register(emu, insn->modrm.reg_index);
+    set_register32(emu, insn->modrm.rm, value);
+}
+
+static void mov_cr_r32(Emulator* emu, Instruction* insn)
+{
+    uint32_t value = get_register32(emu, insn->modrm.rm);
+    set_control_register(emu, insn->modrm.reg_index, value);
+}
+
+static void invlpg(Emulator* emu, Instruction* insn)
+{
+    invalidate_page(emu, calc_memory_address(emu, &insn->modrm));
+}
+
+static void code_0f_01(Emulator* emu, Instruction* insn)
+{
+    switch (insn->modrm.opecode) {
+    case 7:
+        invlpg(emu, insn);
+        break;
+
+    default:
+        printf("0F 01: modrm opecode == %x is not implemented\n", insn->modrm.opecode);
+        exit(0);
+    }
+}
+
+/* 融合した比較命令の2つのオペランドを取得する */
+static void fused_operands(Emulator* emu, Instruction* insn, uint32_t* v1, uint32_t* v2)
+{
+    switch (insn->opecode) {
+    case 0x3B:
+        *v1 = get_r32(emu, &insn->modrm);
+        *v2 = get_rm32(emu, &insn->modrm);
+        break;
+    case 0x3C:
+        /* alu と同じく上位8bitに寄せて、8bit の符号付き比較にする */
+        *v1 = get_register8(emu, AL) << 24;
+        *v2 = insn->imm << 24;
+        break;
+    case 0x3D:
+        *v1 = get_register32(emu, EAX);
+        *v2 = insn->imm;
+        break;
+    default: /* 0x83 /7 */
+        *v1 = get_rm32(emu, &insn->modrm);
+        *v2 = insn->imm;
+        break;
+    }
+}
+
+/* 比較と条件分岐を融合した命令
+ *
+ * 分岐の条件はオペランドから直接求める。EFLAGS も比較命令と同じく更新する。
+ */
+#define DEFINE_FUSED_JX(cc, cond) \
+static void cmp_j ## cc(Emulator* emu, Instruction* insn) \
+{ \
+    uint32_t v1, v2; \
+    fused_operands(emu, insn, &v1, &v2); \
+    update_eflags_sub(emu, v1, v2, (uint64_t)v1 - (uint64_t)v2); \
+    if (cond) { \
+        emu->eip += insn->branch; \
+    } \
+}
+
+DEFINE_FUSED_JX(z, v1 == v2)
+DEFINE_FUSED_JX(nz, v1 != v2)
+DEFINE_FUSED_JX(l, (int32_t)v1 < (int32_t)v2)
+DEFINE_FUSED_JX(le, (int32_t)v1 <= (int32_t)v2)
+
+#undef DEFINE_FUSED_JX
+
+/* 命令の実行関数の一覧(スレッデッドコードのラベルと対応する) */
+#define HANDLERS(X) \
+    X(mov_r8_imm8) X(mov_r32_imm32) X(mov_r8_rm8) X(mov_r32_rm32) \
+    X(add_rm32_r32) X(mov_rm8_r8) X(mov_rm32_r32) X(inc_r32) \
+    X(dec_r32) X(push_r32) X(pop_r32) X(push_imm32) X(push_imm8) \
+    X(code_83) X(mov_rm32_imm32) X(in_al_dx) X(out_dx_al) \
+    X(code_f7) X(code_ff) X(call_rel32) X(ret) X(leave) \
+    X(short_jump) X(near_jump) X(cmp_eax_imm32) \
+    X(cmp_r32_rm32) X(lea) X(jc) X(jnc) X(jz) X(jnz) X(js) X(jns) \
+    X(jo) X(jno) X(jl) X(jle) X(mov_eax_moffs) X(mov_moffs_eax) \
+    X(cwd) X(swi) X(mov_r32_cr) X(mov_cr_r32) X(code_0f_01) \
+    X(cmp_jz) X(cmp_jnz) X(cmp_jl) X(cmp_jle) \
+    X(alu_rm32_r32) X(alu_r32_rm32) X(alu_eax_imm32) X(alu_rm8_r8) \
+    X(alu_r8_rm8) X(alu_al_imm8) X(code_81) X(test_rm8_r8) X(test_rm32_r32) \
+    X(imul_r32_rm32_imm) X(imul_r32_rm32) X(movzx_r32_rm8) X(movzx_r32_rm16) \
+    X(movsx_r32_rm8) X(movsx_r32_rm16) X(code_c1) X(code_d1) X(code_d3) \
+    X(mov_rm8_imm8) X(jbe) X(ja) X(jge) X(jg) X(nop) \
+    X(iretd) X(cli) X(sti) X(hlt) X(cld) X(std) \
+    X(movs) X(cmps) X(stos) X(lods) X(scas)
+
+#define HANDLER_ENUM(name) HANDLER_ ## name,
+#define HANDLER_ADDR(name) name,
+
+enum { HANDLERS(HANDLER_ENUM) HANDLER_END };
+
+static instruction_exec_t* const handlers[] = { HANDLERS(HANDLER_ADDR) };
+
+/* 実行関数に対応する番号を返す */
+static uint8_t handler_index(instruction_exec_t* exec)
+{
+    int i;
+
+    for (i = 0; i < HANDLER_END; i++) {
+        if (handlers[i] == exec) {
+            return i;
+        }
+    }
+
+    return HANDLER_END;
+}
+
+void end_instructions(Instruction* insn)
+{
+    memset(insn, 0, sizeof(Instruction));
+    insn->handler = HANDLER_END;
+}
+
+#if defined(THREADED_DISPATCH) && defined(__GNUC__)
+
+/* スレッデッドコードによる実行
+ *
+ * 各命令のラベルは実行関数を直接呼び出し、そのまま次の命令のラベルへ
+ * 飛ぶ。分岐予測が命令ごとの分岐元で行われるので、1か所の間接呼び出しに
+ * 集中する関数ポインタ表よりも予測が当たりやすい。
+ */
+Instruction* execute_instructions(Emulator* emu, Instruction* insn)
+{
+#define HANDLER_LABEL(name) &&label_ ## name,
+    static void* const labels[] = { HANDLERS(HANDLER_LABEL) &&label_end };
+#undef HANDLER_LABEL
 
+#define DISPATCH() \
+    do { \
+        emu->eip += insn->length; \
+        goto *labels[insn->handler]; \
+    } while (0)
+
+#define HANDLER_BODY(name) \
+label_ ## name: \
+    name(emu, insn); \
+    STATS_COUNT(emu, insn, tsc); \
+    if (emu->block_invalidated) { \
+        return insn; \
+    } \
+    insn++; \
+    DISPATCH();
+
+    STATS_START(tsc);
+
+    DISPATCH();
+
+    HANDLERS(HANDLER_BODY)
+
+label_end:
+    return NULL;
+
+#undef HANDLER_BODY
+#undef DISPATCH
+}
+
+#else
+
+Instruction* execute_instructions(Emulator* emu, Instruction* insn)
+{
+    STATS_START(tsc);
+
+    for (; insn->exec != NULL; insn++) {
+        emu->eip += insn->length;
+        insn->exec(emu, insn);
+        STATS_COUNT(emu, insn, tsc);
+
+        /* 命令を書き換えたら残りは古いデコード結果なので実行しない */
+        if (emu->block_invalidated) {
+            return insn;
+        }
+    }
+
+    return NULL;
+}
+
+#endif
+
+int fuse_instructions(Instruction* first, Instruction* second)
+{
+    instruction_exec_t* exec;
+
+    if (first->fused_opecode != 0) {
+        return FALSE;
+    }
+
+    switch (first->opecode) {
+    case 0x3B:
+    case 0x3C:
+    case 0x3D:
+        break;
+    case 0x83:
+        if (first->modrm.opecode != 7) {
+            return FALSE;
+        }
+        break;
+    default:
+        return FALSE;
+    }
+
+    switch (second->opecode) {
+    case 0x74:
+        exec = cmp_jz;
+        break;
+    case 0x75:
+        exec = cmp_jnz;
+        break;
+    case 0x7C:
+        exec = cmp_jl;
+        break;
+    case 0x7E:
+        exec = cmp_jle;
+        break;
+    default:
+        return FALSE;
+    }
+
+    first->exec = exec;
+    first->handler = handler_index(exec);
+    first->format |= OPF_BRANCH;
+    first->length += second->length;
+    first->fused_opecode = second->opecode;
+    first->branch = second->imm;
+
+    return TRUE;
+}
+
+/* address 番地の命令を opecode 番目の命令としてデコードする */
+static int decode_opecode(Emulator* emu, uint32_t address, uint8_t opecode,
+                          Instruction* insn)
+{
+    uint32_t p = address + 1;
+    uint8_t opecode2 = 0;
+    uint8_t prefix = 0;
+
+    /* rep, repne(0x0F の命令に付くのは SSE の命令なので扱わない) */
+    if (opecode == 0xF2 || opecode == 0xF3) {
+        prefix = opecode;
+        opecode = get_memory8(emu, p);
+        p += 1;
+        if (opecode == 0x0F || opecode == 0xF2 || opecode == 0xF3) {
+            insn->exec = NULL;
+            return FALSE;
+        }
+    }
+
+    if (opecode == 0x0F) {
+        /* 2バイトの命令 */
+        opecode2 = get_memory8(emu, p);
+        p += 1;
+        insn->exec = emu->isa->executors_0f[opecode2];
+        insn->format = emu->isa->formats_0f[opecode2];
+    } else {
+        insn->exec = emu->isa->executors[opecode];
+        insn->format = emu->isa->formats[opecode];
+    }
+
+    insn->handler = handler_index(insn->exec);
+    insn->opecode = opecode;
+    insn->opecode2 = opecode2;
+    insn->prefix = prefix;
+    insn->fused_opecode = 0;
+    insn->branch = 0;
+
+    if (insn->exec == NULL) {
+        return FALSE;
+    }
+
+    if (insn->format & OPF_MODRM) {
+        p += decode_modrm(emu, p, &insn->modrm);
+    } else {
+        memset(&insn->modrm, 0, sizeof(ModRM));
+    }
+
+    if (insn->format & OPF_IMM8) {
+        insn->imm = get_memory8(emu, p);
+        p += 1;
+    } else if (insn->format & OPF_SIMM8) {
+        insn->imm = (int8_t)get_memory8(emu, p);
+        p += 1;
+    } else if (insn->format & OPF_IMM32) {
+        insn->imm = get_memory32(emu, p);
+        p += 4;
+    } else {
+        insn->imm = 0;
+    }
+
+    insn->length = p - address;
+
+#ifdef OPCODE_STATS
+    insn->stats = stats_index(opecode, opecode2, insn->modrm.opecode);
+#endif
+
+    return TRUE;
+}
+
+int decode_instruction(Emulator* emu, uint32_t address, Instruction* insn)
+{
+    return decode_opecode(emu, address, get_memory8(emu, address), insn);
+}
+
+/* eip の命令を opecode 番目の命令としてデコードし、実行する */
+static void step(Emulator* emu, uint8_t opecode)
+{
+    Instruction insn;
+
+    STATS_START(tsc);
+
+    if (!decode_opecode(emu, emu->eip, opecode, &insn)) {
+        /* プレフィックスの後ろが実装されていない命令だった */
+        printf("%02X: opecode == %x is not implemented\n", opecode, get_code8(emu, 1));
+        exit(0);
+    }
+    emu->eip += insn.length;
+    insn.exec(emu, &insn);
+    STATS_COUNT(emu, &insn, tsc);
+
+    /* 1命令ずつ実行するときは eflags を常に正しい値にしておく */
+    flush_eflags(emu);
+}
+
+int step_instruction(Emulator* emu)
+{
+    Instruction insn;
+
+    STATS_START(tsc);
+
+    if (!decode_instruction(emu, emu->eip, &insn)) {
+        return FALSE;
+    }
+    emu->eip += insn.length;
+    insn.exec(emu, &insn);
+    STATS_COUNT(emu, &insn, tsc);
+
+    flush_eflags(emu);
+    emu->retired++;
+    return TRUE;
+}
+
+/* instructions[] に登録する、opecode ごとの逐次解釈用の関数 */
+#define DEFINE_STEP(op) \
+static void step_ ## op(Emulator* emu) \
+{ \
+    step(emu, op); \
+}
+#define DEFINE_STEP16(h) \
+    DEFINE_STEP(h ## 0) DEFINE_STEP(h ## 1) DEFINE_STEP(h ## 2) DEFINE_STEP(h ## 3) \
+    DEFINE_STEP(h ## 4) DEFINE_STEP(h ## 5) DEFINE_STEP(h ## 6) DEFINE_STEP(h ## 7) \
+    DEFINE_STEP(h ## 8) DEFINE_STEP(h ## 9) DEFINE_STEP(h ## A) DEFINE_STEP(h ## B) \
+    DEFINE_STEP(h ## C) DEFINE_STEP(h ## D) DEFINE_STEP(h ## E) DEFINE_STEP(h ## F)
+#define STEP16(h) \
+    step_ ## h ## 0, step_ ## h ## 1, step_ ## h ## 2, step_ ## h ## 3, \
+    step_ ## h ## 4, step_ ## h ## 5, step_ ## h ## 6, step_ ## h ## 7, \
+    step_ ## h ## 8, step_ ## h ## 9, step_ ## h ## A, step_ ## h ## B, \
+    step_ ## h ## C, step_ ## h ## D, step_ ## h ## E, step_ ## h ## F
+
+DEFINE_STEP16(0x0) DEFINE_STEP16(0x1) DEFINE_STEP16(0x2) DEFINE_STEP16(0x3)
+DEFINE_STEP16(0x4) DEFINE_STEP16(0x5) DEFINE_STEP16(0x6) DEFINE_STEP16(0x7)
+DEFINE_STEP16(0x8) DEFINE_STEP16(0x9) DEFINE_STEP16(0xA) DEFINE_STEP16(0xB)
+DEFINE_STEP16(0xC) DEFINE_STEP16(0xD) DEFINE_STEP16(0xE) DEFINE_STEP16(0xF)
+
+static instruction_func_t* const steps[256] = {
+    STEP16(0x0), STEP16(0x1), STEP16(0x2), STEP16(0x3),
+    STEP16(0x4), STEP16(0x5), STEP16(0x6), STEP16(0x7),
+    STEP16(0x8), STEP16(0x9), STEP16(0xA), STEP16(0xB),
+    STEP16(0xC), STEP16(0xD), STEP16(0xE), STEP16(0xF),
+};
+
+#undef STEP16
+#undef DEFINE_STEP16
+#undef DEFINE_STEP
+
+/* opecode 番目の命令を登録する */
+static void register_instruction(InstructionSet* isa, uint8_t opecode,
+                                 instruction_exec_t* exec, uint8_t format)
+{
+    isa->executors[opecode] = exec;
+    isa->formats[opecode] = format;
+    isa->instructions[opecode] = steps[opecode];
+}
+
+/* 0x0F, opecode の2バイトの命令を登録する */
+static void register_instruction_0f(InstructionSet* isa, uint8_t opecode,
+                                    instruction_exec_t* exec, uint8_t format)
+{
+    isa->executors_0f[opecode] = exec;
+    isa->formats_0f[opecode] = format;
+    isa->instructions[0x0F] = steps[0x0F];
+}
+
+void init_instructions(InstructionSet* isa)
+{
+    /* 条件分岐の実行関数(条件の番号 = オペコードの下位4ビット) */
+    static instruction_exec_t* const jcc[16] = {
+        jo, jno, jc, jnc, jz, jnz, jbe, ja,
+        js, jns, NULL, NULL, jl, jge, jle, jg
+    };
+    int32_t i;
+
+    memset(isa, 0, sizeof(InstructionSet));
+
+    /* 00-3F の add, or, adc, sbb, and, sub, xor, cmp */
     for (i = 0; i < 8; i++) {
-        instructions[0x58 + i] = pop_r32;
+        register_instruction(isa, i << 3 | 0, alu_rm8_r8, OPF_MODRM);
+        register_instruction(isa, i << 3 | 1, alu_rm32_r32, OPF_MODRM);
+        register_instruction(isa, i << 3 | 2, alu_r8_rm8, OPF_MODRM);
+        register_instruction(isa, i << 3 | 3, alu_r32_rm32, OPF_MODRM);
+        register_instruction(isa, i << 3 | 4, alu_al_imm8, OPF_IMM8);
+        register_instruction(isa, i << 3 | 5, alu_eax_imm32, OPF_IMM32);
     }
 
-    instructions[0x68] = push_imm32;
-    instructions[0x6A] = push_imm8;
+    register_instruction(isa, 0x01, add_rm32_r32, OPF_MODRM);
+
+    /* アドレスの変換が変わる命令はブロックの終端にする */
+    register_instruction_0f(isa, 0x01, code_0f_01, OPF_MODRM | OPF_BRANCH);
+    register_instruction_0f(isa, 0x20, mov_r32_cr, OPF_MODRM);
+    register_instruction_0f(isa, 0x22, mov_cr_r32, OPF_MODRM | OPF_BRANCH);
+
+    for (i = 0; i < 16; i++) {
+        if (jcc[i] != NULL) {
+            register_instruction_0f(isa, 0x80 + i, jcc[i], OPF_IMM32 | OPF_BRANCH);
+        }
+    }
 
-    instructions[0x70] = jo;
-    instructions[0x71] = jno;
-    instructions[0x72] = jc;
-    instructions[0x73] = jnc;
-    instructions[0x74] = jz;
-    instructions[0x75] = jnz;
-    instructions[0x78] = js;
-    instructions[0x79] = jns;
-    instructions[0x7C] = jl;
-    instructions[0x7E] = jle;
+    register_instruction_0f(isa, 0xAF, imul_r32_rm32, OPF_MODRM);
+    register_instruction_0f(isa, 0xB6, movzx_r32_rm8, OPF_MODRM);
+    register_instruction_0f(isa, 0xB7, movzx_r32_rm16, OPF_MODRM);
+    register_instruction_0f(isa, 0xBE, movsx_r32_rm8, OPF_MODRM);
+    register_instruction_0f(isa, 0xBF, movsx_r32_rm16, OPF_MODRM);
 
-    instructions[0x83] = code_83;
-    instructions[0x88] = mov_rm8_r8;
-    instructions[0x89] = mov_rm32_r32;
-    instructions[0x8A] = mov_r8_rm8;
-    instructions[0x8B] = mov_r32_rm32;
-    instructions[0x8D] = lea;
+    register_instruction(isa, 0x3B, cmp_r32_rm32, OPF_MODRM);
+    register_instruction(isa, 0x3D, cmp_eax_imm32, OPF_IMM32);
 
-    instructions[0x99] = cwd;
+    for (i = 0; i < 8; i++) {
+        register_instruction(isa, 0x40 + i, inc_r32, 0);
+    }
 
-    instructions[0xA1] = mov_eax_moffs;
-    instructions[0xA3] = mov_moffs_eax;
+    for (i = 0; i < 8; i++) {
+        register_instruction(isa, 0x48 + i, dec_r32, 0);
+    }
 
     for (i = 0; i < 8; i++) {
-        instructions[0xB0 + i] = mov_r8_imm8;
+        register_instruction(isa, 0x50 + i, push_r32, 0);
     }
 
     for (i = 0; i < 8; i++) {
-        instructions[0xB8 + i] = mov_r32_imm32;
+        register_instruction(isa, 0x58 + i, pop_r32, 0);
+    }
+
+    register_instruction(isa, 0x68, push_imm32, OPF_IMM32);
+    register_instruction(isa, 0x69, imul_r32_rm32_imm, OPF_MODRM | OPF_IMM32);
+    register_instruction(isa, 0x6A, push_imm8, OPF_IMM8);
+    register_instruction(isa, 0x6B, imul_r32_rm32_imm, OPF_MODRM | OPF_SIMM8);
+
+    for (i = 0; i < 16; i++) {
+        if (jcc[i] != NULL) {
+            register_instruction(isa, 0x70 + i, jcc[i], OPF_SIMM8 | OPF_BRANCH);
+        }
     }
 
-    instructions[0xC3] = ret;
-    instructions[0xC7] = mov_rm32_imm32;
-    instructions[0xC9] = leave;
-    instructions[0xCD] = swi;
+    register_instruction(isa, 0x81, code_81, OPF_MODRM | OPF_IMM32);
+    register_instruction(isa, 0x83, code_83, OPF_MODRM | OPF_SIMM8);
+    register_instruction(isa, 0x84, test_rm8_r8, OPF_MODRM);
+    register_instruction(isa, 0x85, test_rm32_r32, OPF_MODRM);
+    register_instruction(isa, 0x88, mov_rm8_r8, OPF_MODRM);
+    register_instruction(isa, 0x89, mov_rm32_r32, OPF_MODRM);
+    register_instruction(isa, 0x8A, mov_r8_rm8, OPF_MODRM);
+    register_instruction(isa, 0x8B, mov_r32_rm32, OPF_MODRM);
+    register_instruction(isa, 0x8D, lea, OPF_MODRM);
+
+    register_instruction(isa, 0x90, nop, 0);
+    register_instruction(isa, 0x99, cwd, 0);
+
+    register_instruction(isa, 0xA1, mov_eax_moffs, OPF_IMM32);
+    register_instruction(isa, 0xA3, mov_moffs_eax, OPF_IMM32);
+
+    /* 文字列命令(rep, repne のプレフィックスは続く命令と一緒にデコードする) */
+    register_instruction(isa, 0xA4, movs, 0);
+    register_instruction(isa, 0xA5, movs, 0);
+    register_instruction(isa, 0xA6, cmps, 0);
+    register_instruction(isa, 0xA7, cmps, 0);
+    register_instruction(isa, 0xAA, stos, 0);
+    register_instruction(isa, 0xAB, stos, 0);
+    register_instruction(isa, 0xAC, lods, 0);
+    register_instruction(isa, 0xAD, lods, 0);
+    register_instruction(isa, 0xAE, scas, 0);
+    register_instruction(isa, 0xAF, scas, 0);
+    isa->instructions[0xF2] = steps[0xF2];
+    isa->instructions[0xF3] = steps[0xF3];
 
-    instructions[0xE8] = call_rel32;
-    instructions[0xE9] = near_jump;
-    instructions[0xEB] = short_jump;
+    for (i = 0; i < 8; i++) {
+        register_instruction(isa, 0xB0 + i, mov_r8_imm8, OPF_IMM8);
+    }
 
-    instructions[0xEC] = in_al_dx;
-    instructions[0xEE] = out_dx_al;
+    for (i = 0; i < 8; i++) {
+        register_instruction(isa, 0xB8 + i, mov_r32_imm32, OPF_IMM32);
+    }
 
-    instructions[0xF7] = code_f7;
-    instructions[0xFF] = code_ff;
+    register_instruction(isa, 0xC1, code_c1, OPF_MODRM | OPF_IMM8);
+    register_instruction(isa, 0xC3, ret, OPF_BRANCH);
+    register_instruction(isa, 0xC6, mov_rm8_imm8, OPF_MODRM | OPF_IMM8);
+    register_instruction(isa, 0xC7, mov_rm32_imm32, OPF_MODRM | OPF_IMM32);
+    register_instruction(isa, 0xC9, leave, 0);
+    register_instruction(isa, 0xCD, swi, OPF_IMM8 | OPF_BRANCH);
+    register_instruction(isa, 0xCF, iretd, OPF_BRANCH);
+
+    register_instruction(isa, 0xD1, code_d1, OPF_MODRM);
+    register_instruction(isa, 0xD3, code_d3, OPF_MODRM);
+
+    register_instruction(isa, 0xE8, call_rel32, OPF_IMM32 | OPF_BRANCH);
+    register_instruction(isa, 0xE9, near_jump, OPF_IMM32 | OPF_BRANCH);
+    register_instruction(isa, 0xEB, short_jump, OPF_SIMM8 | OPF_BRANCH);
+
+    register_instruction(isa, 0xEC, in_al_dx, 0);
+    register_instruction(isa, 0xEE, out_dx_al, 0);
+
+    register_instruction(isa, 0xF4, hlt, OPF_BRANCH);
+    register_instruction(isa, 0xF7, code_f7, OPF_MODRM);
+
+    /* 割り込みはブロックの終わりで受け付けるので、sti の直後の命令
+     * (sti; hlt など)は割り込みの前に実行される */
+    register_instruction(isa, 0xFA, cli, 0);
+    register_instruction(isa, 0xFB, sti, 0);
+    register_instruction(isa, 0xFC, cld, 0);
+    register_instruction(isa, 0xFD, std, 0);
+    register_instruction(isa, 0xFF, code_ff, OPF_MODRM);
 }
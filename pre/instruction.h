@@ -1,15 +1,119 @@
 #ifndef INSTRUCTION_H_
 #define INSTRUCTION_H_
 
+#include <stdint.h>
+
 #include "emulator.h"
+#include "modrm.h"
 
-/* 命令セットの初期化関数 */
-void init_instructions(void);
+/* 命令の形式(デコード時に使うフラグ) */
+#define OPF_MODRM  (1 << 0) /* ModR/M を持つ */
+#define OPF_IMM8   (1 << 1) /* 符号無し8bit即値を持つ */
+#define OPF_SIMM8  (1 << 2) /* 符号付き8bit即値を持つ(32bitに符号拡張する) */
+#define OPF_IMM32  (1 << 3) /* 32bit即値を持つ */
+#define OPF_BRANCH (1 << 4) /* eip を書き換える(基本ブロックの終端になる) */
+
+typedef struct Instruction Instruction;
+
+/* デコード済みの命令を実行する関数
+ *
+ * 呼び出しのとき emu->eip は次の命令の先頭を指している。
+ */
+typedef void instruction_exec_t(Emulator*, Instruction*);
+
+/* デコード済みの命令 */
+struct Instruction {
+    /* 実行関数 */
+    instruction_exec_t* exec;
+
+    /* ModR/M, SIB, ディスプレースメント */
+    ModRM modrm;
+
+    /* 即値(相対ジャンプでは変位)、符号付き8bit即値は符号拡張済み */
+    uint32_t imm;
+
+    uint8_t opecode;
+
+    /* 0x0F で始まる命令の2バイト目(それ以外は 0) */
+    uint8_t opecode2;
+
+    /* rep(0xF3), repne(0xF2) のプレフィックス(なければ 0) */
+    uint8_t prefix;
+
+    /* 実行関数の番号(スレッデッドコードで使う) */
+    uint8_t handler;
+
+    /* OPF_* の組み合わせ */
+    uint8_t format;
+
+    /* 命令長(バイト数) */
+    uint8_t length;
+
+    /* 融合した条件分岐のオペコードと変位(融合していなければ 0) */
+    uint8_t fused_opecode;
+    uint32_t branch;
+
+#ifdef OPCODE_STATS
+    /* 集計の番号(stats_index) */
+    uint16_t stats;
+#endif
+};
+
+
+/* address 番地の命令をデコードして insn にセットする
+ *
+ * 未実装の命令なら FALSE を返す。emu->eip は変更しない。
+ */
+int decode_instruction(Emulator* emu, uint32_t address, Instruction* insn);
+
+/* 比較命令 first と直後の条件分岐 second を1命令に融合する
+ *
+ * 融合できれば first を融合した命令に書き換えて TRUE を返す。
+ * 融合した命令も EFLAGS を比較命令と同じように更新する。
+ */
+int fuse_instructions(Instruction* first, Instruction* second);
+
+/* insn を命令列の終端にする */
+void end_instructions(Instruction* insn);
+
+/* 終端までの命令列を順に実行する
+ *
+ * 呼び出しのとき emu->eip は先頭の命令を指している必要がある。
+ * THREADED_DISPATCH を定義してビルドするとスレッデッドコードで実行する。
+ * 実行中のブロックを書き換えて(emu->block_invalidated)途中で終えたときは
+ * 書き込んだ命令を返し、終端まで実行したら NULL を返す。
+ */
+Instruction* execute_instructions(Emulator* emu, Instruction* insn);
 
 typedef void instruction_func_t(Emulator*);
 
-/* x86命令の配列、opecode番目の関数がx86の
-   opcodeに対応した命令となっている */
-extern instruction_func_t* instructions[256];
+/* 命令セット
+ *
+ * 内容は init_instructions で決まり、その後は変わらないので、
+ * 複数のエミュレータで共有してもよい。
+ */
+typedef struct InstructionSet {
+    /* x86命令の配列、opecode番目の関数がx86の
+       opcodeに対応した命令となっている */
+    instruction_func_t* instructions[256];
+
+    /* opecode番目の命令の実行関数と形式 */
+    instruction_exec_t* executors[256];
+    uint8_t formats[256];
+
+    /* 0x0F で始まる2バイトの命令の実行関数と形式(2バイト目で引く) */
+    instruction_exec_t* executors_0f[256];
+    uint8_t formats_0f[256];
+} InstructionSet;
+
+/* 命令セットの初期化関数 */
+void init_instructions(InstructionSet* isa);
+
+/* eip の命令を1つだけデコードして実行する
+ *
+ * 未実装の命令なら何もせずに FALSE を返す。実行した命令は
+ * emu->retired に数え、eflags は常に正しい値にしておく。
+ */
+int step_instruction(Emulator* emu);
 
 #endif
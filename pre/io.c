@@ -1,23 +1,85 @@
 #include "io.h"
 
-#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "emulator.h"
+#include "emulator_function.h"
+
+void init_io_ports(Emulator* emu)
+{
+    IoPorts* io = calloc(1, sizeof(IoPorts));
+
+    /* 0 番は map の初期値(デバイスなし、読むと常に 0) */
+    io->devices[0].pollable = TRUE;
+    io->count = 1;
+    emu->io_ports = io;
+}
+
+void destroy_io_ports(Emulator* emu)
+{
+    free(emu->io_ports);
+    emu->io_ports = NULL;
+}
+
+int map_io_ports(Emulator* emu, uint16_t start, uint32_t count,
+                 io_read_t* read, io_write_t* write, void* opaque)
+{
+    IoPorts* io = emu->io_ports;
+    IoDevice* device;
+
+    if (io->count == IO_MAX_DEVICES || start + count > IO_PORTS_COUNT) {
+        return FALSE;
+    }
+
+    device = &io->devices[io->count];
+    device->start = start;
+    device->read = read;
+    device->write = write;
+    device->opaque = opaque;
+    device->pollable = FALSE;
+
+    memset(&io->map[start], io->count, count);
+    io->count++;
 
-uint8_t io_in8(uint16_t address)
+    return TRUE;
+}
+
+void set_io_pollable(Emulator* emu, uint16_t port)
 {
-    switch (address) {
-    case 0x03f8:
-        return getchar();
-    default:
+    IoPorts* io = emu->io_ports;
+
+    io->devices[io->map[port]].pollable = TRUE;
+}
+
+uint32_t io_in(Emulator* emu, uint16_t port, int size)
+{
+    IoDevice* device;
+
+    if (emu->io_ports == NULL) {
         return 0;
     }
+
+    device = &emu->io_ports->devices[emu->io_ports->map[port]];
+    if (!device->pollable) {
+        emu->unstable_reads++;
+    }
+    if (device->read == NULL) {
+        return 0;
+    }
+    return device->read(device->opaque, port - device->start, size);
 }
 
-void io_out8(uint16_t address, uint8_t value)
+void io_out(Emulator* emu, uint16_t port, uint32_t value, int size)
 {
-    switch (address) {
-    case 0x03f8:
-        putchar(value);
-        break;
+    IoDevice* device;
+
+    if (emu->io_ports == NULL) {
+        return;
+    }
+
+    device = &emu->io_ports->devices[emu->io_ports->map[port]];
+    if (device->write != NULL) {
+        device->write(device->opaque, port - device->start, value, size);
     }
 }
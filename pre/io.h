@@ -3,7 +3,80 @@
 
 #include <stdint.h>
 
-uint8_t io_in8(uint16_t address);
-void io_out8(uint16_t address, uint8_t value);
+#include "emulator.h"
+
+/* 登録できるデバイスの数(0 番は「デバイスなし」に使う) */
+#define IO_MAX_DEVICES 32
+
+/* I/O ポートの数 */
+#define IO_PORTS_COUNT 0x10000
+
+/* デバイスの読み書き関数
+ *
+ * offset は登録したポートの先頭からの位置、size は 1, 2, 4 のいずれか。
+ */
+typedef uint32_t io_read_t(void* opaque, uint16_t offset, int size);
+typedef void io_write_t(void* opaque, uint16_t offset, uint32_t value, int size);
+
+/* I/O ポートに登録したデバイス */
+typedef struct {
+    uint16_t start;
+
+    /* NULL なら読み込みは 0、書き込みは無視する */
+    io_read_t* read;
+    io_write_t* write;
+    void* opaque;
+
+    /* 読む値がイベントか wake_emulator を伴う変化でしか変わらない
+     * (ポーリングのループを実行せずに待ってよい) */
+    int pollable;
+} IoDevice;
+
+/* I/O ポート空間
+ *
+ * map はポート番号からデバイスの番号を1回で引く表。
+ */
+typedef struct IoPorts {
+    uint8_t map[IO_PORTS_COUNT];
+    IoDevice devices[IO_MAX_DEVICES];
+    int count;
+} IoPorts;
+
+/* デバイスのない I/O ポート空間を作る */
+void init_io_ports(Emulator* emu);
+void destroy_io_ports(Emulator* emu);
+
+/* デバイスを start 番から count 個のポートに割り当てる
+ *
+ * 既に割り当てたポートに重なれば、後から割り当てたデバイスが優先する。
+ * デバイスの表が一杯か、ポートの範囲が 0xffff を超えれば FALSE を返す。
+ */
+int map_io_ports(Emulator* emu, uint16_t start, uint32_t count,
+                 io_read_t* read, io_write_t* write, void* opaque);
+
+/* port に割り当てたデバイスをポーリングしてよいもの(pollable)にする
+ *
+ * 時間とともに値が変わるデバイス(タイマーのカウンタなど)や、ホストが
+ * 勝手に書き換えるデバイスはポーリングしてよいものにしない。
+ */
+void set_io_pollable(Emulator* emu, uint16_t port);
+
+/* port から size バイト(1, 2, 4)を読み書きする
+ *
+ * 先頭のポートのデバイスが size バイトをまとめて扱う。デバイスの
+ * ないポートは読み込むと 0 になり、書き込みは無視する。
+ */
+uint32_t io_in(Emulator* emu, uint16_t port, int size);
+void io_out(Emulator* emu, uint16_t port, uint32_t value, int size);
+
+static inline uint8_t io_in8(Emulator* emu, uint16_t address)
+{
+    return io_in(emu, address, 1);
+}
+
+static inline void io_out8(Emulator* emu, uint16_t address, uint8_t value)
+{
+    io_out(emu, address, value, 1);
+}
 
 #endif
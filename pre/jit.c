@@ -0,0 +1,708 @@
+#include <stddef.h>
+
+#include "jit.h"
+
+#if defined(ENABLE_JIT) && defined(__x86_64__)
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "block.h"
+#include "emulator_function.h"
+#include "debug.h"
+
+/* ホストのレジスタ番号 */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+
+/* ゲストの汎用レジスタは r8d〜r15d に割り当てる */
+#define H(reg) (8 + (reg))
+
+/* EFLAGS のうち命令で更新するフラグ */
+#define STATUS_FLAGS (CARRY_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG)
+
+/* 1ブロックの変換に必要な領域の上限 */
+#define JIT_BLOCK_MAX_CODE 8192
+
+struct JitCache {
+    uint8_t* code;
+    uint32_t used;
+};
+
+/* 機械語の書き出し位置と、ホストのフラグの状態 */
+typedef struct {
+    uint8_t* p;
+
+    /* ホストの EFLAGS にまだ emu->eflags へ書き戻していない値がある */
+    int flags_live;
+
+    /* コードのある範囲の印(BlockCache の code_lines) */
+    uint8_t* code_lines;
+
+    /* 変換中の命令の番号と次のアドレス(分岐命令なら 0)、書き込みで
+     * ブロックを無効にしたときに抜ける出口(emu->eip と戻り値の eax を
+     * セットしてから飛ぶ) */
+    int index;
+    uint32_t next;
+    uint8_t* exit;
+} Emitter;
+
+JitCache* create_jit_cache(void)
+{
+    JitCache* jit = malloc(sizeof(JitCache));
+
+    jit->code = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->used = 0;
+
+    return jit;
+}
+
+void destroy_jit_cache(JitCache* jit)
+{
+    if (jit != NULL) {
+        munmap(jit->code, JIT_CACHE_SIZE);
+        free(jit);
+    }
+}
+
+void flush_jit_cache(JitCache* jit)
+{
+    if (jit != NULL) {
+        jit->used = 0;
+    }
+}
+
+static void emit8(Emitter* e, uint8_t value)
+{
+    *e->p++ = value;
+}
+
+static void emit32(Emitter* e, uint32_t value)
+{
+    memcpy(e->p, &value, 4);
+    e->p += 4;
+}
+
+static void emit64(Emitter* e, uint64_t value)
+{
+    memcpy(e->p, &value, 8);
+    e->p += 8;
+}
+
+/* 必要なときだけ REX プレフィックスを出力する */
+static void emit_rex(Emitter* e, int reg, int rm)
+{
+    uint8_t rex = 0x40 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+
+    if (rex != 0x40) {
+        emit8(e, rex);
+    }
+}
+
+/* op reg, rm (レジスタ同士) */
+static void emit_rr(Emitter* e, uint8_t op, int reg, int rm)
+{
+    emit_rex(e, reg, rm);
+    emit8(e, op);
+    emit8(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op reg, [rsi + rax] (ゲストのメモリ) */
+static void emit_mem(Emitter* e, uint8_t op, int reg)
+{
+    emit_rex(e, reg, 0);
+    emit8(e, op);
+    emit8(e, (reg & 7) << 3 | 4);
+    emit8(e, 0x06);
+}
+
+/* op reg, [rdi + offset] (Emulator 構造体) */
+static void emit_emu(Emitter* e, uint8_t op, int reg, uint32_t offset)
+{
+    emit_rex(e, reg, RDI);
+    emit8(e, op);
+    emit8(e, 0x80 | (reg & 7) << 3 | RDI);
+    emit32(e, offset);
+}
+
+/* ModR/M の reg 欄で命令を区別するグループ命令(レジスタ) */
+static void emit_group_r(Emitter* e, uint8_t op, int ext, int rm)
+{
+    emit_rr(e, op, ext, rm);
+}
+
+/* ModR/M の reg 欄で命令を区別するグループ命令([rsi + rax]) */
+static void emit_group_mem(Emitter* e, uint8_t op, int ext)
+{
+    emit_mem(e, op, ext);
+}
+
+/* mov reg, imm32 */
+static void emit_mov_imm(Emitter* e, int reg, uint32_t imm)
+{
+    emit_rex(e, 0, reg);
+    emit8(e, 0xB8 + (reg & 7));
+    emit32(e, imm);
+}
+
+/* lea dst, [base + disp] (フラグを変えずに加算する) */
+static void emit_lea(Emitter* e, int dst, int base, uint32_t disp)
+{
+    emit_rex(e, dst, base);
+    emit8(e, 0x8D);
+    emit8(e, 0x80 | (dst & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        emit8(e, 0x24);
+    }
+    emit32(e, disp);
+}
+
+/* mov dword [rdi + eip], imm32 */
+static void emit_set_eip(Emitter* e, uint32_t eip)
+{
+    emit8(e, 0xC7);
+    emit8(e, 0x80 | RDI);
+    emit32(e, offsetof(Emulator, eip));
+    emit32(e, eip);
+}
+
+/* ホストのフラグを emu->eflags に書き戻す(rax, rdx を壊す) */
+static void emit_flush_flags(Emitter* e)
+{
+    if (!e->flags_live) {
+        return;
+    }
+
+    emit8(e, 0x9C);                                   /* pushfq */
+    emit8(e, 0x58);                                   /* pop rax */
+    emit8(e, 0x25);                                   /* and eax, STATUS_FLAGS */
+    emit32(e, STATUS_FLAGS);
+    emit_emu(e, 0x8B, RDX, offsetof(Emulator, eflags));
+    emit_group_r(e, 0x81, 4, RDX);                    /* and edx, ~STATUS_FLAGS */
+    emit32(e, ~STATUS_FLAGS);
+    emit_rr(e, 0x09, RDX, RAX);                       /* or eax, edx */
+    emit_emu(e, 0x89, RAX, offsetof(Emulator, eflags));
+
+    e->flags_live = FALSE;
+}
+
+/* emu->eflags をホストのフラグに読み込む(rax を壊す) */
+static void emit_load_flags(Emitter* e)
+{
+    emit_emu(e, 0x8B, RAX, offsetof(Emulator, eflags));
+    emit8(e, 0x25);                                   /* and eax, STATUS_FLAGS */
+    emit32(e, STATUS_FLAGS);
+    emit8(e, 0x50);                                   /* push rax */
+    emit8(e, 0x9D);                                   /* popfq */
+}
+
+/* lea dst, [base + (index << shift) + disp] (base が -1 ならベースなし) */
+static void emit_lea_index(Emitter* e, int dst, int base, int index, int shift, uint32_t disp)
+{
+    uint8_t rex = 0x40 | ((dst & 8) ? 4 : 0) | ((index & 8) ? 2 : 0)
+                  | ((base >= 0 && (base & 8)) ? 1 : 0);
+
+    if (rex != 0x40) {
+        emit8(e, rex);
+    }
+    emit8(e, 0x8D);
+    if (base < 0) {
+        /* mod = 0 で SIB の base が 5 なら disp32 だけ */
+        emit8(e, (dst & 7) << 3 | 4);
+        emit8(e, shift << 6 | (index & 7) << 3 | RBP);
+    } else {
+        emit8(e, 0x80 | (dst & 7) << 3 | 4);
+        emit8(e, shift << 6 | (index & 7) << 3 | (base & 7));
+    }
+    emit32(e, disp);
+}
+
+/* 実効アドレスを eax に求める(フラグは変えない) */
+static void emit_address(Emitter* e, ModRM* modrm)
+{
+    if (modrm->index != ZERO_REGISTER) {
+        emit_lea_index(e, RAX, modrm->base != ZERO_REGISTER ? H(modrm->base) : -1,
+                       H(modrm->index), modrm->shift, modrm->disp);
+    } else if (modrm->base == ZERO_REGISTER) {
+        emit_mov_imm(e, RAX, modrm->disp);
+    } else if (modrm->disp == 0) {
+        emit_rr(e, 0x8B, RAX, H(modrm->base));
+    } else {
+        emit_lea(e, RAX, H(modrm->base), modrm->disp);
+    }
+}
+
+/* [rsi + rax] に書き込んだ後、デコード済みのコードを書き換えていないか調べる
+ *
+ * コードのある範囲への書き込みなら write_code を呼ぶ(rax, rcx, rdx を壊す)。
+ */
+static void emit_check_code(Emitter* e, int size)
+{
+    uint8_t* skip_ram;
+    uint8_t* skip_line;
+    uint8_t* write = NULL;
+    int i;
+
+    /* 比較でホストのフラグが壊れるので先に書き戻しておく */
+    if (e->flags_live) {
+        emit_rr(e, 0x8B, RCX, RAX);                   /* mov ecx, eax */
+        emit_flush_flags(e);
+        emit_rr(e, 0x8B, RAX, RCX);                   /* mov eax, ecx */
+    }
+
+    emit8(e, 0x3D);                                   /* cmp eax, MEMORY_SIZE - (size - 1) */
+    emit32(e, MEMORY_SIZE - (size - 1));
+    emit8(e, 0x73);                                   /* jae skip */
+    skip_ram = e->p++;
+    emit8(e, 0x48);                                   /* mov rcx, code_lines */
+    emit8(e, 0xB8 + RCX);
+    emit64(e, (uintptr_t)e->code_lines);
+
+    /* 書き込む範囲の先頭と末尾の 64 バイトの範囲を調べる */
+    emit_rr(e, 0x8B, RDX, RAX);                       /* mov edx, eax */
+    emit_group_r(e, 0xC1, 5, RDX);                    /* shr edx, CODE_LINE_SHIFT */
+    emit8(e, CODE_LINE_SHIFT);
+    emit8(e, 0x80);                                   /* cmp byte [rcx + rdx], 0 */
+    emit8(e, 0x3C);
+    emit8(e, RDX << 3 | RCX);
+    emit8(e, 0);
+    if (size > 1) {
+        emit8(e, 0x75);                               /* jne write */
+        write = e->p++;
+        emit_lea(e, RDX, RAX, size - 1);              /* lea edx, [rax + size - 1] */
+        emit_group_r(e, 0xC1, 5, RDX);                /* shr edx, CODE_LINE_SHIFT */
+        emit8(e, CODE_LINE_SHIFT);
+        emit8(e, 0x80);                               /* cmp byte [rcx + rdx], 0 */
+        emit8(e, 0x3C);
+        emit8(e, RDX << 3 | RCX);
+        emit8(e, 0);
+    }
+    emit8(e, 0x74);                                   /* je skip */
+    skip_line = e->p++;
+
+    if (write != NULL) {
+        *write = e->p - (write + 1);
+    }
+
+    /* 呼び出しで壊れるレジスタを保存して rsp を 16 バイト境界に揃える */
+    emit8(e, 0x50);                                   /* push rax */
+    emit8(e, 0x57);                                   /* push rdi */
+    emit8(e, 0x56);                                   /* push rsi */
+    for (i = 8; i <= 11; i++) {
+        emit8(e, 0x41);                               /* push r8〜r11 */
+        emit8(e, 0x50 + (i & 7));
+    }
+
+    emit_rr(e, 0x8B, RSI, RAX);                       /* write_code(emu, eax, size) */
+    emit_mov_imm(e, RDX, size);
+    emit8(e, 0x48);                                   /* mov rax, write_code */
+    emit8(e, 0xB8 + RAX);
+    emit64(e, (uintptr_t)write_code);
+    emit8(e, 0xFF);                                   /* call rax */
+    emit8(e, 0xD0);
+
+    for (i = 11; i >= 8; i--) {
+        emit8(e, 0x41);                               /* pop r11〜r8 */
+        emit8(e, 0x58 + (i & 7));
+    }
+    emit8(e, 0x5E);                                   /* pop rsi */
+    emit8(e, 0x5F);                                   /* pop rdi */
+    emit8(e, 0x58);                                   /* pop rax */
+
+    /* 実行中のブロックを書き換えたかもしれないので、次の命令から
+     * インタプリタに戻ってデコードしなおす(分岐命令はどのみち終わる) */
+    if (e->next != 0) {
+        emit8(e, 0x83);                               /* cmp dword [rdi + block_invalidated], 0 */
+        emit8(e, 0x80 | 7 << 3 | RDI);
+        emit32(e, offsetof(Emulator, block_invalidated));
+        emit8(e, 0);
+        emit8(e, 0x74);                               /* je skip */
+        emit8(e, 20);
+        emit_set_eip(e, e->next);
+        emit_mov_imm(e, RAX, e->index + 1);
+        emit8(e, 0xE9);                               /* jmp exit */
+        emit32(e, e->exit - (e->p + 4));
+    }
+
+    *skip_ram = e->p - (skip_ram + 1);
+    *skip_line = e->p - (skip_line + 1);
+}
+
+/* edx をゲストのスタックに積む */
+static void emit_push_edx(Emitter* e)
+{
+    emit_lea(e, H(ESP), H(ESP), -4);
+    emit_rr(e, 0x8B, RAX, H(ESP));
+    emit_mem(e, 0x89, RDX);
+    emit_check_code(e, 4);
+}
+
+/* ゲストのスタックから edx に取り出す */
+static void emit_pop_edx(Emitter* e)
+{
+    emit_rr(e, 0x8B, RAX, H(ESP));
+    emit_mem(e, 0x8B, RDX);
+    emit_lea(e, H(ESP), H(ESP), 4);
+}
+
+/* op rm32 の形の命令(レジスタまたはメモリ)を出力する */
+static void emit_rm32(Emitter* e, uint8_t op, int reg, ModRM* modrm)
+{
+    if (modrm->mod == 3) {
+        emit_rr(e, op, reg, H(modrm->rm));
+    } else {
+        emit_address(e, modrm);
+        emit_mem(e, op, reg);
+    }
+}
+
+/* グループ命令 op /ext rm32, imm32 を出力する */
+static void emit_group_rm32_imm(Emitter* e, uint8_t op, int ext, ModRM* modrm,
+                                uint32_t imm)
+{
+    if (modrm->mod == 3) {
+        emit_group_r(e, op, ext, H(modrm->rm));
+    } else {
+        emit_address(e, modrm);
+        emit_group_mem(e, op, ext);
+    }
+    emit32(e, imm);
+}
+
+/* 条件分岐 op の分岐先を emu->eip に書き込む */
+static void emit_jcc(Emitter* e, uint8_t op, uint32_t next, uint32_t target)
+{
+    /* ゲストとホストで条件コードの番号は同じ */
+    if (!e->flags_live) {
+        emit_load_flags(e);
+    }
+    emit_mov_imm(e, RAX, next);
+    emit_mov_imm(e, RDX, target);
+    emit8(e, 0x0F);                                   /* cmovcc eax, edx */
+    emit8(e, 0x40 | (op & 0x0F));
+    emit8(e, 0xC0 | RAX << 3 | RDX);
+    emit_emu(e, 0x89, RAX, offsetof(Emulator, eip));
+}
+
+/* 1命令を変換する
+ *
+ * next は次の命令のアドレス。変換できない命令なら何も出力せずに
+ * FALSE を返す。
+ */
+static int translate(Emitter* e, Instruction* insn, uint32_t next)
+{
+    ModRM* modrm = &insn->modrm;
+    uint8_t op = insn->opecode;
+
+    if (insn->fused_opecode != 0) {
+        /* 融合した命令は比較と条件分岐を別々に変換する */
+        Instruction cmp = *insn;
+
+        cmp.fused_opecode = 0;
+        if (!translate(e, &cmp, next)) {
+            return FALSE;
+        }
+        emit_jcc(e, insn->fused_opecode, next, next + insn->branch);
+        return TRUE;
+    }
+
+    switch (op) {
+    case 0x01:
+        emit_rm32(e, 0x01, H(modrm->reg_index), modrm);
+        e->flags_live = TRUE;
+        if (modrm->mod != 3) {
+            emit_check_code(e, 4);
+        }
+        return TRUE;
+    case 0x3B:
+        emit_rm32(e, 0x3B, H(modrm->reg_index), modrm);
+        e->flags_live = TRUE;
+        return TRUE;
+    case 0x3C:
+        emit_group_r(e, 0x80, 7, H(AL));             /* cmp r8b, imm8 */
+        emit8(e, insn->imm);
+        e->flags_live = TRUE;
+        return TRUE;
+    case 0x3D:
+        emit_group_r(e, 0x81, 7, H(EAX));
+        emit32(e, insn->imm);
+        e->flags_live = TRUE;
+        return TRUE;
+    case 0x40: case 0x41: case 0x42: case 0x43:
+    case 0x44: case 0x45: case 0x46: case 0x47:
+    case 0x48: case 0x49: case 0x4A: case 0x4B:
+    case 0x4C: case 0x4D: case 0x4E: case 0x4F:
+        /* inc, dec は CF を変えないので、ホストの CF を emu->eflags に合わせておく
+         * (64ビットでは 40-4F は REX なので FF /0, FF /1 で書く) */
+        if (!e->flags_live) {
+            emit_load_flags(e);
+        }
+        emit_group_r(e, 0xFF, (op >> 3) & 1, H(op & 7));
+        e->flags_live = TRUE;
+        return TRUE;
+    case 0x50: case 0x51: case 0x52: case 0x53:
+    case 0x54: case 0x55: case 0x56: case 0x57:
+        emit_rr(e, 0x8B, RDX, H(op - 0x50));
+        emit_push_edx(e);
+        return TRUE;
+    case 0x58: case 0x59: case 0x5A: case 0x5B:
+    case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+        emit_pop_edx(e);
+        emit_rr(e, 0x8B, H(op - 0x58), RDX);
+        return TRUE;
+    case 0x68:
+    case 0x6A:
+        emit_mov_imm(e, RDX, insn->imm);
+        emit_push_edx(e);
+        return TRUE;
+    case 0x83:
+        switch (modrm->opecode) {
+        case 0:
+        case 5:
+        case 7:
+            emit_group_rm32_imm(e, 0x81, modrm->opecode, modrm, insn->imm);
+            e->flags_live = TRUE;
+            if (modrm->opecode != 7 && modrm->mod != 3) {
+                emit_check_code(e, 4);
+            }
+            return TRUE;
+        default:
+            return FALSE;
+        }
+    case 0x88:
+    case 0x8A:
+        /* AH〜BH はホストの r8〜r11 では表せない */
+        if (modrm->reg_index >= 4 || (modrm->mod == 3 && modrm->rm >= 4)) {
+            return FALSE;
+        }
+        emit_rm32(e, op, H(modrm->reg_index), modrm);
+        if (op == 0x88 && modrm->mod != 3) {
+            emit_check_code(e, 1);
+        }
+        return TRUE;
+    case 0x89:
+    case 0x8B:
+        emit_rm32(e, op, H(modrm->reg_index), modrm);
+        if (op == 0x89 && modrm->mod != 3) {
+            emit_check_code(e, 4);
+        }
+        return TRUE;
+    case 0x8D:
+        if (modrm->mod == 3) {
+            return FALSE;
+        }
+        emit_address(e, modrm);
+        emit_rr(e, 0x8B, H(modrm->reg_index), RAX);
+        return TRUE;
+    case 0x90:
+        return TRUE;
+    case 0x99:
+        emit_flush_flags(e);
+        emit_rr(e, 0x8B, H(EDX), H(EAX));
+        emit_group_r(e, 0xC1, 7, H(EDX));             /* sar edx, 31 */
+        emit8(e, 31);
+        return TRUE;
+    case 0xA1:
+        emit_mov_imm(e, RAX, insn->imm);
+        emit_mem(e, 0x8B, H(EAX));
+        return TRUE;
+    case 0xA3:
+        emit_mov_imm(e, RAX, insn->imm);
+        emit_mem(e, 0x89, H(EAX));
+        emit_check_code(e, 4);
+        return TRUE;
+    case 0xB0: case 0xB1: case 0xB2: case 0xB3:
+        emit_rex(e, 0, H(op - 0xB0));
+        emit8(e, 0xB0 + (H(op - 0xB0) & 7));
+        emit8(e, insn->imm);
+        return TRUE;
+    case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+    case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+        emit_mov_imm(e, H(op - 0xB8), insn->imm);
+        return TRUE;
+    case 0xC7:
+        if (modrm->mod == 3) {
+            emit_mov_imm(e, H(modrm->rm), insn->imm);
+        } else {
+            emit_address(e, modrm);
+            emit_group_mem(e, 0xC7, 0);
+            emit32(e, insn->imm);
+            emit_check_code(e, 4);
+        }
+        return TRUE;
+    case 0xC9:
+        emit_rr(e, 0x8B, H(ESP), H(EBP));
+        emit_pop_edx(e);
+        emit_rr(e, 0x8B, H(EBP), RDX);
+        return TRUE;
+    case 0xFF:
+        if (modrm->opecode > 1) {
+            return FALSE;
+        }
+        /* inc, dec は CF を変えないので、ホストの CF を emu->eflags に合わせておく */
+        if (!e->flags_live) {
+            emit_load_flags(e);
+        }
+        if (modrm->mod == 3) {
+            emit_group_r(e, 0xFF, modrm->opecode, H(modrm->rm));
+        } else {
+            emit_address(e, modrm);
+            emit_group_mem(e, 0xFF, modrm->opecode);
+        }
+        e->flags_live = TRUE;
+        if (modrm->mod != 3) {
+            emit_check_code(e, 4);
+        }
+        return TRUE;
+
+    /* 以下はブロックの終端になる命令 */
+    case 0x70: case 0x71: case 0x72: case 0x73:
+    case 0x74: case 0x75: case 0x76: case 0x77:
+    case 0x78: case 0x79: case 0x7C: case 0x7D:
+    case 0x7E: case 0x7F:
+        emit_jcc(e, op, next, next + insn->imm);
+        return TRUE;
+    case 0xE8:
+        emit_mov_imm(e, RDX, next);
+        emit_push_edx(e);
+        emit_set_eip(e, next + insn->imm);
+        return TRUE;
+    case 0xE9:
+    case 0xEB:
+        emit_set_eip(e, next + insn->imm);
+        return TRUE;
+    case 0xC3:
+        emit_pop_edx(e);
+        emit_emu(e, 0x89, RDX, offsetof(Emulator, eip));
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* 汎用レジスタを読み込む */
+static void emit_prologue(Emitter* e)
+{
+    int i;
+
+    for (i = 12; i <= 15; i++) {
+        emit8(e, 0x41);                               /* push r12〜r15 */
+        emit8(e, 0x50 + (i & 7));
+    }
+
+    for (i = 0; i < REGISTERS_COUNT; i++) {
+        emit_emu(e, 0x8B, H(i), offsetof(Emulator, registers) + 4 * i);
+    }
+}
+
+/* 汎用レジスタとフラグを書き戻して呼び出し元に戻る(flags_live でなければ eax は壊さない) */
+static void emit_epilogue(Emitter* e)
+{
+    int i;
+
+    emit_flush_flags(e);
+
+    for (i = 0; i < REGISTERS_COUNT; i++) {
+        emit_emu(e, 0x89, H(i), offsetof(Emulator, registers) + 4 * i);
+    }
+
+    for (i = 15; i >= 12; i--) {
+        emit8(e, 0x41);                               /* pop r15〜r12 */
+        emit8(e, 0x58 + (i & 7));
+    }
+
+    emit8(e, 0xC3);                                   /* ret */
+}
+
+int jit_compile(BlockCache* cache, Block* block)
+{
+    JitCache* jit = cache->jit;
+    Emitter e;
+    uint8_t* entry;
+    uint32_t address = block->start;
+    int i;
+
+    if (jit == NULL) {
+        return FALSE;
+    }
+
+    if (jit->used + JIT_BLOCK_MAX_CODE > JIT_CACHE_SIZE) {
+        /* 領域が尽きたら変換済みのコードを全て捨てる */
+        for (i = 0; i < BLOCK_CACHE_SIZE; i++) {
+            cache->blocks[i].native = NULL;
+        }
+        flush_jit_cache(jit);
+    }
+
+    e.p = jit->code + jit->used;
+    e.flags_live = FALSE;
+    e.code_lines = cache->code_lines;
+
+    /* 途中で抜ける出口は関数の手前に置く */
+    e.exit = e.p;
+    emit_epilogue(&e);
+    entry = e.p;
+
+    emit_prologue(&e);
+
+    for (i = 0; i < block->count; i++) {
+        Instruction* insn = &block->instructions[i];
+
+        e.index = i;
+        e.next = (insn->format & OPF_BRANCH) ? 0 : address + insn->length;
+        if (!translate(&e, insn, address + insn->length)) {
+            break;
+        }
+        address += insn->length;
+    }
+
+    if (i == 0) {
+        return FALSE;
+    }
+
+    if (!(block->instructions[i - 1].format & OPF_BRANCH)) {
+        /* 変換できなかった命令から続きをインタプリタで実行する */
+        emit_set_eip(&e, address);
+    }
+
+    emit_flush_flags(&e);
+    emit_mov_imm(&e, RAX, i);
+    emit_epilogue(&e);
+
+    dprintf("block 0x%08x: %d/%d instructions, %d bytes\n",
+            block->start, i, block->count,
+            (int)(e.p - (jit->code + jit->used)));
+
+    block->native = (jit_func_t*)entry;
+    block->native_count = i;
+    jit->used = e.p - jit->code;
+
+    return TRUE;
+}
+
+#else
+
+JitCache* create_jit_cache(void)
+{
+    return NULL;
+}
+
+void destroy_jit_cache(JitCache* jit)
+{
+}
+
+void flush_jit_cache(JitCache* jit)
+{
+}
+
+int jit_compile(struct BlockCache* cache, struct Block* block)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* この回数だけ実行されたブロックを機械語に変換する */
+#define JIT_THRESHOLD 50
+
+/* 変換済みコードを置く領域の大きさ */
+#define JIT_CACHE_SIZE (16 * 1024 * 1024)
+
+struct Block;
+struct BlockCache;
+
+/* 変換済みのブロック
+ *
+ * 汎用レジスタ・EFLAGS・EIP を emu から読み書きし、memory をゲストの
+ * メモリの先頭として実行する。実行した命令数(Block.instructions の
+ * 先頭からの個数)を返す。実行中のブロックを書き換えたときは、書き込んだ
+ * 命令までで戻る。
+ */
+typedef int jit_func_t(Emulator* emu, uint8_t* memory);
+
+/* 変換済みコードのキャッシュ */
+typedef struct JitCache JitCache;
+
+/* キャッシュを作る。実行可能なメモリが確保できなければ NULL を返す */
+JitCache* create_jit_cache(void);
+void destroy_jit_cache(JitCache* jit);
+
+/* 変換済みのコードを全て捨てる */
+void flush_jit_cache(JitCache* jit);
+
+/* ブロックをホストの x86-64 機械語に変換する
+ *
+ * 先頭から変換できる命令までを変換し、block->native と
+ * block->native_count にセットする。1命令も変換できなければ FALSE を返す。
+ */
+int jit_compile(struct BlockCache* cache, struct Block* block);
+
+#endif
@@ -2,34 +2,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include "emulator.h"
 #include "emulator_function.h"
 #include "instruction.h"
-
-/* メモリは1MB */
-#define MEMORY_SIZE (1024 * 1024)
+#include "block.h"
+#include "ram.h"
+#include "bus.h"
+#include "mmu.h"
+#include "trace.h"
+#include "profile.h"
+#include "stats.h"
+#include "serial.h"
+#include "scheduler.h"
+#include "px86.h"
 
 #define INT_HANDLER_FILE "int"
 
-char* registers_name[] = {"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"};
-
-/* Emulatorのメモリにバイナリファイルの内容を512バイトコピーする */
-static void read_binary(Emulator* emu, const char* filename)
-{
-    FILE* binary;
-
-    binary = fopen(filename, "rb");
-
-    if (binary == NULL) {
-        printf("%s ファイルを開けません\n", filename);
-        exit(1);
-    }
-
-    /* Emulatorのメモリにバイナリファイルの内容を512バイトコピーする */
-    fread(emu->memory + 0x7c00, 1, 0x200, binary);
-    fclose(binary);
-}
+static const char* const registers_name[] = {"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"};
 
 /* 汎用レジスタとプログラムカウンタの値を標準出力に出力する */
 static void dump_registers(Emulator* emu)
@@ -41,44 +32,28 @@ static void dump_registers(Emulator* emu)
     }
 
     printf("EIP = %08x\n", emu->eip);
-}
-
-/* 与えられた引数を元にEmulatorを作成する */
-static Emulator* create_emu(size_t size, uint32_t eip, uint32_t esp)
-{
-    /* Emulatorの作成 */
-    Emulator* emu = malloc(sizeof(Emulator));
-
-    /* Emulator内で使うメモリの確保 */
-    emu->memory = malloc(size);
+    printf("Instructions = %llu\n", (unsigned long long)emu->retired);
 
-    /* 汎用レジスタを全て0にする */
-    memset(emu->registers, 0, sizeof(emu->registers));
-
-    /* プログラムカウンタの初期値 */
-    emu->eip = eip;
-
-    /* スタックポインタの初期値 */
-    emu->registers[ESP] = esp;
-
-    emu->int_index = -1;
+    if (emu->cr0 & CR0_PG) {
+        printf("CR0 = %08x, CR2 = %08x, CR3 = %08x\n", emu->cr0, emu->cr2, emu->cr3);
+        printf("TLB hits = %llu, misses = %llu\n",
+               (unsigned long long)emu->tlb_hits,
+               (unsigned long long)emu->tlb_misses);
+    }
 
-    return emu;
-}
+    if (emu->block_cache->smc_writes > 0) {
+        printf("SMC writes = %llu, invalidated blocks = %llu\n",
+               (unsigned long long)emu->block_cache->smc_writes,
+               (unsigned long long)emu->block_cache->smc_invalidations);
+    }
 
-/* エミュレータを破棄する */
-static void destroy_emu(Emulator* emu)
-{
-    free(emu->memory);
-    free(emu);
-}
+#ifdef LOOP_IDIOMS
+    dump_idiom_stats(emu->block_cache);
+#endif
 
-static void interrupt(Emulator* emu)
-{
-    push32(emu, emu->eflags);
-    push32(emu, emu->eip);
-    emu->eip = get_memory32(emu, get_code32(emu, 1));
-	set_interrupt(emu, TRUE);
+#ifdef OPCODE_STATS
+    dump_opcode_stats(emu->opcode_stats);
+#endif
 }
 
 static void init_inttable(Emulator* emu)
@@ -134,71 +109,250 @@ int opt_remove_at(int argc, char* argv[], int index)
     }
 }
 
+/* 1命令を実行してトレースに記録する
+ *
+ * 実装されていない命令なら FALSE を返す。
+ */
+static int trace_step(Emulator* emu, Trace* trace)
+{
+    Instruction insn[2];
+    uint32_t before[REGISTERS_COUNT];
+    uint32_t eip = emu->eip;
+
+    if (!decode_instruction(emu, eip, &insn[0])) {
+        return FALSE;
+    }
+    end_instructions(&insn[1]);
+
+    memcpy(before, emu->registers, sizeof(before));
+    execute_instructions(emu, insn);
+    trace_instruction(trace, emu, &insn[0], eip, before);
+
+    return TRUE;
+}
+
+/* 割り込みを受け付け、trace が NULL でなければ記録する
+ *
+ * int n もここで受け付けるので、記録しないとトレースから組み立てた
+ * レジスタが割り込みの後で実際とずれる。
+ */
+static void enter_interrupt(Emulator* emu, Trace* trace)
+{
+    uint32_t before[REGISTERS_COUNT];
+    uint32_t eip = emu->eip;
+
+    if (trace == NULL) {
+        interrupt(emu);
+        return;
+    }
+
+    memcpy(before, emu->registers, sizeof(before));
+    interrupt(emu);
+
+    /* 受け付けたなら戻り先を積むので ESP が変わる */
+    if (emu->registers[ESP] != before[ESP]) {
+        trace_interrupt(trace, emu, eip, before);
+    }
+}
+
+/* プログラムの終了か未実装の命令までエミュレートする
+ *
+ * trace が NULL でなければ1命令ずつ実行してトレースに記録する。
+ * profiler が NULL でなければ一定の命令数ごとに EIP の標本を取る。
+ */
+static void run(Emulator* emu, int quiet, Trace* trace, Profiler* profiler)
+{
+    /* 標本を取らないときは比較が成り立たないようにしておく */
+    uint64_t sample_at = profiler != NULL ? next_sample(profiler) : UINT64_MAX;
+
+    while ((emu->cr0 & CR0_PG) || emu->eip < MEMORY_SIZE) {
+        /* hlt で止まっている間は割り込みが来るまで待つ */
+        if (emu->halted) {
+            flush_serial(emu->serial);
+            if (wait_for_interrupt(emu, NULL) == WAKE_NEVER) {
+                printf("\n\nhalted.\n\n");
+                break;
+            }
+            enter_interrupt(emu, trace);
+            continue;
+        }
+
+        if (trace != NULL) {
+            if (!trace_step(emu, trace)) {
+                flush_serial(emu->serial);
+                printf("\n\nNot Implemented: %x\n", get_code8(emu, 0));
+                break;
+            }
+            emu->retired++;
+        } else if (quiet) {
+            /* デコード済みのブロックをまとめて実行する */
+            Block* block = lookup_block(emu);
+            uint32_t wakeups;
+
+            if (block == NULL) {
+                /* 実装されてない命令が来たらEmulatorを終了する */
+                flush_serial(emu->serial);
+                printf("\n\nNot Implemented: %x\n", get_code8(emu, 0));
+                break;
+            }
+
+            execute_block(emu, block);
+
+            /* 何も変わらないのに回り続けるループは、変わるときまで待つ */
+            if (block->idle && is_idle_loop(emu, block, &wakeups)) {
+                flush_serial(emu->serial);
+                if (wait_for_change(emu, wakeups, NULL) == WAKE_NEVER) {
+                    printf("\n\nhalted in a loop: %x\n\n", emu->eip);
+                    break;
+                }
+            }
+        } else {
+            uint8_t code = get_code8(emu, 0);
+            /* 現在のプログラムカウンタと実行されるバイナリを出力する */
+            printf("EIP = %X, Code = %02X\n", emu->eip, code);
+
+            if (emu->isa->instructions[code] == NULL) {
+                /* 実装されてない命令が来たらEmulatorを終了する */
+                printf("\n\nNot Implemented: %x\n", code);
+                break;
+            }
+
+            /* 命令の実行(ゲストの出力は実行の表示と混ぜて出す) */
+            emu->isa->instructions[code](emu);
+            emu->retired++;
+            flush_serial(emu->serial);
+        }
+
+        if (emu->retired >= sample_at) {
+            profile_sample(profiler, emu);
+            sample_at = next_sample(profiler);
+        }
+
+        if (emu->retired >= emu->next_event) {
+            run_events(emu);
+        }
+
+        if (has_interrupt(emu)) {
+            enter_interrupt(emu, trace);
+        }
+
+        /* EIPが0になったらプログラム終了 */
+        if (emu->eip == 0) {
+            flush_serial(emu->serial);
+            printf("\n\nend of program.\n\n");
+            break;
+        }
+
+        if (!quiet && trace == NULL) {
+            print_stack(emu);
+        }
+    }
+}
+
 int main(int argc, char* argv[])
 {
+    static sigjmp_buf fault_jmp;
     Emulator* emu;
     int i;
     int quiet = 0;
+    const char* trace_file = NULL;
+    Trace* trace = NULL;
+    const char* profile_file = NULL;
+    const char* symbol_file = NULL;
+    uint32_t interval = PROFILE_DEFAULT_INTERVAL;
+    Profiler* profiler = NULL;
 
     i = 1;
     while (i < argc) {
         if (strcmp(argv[i], "-q") == 0) {
             quiet = 1;
             argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            /* -t ファイル名: 実行した命令をバイナリで記録する */
+            trace_file = argv[i + 1];
+            argc = opt_remove_at(argc, argv, i);
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            /* -p ファイル名: 実行中の関数の標本を取って集計を書き出す */
+            profile_file = argv[i + 1];
+            argc = opt_remove_at(argc, argv, i);
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            /* -s ファイル名: 関数名を引くためのゲストの ELF ファイル */
+            symbol_file = argv[i + 1];
+            argc = opt_remove_at(argc, argv, i);
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            /* -r 命令数: 標本を取る間隔 */
+            interval = strtoul(argv[i + 1], NULL, 0);
+            argc = opt_remove_at(argc, argv, i);
+            argc = opt_remove_at(argc, argv, i);
         } else {
             i++;
         }
     }
 
     /* 引数が1つでなければエラーメッセージ */
-    if (argc != 2) {
-        printf("usage: px86 filename\n");
+    if (argc != 2 || interval == 0) {
+        printf("usage: px86 [-q] [-t tracefile] [-p profile [-s guest.elf] [-r interval]] filename\n");
         return 1;
     }
 
-    /* 命令セットの初期化を行う */
-    init_instructions();
-
     /* メモリ1MBでEIP、ESPが0x7C00の状態のEmulatorを作る */
-    emu = create_emu(MEMORY_SIZE, 0x7c00, 0x7c00);
+    emu = px86_create(STDIN_FILENO, STDOUT_FILENO);
+    if (emu == NULL) {
+        printf("メモリを確保できません\n");
+        return 1;
+    }
 
-    /* 引数で与えられたバイナリを読み込む */
-    read_binary(emu, argv[1]);
+    /* 引数で与えられたバイナリを 0x7c00 番地から読み込む
+     * (512バイトを超えるプログラム(bench/ など)もメモリの終わりまで読み込む) */
+    if (px86_load(emu, argv[1], 0x7c00) < 0) {
+        printf("%s ファイルを開けません\n", argv[1]);
+        return 1;
+    }
     //read_handler(emu, INT_HANDLER_FILE);
     init_inttable(emu);
 
-    while (emu->eip < MEMORY_SIZE) {
-        uint8_t code = get_code8(emu, 0);
-        /* 現在のプログラムカウンタと実行されるバイナリを出力する */
-        if (!quiet) {
-            printf("EIP = %X, Code = %02X\n", emu->eip, code);
+    if (trace_file != NULL) {
+        trace = open_trace(trace_file, emu);
+        if (trace == NULL) {
+            printf("%s ファイルを開けません\n", trace_file);
+            return 1;
         }
+    }
 
-        if (instructions[code] == NULL) {
-            /* 実装されてない命令が来たらEmulatorを終了する */
-            printf("\n\nNot Implemented: %x\n", code);
-            break;
+    if (profile_file != NULL) {
+        profiler = create_profiler(symbol_file, interval);
+        if (profiler == NULL) {
+            printf("%s からシンボルを読み込めません\n", symbol_file);
+            return 1;
         }
+    }
 
-        /* 命令の実行 */
-        instructions[code](emu);
-
-        if (emu->int_index > -1) {
-            interrupt(emu);
-        }
+    if (sigsetjmp(fault_jmp, 1) == 0) {
+        catch_guest_fault(emu, &fault_jmp);
+        run(emu, quiet, trace, profiler);
+    } else {
+        /* ゲストがメモリの外にアクセスした */
+        flush_serial(emu->serial);
+        printf("\n\nGuest Fault: address = %08x\n", emu->fault_address);
+    }
+    catch_guest_fault(NULL, NULL);
+    flush_serial(emu->serial);
 
-        /* EIPが0になったらプログラム終了 */
-        if (emu->eip == 0) {
-            printf("\n\nend of program.\n\n");
-            break;
-        }
+    if (trace != NULL) {
+        close_trace(trace);
+    }
 
-        if (!quiet) {
-            print_stack(emu);
+    if (profiler != NULL) {
+        if (!write_profile(profiler, profile_file)) {
+            printf("%s ファイルを開けません\n", profile_file);
         }
+        destroy_profiler(profiler);
     }
 
     dump_registers(emu);
-    destroy_emu(emu);
+    px86_destroy(emu);
     return 0;
 }
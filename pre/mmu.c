@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mmu.h"
+#include "block.h"
+#include "bus.h"
+#include "ram.h"
+#include "emulator_function.h"
+
+uint32_t get_control_register(Emulator* emu, int index)
+{
+    switch (index) {
+    case 0:
+        return emu->cr0;
+    case 2:
+        return emu->cr2;
+    case 3:
+        return emu->cr3;
+    default:
+        printf("CR%d is not implemented\n", index);
+        exit(0);
+    }
+}
+
+/* ページの対応が変わったので、変換結果とデコード済みのブロックを捨てる */
+static void flush_translations(Emulator* emu)
+{
+    flush_tlb(emu);
+    if (emu->block_cache != NULL) {
+        flush_block_cache(emu->block_cache);
+    }
+}
+
+void set_control_register(Emulator* emu, int index, uint32_t value)
+{
+    switch (index) {
+    case 0:
+        if ((emu->cr0 ^ value) & (CR0_PG | CR0_WP)) {
+            flush_translations(emu);
+        }
+        emu->cr0 = value;
+        break;
+    case 2:
+        emu->cr2 = value;
+        break;
+    case 3:
+        emu->cr3 = value;
+        flush_translations(emu);
+        break;
+    default:
+        printf("CR%d is not implemented\n", index);
+        exit(0);
+    }
+}
+
+void flush_tlb(Emulator* emu)
+{
+    int i;
+
+    for (i = 0; i < TLB_SIZE; i++) {
+        emu->tlb[i].read_tag = TLB_INVALID;
+        emu->tlb[i].write_tag = TLB_INVALID;
+    }
+}
+
+void invalidate_page(Emulator* emu, uint32_t address)
+{
+    TlbEntry* entry = &emu->tlb[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+    uint32_t page = address & PAGE_MASK;
+
+    if (entry->read_tag == page) {
+        entry->read_tag = TLB_INVALID;
+        entry->write_tag = TLB_INVALID;
+    }
+
+    if (emu->block_cache != NULL) {
+        invalidate_blocks(emu->block_cache, page, page + PAGE_SIZE);
+    }
+}
+
+/* ページフォールト */
+static void page_fault(Emulator* emu, uint32_t address)
+{
+    emu->cr2 = address;
+    raise_guest_fault(emu, address);
+}
+
+uint32_t walk_page_table(Emulator* emu, uint32_t address, int write)
+{
+    uint32_t pde_address = (emu->cr3 & PAGE_MASK) + ((address >> 22) << 2);
+    uint32_t pde = read_physical32(emu, pde_address);
+    uint32_t pte_address;
+    uint32_t pte;
+    uint32_t flags;
+    uint32_t page = address & PAGE_MASK;
+    TlbEntry* entry;
+
+    emu->tlb_misses++;
+
+    if (!(pde & PTE_PRESENT)) {
+        page_fault(emu, address);
+    }
+
+    pte_address = (pde & PAGE_MASK) + (((address >> PAGE_SHIFT) & 0x3ff) << 2);
+    pte = read_physical32(emu, pte_address);
+    if (!(pte & PTE_PRESENT)) {
+        page_fault(emu, address);
+    }
+
+    /* CR0.WP のときは特権レベルでも書き込み禁止のページに書き込めない */
+    if (write && (emu->cr0 & CR0_WP) && !(pde & pte & PTE_WRITABLE)) {
+        page_fault(emu, address);
+    }
+
+    /* アクセスしたことをページテーブルに記録する */
+    if (!(pde & PTE_ACCESSED)) {
+        write_physical32(emu, pde_address, pde | PTE_ACCESSED);
+    }
+    flags = PTE_ACCESSED | (write ? PTE_DIRTY : 0);
+    if ((pte & flags) != flags) {
+        pte |= flags;
+        write_physical32(emu, pte_address, pte);
+    }
+
+    entry = &emu->tlb[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+    entry->read_tag = page;
+    entry->offset = (pte & PAGE_MASK) - page;
+
+    /* dirty ビットが立っていれば以降の書き込みも TLB で変換できる */
+    if ((pte & PTE_DIRTY)
+        && ((pde & pte & PTE_WRITABLE) || !(emu->cr0 & CR0_WP))) {
+        entry->write_tag = page;
+    } else {
+        entry->write_tag = TLB_INVALID;
+    }
+
+    return address + entry->offset;
+}
@@ -0,0 +1,70 @@
+#ifndef MMU_H_
+#define MMU_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* CR0 のビットフラグ */
+#define CR0_PE (1)
+#define CR0_WP (1 << 16)
+#define CR0_PG (1u << 31)
+
+/* ページの大きさ */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (~(uint32_t)(PAGE_SIZE - 1))
+
+/* ページディレクトリ・ページテーブルのエントリのビットフラグ */
+#define PTE_PRESENT (1)
+#define PTE_WRITABLE (1 << 1)
+#define PTE_ACCESSED (1 << 5)
+#define PTE_DIRTY (1 << 6)
+
+/* どのページとも一致しない TLB のタグ */
+#define TLB_INVALID (1)
+
+/* address から size バイトがページをまたぐか */
+#define CROSSES_PAGE(address, size) \
+    (((address) & (PAGE_SIZE - 1)) > PAGE_SIZE - (size))
+
+/* index 番のコントロールレジスタの取得・設定
+ *
+ * CR3 の書き換えとページングの有効・無効の切り替えでは TLB と
+ * デコード済みのブロックを全て捨てる。
+ */
+uint32_t get_control_register(Emulator* emu, int index);
+void set_control_register(Emulator* emu, int index, uint32_t value);
+
+/* TLB の全エントリを無効にする */
+void flush_tlb(Emulator* emu);
+
+/* address を含むページの変換結果を捨てる(invlpg) */
+void invalidate_page(Emulator* emu, uint32_t address);
+
+/* ページテーブルをたどって線形アドレスを物理アドレスに変換する
+ *
+ * 結果は TLB に登録する。ページが存在しない、または書き込み禁止の
+ * ページに書き込もうとしたときは CR2 に address をセットして
+ * ゲストのフォールトを起こす。
+ */
+uint32_t walk_page_table(Emulator* emu, uint32_t address, int write);
+
+/* ページングが有効なときに線形アドレスを物理アドレスに変換する
+ *
+ * TLB に当たれば比較1回と加算1回で済む。
+ */
+static inline uint32_t to_physical(Emulator* emu, uint32_t address, int write)
+{
+    TlbEntry* entry = &emu->tlb[(address >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+    uint32_t tag = write ? entry->write_tag : entry->read_tag;
+
+    if (tag == (address & PAGE_MASK)) {
+        emu->tlb_hits++;
+        return address + entry->offset;
+    }
+
+    return walk_page_table(emu, address, write);
+}
+
+#endif
@@ -10,62 +10,69 @@
 
 void parse_modrm(Emulator* emu, ModRM* modrm)
 {
-    uint8_t code;
-
     assert(emu != NULL && modrm != NULL);
 
+    emu->eip += decode_modrm(emu, emu->eip, modrm);
+}
+
+uint32_t decode_modrm(Emulator* emu, uint32_t address, ModRM* modrm)
+{
+    uint8_t code;
+    uint32_t p = address;
+    int disp32;
+
     memset(modrm, 0, sizeof(ModRM)); // 全部を 0 に初期化
 
-    code = get_code8(emu, 0);
+    code = get_memory8(emu, p);
     modrm->mod = ((code & 0xC0) >> 6);
     modrm->opecode = ((code & 0x38) >> 3);
     modrm->rm = code & 0x07;
 
-    emu->eip += 1;
+    p += 1;
+
+    modrm->base = modrm->rm;
+    modrm->index = ZERO_REGISTER;
+    disp32 = modrm->mod == 2 || (modrm->mod == 0 && modrm->rm == 5);
 
     if (modrm->mod != 3 && modrm->rm == 4) {
-        modrm->sib = get_code8(emu, 0);
-        emu->eip += 1;
+        modrm->sib = get_memory8(emu, p);
+        p += 1;
+
+        /* scale(2bit), index(3bit), base(3bit)
+         * index が 4(ESP)ならインデックスなし、mod = 0 で base が 5 なら
+         * ベースなしで disp32 が続く */
+        modrm->base = modrm->sib & 0x07;
+        modrm->index = (modrm->sib >> 3) & 0x07;
+        modrm->shift = modrm->sib >> 6;
+        if (modrm->index == ESP) {
+            modrm->index = ZERO_REGISTER;
+        }
+        if (modrm->mod == 0 && modrm->base == EBP) {
+            disp32 = TRUE;
+        }
     }
 
-    if ((modrm->mod == 0 && modrm->rm == 5) || modrm->mod == 2) {
-        modrm->disp32 = get_sign_code32(emu, 0);
-        emu->eip += 4;
+    if (modrm->mod == 0 && disp32) {
+        modrm->base = ZERO_REGISTER;
+    }
+
+    if (disp32) {
+        modrm->disp32 = get_memory32(emu, p);
+        modrm->disp = modrm->disp32;
+        p += 4;
     } else if (modrm->mod == 1) {
-        modrm->disp8 = get_sign_code8(emu, 0);
-        emu->eip += 1;
+        modrm->disp8 = (int8_t)get_memory8(emu, p);
+        modrm->disp = modrm->disp8;
+        p += 1;
     }
+
+    return p - address;
 }
 
 uint32_t calc_memory_address(Emulator* emu, ModRM* modrm)
 {
-    if (modrm->mod == 0) {
-        if (modrm->rm == 4) {
-            printf("not implemented ModRM mod = 0, rm = 4\n");
-            exit(0);
-        } else if (modrm->rm == 5) {
-            return modrm->disp32;
-        } else {
-            return get_register32(emu, modrm->rm);
-        }
-    } else if (modrm->mod == 1) {
-        if (modrm->rm == 4) {
-            printf("not implemented ModRM mod = 1, rm = 4\n");
-            exit(0);
-        } else {
-            return get_register32(emu, modrm->rm) + modrm->disp8;
-        }
-    } else if (modrm->mod == 2) {
-        if (modrm->rm == 4) {
-            printf("not implemented ModRM mod = 2, rm = 4\n");
-            exit(0);
-        } else {
-            return get_register32(emu, modrm->rm) + modrm->disp32;
-        }
-    } else {
-        printf("not implemented ModRM mod = 3\n");
-        exit(0);
-    }
+    return emu->registers[modrm->base]
+           + (emu->registers[modrm->index] << modrm->shift) + modrm->disp;
 }
 
 void set_rm8(Emulator* emu, ModRM* modrm, uint8_t value)
@@ -106,6 +113,16 @@ uint8_t get_rm8(Emulator* emu, ModRM* modrm)
     }
 }
 
+uint16_t get_rm16(Emulator* emu, ModRM* modrm)
+{
+    if (modrm->mod == 3) {
+        return get_register32(emu, modrm->rm) & 0xffff;
+    } else {
+        uint32_t address = calc_memory_address(emu, modrm);
+        return get_memory8(emu, address) | get_memory8(emu, address + 1) << 8;
+    }
+}
+
 uint32_t get_rm32(Emulator* emu, ModRM* modrm)
 {
     if (modrm->mod == 3) {
@@ -24,6 +24,14 @@ typedef struct {
         int8_t disp8; // disp8 は符号付き整数
         uint32_t disp32;
     };
+
+    /* 実効アドレスを base + (index << shift) + disp で求めるための形
+     * (decode_modrm で ModR/M と SIB から求めておく)
+     * 使わないレジスタは常に 0 の ZERO_REGISTER にする */
+    uint8_t base;
+    uint8_t index;
+    uint8_t shift;
+    uint32_t disp;
 } ModRM;
 
 /* ModR/M, SIB, ディスプレースメントを解析する
@@ -38,9 +46,17 @@ typedef struct {
  */
 void parse_modrm(Emulator* emu, ModRM* modrm);
 
+/* address 番地から ModR/M, SIB, ディスプレースメントを解析する
+ *
+ * parse_modrm と同じだが emu->eip を変更しない。
+ * 戻り値は ModR/M から読み取ったバイト数（即値は含まない）。
+ */
+uint32_t decode_modrm(Emulator* emu, uint32_t address, ModRM* modrm);
+
 /* ModR/M の内容に基づきメモリの実効アドレスを計算する
  *
- * modrm->mod は 0, 1, 2 のいずれかでなければならない
+ * modrm->mod は 0, 1, 2 のいずれかでなければならない。SIB を含む
+ * 32bit のアドレス指定の全ての形を、分岐せずに計算する。
  */
 uint32_t calc_memory_address(Emulator* emu, ModRM* modrm);
 
@@ -70,4 +86,7 @@ void set_rm8(Emulator* emu, ModRM* modrm, uint8_t value);
 uint8_t get_r8(Emulator* emu, ModRM* modrm);
 void set_r8(Emulator* emu, ModRM* modrm, uint8_t value);
 
+/* 16ビット版(movzx, movsx で使う) */
+uint16_t get_rm16(Emulator* emu, ModRM* modrm);
+
 #endif
@@ -0,0 +1,203 @@
+#include "pit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator_function.h"
+#include "io.h"
+#include "scheduler.h"
+
+Pit* create_pit(void)
+{
+    return calloc(1, sizeof(Pit));
+}
+
+void destroy_pit(Pit* pit)
+{
+    free(pit);
+}
+
+/* count 回数えるのにかかる命令数(1以上) */
+static uint64_t counts_to_time(uint64_t count)
+{
+    uint64_t time = count * VIRTUAL_HZ / PIT_HZ;
+
+    return time > 0 ? time : 1;
+}
+
+/* 時刻 elapsed までに減ったカウント数 */
+static uint64_t time_to_counts(uint64_t elapsed)
+{
+    return elapsed / VIRTUAL_HZ * PIT_HZ + elapsed % VIRTUAL_HZ * PIT_HZ / VIRTUAL_HZ;
+}
+
+static uint32_t reload_value(PitChannel* channel)
+{
+    return channel->reload != 0 ? channel->reload : 0x10000;
+}
+
+/* カウンタ 0 が 0 になった */
+static void pit_expired(Emulator* emu, void* opaque)
+{
+    Pit* pit = opaque;
+    PitChannel* channel = &pit->channels[0];
+
+    pulse_irq(emu, pit->irq);
+
+    if (channel->mode != PIT_MODE_RATE && channel->mode != PIT_MODE_SQUARE) {
+        channel->running = FALSE;
+        return;
+    }
+
+    /* ずれがたまらないように前の時刻から数える */
+    channel->deadline += counts_to_time(reload_value(channel));
+    schedule_event(emu, channel->deadline, pit_expired, pit);
+}
+
+/* 初期値を書き終えたのでカウントを始める */
+static void start_counter(Pit* pit, int index)
+{
+    PitChannel* channel = &pit->channels[index];
+
+    channel->running = TRUE;
+    channel->start = virtual_time(pit->emu);
+    channel->deadline = channel->start + counts_to_time(reload_value(channel));
+
+    if (index == 0) {
+        cancel_event(pit->emu, pit_expired, pit);
+        schedule_event(pit->emu, channel->deadline, pit_expired, pit);
+    }
+}
+
+void reset_pit(Pit* pit)
+{
+    if (pit->emu != NULL) {
+        cancel_event(pit->emu, pit_expired, pit);
+    }
+    memset(pit->channels, 0, sizeof(pit->channels));
+}
+
+/* 今のカウントの値 */
+static uint16_t current_count(Pit* pit, PitChannel* channel)
+{
+    uint32_t reload = reload_value(channel);
+    uint64_t elapsed;
+
+    if (!channel->running) {
+        return channel->reload;
+    }
+
+    elapsed = time_to_counts(virtual_time(pit->emu) - channel->start);
+    if (channel->mode != PIT_MODE_RATE && channel->mode != PIT_MODE_SQUARE
+        && elapsed >= reload) {
+        return 0;
+    }
+    return reload - elapsed % reload;
+}
+
+static uint32_t pit_read(void* opaque, uint16_t offset, int size)
+{
+    Pit* pit = opaque;
+    PitChannel* channel;
+    uint16_t value;
+
+    if (offset >= PIT_CHANNELS) {
+        return 0xff;
+    }
+    channel = &pit->channels[offset];
+
+    value = channel->latched ? channel->latch : current_count(pit, channel);
+
+    switch (channel->access) {
+    case PIT_ACCESS_LOW:
+        channel->latched = FALSE;
+        return value & 0xff;
+    case PIT_ACCESS_HIGH:
+        channel->latched = FALSE;
+        return value >> 8;
+    default:
+        channel->read_high = !channel->read_high;
+        if (channel->read_high) {
+            return value & 0xff;
+        }
+        /* 上位バイトまで読んだらラッチを外す */
+        channel->latched = FALSE;
+        return value >> 8;
+    }
+}
+
+static void write_control(Pit* pit, uint8_t value)
+{
+    int index = value >> 6;
+    uint8_t access = value >> 4 & 3;
+    PitChannel* channel;
+
+    /* 8254 のリードバックコマンドは扱わない */
+    if (index >= PIT_CHANNELS) {
+        return;
+    }
+    channel = &pit->channels[index];
+
+    if (access == PIT_ACCESS_LATCH) {
+        if (!channel->latched) {
+            channel->latch = current_count(pit, channel);
+            channel->latched = TRUE;
+        }
+        return;
+    }
+
+    channel->access = access;
+    /* 6, 7 は 2, 3 と同じ */
+    channel->mode = (value >> 1 & 7) > 5 ? (value >> 1 & 3) : (value >> 1 & 7);
+    channel->write_high = FALSE;
+    channel->read_high = FALSE;
+    channel->latched = FALSE;
+
+    /* モードを設定すると初期値を書くまで止まる */
+    channel->running = FALSE;
+    if (index == 0) {
+        cancel_event(pit->emu, pit_expired, pit);
+    }
+}
+
+static void pit_write(void* opaque, uint16_t offset, uint32_t value, int size)
+{
+    Pit* pit = opaque;
+    PitChannel* channel;
+
+    if (offset == PIT_CONTROL) {
+        write_control(pit, value);
+        return;
+    }
+    if (offset >= PIT_CHANNELS) {
+        return;
+    }
+    channel = &pit->channels[offset];
+
+    switch (channel->access) {
+    case PIT_ACCESS_LOW:
+        channel->reload = value & 0xff;
+        break;
+    case PIT_ACCESS_HIGH:
+        channel->reload = (value & 0xff) << 8;
+        break;
+    default:
+        if (!channel->write_high) {
+            channel->low = value;
+            channel->write_high = TRUE;
+            return;
+        }
+        channel->reload = (value & 0xff) << 8 | channel->low;
+        channel->write_high = FALSE;
+        break;
+    }
+
+    start_counter(pit, offset);
+}
+
+int map_pit(Emulator* emu, Pit* pit, uint16_t port, int irq)
+{
+    pit->emu = emu;
+    pit->irq = irq;
+    return map_io_ports(emu, port, PIT_PORTS_COUNT, pit_read, pit_write, pit);
+}
@@ -0,0 +1,78 @@
+#ifndef PIT_H_
+#define PIT_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* 8253/8254 の入力クロック(Hz) */
+#define PIT_HZ 1193182ULL
+
+/* I/O ポートと IRQ */
+#define PIT_PORT 0x40
+#define PIT_IRQ 0
+
+/* レジスタ(ポートの先頭からの位置) */
+#define PIT_COUNTER0 0
+#define PIT_CONTROL  3
+#define PIT_PORTS_COUNT 4
+
+#define PIT_CHANNELS 3
+
+/* 制御語の読み書きの方法 */
+#define PIT_ACCESS_LATCH 0
+#define PIT_ACCESS_LOW   1
+#define PIT_ACCESS_HIGH  2
+#define PIT_ACCESS_WORD  3
+
+/* モード(2 と 3 は周期的に、それ以外は1回だけ割り込む) */
+#define PIT_MODE_ONESHOT 0
+#define PIT_MODE_RATE    2
+#define PIT_MODE_SQUARE  3
+
+typedef struct {
+    /* カウントの初期値(0 は 65536) */
+    uint32_t reload;
+    uint8_t mode;
+    uint8_t access;
+
+    /* WORD のとき次に読み書きするのが上位バイトか */
+    int write_high;
+    int read_high;
+
+    /* 書き込み途中の下位バイト */
+    uint8_t low;
+
+    /* ラッチした値 */
+    int latched;
+    uint16_t latch;
+
+    /* カウントを始めた時刻と、次に 0 になる時刻(仮想時間) */
+    int running;
+    uint64_t start;
+    uint64_t deadline;
+} PitChannel;
+
+/* 8253/8254 互換のタイマー
+ *
+ * 時刻はスケジューラの仮想時間(VIRTUAL_HZ 命令で1秒)で数える。
+ * カウンタ 0 が 0 になると IRQ 0 を1回要求し、モード 2, 3 なら初期値から
+ * 数えなおす。次に 0 になる時刻をイベントとして予約するので、実行中に
+ * タイマーのための処理はない。カウンタ 1, 2 は読み出せるだけで割り込まない。
+ */
+typedef struct Pit {
+    Emulator* emu;
+    int irq;
+    PitChannel channels[PIT_CHANNELS];
+} Pit;
+
+Pit* create_pit(void);
+void destroy_pit(Pit* pit);
+
+/* 全てのカウンタを止める */
+void reset_pit(Pit* pit);
+
+/* pit を port 番からの I/O ポートに割り当て、割り込みは irq で要求する */
+int map_pit(Emulator* emu, Pit* pit, uint16_t port, int irq);
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+
+#include "profile.h"
+#include "bus.h"
+#include "mmu.h"
+
+/* ゲストの関数 */
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    char* name;
+} Symbol;
+
+struct Profiler {
+    uint32_t interval;
+    uint64_t next;
+
+    /* 標本(深さ、EIP、呼び出し元の戻り番地... を続けて並べる) */
+    uint32_t* samples;
+    size_t used;
+    size_t capacity;
+    uint32_t count;
+
+    /* アドレス順に並べた関数 */
+    Symbol* symbols;
+    int symbols_count;
+};
+
+static int compare_symbols(const void* a, const void* b)
+{
+    const Symbol* x = a;
+    const Symbol* y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* ELF のシンボルテーブルから関数とラベルを読み込む */
+static int load_symbols(Profiler* profiler, const char* filename)
+{
+    FILE* file = fopen(filename, "rb");
+    uint8_t* image;
+    long size;
+    Elf32_Ehdr* ehdr;
+    Elf32_Shdr* shdrs;
+    int i, j;
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    image = malloc(size);
+    if (fread(image, 1, size, file) != (size_t)size) {
+        free(image);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+
+    ehdr = (Elf32_Ehdr*)image;
+    if (size < (long)sizeof(Elf32_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+        || ehdr->e_ident[EI_CLASS] != ELFCLASS32
+        || ehdr->e_shoff + (long)ehdr->e_shnum * sizeof(Elf32_Shdr) > (unsigned long)size) {
+        free(image);
+        return 0;
+    }
+
+    shdrs = (Elf32_Shdr*)(image + ehdr->e_shoff);
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        Elf32_Sym* syms;
+        const char* strtab;
+        int n;
+
+        if (shdrs[i].sh_type != SHT_SYMTAB || shdrs[i].sh_link >= ehdr->e_shnum) {
+            continue;
+        }
+
+        syms = (Elf32_Sym*)(image + shdrs[i].sh_offset);
+        n = shdrs[i].sh_size / sizeof(Elf32_Sym);
+        strtab = (const char*)(image + shdrs[shdrs[i].sh_link].sh_offset);
+
+        profiler->symbols = realloc(profiler->symbols,
+                                    sizeof(Symbol) * (profiler->symbols_count + n));
+
+        for (j = 0; j < n; j++) {
+            int type = ELF32_ST_TYPE(syms[j].st_info);
+
+            /* nasm のラベルは型を持たないので NOTYPE も含める */
+            if ((type != STT_FUNC && type != STT_NOTYPE)
+                || syms[j].st_shndx == SHN_UNDEF || syms[j].st_name == 0) {
+                continue;
+            }
+
+            profiler->symbols[profiler->symbols_count].start = syms[j].st_value;
+            profiler->symbols[profiler->symbols_count].end = syms[j].st_value + syms[j].st_size;
+            profiler->symbols[profiler->symbols_count].name = strdup(strtab + syms[j].st_name);
+            profiler->symbols_count++;
+        }
+    }
+
+    free(image);
+
+    qsort(profiler->symbols, profiler->symbols_count, sizeof(Symbol), compare_symbols);
+
+    /* 大きさのないシンボルは次のシンボルまでとする */
+    for (i = 0; i < profiler->symbols_count; i++) {
+        Symbol* symbol = &profiler->symbols[i];
+        if (symbol->end == symbol->start) {
+            symbol->end = i + 1 < profiler->symbols_count
+                ? profiler->symbols[i + 1].start : 0xffffffff;
+        }
+    }
+
+    return 1;
+}
+
+Profiler* create_profiler(const char* symbol_file, uint32_t interval)
+{
+    Profiler* profiler = calloc(1, sizeof(Profiler));
+
+    profiler->interval = interval;
+    profiler->next = interval;
+
+    if (symbol_file != NULL && !load_symbols(profiler, symbol_file)) {
+        destroy_profiler(profiler);
+        return NULL;
+    }
+
+    return profiler;
+}
+
+void destroy_profiler(Profiler* profiler)
+{
+    int i;
+
+    for (i = 0; i < profiler->symbols_count; i++) {
+        free(profiler->symbols[i].name);
+    }
+    free(profiler->symbols);
+    free(profiler->samples);
+    free(profiler);
+}
+
+uint64_t next_sample(Profiler* profiler)
+{
+    return profiler->next;
+}
+
+static void add_value(Profiler* profiler, uint32_t value)
+{
+    if (profiler->used == profiler->capacity) {
+        profiler->capacity = profiler->capacity ? profiler->capacity * 2 : 4096;
+        profiler->samples = realloc(profiler->samples,
+                                    sizeof(uint32_t) * profiler->capacity);
+    }
+    profiler->samples[profiler->used++] = value;
+}
+
+void profile_sample(Profiler* profiler, Emulator* emu)
+{
+    uint32_t frames[PROFILE_MAX_DEPTH];
+    uint32_t ebp = emu->registers[EBP];
+    int depth = 0;
+    int i;
+
+    profiler->next = emu->retired + profiler->interval;
+    profiler->count++;
+
+    frames[depth++] = emu->eip;
+
+    /* [ebp] に呼び出し元の EBP、[ebp + 4] に戻り番地がある
+     * ページングが有効なときやメモリの外を指すときはたどらない */
+    while (depth < PROFILE_MAX_DEPTH && !(emu->cr0 & CR0_PG)
+           && ebp != 0 && ebp <= MEMORY_SIZE - 8) {
+        uint32_t next = load32(emu->memory + ebp);
+
+        /* 戻り番地は call の次を指すので、call 命令の中に戻す */
+        frames[depth++] = load32(emu->memory + ebp + 4) - 1;
+
+        /* 呼び出し元のフレームは必ず上位のアドレスにある */
+        if (next <= ebp) {
+            break;
+        }
+        ebp = next;
+    }
+
+    add_value(profiler, depth);
+    for (i = 0; i < depth; i++) {
+        add_value(profiler, frames[i]);
+    }
+}
+
+/* address を含む関数の名前を buffer に書く */
+static void symbolize(Profiler* profiler, uint32_t address, char* buffer, size_t size)
+{
+    int low = 0;
+    int high = profiler->symbols_count - 1;
+
+    /* start <= address となる最後のシンボルを二分探索する */
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (profiler->symbols[mid].start <= address) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    if (high >= 0 && address < profiler->symbols[high].end) {
+        snprintf(buffer, size, "%s", profiler->symbols[high].name);
+    } else {
+        snprintf(buffer, size, "0x%08x", address);
+    }
+}
+
+static int compare_strings(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int write_profile(Profiler* profiler, const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    char** stacks;
+    size_t p = 0;
+    uint32_t i, j;
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    /* 標本ごとに呼び出し元から順に関数名をつなげる */
+    stacks = malloc(sizeof(char*) * (profiler->count + 1));
+    for (i = 0; i < profiler->count; i++) {
+        uint32_t depth = profiler->samples[p++];
+        size_t length = 0;
+        char* stack = malloc(depth * 256 + 1);
+
+        stack[0] = '\0';
+        for (j = depth; j > 0; j--) {
+            char name[256];
+
+            symbolize(profiler, profiler->samples[p + j - 1], name, sizeof(name));
+            length += sprintf(stack + length, "%s%s", j == depth ? "" : ";", name);
+        }
+        p += depth;
+        stacks[i] = stack;
+    }
+
+    /* 同じスタックをまとめて数える */
+    qsort(stacks, profiler->count, sizeof(char*), compare_strings);
+    for (i = 0; i < profiler->count; i = j) {
+        for (j = i + 1; j < profiler->count && strcmp(stacks[i], stacks[j]) == 0; j++) {
+        }
+        fprintf(file, "%s %u\n", stacks[i], j - i);
+    }
+
+    for (i = 0; i < profiler->count; i++) {
+        free(stacks[i]);
+    }
+    free(stacks);
+    fclose(file);
+
+    return 1;
+}
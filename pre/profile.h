@@ -0,0 +1,35 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+/* 標本を取る間隔(実行した命令数)の既定値
+ * 周期的なループと同期しないように素数にしておく */
+#define PROFILE_DEFAULT_INTERVAL 10007
+
+/* 1つの標本に記録する呼び出しの深さの上限 */
+#define PROFILE_MAX_DEPTH 64
+
+typedef struct Profiler Profiler;
+
+/* プロファイラを作る
+ *
+ * symbol_file はゲストの ELF ファイル(NULL ならアドレスのまま出力する)。
+ * interval 命令ごとに標本を取る。ELF を読めなければ NULL を返す。
+ */
+Profiler* create_profiler(const char* symbol_file, uint32_t interval);
+void destroy_profiler(Profiler* profiler);
+
+/* 次に標本を取る時点(emu->retired の値) */
+uint64_t next_sample(Profiler* profiler);
+
+/* 現在の EIP と EBP をたどった呼び出し元を1つの標本として記録する */
+void profile_sample(Profiler* profiler, Emulator* emu);
+
+/* 標本を関数名で集計し、flame graph 用の形式(呼び出し元から順に
+ * ";" でつないだスタックと回数)で書き出す */
+int write_profile(Profiler* profiler, const char* filename);
+
+#endif
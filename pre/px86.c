@@ -0,0 +1,328 @@
+#include "px86.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "block.h"
+#include "ram.h"
+#include "bus.h"
+#include "mmu.h"
+#include "io.h"
+#include "serial.h"
+#include "scheduler.h"
+#include "pit.h"
+
+/* 時間切れを調べる間隔(実行したブロックの数、2のべき乗) */
+#define TIMEOUT_CHECK_INTERVAL 1024
+
+/* 命令セットとエミュレータを1回の確保でまとめて持つ */
+typedef struct {
+    Emulator emu;
+    InstructionSet isa;
+} Instance;
+
+Emulator* px86_create(int console_in, int console_out)
+{
+    Instance* instance = calloc(1, sizeof(Instance));
+    Emulator* emu;
+
+    if (instance == NULL) {
+        return NULL;
+    }
+    emu = &instance->emu;
+
+    emu->memory = create_ram(MEMORY_SIZE);
+    if (emu->memory == NULL) {
+        free(instance);
+        return NULL;
+    }
+    init_memory_bus(emu, MEMORY_SIZE);
+
+    init_instructions(&instance->isa);
+    emu->isa = &instance->isa;
+
+    emu->block_cache = create_block_cache();
+
+    pthread_mutex_init(&emu->idle_mutex, NULL);
+    pthread_cond_init(&emu->idle_cond, NULL);
+
+    init_io_ports(emu);
+    init_scheduler(emu);
+    emu->serial = create_serial(console_in, console_out);
+    map_serial(emu, emu->serial, SERIAL_COM1_PORT, SERIAL_COM1_IRQ);
+    emu->pit = create_pit();
+    map_pit(emu, emu->pit, PIT_PORT, PIT_IRQ);
+
+    px86_reset(emu);
+    return emu;
+}
+
+void px86_destroy(Emulator* emu)
+{
+    destroy_pit(emu->pit);
+    destroy_serial(emu->serial);
+    destroy_scheduler(emu);
+    destroy_io_ports(emu);
+    destroy_block_cache(emu->block_cache);
+    destroy_memory_bus(emu);
+    destroy_ram(emu->memory, MEMORY_SIZE);
+    pthread_cond_destroy(&emu->idle_cond);
+    pthread_mutex_destroy(&emu->idle_mutex);
+    free(emu);
+}
+
+void px86_reset(Emulator* emu)
+{
+    memset(emu->memory, 0, MEMORY_SIZE);
+
+    memset(emu->registers, 0, sizeof(emu->registers));
+    set_eflags(emu, 0);
+    emu->eip = 0x7c00;
+    emu->registers[ESP] = 0x7c00;
+
+    emu->cr0 = 0;
+    emu->cr2 = 0;
+    emu->cr3 = 0;
+    flush_tlb(emu);
+
+    emu->retired = 0;
+    emu->int_index = -1;
+    emu->irq_pulses = 0;
+    emu->idle_time = 0;
+    emu->halted = FALSE;
+    emu->idle_loop.eip = 0;
+    emu->fault_address = 0;
+
+    /* 時刻が 0 に戻るので予約したイベントも捨てる */
+    clear_events(emu);
+    reset_pit(emu->pit);
+
+    flush_block_cache(emu->block_cache);
+}
+
+/* ホストからメモリを書き換えたので、その範囲のキャッシュしたコードを捨てる */
+static void host_write(Emulator* emu, uint32_t address, size_t size)
+{
+    uint32_t page;
+
+    for (page = address >> CODE_PAGE_SHIFT;
+         page <= (address + size - 1) >> CODE_PAGE_SHIFT; page++) {
+        if (IS_CODE_PAGE(emu->block_cache, page << CODE_PAGE_SHIFT)) {
+            flush_block_cache(emu->block_cache);
+            return;
+        }
+    }
+}
+
+long px86_load(Emulator* emu, const char* filename, uint32_t address)
+{
+    FILE* binary;
+    size_t size;
+
+    if (address >= MEMORY_SIZE) {
+        return -1;
+    }
+
+    binary = fopen(filename, "rb");
+    if (binary == NULL) {
+        return -1;
+    }
+
+    size = fread(emu->memory + address, 1, MEMORY_SIZE - address, binary);
+    fclose(binary);
+
+    if (size > 0) {
+        host_write(emu, address, size);
+    }
+    return size;
+}
+
+int px86_read_memory(Emulator* emu, uint32_t address, void* buffer, size_t size)
+{
+    if (address > MEMORY_SIZE || size > MEMORY_SIZE - address) {
+        return -1;
+    }
+    memcpy(buffer, emu->memory + address, size);
+    return 0;
+}
+
+int px86_write_memory(Emulator* emu, uint32_t address, const void* buffer, size_t size)
+{
+    if (address > MEMORY_SIZE || size > MEMORY_SIZE - address) {
+        return -1;
+    }
+    if (size > 0) {
+        memcpy(emu->memory + address, buffer, size);
+        host_write(emu, address, size);
+    }
+    return 0;
+}
+
+void px86_get_registers(Emulator* emu, PX86Registers* regs)
+{
+    memcpy(regs->registers, emu->registers, sizeof(regs->registers));
+    regs->eip = emu->eip;
+    regs->eflags = get_eflags(emu);
+}
+
+void px86_set_registers(Emulator* emu, const PX86Registers* regs)
+{
+    memcpy(emu->registers, regs->registers, sizeof(regs->registers));
+    emu->eip = regs->eip;
+    set_eflags(emu, regs->eflags);
+}
+
+uint64_t px86_retired(Emulator* emu)
+{
+    return emu->retired;
+}
+
+uint32_t px86_fault_address(Emulator* emu)
+{
+    return emu->fault_address;
+}
+
+int px86_map_io(Emulator* emu, uint16_t start, uint32_t count,
+                px86_io_read_t* read, px86_io_write_t* write, void* opaque)
+{
+    return map_io_ports(emu, start, count, read, write, opaque) ? 0 : -1;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* px86_run の本体(ゲストのフォールトは呼び出し側で捕まえる) */
+static int run_until(Emulator* emu, uint64_t count, uint32_t stop_address,
+                     uint32_t timeout_ms)
+{
+    uint64_t end = count > 0 ? emu->retired + count : UINT64_MAX;
+    uint64_t deadline = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+    uint32_t blocks = 0;
+    struct timespec wake_deadline;
+
+    /* hlt やポーリングのループで眠るときの期限 */
+    clock_gettime(CLOCK_REALTIME, &wake_deadline);
+    wake_deadline.tv_sec += timeout_ms / 1000;
+    wake_deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (wake_deadline.tv_nsec >= 1000000000) {
+        wake_deadline.tv_sec++;
+        wake_deadline.tv_nsec -= 1000000000;
+    }
+
+    for (;;) {
+        Block* block;
+
+        /* hlt で止まっている間は割り込みが来るまで待つ */
+        if (emu->halted) {
+            flush_serial(emu->serial);
+            switch (wait_for_interrupt(emu, timeout_ms > 0 ? &wake_deadline : NULL)) {
+            case WAKE_NEVER:
+                return PX86_HALTED;
+            case WAKE_TIMEOUT:
+                return PX86_TIMEOUT;
+            }
+            interrupt(emu);
+            if (emu->eip == stop_address) {
+                return PX86_STOPPED;
+            }
+            continue;
+        }
+
+        if (!(emu->cr0 & CR0_PG) && emu->eip >= MEMORY_SIZE) {
+            emu->fault_address = emu->eip;
+            return PX86_FAULT;
+        }
+
+        block = lookup_block(emu);
+        if (block == NULL) {
+            return PX86_NOT_IMPLEMENTED;
+        }
+
+        /* 途中で止まるブロックは1命令ずつ実行する(先頭で止まるブロックも、
+         * ループをまとめて実行すると止まる番地を通り過ぎるので同じ) */
+        if (end - emu->retired < (uint64_t)block->retired
+            || (block->start <= stop_address && stop_address < block->end)) {
+            if (!step_instruction(emu)) {
+                return PX86_NOT_IMPLEMENTED;
+            }
+        } else {
+            uint32_t wakeups;
+
+            execute_block(emu, block);
+
+            /* 何も変わらないのに回り続けるループは、変わるときまで待つ
+             * (命令数で止まるときは命令を数え続ける) */
+            if (block->idle && count == 0 && is_idle_loop(emu, block, &wakeups)) {
+                flush_serial(emu->serial);
+                switch (wait_for_change(emu, wakeups,
+                                        timeout_ms > 0 ? &wake_deadline : NULL)) {
+                case WAKE_NEVER:
+                    return PX86_HALTED;
+                case WAKE_TIMEOUT:
+                    return PX86_TIMEOUT;
+                }
+            }
+        }
+
+        if (emu->retired >= emu->next_event) {
+            run_events(emu);
+        }
+
+        if (has_interrupt(emu)) {
+            interrupt(emu);
+        }
+
+        if (emu->eip == 0) {
+            return PX86_EXITED;
+        }
+        if (emu->eip == stop_address) {
+            return PX86_STOPPED;
+        }
+        if (emu->retired >= end) {
+            return PX86_COUNT;
+        }
+        if (deadline > 0 && (++blocks & (TIMEOUT_CHECK_INTERVAL - 1)) == 0
+            && now_ms() >= deadline) {
+            return PX86_TIMEOUT;
+        }
+    }
+}
+
+int px86_run(Emulator* emu, uint64_t count, uint32_t stop_address,
+             uint32_t timeout_ms)
+{
+    sigjmp_buf fault_jmp;
+    int result;
+
+    emu->retired_limit = count > 0 ? emu->retired + count : 0;
+
+    if (sigsetjmp(fault_jmp, 1) == 0) {
+        catch_guest_fault(emu, &fault_jmp);
+        result = run_until(emu, count, stop_address, timeout_ms);
+    } else {
+        /* ゲストがメモリの外にアクセスした */
+        result = PX86_FAULT;
+    }
+    catch_guest_fault(NULL, NULL);
+    emu->retired_limit = 0;
+
+    /* 止まったところまでのゲストの出力を見えるようにする */
+    flush_serial(emu->serial);
+
+    return result;
+}
+
+int px86_step(Emulator* emu)
+{
+    return px86_run(emu, 1, PX86_NO_STOP, 0);
+}
@@ -0,0 +1,117 @@
+#ifndef PX86_H_
+#define PX86_H_
+
+/* libpx86: エミュレータをライブラリとして使うための API
+ *
+ * エミュレータの状態(メモリ、レジスタ、命令セット、I/O ポート)は全て
+ * インスタンスごとに持つので、1つのプロセスでいくつでも作れる。
+ * 1つのインスタンスを同時に複数のスレッドから使ってはいけない。
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Emulator Emulator;
+
+/* px86_run が止まった理由 */
+enum {
+    PX86_EXITED,          /* EIP が 0 になった(プログラムの終了) */
+    PX86_COUNT,           /* 指定した命令数を実行した */
+    PX86_STOPPED,         /* EIP が stop_address になった */
+    PX86_TIMEOUT,         /* 指定した時間が過ぎた */
+    PX86_NOT_IMPLEMENTED, /* 実装されていない命令に来た */
+    PX86_FAULT,           /* メモリの外にアクセスした */
+    PX86_HALTED           /* hlt か抜けられないループで止まり、もう先に進まない */
+};
+
+/* px86_run の stop_address に渡すと EIP では止まらない */
+#define PX86_NO_STOP 0xffffffffu
+
+/* px86_get_registers で読むレジスタ(registers は EAX, ECX, EDX, EBX,
+ * ESP, EBP, ESI, EDI の順) */
+typedef struct {
+    uint32_t registers[8];
+    uint32_t eip;
+    uint32_t eflags;
+} PX86Registers;
+
+/* I/O ポートのデバイスの読み書き関数
+ *
+ * opaque は px86_map_io に渡したもの、offset は割り当てたポートの
+ * 先頭からの位置、size は 1, 2, 4 のいずれか。
+ */
+typedef uint32_t px86_io_read_t(void* opaque, uint16_t offset, int size);
+typedef void px86_io_write_t(void* opaque, uint16_t offset, uint32_t value, int size);
+
+/* メモリ1MBのエミュレータを作る
+ *
+ * 作ったときは px86_reset した状態で、次のデバイスがつながっている。
+ * - COM1(0x03f8, IRQ 4): console_in から読み、console_out に書く
+ *   コンソール。出力はまとめて書き出し、px86_run から戻るときには
+ *   書き出し終えている。負のファイルディスクリプタを渡すと、その向きは
+ *   つながず、入力は来ず出力は捨てる。
+ * - PIT(0x40, IRQ 0): 実行した命令数で数えるタイマー。
+ * IRQ n はベクタ 0x20 + n の割り込みになる。
+ * メモリを確保できなければ NULL を返す。
+ */
+Emulator* px86_create(int console_in, int console_out);
+void px86_destroy(Emulator* emu);
+
+/* メモリを 0 にして、レジスタを起動時の値(EIP, ESP が 0x7c00)に戻す */
+void px86_reset(Emulator* emu);
+
+/* ファイルの内容を address 番地から読み込む
+ *
+ * メモリの終わりまでに入る分だけ読み込み、読み込んだバイト数を返す。
+ * 開けなければ -1 を返す。
+ */
+long px86_load(Emulator* emu, const char* filename, uint32_t address);
+
+/* メモリの address 番地から size バイトを読み書きする
+ *
+ * メモリの外にかかるときは何もせずに -1 を返す。
+ */
+int px86_read_memory(Emulator* emu, uint32_t address, void* buffer, size_t size);
+int px86_write_memory(Emulator* emu, uint32_t address, const void* buffer, size_t size);
+
+void px86_get_registers(Emulator* emu, PX86Registers* regs);
+void px86_set_registers(Emulator* emu, const PX86Registers* regs);
+
+/* 今までに実行した命令数 */
+uint64_t px86_retired(Emulator* emu);
+
+/* メモリの外にアクセスして PX86_FAULT で止まったときのアドレス */
+uint32_t px86_fault_address(Emulator* emu);
+
+/* デバイスを start 番から count 個の I/O ポートに割り当てる
+ *
+ * 重なるポートは後から割り当てたデバイスが使われる。read, write が
+ * NULL なら読み込みは 0、書き込みは無視する。割り当てられなければ
+ * -1 を返す。
+ */
+int px86_map_io(Emulator* emu, uint16_t start, uint32_t count,
+                px86_io_read_t* read, px86_io_write_t* write, void* opaque);
+
+/* 止まる条件のどれかが成り立つまで実行し、止まった理由(PX86_*)を返す
+ *
+ * count 命令を実行する(0 なら数えない)、EIP が stop_address になる、
+ * timeout_ms ミリ秒が過ぎる(0 なら時間を見ない)のいずれかで止まる。
+ * 命令数と stop_address はちょうどで止まり、時間はおおよそで止まる。
+ *
+ * hlt で止まると、タイマーのイベントまでは仮想時間を進めて待たずに
+ * 続け、入力を待つときはホストのスレッドを眠らせる。割り込みが
+ * 来ることがなければ(IF が下りている、デバイスもイベントもない)
+ * PX86_HALTED を返す。
+ *
+ * count が 0 なら、jmp $ や LSR を読み続けるループのように何かが変わる
+ * まで同じことを繰り返すループも hlt と同じように待つ。抜けることが
+ * なければ、timeout_ms が 0 なら PX86_HALTED、そうでなければ時間が
+ * 過ぎるまで眠って PX86_TIMEOUT を返す。
+ */
+int px86_run(Emulator* emu, uint64_t count, uint32_t stop_address,
+             uint32_t timeout_ms);
+
+/* 1命令だけ実行する(px86_run(emu, 1, PX86_NO_STOP, 0) と同じ) */
+int px86_step(Emulator* emu);
+
+#endif
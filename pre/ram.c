@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ram.h"
+
+/* 現在実行中のエミュレータと、フォルト時の戻り先 */
+static __thread Emulator* fault_emu;
+static __thread sigjmp_buf* fault_jmp;
+
+void raise_guest_fault(Emulator* emu, uint32_t address)
+{
+    emu->fault_address = address;
+
+    if (fault_emu != emu || fault_jmp == NULL) {
+        printf("\n\nGuest Fault: address = %08x\n", address);
+        exit(1);
+    }
+
+    siglongjmp(*fault_jmp, 1);
+}
+
+#ifdef RAM_GUARD_PAGES
+
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* 予約する仮想アドレスの大きさ
+ * 4GB の末尾をまたぐアクセスや命令の先読みもガードページに収まるようにする */
+#define RAM_RESERVE_SIZE (((size_t)1 << 32) + 0x10000)
+
+uint8_t* create_ram(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint8_t* memory;
+
+    memory = mmap(NULL, RAM_RESERVE_SIZE, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    size = (size + page - 1) / page * page;
+    if (mprotect(memory, size, PROT_READ | PROT_WRITE) != 0) {
+        munmap(memory, RAM_RESERVE_SIZE);
+        return NULL;
+    }
+
+    return memory;
+}
+
+void destroy_ram(uint8_t* memory, size_t size)
+{
+    munmap(memory, RAM_RESERVE_SIZE);
+}
+
+/* ハンドラを入れる前の SIGSEGV, SIGBUS の動作(ライブラリを組み込んだ
+ * アプリケーションのハンドラなど) */
+static struct sigaction previous_segv;
+static struct sigaction previous_bus;
+static pthread_once_t install_once = PTHREAD_ONCE_INIT;
+
+static void fault_handler(int sig, siginfo_t* info, void* context)
+{
+    uint8_t* address = info->si_addr;
+    Emulator* emu = fault_emu;
+
+    if (emu == NULL || address < emu->memory ||
+        address >= emu->memory + RAM_RESERVE_SIZE) {
+        /* ゲストのメモリ以外でのフォルトはホストのバグなので、前のハンドラに
+         * 渡すか、なければ通常通り落とす(戻ると同じ命令でもう一度起きる) */
+        struct sigaction* previous = sig == SIGBUS ? &previous_bus : &previous_segv;
+
+        if (previous->sa_flags & SA_SIGINFO) {
+            previous->sa_sigaction(sig, info, context);
+        } else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+            previous->sa_handler(sig);
+        } else {
+            signal(sig, SIG_DFL);
+        }
+        return;
+    }
+
+    emu->fault_address = (uint32_t)(address - emu->memory);
+    siglongjmp(*fault_jmp, 1);
+}
+
+static void install_fault_handler(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fault_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &previous_segv);
+    sigaction(SIGBUS, &sa, &previous_bus);
+}
+
+void catch_guest_fault(Emulator* emu, sigjmp_buf* jmp)
+{
+    pthread_once(&install_once, install_fault_handler);
+
+    fault_emu = emu;
+    fault_jmp = jmp;
+}
+
+#else
+
+uint8_t* create_ram(size_t size)
+{
+    return calloc(1, size);
+}
+
+void destroy_ram(uint8_t* memory, size_t size)
+{
+    free(memory);
+}
+
+void catch_guest_fault(Emulator* emu, sigjmp_buf* jmp)
+{
+    fault_emu = emu;
+    fault_jmp = jmp;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef RAM_H_
+#define RAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+
+#include "emulator.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+/* ゲストのメモリの外側をガードページで保護できる */
+#define RAM_GUARD_PAGES
+#else
+typedef jmp_buf sigjmp_buf;
+#define sigsetjmp(env, savemask) setjmp(env)
+#define siglongjmp(env, val) longjmp(env, val)
+#endif
+
+/* ゲストのメモリを確保する
+ *
+ * RAM_GUARD_PAGES のときは 32bit のアドレス空間全体(4GB)と少しの余白を
+ * 仮想アドレスとして予約し、先頭 size バイトだけを読み書きできるようにする。
+ * 残りはアクセスできない(PROT_NONE)ので、ゲストがメモリの外を読み書き
+ * してもホストのメモリを壊さない。実際のページは最初に触れたときに
+ * 割り当てられる。
+ */
+uint8_t* create_ram(size_t size);
+void destroy_ram(uint8_t* memory, size_t size);
+
+/* ゲストのメモリの外へのアクセスを捕まえる
+ *
+ * 以降、emu->memory の予約領域内で SIGSEGV が起きると、アクセスした
+ * ゲストのアドレスを emu->fault_address にセットして jmp に siglongjmp する。
+ * emu が NULL なら捕まえるのをやめる。
+ *
+ * 最初の呼び出しでプロセス全体の SIGSEGV, SIGBUS のハンドラを入れる。
+ * 予約領域の外でのフォルトは、入れる前にあったハンドラに渡す(なければ
+ * そのシグナルで終了する)。
+ */
+void catch_guest_fault(Emulator* emu, sigjmp_buf* jmp);
+
+/* ゲストのフォールトを起こす
+ *
+ * ページフォールトなど、エミュレータが検出したフォールトで使う。
+ * emu->fault_address に address をセットして catch_guest_fault の jmp に
+ * 戻る。捕まえていなければエミュレータを終了する。
+ */
+void raise_guest_fault(Emulator* emu, uint32_t address);
+
+#endif
@@ -0,0 +1,258 @@
+#include "scheduler.h"
+
+#include <stdlib.h>
+
+#include "emulator_function.h"
+
+void init_scheduler(Emulator* emu)
+{
+    emu->scheduler = calloc(1, sizeof(Scheduler));
+    emu->next_event = UINT64_MAX;
+}
+
+void destroy_scheduler(Emulator* emu)
+{
+    free(emu->scheduler);
+    emu->scheduler = NULL;
+    emu->next_event = UINT64_MAX;
+}
+
+/* a が b より先に実行するイベントか */
+static int earlier(const Event* a, const Event* b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void swap_events(Event* a, Event* b)
+{
+    Event t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void sift_up(Scheduler* scheduler, int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!earlier(&scheduler->heap[i], &scheduler->heap[parent])) {
+            break;
+        }
+        swap_events(&scheduler->heap[i], &scheduler->heap[parent]);
+        i = parent;
+    }
+}
+
+static void sift_down(Scheduler* scheduler, int i)
+{
+    for (;;) {
+        int left = i * 2 + 1;
+        int right = left + 1;
+        int first = i;
+
+        if (left < scheduler->count
+            && earlier(&scheduler->heap[left], &scheduler->heap[first])) {
+            first = left;
+        }
+        if (right < scheduler->count
+            && earlier(&scheduler->heap[right], &scheduler->heap[first])) {
+            first = right;
+        }
+        if (first == i) {
+            break;
+        }
+        swap_events(&scheduler->heap[i], &scheduler->heap[first]);
+        i = first;
+    }
+}
+
+/* i 番目のイベントを取り除く */
+static void remove_event(Scheduler* scheduler, int i)
+{
+    scheduler->count--;
+    if (i == scheduler->count) {
+        return;
+    }
+    scheduler->heap[i] = scheduler->heap[scheduler->count];
+    sift_down(scheduler, i);
+    sift_up(scheduler, i);
+}
+
+static void update_next_event(Emulator* emu)
+{
+    Scheduler* scheduler = emu->scheduler;
+    uint64_t time;
+
+    if (scheduler->count == 0) {
+        emu->next_event = UINT64_MAX;
+        return;
+    }
+
+    time = scheduler->heap[0].time;
+    emu->next_event = time > emu->idle_time ? time - emu->idle_time : 0;
+}
+
+void clear_events(Emulator* emu)
+{
+    emu->scheduler->count = 0;
+    update_next_event(emu);
+}
+
+int schedule_event(Emulator* emu, uint64_t time, event_func_t* func, void* opaque)
+{
+    Scheduler* scheduler = emu->scheduler;
+    Event* event;
+
+    if (scheduler->count == SCHEDULER_MAX_EVENTS) {
+        return FALSE;
+    }
+
+    event = &scheduler->heap[scheduler->count];
+    event->time = time;
+    event->seq = scheduler->seq++;
+    event->func = func;
+    event->opaque = opaque;
+    sift_up(scheduler, scheduler->count++);
+
+    update_next_event(emu);
+    return TRUE;
+}
+
+void cancel_event(Emulator* emu, event_func_t* func, void* opaque)
+{
+    Scheduler* scheduler = emu->scheduler;
+    int i = 0;
+
+    while (i < scheduler->count) {
+        Event* event = &scheduler->heap[i];
+
+        if (event->func == func && event->opaque == opaque) {
+            remove_event(scheduler, i);
+            /* ヒープの並びが変わるので先頭から調べなおす */
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    update_next_event(emu);
+}
+
+void run_events(Emulator* emu)
+{
+    Scheduler* scheduler = emu->scheduler;
+
+    if (scheduler == NULL) {
+        emu->next_event = UINT64_MAX;
+        return;
+    }
+
+    while (scheduler->count > 0 && scheduler->heap[0].time <= virtual_time(emu)) {
+        Event event = scheduler->heap[0];
+
+        remove_event(scheduler, 0);
+        update_next_event(emu);
+        event.func(emu, event.opaque);
+    }
+
+    update_next_event(emu);
+}
+
+/* 割り込みを受け付けられるか */
+static int interrupt_ready(Emulator* emu)
+{
+    return (__atomic_load_n(&emu->irq_lines, __ATOMIC_SEQ_CST)
+            | __atomic_load_n(&emu->irq_pulses, __ATOMIC_SEQ_CST)) != 0;
+}
+
+int wait_for_interrupt(Emulator* emu, const struct timespec* deadline)
+{
+    int result = WAKE_INTERRUPT;
+
+    /* cli; hlt はどんな割り込みでも起きない */
+    if (!is_interrupt(emu)) {
+        return WAKE_NEVER;
+    }
+
+    /* 次のイベントまで仮想時間を進める(眠らずに済む) */
+    while (!interrupt_ready(emu) && emu->scheduler != NULL
+           && emu->scheduler->count > 0) {
+        uint64_t time = emu->scheduler->heap[0].time;
+
+        if (time > virtual_time(emu)) {
+            emu->idle_time += time - virtual_time(emu);
+        }
+        run_events(emu);
+    }
+
+    if (interrupt_ready(emu)) {
+        return WAKE_INTERRUPT;
+    }
+
+    /* 別のスレッドのデバイスが割り込みを要求するまで眠る */
+    pthread_mutex_lock(&emu->idle_mutex);
+    __atomic_store_n(&emu->sleeping, TRUE, __ATOMIC_SEQ_CST);
+    while (!interrupt_ready(emu)) {
+        if (__atomic_load_n(&emu->async_sources, __ATOMIC_SEQ_CST) == 0) {
+            result = WAKE_NEVER;
+            break;
+        }
+        if (deadline == NULL) {
+            pthread_cond_wait(&emu->idle_cond, &emu->idle_mutex);
+        } else if (pthread_cond_timedwait(&emu->idle_cond, &emu->idle_mutex,
+                                          deadline) != 0
+                   && !interrupt_ready(emu)) {
+            result = WAKE_TIMEOUT;
+            break;
+        }
+    }
+    __atomic_store_n(&emu->sleeping, FALSE, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&emu->idle_mutex);
+
+    return result;
+}
+
+/* 眠っている間に待つことが起きたか */
+static int changed(Emulator* emu, uint32_t wakeups)
+{
+    return (is_interrupt(emu) && interrupt_ready(emu))
+           || __atomic_load_n(&emu->wakeups, __ATOMIC_SEQ_CST) != wakeups;
+}
+
+int wait_for_change(Emulator* emu, uint32_t wakeups, const struct timespec* deadline)
+{
+    int result = WAKE_INTERRUPT;
+
+    /* 次のイベントまで仮想時間を進める(イベントで値が変わるかもしれない
+     * ので、1つ実行したらループに戻る) */
+    if (emu->scheduler != NULL && emu->scheduler->count > 0) {
+        uint64_t time = emu->scheduler->heap[0].time;
+
+        if (time > virtual_time(emu)) {
+            emu->idle_time += time - virtual_time(emu);
+        }
+        run_events(emu);
+        return WAKE_INTERRUPT;
+    }
+
+    pthread_mutex_lock(&emu->idle_mutex);
+    __atomic_store_n(&emu->sleeping, TRUE, __ATOMIC_SEQ_CST);
+    while (!changed(emu, wakeups)) {
+        if (deadline == NULL) {
+            if (__atomic_load_n(&emu->async_sources, __ATOMIC_SEQ_CST) == 0) {
+                result = WAKE_NEVER;
+                break;
+            }
+            pthread_cond_wait(&emu->idle_cond, &emu->idle_mutex);
+        } else if (pthread_cond_timedwait(&emu->idle_cond, &emu->idle_mutex,
+                                          deadline) != 0
+                   && !changed(emu, wakeups)) {
+            result = WAKE_TIMEOUT;
+            break;
+        }
+    }
+    __atomic_store_n(&emu->sleeping, FALSE, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&emu->idle_mutex);
+
+    return result;
+}
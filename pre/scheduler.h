@@ -0,0 +1,98 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include "emulator.h"
+
+/* 予約できるイベントの数 */
+#define SCHEDULER_MAX_EVENTS 64
+
+/* 仮想時間の1秒に実行する命令数
+ *
+ * エミュレータの時間は実行した命令数(emu->retired)で数え、デバイスは
+ * この値で実時間の周期を命令数に換算する。
+ */
+#define VIRTUAL_HZ 100000000ULL
+
+/* wait_for_interrupt, wait_for_change の結果 */
+#define WAKE_INTERRUPT 0 /* 割り込みを受け付けられる(状態が変わったかもしれない) */
+#define WAKE_NEVER     1 /* 割り込みも変化ももう来ない */
+#define WAKE_TIMEOUT   2 /* その前に deadline を過ぎた */
+
+/* 仮想時間(実行した命令数と、hlt などで進めた時間の和) */
+static inline uint64_t virtual_time(Emulator* emu)
+{
+    return emu->retired + emu->idle_time;
+}
+
+/* イベントの処理関数(仮想時間が予約した時刻を過ぎたときに呼ばれる) */
+typedef void event_func_t(Emulator* emu, void* opaque);
+
+typedef struct {
+    /* 実行する時刻(仮想時間) */
+    uint64_t time;
+
+    /* 同じ時刻のイベントを予約した順に実行するための通し番号 */
+    uint64_t seq;
+
+    event_func_t* func;
+    void* opaque;
+} Event;
+
+/* 時刻の早い順に取り出すイベントのキュー(二分ヒープ)
+ *
+ * 先頭の時刻は emu->retired に換算して emu->next_event に写しておき、
+ * 実行ループは emu->retired >= emu->next_event の1回の比較だけで調べる。
+ */
+typedef struct Scheduler {
+    Event heap[SCHEDULER_MAX_EVENTS];
+    int count;
+    uint64_t seq;
+} Scheduler;
+
+/* イベントのないスケジューラを作る */
+void init_scheduler(Emulator* emu);
+void destroy_scheduler(Emulator* emu);
+
+/* 予約したイベントを全て取り消す */
+void clear_events(Emulator* emu);
+
+/* time に func(emu, opaque) を呼ぶように予約する
+ *
+ * 予約が一杯なら FALSE を返す。
+ */
+int schedule_event(Emulator* emu, uint64_t time, event_func_t* func, void* opaque);
+
+/* func と opaque が同じイベントの予約を取り消す */
+void cancel_event(Emulator* emu, event_func_t* func, void* opaque);
+
+/* hlt で止まった CPU を割り込みを受け付けられるまで待たせる
+ *
+ * IF が立っていれば、予約したイベントの時刻まで仮想時間を進めて
+ * イベントを実行し、まだ割り込みがなければ他のスレッドのデバイスからの
+ * 要求をホストのスレッドを眠らせて待つ。IF が下りているか、イベントも
+ * 別のスレッドのデバイスもなければ WAKE_NEVER を返す。deadline が
+ * NULL でなければ、その時刻(CLOCK_REALTIME)を過ぎると WAKE_TIMEOUT を返す。
+ */
+int wait_for_interrupt(Emulator* emu, const struct timespec* deadline);
+
+/* ポーリングのループを実行する代わりに、読む値が変わりうるときまで待つ
+ *
+ * イベントがあれば次のイベントまで仮想時間を進めて実行する。なければ
+ * 割り込み(IF が立っているとき)か、emu->wakeups が wakeups から変わる
+ * (別のスレッドのデバイスの変化)まで眠る。何も来ることがなければ、
+ * deadline が NULL なら WAKE_NEVER を返し、そうでなければ deadline まで
+ * 眠って WAKE_TIMEOUT を返す。
+ */
+int wait_for_change(Emulator* emu, uint32_t wakeups, const struct timespec* deadline);
+
+/* 時刻を過ぎたイベントを時刻の順に実行する
+ *
+ * 実行ループで emu->retired >= emu->next_event のときに呼ぶ。処理関数の
+ * 中で新しく予約したイベントも、時刻を過ぎていれば続けて実行する。
+ */
+void run_events(Emulator* emu);
+
+#endif
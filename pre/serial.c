@@ -0,0 +1,396 @@
+#include "serial.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "emulator_function.h"
+#include "io.h"
+
+Serial* create_serial(int in_fd, int out_fd)
+{
+    Serial* serial = calloc(1, sizeof(Serial));
+
+    serial->in_fd = in_fd;
+    serial->out_fd = out_fd;
+    serial->line_mode = out_fd >= 0 && isatty(out_fd);
+
+    /* 入力がなければ最初から終わりとして扱う */
+    serial->eof = in_fd < 0;
+
+    pthread_mutex_init(&serial->mutex, NULL);
+    pthread_cond_init(&serial->cond, NULL);
+
+    return serial;
+}
+
+void destroy_serial(Serial* serial)
+{
+    if (serial->reader_started) {
+        pthread_mutex_lock(&serial->mutex);
+        serial->stopping = TRUE;
+        pthread_cond_broadcast(&serial->cond);
+        pthread_mutex_unlock(&serial->mutex);
+
+        /* 入力を待っている poll を起こす */
+        if (write(serial->stop_pipe[1], "", 1) < 0) {
+            perror("write");
+        }
+        pthread_join(serial->reader, NULL);
+        close(serial->stop_pipe[0]);
+        close(serial->stop_pipe[1]);
+    }
+
+    flush_serial(serial);
+    pthread_cond_destroy(&serial->cond);
+    pthread_mutex_destroy(&serial->mutex);
+    free(serial);
+}
+
+void flush_serial(Serial* serial)
+{
+    uint32_t written = 0;
+
+    if (serial->length == 0) {
+        return;
+    }
+
+    /* 出力先がなければ捨てる */
+    if (serial->out_fd < 0) {
+        serial->length = 0;
+        return;
+    }
+
+    /* 同じ出力先に stdio で書いたもの(px86 の表示)との順番を保つ */
+    if (serial->out_fd == STDOUT_FILENO) {
+        fflush(stdout);
+    }
+
+    while (written < serial->length) {
+        ssize_t n = write(serial->out_fd, serial->buffer + written,
+                          serial->length - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    serial->length = 0;
+}
+
+/* 割り込みの要因があれば IRQ を要求し、なければ取り下げる
+ *
+ * mutex を持って呼ぶ。
+ */
+static void update_irq(Serial* serial)
+{
+    int level = ((serial->ier & UART_IER_RX) && serial->fifo_count > 0)
+                || ((serial->ier & UART_IER_THR) && serial->thr_interrupt);
+
+    if (serial->emu == NULL) {
+        return;
+    }
+
+    if (level) {
+        raise_irq(serial->emu, serial->irq);
+    } else {
+        lower_irq(serial->emu, serial->irq);
+    }
+}
+
+/* in_fd から読んだデータを受信 FIFO に入れるスレッド */
+static void* reader_main(void* arg)
+{
+    Serial* serial = arg;
+    struct pollfd fds[2];
+
+    fds[0].fd = serial->in_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = serial->stop_pipe[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        uint8_t data[SERIAL_FIFO_SIZE];
+        uint32_t space;
+        int stopping;
+        ssize_t n;
+        uint32_t i;
+
+        /* FIFO に空きができるまで待つ */
+        pthread_mutex_lock(&serial->mutex);
+        while (serial->fifo_count == SERIAL_FIFO_SIZE && !serial->stopping) {
+            pthread_cond_wait(&serial->cond, &serial->mutex);
+        }
+        space = SERIAL_FIFO_SIZE - serial->fifo_count;
+        stopping = serial->stopping;
+        pthread_mutex_unlock(&serial->mutex);
+
+        if (stopping) {
+            break;
+        }
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            n = -1;
+        } else if (fds[1].revents != 0) {
+            break;
+        } else {
+            n = read(serial->in_fd, data, space);
+        }
+
+        pthread_mutex_lock(&serial->mutex);
+        if (n <= 0) {
+            serial->eof = TRUE;
+        }
+        for (i = 0; i < (uint32_t)(n > 0 ? n : 0); i++) {
+            uint32_t tail = (serial->fifo_head + serial->fifo_count) % SERIAL_FIFO_SIZE;
+
+            serial->fifo[tail] = data[i];
+            serial->fifo_count++;
+        }
+        update_irq(serial);
+        pthread_cond_broadcast(&serial->cond);
+        pthread_mutex_unlock(&serial->mutex);
+
+        if (n <= 0) {
+            break;
+        }
+
+        /* LSR をポーリングして眠っている CPU に知らせる */
+        if (serial->emu != NULL) {
+            wake_emulator(serial->emu);
+        }
+    }
+
+    /* もう割り込みを要求しないので、hlt で待っている CPU に知らせる */
+    if (serial->emu != NULL) {
+        __atomic_fetch_sub(&serial->emu->async_sources, 1, __ATOMIC_SEQ_CST);
+        wake_emulator(serial->emu);
+    }
+
+    return NULL;
+}
+
+/* ゲストが受信側を使い始めたら読み込み用のスレッドを起動する */
+static void start_reader(Serial* serial)
+{
+    if (serial->reader_started || serial->in_fd < 0) {
+        return;
+    }
+
+    if (pipe(serial->stop_pipe) != 0) {
+        /* 入力なしとして扱う */
+        serial->eof = TRUE;
+        return;
+    }
+
+    if (serial->emu != NULL) {
+        __atomic_fetch_add(&serial->emu->async_sources, 1, __ATOMIC_SEQ_CST);
+    }
+    if (pthread_create(&serial->reader, NULL, reader_main, serial) != 0) {
+        if (serial->emu != NULL) {
+            __atomic_fetch_sub(&serial->emu->async_sources, 1, __ATOMIC_SEQ_CST);
+        }
+        close(serial->stop_pipe[0]);
+        close(serial->stop_pipe[1]);
+        serial->eof = TRUE;
+        return;
+    }
+    serial->reader_started = TRUE;
+}
+
+/* 受信 FIFO から1バイト取り出す(空なら届くまで待つ) */
+static uint8_t receive(Serial* serial)
+{
+    uint8_t value = 0xff;
+
+    /* プロンプトを表示してから待つ */
+    flush_serial(serial);
+    start_reader(serial);
+
+    pthread_mutex_lock(&serial->mutex);
+    while (serial->fifo_count == 0 && !serial->eof) {
+        pthread_cond_wait(&serial->cond, &serial->mutex);
+    }
+    if (serial->fifo_count > 0) {
+        value = serial->fifo[serial->fifo_head];
+        serial->fifo_head = (serial->fifo_head + 1) % SERIAL_FIFO_SIZE;
+        serial->fifo_count--;
+
+        /* 次に読む値は変わるかもしれない */
+        if (serial->emu != NULL) {
+            serial->emu->unstable_reads++;
+        }
+    }
+    update_irq(serial);
+    pthread_cond_broadcast(&serial->cond);
+    pthread_mutex_unlock(&serial->mutex);
+
+    return value;
+}
+
+static void transmit(Serial* serial, uint8_t value)
+{
+    serial->buffer[serial->length++] = value;
+
+    if (serial->length == SERIAL_BUFFER_SIZE
+        || (serial->line_mode && value == '\n')) {
+        flush_serial(serial);
+    }
+
+    /* 送信はすぐに終わり、THR はまた空く */
+    pthread_mutex_lock(&serial->mutex);
+    serial->thr_interrupt = TRUE;
+    update_irq(serial);
+    pthread_mutex_unlock(&serial->mutex);
+}
+
+static uint8_t read_iir(Serial* serial)
+{
+    uint8_t iir = UART_IIR_NONE;
+
+    pthread_mutex_lock(&serial->mutex);
+    if ((serial->ier & UART_IER_RX) && serial->fifo_count > 0) {
+        iir = UART_IIR_RX;
+    } else if ((serial->ier & UART_IER_THR) && serial->thr_interrupt) {
+        /* THR の割り込みは IIR で読むと消える */
+        iir = UART_IIR_THR;
+        serial->thr_interrupt = FALSE;
+        update_irq(serial);
+    }
+    pthread_mutex_unlock(&serial->mutex);
+
+    return iir | UART_IIR_FIFO;
+}
+
+static uint8_t read_lsr(Serial* serial)
+{
+    uint8_t lsr = UART_LSR_THRE | UART_LSR_TEMT;
+
+    start_reader(serial);
+
+    pthread_mutex_lock(&serial->mutex);
+    if (serial->fifo_count > 0) {
+        lsr |= UART_LSR_DR;
+    }
+    pthread_mutex_unlock(&serial->mutex);
+
+    /* 入力を待っているゲストのプロンプトを表示する */
+    if (!(lsr & UART_LSR_DR)) {
+        flush_serial(serial);
+    }
+    return lsr;
+}
+
+static uint32_t serial_read(void* opaque, uint16_t offset, int size)
+{
+    Serial* serial = opaque;
+
+    switch (offset) {
+    case UART_DATA:
+        if (serial->lcr & UART_LCR_DLAB) {
+            return serial->divisor & 0xff;
+        }
+        return receive(serial);
+    case UART_IER:
+        if (serial->lcr & UART_LCR_DLAB) {
+            return serial->divisor >> 8;
+        }
+        return serial->ier;
+    case UART_IIR:
+        return read_iir(serial);
+    case UART_LCR:
+        return serial->lcr;
+    case UART_MCR:
+        return serial->mcr;
+    case UART_LSR:
+        return read_lsr(serial);
+    case UART_MSR:
+        /* CTS, DSR, DCD が立っている */
+        return 0xb0;
+    case UART_SCR:
+        return serial->scr;
+    default:
+        return 0xff;
+    }
+}
+
+static void write_ier(Serial* serial, uint8_t value)
+{
+    if (value & UART_IER_RX) {
+        start_reader(serial);
+    }
+
+    pthread_mutex_lock(&serial->mutex);
+    /* THR の割り込みを許可したときは、THR が空いているのですぐに割り込む */
+    if ((value & UART_IER_THR) && !(serial->ier & UART_IER_THR)) {
+        serial->thr_interrupt = TRUE;
+    }
+    serial->ier = value & 0x0f;
+    update_irq(serial);
+    pthread_mutex_unlock(&serial->mutex);
+}
+
+static void write_fcr(Serial* serial, uint8_t value)
+{
+    if (!(value & UART_FCR_CLEAR_RX)) {
+        return;
+    }
+
+    pthread_mutex_lock(&serial->mutex);
+    serial->fifo_count = 0;
+    update_irq(serial);
+    pthread_cond_broadcast(&serial->cond);
+    pthread_mutex_unlock(&serial->mutex);
+}
+
+static void serial_write(void* opaque, uint16_t offset, uint32_t value, int size)
+{
+    Serial* serial = opaque;
+
+    switch (offset) {
+    case UART_DATA:
+        if (serial->lcr & UART_LCR_DLAB) {
+            serial->divisor = (serial->divisor & 0xff00) | (value & 0xff);
+        } else {
+            transmit(serial, value);
+        }
+        break;
+    case UART_IER:
+        if (serial->lcr & UART_LCR_DLAB) {
+            serial->divisor = (serial->divisor & 0x00ff) | (value & 0xff) << 8;
+        } else {
+            write_ier(serial, value);
+        }
+        break;
+    case UART_IIR:
+        write_fcr(serial, value);
+        break;
+    case UART_LCR:
+        serial->lcr = value;
+        break;
+    case UART_MCR:
+        serial->mcr = value;
+        break;
+    case UART_SCR:
+        serial->scr = value;
+        break;
+    }
+}
+
+int map_serial(Emulator* emu, Serial* serial, uint16_t port, int irq)
+{
+    serial->emu = emu;
+    serial->irq = irq;
+    if (!map_io_ports(emu, port, UART_PORTS_COUNT, serial_read, serial_write, serial)) {
+        return FALSE;
+    }
+
+    /* 状態は CPU の読み書きか、wake_emulator を呼ぶ読み込み用のスレッドでしか
+     * 変わらない */
+    set_io_pollable(emu, port);
+    return TRUE;
+}
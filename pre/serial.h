@@ -0,0 +1,122 @@
+#ifndef SERIAL_H_
+#define SERIAL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emulator.h"
+
+/* 出力をまとめて書き出すバッファの大きさ */
+#define SERIAL_BUFFER_SIZE 4096
+
+/* 受信 FIFO の大きさ(16550 と同じ) */
+#define SERIAL_FIFO_SIZE 16
+
+/* COM1 の I/O ポートと IRQ */
+#define SERIAL_COM1_PORT 0x03f8
+#define SERIAL_COM1_IRQ 4
+
+/* レジスタ(ポートの先頭からの位置) */
+#define UART_DATA 0 /* 読み込み: RBR(受信), 書き込み: THR(送信) */
+#define UART_IER  1 /* 割り込みの許可 */
+#define UART_IIR  2 /* 読み込み: 割り込みの要因, 書き込み: FCR(FIFO の制御) */
+#define UART_LCR  3 /* 回線の設定(bit 7 が立っていると 0, 1 は分周比) */
+#define UART_MCR  4
+#define UART_LSR  5 /* 回線の状態 */
+#define UART_MSR  6
+#define UART_SCR  7
+#define UART_PORTS_COUNT 8
+
+#define UART_IER_RX  (1 << 0) /* 受信データがあれば割り込む */
+#define UART_IER_THR (1 << 1) /* 送信レジスタが空いたら割り込む */
+
+#define UART_IIR_NONE 0x01 /* 割り込みなし */
+#define UART_IIR_THR  0x02
+#define UART_IIR_RX   0x04
+#define UART_IIR_FIFO 0xc0 /* FIFO が有効 */
+
+#define UART_FCR_CLEAR_RX (1 << 1)
+
+#define UART_LCR_DLAB (1 << 7)
+
+#define UART_LSR_DR   (1 << 0) /* 受信データがある */
+#define UART_LSR_THRE (1 << 5) /* 送信レジスタが空いている */
+#define UART_LSR_TEMT (1 << 6) /* 送信が終わっている */
+
+/* ホストのファイルディスクリプタにつないだ 16550 互換のシリアルポート
+ *
+ * ゲストの出力はバッファにためておき、次のときに1回の write で書き出す。
+ * 送信はすぐに終わったことにするので、LSR の THRE は常に立っている。
+ * - バッファが一杯になった
+ * - 行単位のモードで改行を出力した
+ * - ゲストが入力を読もうとした(プロンプトを先に表示する)
+ * - flush_serial を呼んだ(実行を終えたとき)
+ *
+ * 入力はゲストが初めて受信側のレジスタに触れたときに起動する読み込み用の
+ * スレッドが受信 FIFO に入れ、CPU のループを止めない。FIFO が一杯の間は
+ * スレッドが読み込みを待つ。IER で許可していれば、受信データがある間
+ * IRQ(COM1 なら 4)を要求する。
+ *
+ * FIFO が空のときに RBR を読むと、届くまで待つ(LSR を見ずに読む古い
+ * ゲストのため)。入力の終わりの後は 0xff を返す。
+ *
+ * LSR をポーリングするループは入力が届くまで CPU を眠らせてよい
+ * (set_io_pollable)。
+ */
+typedef struct Serial {
+    /* 割り込みを要求する先(map_serial で決まる) */
+    Emulator* emu;
+    int irq;
+
+    int in_fd;
+    int out_fd;
+
+    /* 改行ごとに書き出すか */
+    int line_mode;
+
+    uint32_t length;
+    uint8_t buffer[SERIAL_BUFFER_SIZE];
+
+    /* レジスタ */
+    uint8_t ier;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t scr;
+    uint16_t divisor;
+
+    /* 送信レジスタが空いたことをまだ IIR で知らせていない */
+    int thr_interrupt;
+
+    /* 受信 FIFO(以下は mutex で守る) */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t fifo[SERIAL_FIFO_SIZE];
+    uint32_t fifo_head;
+    uint32_t fifo_count;
+    int eof;
+
+    /* 読み込み用のスレッドと、止めるためのパイプ */
+    int reader_started;
+    int stopping;
+    pthread_t reader;
+    int stop_pipe[2];
+} Serial;
+
+/* シリアルポートを作る
+ *
+ * out_fd が端末なら行単位のモードにする。
+ * in_fd が負なら入力はなく(受信は常に終わり)、out_fd が負なら出力は捨てる。
+ */
+Serial* create_serial(int in_fd, int out_fd);
+
+/* 読み込み用のスレッドを止め、バッファに残っている出力を書き出してから
+ * 破棄する */
+void destroy_serial(Serial* serial);
+
+/* バッファに残っている出力を書き出す */
+void flush_serial(Serial* serial);
+
+/* serial を port 番からの I/O ポートに割り当て、割り込みは irq で要求する */
+int map_serial(Emulator* emu, Serial* serial, uint16_t port, int irq);
+
+#endif
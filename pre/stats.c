@@ -0,0 +1,97 @@
+#include "stats.h"
+
+#ifdef OPCODE_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if !defined(__x86_64__) && !defined(__i386__)
+/* rdtsc のないホストではナノ秒で数える */
+uint64_t stats_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+uint16_t stats_index(uint8_t opecode, uint8_t opecode2, uint8_t reg)
+{
+    switch (opecode) {
+    case 0x0F:
+        return STATS_TWO_BYTE + opecode2;
+    case 0x83:
+        return STATS_GROUP + 0 * 8 + reg;
+    case 0xF7:
+        return STATS_GROUP + 1 * 8 + reg;
+    case 0xFF:
+        return STATS_GROUP + 2 * 8 + reg;
+    default:
+        return opecode;
+    }
+}
+
+/* 集計の番号を "83 /7" や "0F 20" の形の名前にする */
+static void stats_name(int index, char* buffer, size_t size)
+{
+    static const uint8_t groups[] = { 0x83, 0xF7, 0xFF };
+
+    if (index >= STATS_GROUP) {
+        index -= STATS_GROUP;
+        snprintf(buffer, size, "%02X /%d", groups[index / 8], index % 8);
+    } else if (index >= STATS_TWO_BYTE) {
+        snprintf(buffer, size, "0F %02X", index - STATS_TWO_BYTE);
+    } else {
+        snprintf(buffer, size, "%02X", index);
+    }
+}
+
+static int compare_cycles(const void* a, const void* b)
+{
+    const OpcodeStats* x = *(const OpcodeStats* const*)a;
+    const OpcodeStats* y = *(const OpcodeStats* const*)b;
+
+    return x->cycles < y->cycles ? 1 : x->cycles > y->cycles ? -1 : 0;
+}
+
+void dump_opcode_stats(const OpcodeStats* stats)
+{
+    const OpcodeStats* order[STATS_SIZE];
+    uint64_t count = 0;
+    uint64_t cycles = 0;
+    int n = 0;
+    int i;
+
+    for (i = 0; i < STATS_SIZE; i++) {
+        if (stats[i].count > 0) {
+            order[n++] = &stats[i];
+            count += stats[i].count;
+            cycles += stats[i].cycles;
+        }
+    }
+
+    if (n == 0) {
+        return;
+    }
+
+    qsort(order, n, sizeof(order[0]), compare_cycles);
+
+    printf("--- opcode stats ---\n");
+    printf("%-6s %14s %16s %6s %8s\n", "opcode", "count", "cycles", "%", "cyc/op");
+    for (i = 0; i < n; i++) {
+        char name[16];
+
+        stats_name(order[i] - stats, name, sizeof(name));
+        printf("%-6s %14llu %16llu %6.2f %8.1f\n", name,
+               (unsigned long long)order[i]->count,
+               (unsigned long long)order[i]->cycles,
+               cycles ? 100.0 * order[i]->cycles / cycles : 0.0,
+               (double)order[i]->cycles / order[i]->count);
+    }
+    printf("%-6s %14llu %16llu\n", "total",
+           (unsigned long long)count, (unsigned long long)cycles);
+}
+
+#endif
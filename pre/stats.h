@@ -0,0 +1,65 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/* 命令ごとの実行回数とホストのサイクル数の集計
+ *
+ * OPCODE_STATS を定義してビルドしたときだけ集計する。定義しなければ
+ * STATS_* マクロは空になり、実行のコードには何も残らない。
+ */
+
+#include <stdint.h>
+
+/* 集計の番号
+ *
+ * 0x000-0x0FF: 1バイトの命令(オペコード)
+ * 0x100-0x1FF: 0x0F で始まる2バイトの命令(2バイト目)
+ * 0x200-     : ModR/M の reg で命令が決まるグループ(83, F7, FF の順に8つずつ)
+ */
+#define STATS_TWO_BYTE 0x100
+#define STATS_GROUP    0x200
+#define STATS_SIZE     (STATS_GROUP + 3 * 8)
+
+#ifdef OPCODE_STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define stats_clock() __rdtsc()
+#else
+uint64_t stats_clock(void);
+#endif
+
+typedef struct {
+    /* 実行した回数(融合した比較と条件分岐は比較命令の1回と数える) */
+    uint64_t count;
+
+    /* 実行関数で使ったホストのサイクル数 */
+    uint64_t cycles;
+} OpcodeStats;
+
+/* opecode(0x0F なら opecode2)と ModR/M の reg から集計の番号を求める */
+uint16_t stats_index(uint8_t opecode, uint8_t opecode2, uint8_t reg);
+
+/* stats(STATS_SIZE 個)の集計をサイクル数の多い順に標準出力に出力する */
+void dump_opcode_stats(const OpcodeStats* stats);
+
+/* 計測の開始時刻を t に入れる */
+#define STATS_START(t) uint64_t t = stats_clock()
+
+/* t から今までを insn の命令の分として emu の集計に数え、t を今の時刻にする */
+#define STATS_COUNT(emu, insn, t) \
+    do { \
+        uint64_t stats_now = stats_clock(); \
+        OpcodeStats* stats = &(emu)->opcode_stats[(insn)->stats]; \
+        stats->count++; \
+        stats->cycles += stats_now - (t); \
+        (t) = stats_now; \
+    } while (0)
+
+#else
+
+#define STATS_START(t)
+#define STATS_COUNT(emu, insn, t)
+
+#endif
+
+#endif
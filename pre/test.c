@@ -1,10 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "emulator.h"
 #include "emulator_function.h"
 #include "instruction.h"
 #include "modrm.h"
+#include "block.h"
+#include "ram.h"
+#include "bus.h"
+#include "mmu.h"
+#include "trace.h"
+#include "profile.h"
+#include "stats.h"
+#include "io.h"
+#include "serial.h"
+#include "scheduler.h"
+#include "pit.h"
+#include "px86.h"
 
 #ifdef COLORED
 #define ESC(e) "\x1b[" e "m"
@@ -53,10 +70,13 @@ static void print_result(void)
 #define SF (1u << 7)
 #define OF (1u << 11)
 
+static InstructionSet isa;
 uint8_t emu_buf[sizeof(Emulator) + 1024 * 1024];
 static Emulator* init_emu()
 {
     Emulator* emu = (Emulator*)emu_buf;
+    memset(emu, 0, sizeof(Emulator));
+    emu->isa = &isa;
     emu->memory = emu_buf + sizeof(Emulator);
     memset(emu->memory, 0, sizeof(emu_buf) - sizeof(Emulator));
     memset(emu->registers, 0, sizeof(uint32_t) * REGISTERS_COUNT);
@@ -122,9 +142,92 @@ void test_parse_modrm(void)
     assert(modrm.rm == 4);
     assert(modrm.sib == 0x8b); // [4 * ecx + ebx]
     assert(modrm.disp32 == 512);
+    assert(modrm.base == EBX);
+    assert(modrm.index == ECX);
+    assert(modrm.shift == 2);
+    assert(modrm.disp == 512);
     assert(emu->eip == eip0 + 6);
 }
 
+void test_sib(void)
+{
+    Emulator* emu;
+    ModRM modrm;
+    Block* block;
+    uint32_t eip0;
+    uint32_t i;
+
+    emu = init_emu();
+    eip0 = emu->eip;
+    emu->registers[EAX] = 0x10;
+    emu->registers[EBX] = 0x300;
+    emu->registers[ECX] = 3;
+    emu->registers[ESP] = 0x7000;
+    emu->registers[EBP] = 0x500;
+
+    /* [ebx + ecx * 4] */
+    memcpy(emu->memory + emu->eip, "\x04\x8b", 2);
+    parse_modrm(emu, &modrm);
+    assert(calc_memory_address(emu, &modrm) == 0x30c);
+    assert(emu->eip == eip0 + 2);
+
+    /* [esp + 8](インデックスなし) */
+    memcpy(emu->memory + emu->eip, "\x44\x24\x08", 3);
+    parse_modrm(emu, &modrm);
+    assert(modrm.index == ZERO_REGISTER);
+    assert(calc_memory_address(emu, &modrm) == 0x7008);
+    assert(emu->eip == eip0 + 5);
+
+    /* [eax * 4 + 0x1000](mod = 0 で base = 5 ならベースなし) */
+    memcpy(emu->memory + emu->eip, "\x04\x85\x00\x10\x00\x00", 6);
+    parse_modrm(emu, &modrm);
+    assert(modrm.base == ZERO_REGISTER);
+    assert(calc_memory_address(emu, &modrm) == 0x1040);
+    assert(emu->eip == eip0 + 11);
+
+    /* [0x2000](ベースもインデックスもなし) */
+    memcpy(emu->memory + emu->eip, "\x04\x25\x00\x20\x00\x00", 6);
+    parse_modrm(emu, &modrm);
+    assert(calc_memory_address(emu, &modrm) == 0x2000);
+    assert(emu->eip == eip0 + 17);
+
+    /* [ebp + ebx * 4 - 16] */
+    memcpy(emu->memory + emu->eip, "\x6c\x9d\xf0", 3);
+    parse_modrm(emu, &modrm);
+    assert(calc_memory_address(emu, &modrm) == 0x500 + 0xc00 - 16);
+    assert(emu->eip == eip0 + 20);
+
+    /* 配列のループ(ENABLE_JIT なら変換したコードでも実行する)
+     * loop: mov edx, [ebx + ecx * 4]; add eax, edx; mov [edi + ecx * 4 + 4], eax;
+     *       inc ecx; cmp ecx, 100; jl loop */
+    emu = init_emu();
+    memcpy(emu->memory + emu->eip,
+           "\x8b\x14\x8b\x01\xd0\x89\x44\x8f\x04\x41\x83\xf9\x64\x7c\xf1\x42", 16);
+    for (i = 0; i < 100; i++) {
+        set_memory32(emu, 0x1000 + i * 4, i);
+    }
+    emu->registers[EBX] = 0x1000;
+    emu->registers[EDI] = 0x2000;
+    emu->block_cache = create_block_cache();
+
+    while (emu->eip != 0x7c0f) {
+        block = lookup_block(emu);
+        execute_block(emu, block);
+    }
+
+#ifdef ENABLE_JIT
+    assert(block->native != NULL);
+    assert(block->native_count == block->count);
+#endif
+    assert(emu->registers[EAX] == 4950);
+    assert(emu->registers[ECX] == 100);
+    assert(get_memory32(emu, 0x2004) == 0);
+    assert(get_memory32(emu, 0x2008) == 1);
+    assert(get_memory32(emu, 0x2000 + 100 * 4) == 4950);
+
+    destroy_block_cache(emu->block_cache);
+}
+
 void test_set_rm8(void)
 {
     Emulator* emu;
@@ -360,7 +463,7 @@ void test_01(void)
     emu->registers[EBP] = 0x104;
     emu->registers[EAX] = 5;
 
-    instructions[0x01](emu);
+    emu->isa->instructions[0x01](emu);
 
     assert(get_memory32(emu, 0x100) == 7);
     assert((emu->eflags & CF) == 0);
@@ -377,7 +480,7 @@ void test_01(void)
     emu->registers[EBP] = 0x104;
     emu->registers[EAX] = 0xe0000001;
 
-    instructions[0x01](emu);
+    emu->isa->instructions[0x01](emu);
 
     assert(get_memory32(emu, 0x100) == 0);
     assert((emu->eflags & CF) != 0);
@@ -399,7 +502,7 @@ void test_3b(void)
         emu->registers[EAX] = (a); \
         emu->registers[EBP] = 0x100; \
         set_memory32(emu, 0x100, (b)); \
-        instructions[0x3b](emu); \
+        emu->isa->instructions[0x3b](emu); \
         assert(((emu->eflags & CF) != 0) == (c)); \
         assert(((emu->eflags & ZF) != 0) == (z)); \
         assert(((emu->eflags & SF) != 0) == (s)); \
@@ -428,7 +531,7 @@ void test_3c(void)
         emu->memory[emu->eip + 0] = 0x3c; \
         emu->memory[emu->eip + 1] = (b); \
         emu->registers[EAX] = (a); \
-        instructions[0x3c](emu); \
+        emu->isa->instructions[0x3c](emu); \
         assert(((emu->eflags & CF) != 0) == (c)); \
         assert(((emu->eflags & ZF) != 0) == (z)); \
         assert(((emu->eflags & SF) != 0) == (s)); \
@@ -442,6 +545,7 @@ void test_3c(void)
     TEST_CMP(-3, -2, 1, 0, 1, 0);
     TEST_CMP(-3, -3, 0, 1, 0, 0);
     TEST_CMP(-3, -4, 0, 0, 0, 0);
+    TEST_CMP(0x80, 1, 0, 0, 0, 1);
 
 #undef TEST_CMP
 }
@@ -457,7 +561,7 @@ void test_3d(void)
         emu->memory[emu->eip + 0] = 0x3d; \
         set_memory32(emu, emu->eip + 1, (int32_t)(b)); \
         emu->registers[EAX] = (int32_t)(a); \
-        instructions[0x3d](emu); \
+        emu->isa->instructions[0x3d](emu); \
         assert(((emu->eflags & CF) != 0) == (c)); \
         assert(((emu->eflags & ZF) != 0) == (z)); \
         assert(((emu->eflags & SF) != 0) == (s)); \
@@ -483,7 +587,7 @@ void test_41(void)
     memcpy(emu->memory + emu->eip, "\x41", 1);
     emu->registers[ECX] = 41;
 
-    instructions[0x41](emu);
+    emu->isa->instructions[0x41](emu);
 
     assert(emu->registers[ECX] == 42);
     assert(emu->eip == 0x7c01);
@@ -497,7 +601,7 @@ void test_54(void)
     memcpy(emu->memory + emu->eip, "\x54", 1);
     emu->registers[ESP] = 0x7c00;
 
-    instructions[0x54](emu);
+    emu->isa->instructions[0x54](emu);
 
     assert(get_memory32(emu, 0x7bfc) == 0x7c00);
     assert(emu->registers[ESP] == 0x7bfc);
@@ -513,7 +617,7 @@ void test_5d(void)
     emu->registers[ESP] = 0x0600;
     set_memory32(emu, 0x0600, 0x12345678);
 
-    instructions[0x5d](emu);
+    emu->isa->instructions[0x5d](emu);
 
     assert(emu->registers[EBP] == 0x12345678);
     assert(emu->registers[ESP] == 0x0604);
@@ -528,7 +632,7 @@ void test_68(void)
     memcpy(emu->memory + emu->eip, "\x68\x78\x56\x34\x12", 5);
     emu->registers[ESP] = 0x7c00;
 
-    instructions[0x68](emu);
+    emu->isa->instructions[0x68](emu);
 
     assert(get_memory32(emu, 0x7bfc) == 0x12345678);
     assert(emu->registers[ESP] == 0x7bfc);
@@ -543,7 +647,7 @@ void test_6a(void)
     memcpy(emu->memory + emu->eip, "\x68\x29", 2);
     emu->registers[ESP] = 0x7c00;
 
-    instructions[0x6A](emu);
+    emu->isa->instructions[0x6A](emu);
 
     assert(get_memory32(emu, 0x7bfc) == 41);
     assert(emu->registers[ESP] == 0x7bfc);
@@ -558,7 +662,7 @@ void test_78(void)
     memcpy(emu->memory + emu->eip, "\x78\xf7", 2);
     emu->eflags = SF;
 
-    instructions[0x78](emu);
+    emu->isa->instructions[0x78](emu);
 
     assert(emu->eip == 0x7c02 - 9);
 }
@@ -571,7 +675,7 @@ void test_7c(void)
     memcpy(emu->memory + emu->eip, "\x7c\xf5", 2);
     emu->eflags = 0;
 
-    instructions[0x7c](emu);
+    emu->isa->instructions[0x7c](emu);
 
     assert(emu->eip == 0x7c02);
 
@@ -581,7 +685,7 @@ void test_7c(void)
     memcpy(emu->memory + emu->eip, "\x7c\xf5", 2);
     emu->eflags = OF;
 
-    instructions[0x7c](emu);
+    emu->isa->instructions[0x7c](emu);
 
     assert(emu->eip == 0x7c02 - 11);
 
@@ -591,7 +695,7 @@ void test_7c(void)
     memcpy(emu->memory + emu->eip, "\x7c\xf5", 2);
     emu->eflags = SF;
 
-    instructions[0x7c](emu);
+    emu->isa->instructions[0x7c](emu);
 
     assert(emu->eip == 0x7c02 - 11);
 
@@ -601,7 +705,7 @@ void test_7c(void)
     memcpy(emu->memory + emu->eip, "\x7c\xf5", 2);
     emu->eflags = SF | OF;
 
-    instructions[0x7c](emu);
+    emu->isa->instructions[0x7c](emu);
 
     assert(emu->eip == 0x7c02);
 }
@@ -614,7 +718,7 @@ void test_7e(void)
     memcpy(emu->memory + emu->eip, "\x78\xf3", 2);
     emu->eflags = ZF;
 
-    instructions[0x7e](emu);
+    emu->isa->instructions[0x7e](emu);
 
     assert(emu->eip == 0x7c02 - 13);
 }
@@ -629,19 +733,50 @@ void test_83(void)
     memcpy(emu->memory + emu->eip, "\x83\xc4\x08", 3);
     emu->registers[ESP] = 0x7bf0;
 
-    instructions[0x83](emu);
+    emu->isa->instructions[0x83](emu);
 
     assert(emu->registers[ESP] == 0x7bf8);
     assert(emu->eip == 0x7c03);
 
     emu = init_emu();
 
+    // add eax, byte 1 もフラグを更新する
+    memcpy(emu->memory + emu->eip, "\x83\xc0\x01", 3);
+    emu->registers[EAX] = 0xffffffff;
+
+    emu->isa->instructions[0x83](emu);
+
+    assert(emu->registers[EAX] == 0);
+    assert((emu->eflags & CF) != 0);
+    assert((emu->eflags & ZF) != 0);
+    assert((emu->eflags & SF) == 0);
+    assert((emu->eflags & OF) == 0);
+
+    // mov ecx, -100; loop: inc eax; add ecx, byte 1; jnz loop
+    // (ENABLE_JIT なら変換したコードでも実行する)
+    emu = init_emu();
+    memcpy(emu->memory + emu->eip, "\xb9\x9c\xff\xff\xff\x40\x83\xc1\x01\x75\xfa\x42", 12);
+    emu->block_cache = create_block_cache();
+
+    while (emu->eip != 0x7c0b) {
+        execute_block(emu, lookup_block(emu));
+    }
+
+    assert(emu->registers[EAX] == 100);
+    assert(emu->registers[ECX] == 0);
+    assert(is_zero(emu));
+    assert(is_carry(emu));
+
+    destroy_block_cache(emu->block_cache);
+
+    emu = init_emu();
+
     // sub dword [ebp+4], byte 41
     memcpy(emu->memory + emu->eip, "\x83\x6d\x04\x29", 4);
     emu->registers[EBP] = 0x100;
     set_memory32(emu, 0x104, 0xffffff2a);
 
-    instructions[0x83](emu);
+    emu->isa->instructions[0x83](emu);
 
     assert(get_memory32(emu, 0x104) == 0xffffff01);
     assert((emu->eflags & CF) == 0);
@@ -657,7 +792,7 @@ void test_83(void)
     emu->registers[EAX] = 0x100;
     set_memory32(emu, 0x100, 41);
 
-    instructions[0x83](emu);
+    emu->isa->instructions[0x83](emu);
 
     assert(get_memory32(emu, 0x100) == 0);
     assert((emu->eflags & CF) == 0);
@@ -676,7 +811,7 @@ void test_83(void)
         emu->memory[emu->eip + 2] = (b); \
         emu->registers[ESI] = 0x100; \
         set_memory32(emu, 0x100, (a)); \
-        instructions[0x83](emu); \
+        emu->isa->instructions[0x83](emu); \
         assert(((emu->eflags & CF) != 0) == (c)); \
         assert(((emu->eflags & ZF) != 0) == (z)); \
         assert(((emu->eflags & SF) != 0) == (s)); \
@@ -704,7 +839,7 @@ void test_88(void)
     emu->registers[EBP] = 0x104;
     emu->registers[ECX] = 0x12345678;
 
-    instructions[0x88](emu);
+    emu->isa->instructions[0x88](emu);
 
     assert(get_memory8(emu, 0x100) == 0x78);
     assert(emu->eip == 0x7c03);
@@ -719,7 +854,7 @@ void test_89(void)
     emu->registers[EBP] = 0x104;
     emu->registers[EBX] = 0x12345678;
 
-    instructions[0x89](emu);
+    emu->isa->instructions[0x89](emu);
 
     assert(get_memory32(emu, 0x100) == 0x12345678);
     assert(emu->eip == 0x7c03);
@@ -735,7 +870,7 @@ void test_8a(void)
     emu->registers[EBX] = 0x12345678;
     set_memory8(emu, 0x104, 0xfa);
 
-    instructions[0x8a](emu);
+    emu->isa->instructions[0x8a](emu);
 
     assert(emu->registers[EBX] == 0x1234fa78);
     assert(emu->eip == 0x7c03);
@@ -750,7 +885,7 @@ void test_8b(void)
     emu->registers[EBP] = 0x100;
     set_memory32(emu, 0x100, 41);
 
-    instructions[0x8b](emu);
+    emu->isa->instructions[0x8b](emu);
 
     assert(emu->registers[EAX] == 41);
     assert(emu->eip == 0x7c03);
@@ -763,7 +898,7 @@ void test_8b(void)
     emu->registers[ECX] = 0xfffc;
     set_memory32(emu, 0xfffc, 12);
 
-    instructions[0x8b](emu);
+    emu->isa->instructions[0x8b](emu);
 
     assert(emu->registers[EDI] == 12);
     assert(emu->eip == 0x7c02);
@@ -778,7 +913,7 @@ void test_8d(void)
     memcpy(emu->memory + emu->eip, "\x8d\x45\xfc", 3);
     emu->registers[EBP] = 0x7bfc;
 
-    instructions[0x8d](emu);
+    emu->isa->instructions[0x8d](emu);
 
     assert(emu->registers[EAX] == 0x7bf8);
     assert(emu->eip == 0x7c03);
@@ -792,7 +927,7 @@ void test_99(void)
     memcpy(emu->memory + emu->eip, "\x99", 1);
     emu->registers[EAX] = 0xffffffd7; // -41
 
-    instructions[0x99](emu);
+    emu->isa->instructions[0x99](emu);
 
     assert(emu->registers[EAX] == 0xffffffd7);
     assert(emu->registers[EDX] == 0xffffffff);
@@ -807,7 +942,7 @@ void test_a1(void)
     memcpy(emu->memory + emu->eip, "\xa1\x4e\x7c\x00\x00", 5);
     set_memory32(emu, 0x7c4e, 0x12345678);
 
-    instructions[0xa1](emu);
+    emu->isa->instructions[0xa1](emu);
 
     assert(emu->registers[EAX] == 0x12345678);
     assert(emu->eip == 0x7c05);
@@ -821,7 +956,7 @@ void test_a3(void)
     memcpy(emu->memory + emu->eip, "\xa3\x4e\x7c\x00\x00", 5);
     emu->registers[EAX] = 0x12345678;
 
-    instructions[0xa3](emu);
+    emu->isa->instructions[0xa3](emu);
 
     assert(get_memory32(emu, 0x7c4e) == 0x12345678);
     assert(emu->eip == 0x7c05);
@@ -835,7 +970,7 @@ void test_b4(void)
     memcpy(emu->memory + emu->eip, "\xb4\x60", 2);
     emu->registers[EAX] = 0x11111111;
 
-    instructions[0xb4](emu);
+    emu->isa->instructions[0xb4](emu);
 
     assert(emu->registers[EAX] == 0x11116011);
     assert(emu->eip == 0x7c02);
@@ -848,7 +983,7 @@ void test_bc(void)
     // mov esp, 0x0600
     memcpy(emu->memory + emu->eip, "\xbc\x00\x06\x00\x00", 5);
 
-    instructions[0xbc](emu);
+    emu->isa->instructions[0xbc](emu);
 
     assert(emu->registers[ESP] == 0x0600);
     assert(emu->eip == 0x7c05);
@@ -863,7 +998,7 @@ void test_c3(void)
     emu->registers[ESP] = 0x7bfc;
     set_memory32(emu, 0x7bfc, 0x0600);
 
-    instructions[0xc3](emu);
+    emu->isa->instructions[0xc3](emu);
 
     assert(emu->registers[ESP] == 0x7c00);
     assert(emu->eip == 0x0600);
@@ -877,7 +1012,7 @@ void test_c7(void)
     memcpy(emu->memory + emu->eip, "\xc7\x45\x20\x01\x02\x03\x04", 7);
     emu->registers[EBP] = 0x100;
 
-    instructions[0xc7](emu);
+    emu->isa->instructions[0xc7](emu);
 
     assert(get_memory32(emu, 0x120) == 0x04030201);
     assert(emu->eip == 0x7c07);
@@ -893,7 +1028,7 @@ void test_c9(void)
     emu->registers[EBP] = 0x7bf8;
     set_memory32(emu, 0x7bf8, 0x12345678);
 
-    instructions[0xc9](emu);
+    emu->isa->instructions[0xc9](emu);
 
     assert(emu->registers[ESP] == 0x7bfc);
     assert(emu->registers[EBP] == 0x12345678);
@@ -908,7 +1043,7 @@ void test_e8(void)
     memcpy(emu->memory + emu->eip, "\xe8\x0c\x00\x00\x00", 5);
     emu->registers[ESP] = 0x0600;
 
-    instructions[0xe8](emu);
+    emu->isa->instructions[0xe8](emu);
 
     assert(emu->registers[ESP] == 0x05fc);
     assert(get_memory32(emu, emu->registers[ESP]) == 0x7c05);
@@ -922,7 +1057,7 @@ void test_e9(void)
     // jmp near (offset +8)
     memcpy(emu->memory + emu->eip, "\xe9\x08\x00\x00\x00", 5);
 
-    instructions[0xe9](emu);
+    emu->isa->instructions[0xe9](emu);
 
     assert(emu->eip == 0x7c05 + 8);
 }
@@ -934,7 +1069,7 @@ void test_eb(void)
     // jmp near (offset +6)
     memcpy(emu->memory + emu->eip, "\xeb\x06", 2);
 
-    instructions[0xeb](emu);
+    emu->isa->instructions[0xeb](emu);
 
     assert(emu->eip == 0x7c02 + 6);
 }
@@ -950,7 +1085,7 @@ void test_f7(void)
     emu->registers[EAX] = 0x23456789;
     set_memory32(emu, 0x100, 128);
 
-    instructions[0xf7](emu);
+    emu->isa->instructions[0xf7](emu);
 
     assert(emu->registers[EAX] == 38177487);
     assert(emu->registers[EDX] == 9);
@@ -966,18 +1101,1908 @@ void test_ff(void)
     emu->registers[EBP] = 0x100;
     set_memory32(emu, 0xfc, 41);
 
-    instructions[0xff](emu);
+    emu->isa->instructions[0xff](emu);
 
     assert(get_memory32(emu, 0xfc) == 42);
     assert(emu->eip == 0x7c03);
+
+    // dec dword [ebp-4](CF は変えない)
+    memcpy(emu->memory + emu->eip, "\xff\x4d\xfc", 3);
+    set_memory32(emu, 0xfc, 1);
+    emu->eflags |= CF;
+
+    emu->isa->instructions[0xff](emu);
+
+    assert(get_memory32(emu, 0xfc) == 0);
+    assert((emu->eflags & ZF) != 0);
+    assert((emu->eflags & CF) != 0);
+    assert(emu->eip == 0x7c06);
+
+    // mov ecx, 100; loop: inc eax; dec ecx; jnz loop
+    // (ENABLE_JIT なら変換したコードでも実行する)
+    emu = init_emu();
+    memcpy(emu->memory + emu->eip, "\xb9\x64\x00\x00\x00\x40\xff\xc9\x75\xfb\x42", 11);
+    emu->eflags |= CF;
+    emu->block_cache = create_block_cache();
+
+    while (emu->eip != 0x7c0a) {
+        execute_block(emu, lookup_block(emu));
+    }
+
+    assert(emu->registers[EAX] == 100);
+    assert(emu->registers[ECX] == 0);
+    assert(is_zero(emu));
+    assert(is_carry(emu));
+
+    destroy_block_cache(emu->block_cache);
+
+    // inc dword [ebp-4](CF は変えない)
+    emu = init_emu();
+    memcpy(emu->memory + emu->eip, "\xff\x45\xfc", 3);
+    emu->registers[EBP] = 0x100;
+    set_memory32(emu, 0xfc, 0xffffffff);
+
+    emu->isa->instructions[0xff](emu);
+
+    assert(get_memory32(emu, 0xfc) == 0);
+    assert((emu->eflags & ZF) != 0);
+    assert((emu->eflags & CF) == 0);
+
+    // inc eax
+    memcpy(emu->memory + emu->eip, "\x40", 1);
+    emu->registers[EAX] = 0x7fffffff;
+
+    emu->isa->instructions[0x40](emu);
+
+    assert(emu->registers[EAX] == 0x80000000);
+    assert((emu->eflags & (OF | SF)) == (OF | SF));
+    assert((emu->eflags & (ZF | CF)) == 0);
+
+    // dec ebx
+    memcpy(emu->memory + emu->eip, "\x4b", 1);
+    emu->registers[EBX] = 1;
+    emu->eflags |= CF;
+
+    emu->isa->instructions[0x4b](emu);
+
+    assert(emu->registers[EBX] == 0);
+    assert((emu->eflags & (ZF | CF)) == (ZF | CF));
+    assert((emu->eflags & (OF | SF)) == 0);
+
+    // mov ebx, 0x100; inc dword [ebx]; jnz; mov ecx, -100; inc edx; inc ecx; jnz;
+    // mov eax, 100; dec eax; jnz(それぞれのループは inc, dec のフラグで抜ける)
+    emu = init_emu();
+    memcpy(emu->memory + emu->eip,
+           "\xbb\x00\x01\x00\x00\xff\x03\x75\xfc"
+           "\xb9\x9c\xff\xff\xff\x42\xff\xc1\x75\xfb"
+           "\xb8\x64\x00\x00\x00\x48\x75\xfd\x42", 28);
+    set_memory32(emu, 0x100, -100);
+    emu->eflags |= CF;
+    emu->block_cache = create_block_cache();
+
+    while (emu->eip != 0x7c1b) {
+        execute_block(emu, lookup_block(emu));
+    }
+
+    assert(get_memory32(emu, 0x100) == 0);
+    assert(emu->registers[ECX] == 0);
+    assert(emu->registers[EDX] == 100);
+    assert(emu->registers[EAX] == 0);
+    assert(is_zero(emu));
+    assert(is_carry(emu));
+
+    destroy_block_cache(emu->block_cache);
+}
+
+void test_alu(void)
+{
+    Emulator* emu = init_emu();
+
+    // xor eax, 0xedb88320
+    memcpy(emu->memory + emu->eip, "\x35\x20\x83\xb8\xed", 5);
+    emu->registers[EAX] = 0xedb88320;
+
+    emu->isa->instructions[0x35](emu);
+
+    assert(emu->registers[EAX] == 0);
+    assert((emu->eflags & ZF) != 0);
+    assert((emu->eflags & CF) == 0);
+    assert(emu->eip == 0x7c05);
+
+    emu = init_emu();
+
+    // and dword [ebp-4], 0xff00; sub ecx, eax
+    memcpy(emu->memory + emu->eip, "\x81\x65\xfc\x00\xff\x00\x00\x29\xc1", 9);
+    emu->registers[EBP] = 0x104;
+    emu->registers[EAX] = 2;
+    emu->registers[ECX] = 1;
+    set_memory32(emu, 0x100, 0x12345678);
+
+    emu->isa->instructions[0x81](emu);
+    assert(get_memory32(emu, 0x100) == 0x5600);
+
+    emu->isa->instructions[0x29](emu);
+    assert(emu->registers[ECX] == 0xffffffff);
+    assert((emu->eflags & CF) != 0);
+    assert((emu->eflags & SF) != 0);
+    assert(emu->eip == 0x7c09);
+
+    emu = init_emu();
+
+    // cmp dl, al; test al, al
+    memcpy(emu->memory + emu->eip, "\x38\xc2\x84\xc0", 4);
+    emu->registers[EAX] = 0x80;
+    emu->registers[EDX] = 0x7f;
+
+    emu->isa->instructions[0x38](emu);
+    assert((emu->eflags & CF) != 0);
+    assert((emu->eflags & OF) != 0);
+    assert((emu->eflags & SF) != 0);
+
+    emu->isa->instructions[0x84](emu);
+    assert((emu->eflags & CF) == 0);
+    assert((emu->eflags & OF) == 0);
+    assert((emu->eflags & SF) != 0);
+    assert((emu->eflags & ZF) == 0);
+
+    emu = init_emu();
+
+    // sbb eax, ebx(0 - 0xffffffff - 1 は借りがあって 0 になる)
+    memcpy(emu->memory + emu->eip, "\x1b\xc3", 2);
+    emu->registers[EAX] = 0;
+    emu->registers[EBX] = 0xffffffff;
+    emu->eflags |= CF;
+
+    emu->isa->instructions[0x1b](emu);
+    assert(emu->registers[EAX] == 0);
+    assert(is_zero(emu));
+    assert(is_carry(emu));
+
+    emu = init_emu();
+
+    // sbb eax, ebx(5 - 5 - 1 なので符号付きでも 5 < 5 + 1)
+    memcpy(emu->memory + emu->eip, "\x1b\xc3", 2);
+    emu->registers[EAX] = 5;
+    emu->registers[EBX] = 5;
+    emu->eflags |= CF;
+
+    emu->isa->instructions[0x1b](emu);
+    assert(emu->registers[EAX] == 0xffffffff);
+    assert(is_less(emu));
+    assert(is_less_or_equal(emu));
+}
+
+void test_shift(void)
+{
+    Emulator* emu = init_emu();
+
+    // shl eax, 13; shr eax, 1; sar edx, cl
+    memcpy(emu->memory + emu->eip, "\xc1\xe0\x0d\xd1\xe8\xd3\xfa", 7);
+    emu->registers[EAX] = 0x00080001;
+    emu->registers[ECX] = 4;
+    emu->registers[EDX] = 0x80000010;
+
+    emu->isa->instructions[0xc1](emu);
+    assert(emu->registers[EAX] == 0x00002000);
+    assert((emu->eflags & CF) != 0);
+
+    emu->isa->instructions[0xd1](emu);
+    assert(emu->registers[EAX] == 0x00001000);
+    assert((emu->eflags & CF) == 0);
+
+    emu->isa->instructions[0xd3](emu);
+    assert(emu->registers[EDX] == 0xf8000001);
+    assert((emu->eflags & SF) != 0);
+    assert(emu->eip == 0x7c07);
+}
+
+void test_imul(void)
+{
+    Emulator* emu = init_emu();
+
+    // imul eax, eax, 0x41c64e6d; imul eax, ecx; mul edx
+    memcpy(emu->memory + emu->eip,
+           "\x69\xc0\x6d\x4e\xc6\x41\x0f\xaf\xc1\xf7\xe2", 11);
+    emu->registers[EAX] = 3;
+    emu->registers[ECX] = -2;
+    emu->registers[EDX] = 0x10;
+
+    emu->isa->instructions[0x69](emu);
+    assert(emu->registers[EAX] == 0xc552eb47);
+
+    emu->isa->instructions[0x0f](emu);
+    assert(emu->registers[EAX] == 0x755a2972);
+    assert((emu->eflags & OF) == 0);
+
+    emu->isa->instructions[0xf7](emu);
+    assert(emu->registers[EAX] == 0x55a29720);
+    assert(emu->registers[EDX] == 0x7);
+    assert((emu->eflags & CF) != 0);
+    assert(emu->eip == 0x7c0b);
+
+    emu = init_emu();
+
+    // idiv ecx
+    memcpy(emu->memory + emu->eip, "\xf7\xf9", 2);
+    emu->registers[EAX] = -7;
+    emu->registers[EDX] = -1;
+    emu->registers[ECX] = 2;
+
+    emu->isa->instructions[0xf7](emu);
+    assert(emu->registers[EAX] == (uint32_t)-3);
+    assert(emu->registers[EDX] == (uint32_t)-1);
+}
+
+void test_movzx(void)
+{
+    Emulator* emu = init_emu();
+
+    // movzx eax, byte [ebx]; movsx ecx, byte [ebx]; movzx edx, word [ebx]
+    memcpy(emu->memory + emu->eip, "\x0f\xb6\x03\x0f\xbe\x0b\x0f\xb7\x13", 9);
+    emu->registers[EBX] = 0x100;
+    set_memory32(emu, 0x100, 0x1234a5f0);
+
+    emu->isa->instructions[0x0f](emu);
+    emu->isa->instructions[0x0f](emu);
+    emu->isa->instructions[0x0f](emu);
+
+    assert(emu->registers[EAX] == 0xf0);
+    assert(emu->registers[ECX] == 0xfffffff0);
+    assert(emu->registers[EDX] == 0xa5f0);
+    assert(emu->eip == 0x7c09);
+}
+
+void test_jcc(void)
+{
+    Emulator* emu = init_emu();
+
+    // cmp eax, ecx; jg +0x10; jle near +0x100
+    memcpy(emu->memory + emu->eip,
+           "\x39\xc8\x7f\x10\x0f\x8e\x00\x01\x00\x00", 10);
+    emu->registers[EAX] = -1;
+    emu->registers[ECX] = 1;
+
+    emu->isa->instructions[0x39](emu);
+    emu->isa->instructions[0x7f](emu);
+    assert(emu->eip == 0x7c04);
+
+    emu->isa->instructions[0x0f](emu);
+    assert(emu->eip == 0x7d0a);
+}
+
+void test_string(void)
+{
+    static const uint8_t smc[] = {
+        0xE8, 0xFB, 0x03, 0x00, 0x00, /* 7c00: call 8000 */
+        0xF3, 0xA4,                   /* 7c05: rep movsb */
+        0xE8, 0xF4, 0x03, 0x00, 0x00, /* 7c07: call 8000 */
+        0xE9, 0xEF, 0x83, 0xFF, 0xFF, /* 7c0c: jmp 0 */
+    };
+    static const uint8_t ret1[] = { 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC3 }; /* mov eax, 1; ret */
+    static const uint8_t ret2[] = { 0xB8, 0x02, 0x00, 0x00, 0x00, 0xC3 }; /* mov eax, 2; ret */
+    static const uint8_t exit_code[] = { 0xE9, 0xF9, 0x83, 0xFF, 0xFF }; /* 7c02: jmp 0 */
+    static uint8_t buffer[0x3000];
+    static uint8_t check[0x3000];
+    Emulator* emu = init_emu();
+    PX86Registers regs;
+    uint32_t i;
+
+    /* rep movsb */
+    memcpy(emu->memory + 0x1000, "hello", 6);
+    memcpy(emu->memory + emu->eip, "\xf3\xa4", 2);
+    emu->registers[ESI] = 0x1000;
+    emu->registers[EDI] = 0x2000;
+    emu->registers[ECX] = 5;
+    emu->isa->instructions[0xf3](emu);
+    assert(memcmp(emu->memory + 0x2000, "hello", 5) == 0);
+    assert(emu->registers[ESI] == 0x1005);
+    assert(emu->registers[EDI] == 0x2005);
+    assert(emu->registers[ECX] == 0);
+    assert(emu->eip == 0x7c02);
+
+    /* std; rep movsd; cld(後ろから写す) */
+    memcpy(emu->memory + emu->eip, "\xfd\xf3\xa5\xfc", 4);
+    emu->registers[ESI] = 0x1004;
+    emu->registers[EDI] = 0x3004;
+    emu->registers[ECX] = 2;
+    emu->isa->instructions[0xfd](emu);
+    emu->isa->instructions[0xf3](emu);
+    assert(is_direction(emu));
+    emu->isa->instructions[0xfc](emu);
+    assert(!is_direction(emu));
+    assert(memcmp(emu->memory + 0x3000, "hello", 6) == 0);
+    assert(emu->registers[ESI] == 0x0ffc);
+    assert(emu->registers[EDI] == 0x2ffc);
+
+    /* repne scasb(strlen) */
+    memcpy(emu->memory + emu->eip, "\xf2\xae", 2);
+    set_register8(emu, AL, 0);
+    emu->registers[EDI] = 0x1000;
+    emu->registers[ECX] = 0xffffffff;
+    emu->isa->instructions[0xf2](emu);
+    assert(emu->registers[EDI] == 0x1006);
+    assert(emu->registers[ECX] == 0xffffffff - 6);
+    assert(is_zero(emu));
+
+    /* repe cmpsb は違うバイトで止まる */
+    memcpy(emu->memory + 0x2000, "help!", 5);
+    memcpy(emu->memory + emu->eip, "\xf3\xa6", 2);
+    emu->registers[ESI] = 0x1000;
+    emu->registers[EDI] = 0x2000;
+    emu->registers[ECX] = 5;
+    emu->isa->instructions[0xf3](emu);
+    assert(emu->registers[ESI] == 0x1004);
+    assert(emu->registers[ECX] == 1);
+    assert(!is_zero(emu));
+    assert(is_carry(emu));
+
+    /* rep stosd, lodsb */
+    memcpy(emu->memory + emu->eip, "\xf3\xab\xac", 3);
+    emu->registers[EAX] = 0x11223344;
+    emu->registers[EDI] = 0x4000;
+    emu->registers[ECX] = 3;
+    emu->registers[ESI] = 0x1001;
+    emu->isa->instructions[0xf3](emu);
+    emu->isa->instructions[0xac](emu);
+    assert(get_memory32(emu, 0x4000) == 0x11223344);
+    assert(get_memory32(emu, 0x4008) == 0x11223344);
+    assert(get_memory32(emu, 0x400c) == 0);
+    assert(emu->registers[EDI] == 0x400c);
+    assert(get_register8(emu, AL) == 'e');
+    assert(emu->registers[ESI] == 0x1002);
+
+    /* ECX が 0 なら何もしない */
+    memcpy(emu->memory + emu->eip, "\xf3\xaa", 2);
+    emu->registers[ECX] = 0;
+    emu->isa->instructions[0xf3](emu);
+    assert(emu->registers[EDI] == 0x400c);
+
+    /* RAM の中はページごとにまとめて処理する(ページをまたぐ長さ) */
+    emu = px86_create(-1, -1);
+    assert(emu != NULL);
+    for (i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = i * 7 + 1;
+    }
+    assert(px86_write_memory(emu, 0x10001, buffer, sizeof(buffer)) == 0);
+    assert(px86_write_memory(emu, 0x7c00, "\xf3\xa4", 2) == 0);
+    assert(px86_write_memory(emu, 0x7c02, exit_code, sizeof(exit_code)) == 0);
+    px86_get_registers(emu, &regs);
+    regs.registers[ESI] = 0x10001;
+    regs.registers[EDI] = 0x20003;
+    regs.registers[ECX] = sizeof(buffer);
+    px86_set_registers(emu, &regs);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    assert(px86_read_memory(emu, 0x20003, check, sizeof(check)) == 0);
+    assert(memcmp(buffer, check, sizeof(check)) == 0);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[ESI] == 0x10001 + sizeof(buffer));
+    assert(regs.registers[EDI] == 0x20003 + sizeof(buffer));
+    assert(regs.registers[ECX] == 0);
+
+    /* 1バイト後ろへの重なった rep movsb は先頭のバイトで埋める */
+    regs.eip = 0x7c00;
+    regs.registers[ESI] = 0x10001;
+    regs.registers[EDI] = 0x10002;
+    regs.registers[ECX] = 100;
+    px86_set_registers(emu, &regs);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    assert(px86_read_memory(emu, 0x10001, check, 101) == 0);
+    for (i = 0; i < 101; i++) {
+        assert(check[i] == buffer[0]);
+    }
+
+    /* rep stosd */
+    assert(px86_write_memory(emu, 0x7c00, "\xf3\xab", 2) == 0);
+    regs.eip = 0x7c00;
+    regs.registers[EAX] = 0xdeadbeef;
+    regs.registers[EDI] = 0x30002;
+    regs.registers[ECX] = 0x801;
+    px86_set_registers(emu, &regs);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EDI] == 0x30002 + 0x801 * 4);
+    assert(get_memory32(emu, 0x30002) == 0xdeadbeef);
+    assert(get_memory32(emu, 0x30002 + 0x800 * 4) == 0xdeadbeef);
+    assert(get_memory32(emu, 0x30002 + 0x801 * 4) == 0);
+
+    /* repne scasb は memchr で探す */
+    memset(buffer, 'x', sizeof(buffer));
+    buffer[5000] = 0;
+    assert(px86_write_memory(emu, 0x40000, buffer, sizeof(buffer)) == 0);
+    assert(px86_write_memory(emu, 0x7c00, "\xf2\xae", 2) == 0);
+    regs.eip = 0x7c00;
+    regs.registers[EAX] = 0;
+    regs.registers[EDI] = 0x40000;
+    regs.registers[ECX] = 0xffffffff;
+    px86_set_registers(emu, &regs);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EDI] == 0x40000 + 5001);
+    assert(~regs.registers[ECX] - 1 == 5000);
+    assert(regs.eflags & ZERO_FLAG);
+
+    /* repe cmpsb はページをまたいで違うバイトを探す */
+    buffer[5000] = 'y';
+    assert(px86_write_memory(emu, 0x50000, buffer, sizeof(buffer)) == 0);
+    assert(px86_write_memory(emu, 0x7c00, "\xf3\xa6", 2) == 0);
+    regs.eip = 0x7c00;
+    regs.registers[ESI] = 0x40000;
+    regs.registers[EDI] = 0x50000;
+    regs.registers[ECX] = sizeof(buffer);
+    px86_set_registers(emu, &regs);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[ESI] == 0x40000 + 5001);
+    assert(regs.registers[ECX] == sizeof(buffer) - 5001);
+    assert(!(regs.eflags & ZERO_FLAG));
+    assert(regs.eflags & CARRY_FLAG);
+
+    /* 実行したコードを rep movsb で書き換える */
+    px86_reset(emu);
+    assert(px86_write_memory(emu, 0x7c00, smc, sizeof(smc)) == 0);
+    assert(px86_write_memory(emu, 0x8000, ret1, sizeof(ret1)) == 0);
+    assert(px86_write_memory(emu, 0x9000, ret2, sizeof(ret2)) == 0);
+    px86_get_registers(emu, &regs);
+    regs.registers[ESI] = 0x9000;
+    regs.registers[EDI] = 0x8000;
+    regs.registers[ECX] = sizeof(ret2);
+    px86_set_registers(emu, &regs);
+    assert(px86_run(emu, 0, 0x7c05, 0) == PX86_STOPPED);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EAX] == 1);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EAX] == 2);
+
+    px86_destroy(emu);
+}
+
+void test_block(void)
+{
+    Emulator* emu = init_emu();
+    Block* block;
+
+    // mov ecx, 3; add eax, ecx; cmp eax, 9; jl (offset -9); inc edx
+    memcpy(emu->memory + emu->eip,
+           "\xb9\x03\x00\x00\x00\x01\xc8\x3d\x09\x00\x00\x00\x7c\xf7\x42", 15);
+    emu->block_cache = create_block_cache();
+
+    block = lookup_block(emu);
+
+    assert(block != NULL);
+    assert(block->start == 0x7c00);
+    assert(block->end == 0x7c0e);
+    assert(block->count == 3);
+    assert(block->instructions[0].imm == 3);
+
+    // cmp と jl は1命令に融合される
+    assert(block->instructions[2].length == 7);
+    assert(block->instructions[2].imm == 9);
+    assert(block->instructions[2].fused_opecode == 0x7c);
+    assert(block->instructions[2].branch == (uint32_t)-9);
+
+    execute_block(emu, block);
+
+    assert(emu->registers[EAX] == 3);
+    assert(emu->eip == 0x7c05);
+
+    // 2回目以降はキャッシュ済みのブロックが返る
+    assert(lookup_block(emu) == lookup_block(emu));
+
+    while (emu->eip != 0x7c0e) {
+        execute_block(emu, lookup_block(emu));
+    }
+
+    assert(emu->registers[EAX] == 9);
+    assert(emu->registers[EDX] == 0);
+
+    destroy_block_cache(emu->block_cache);
+}
+
+void test_eflags(void)
+{
+    Emulator* emu = init_emu();
+
+    // cmp eax, 5; jmp (offset 0)
+    memcpy(emu->memory + emu->eip, "\x3d\x05\x00\x00\x00\xeb\x00", 7);
+    emu->registers[EAX] = -3;
+    emu->block_cache = create_block_cache();
+
+    execute_block(emu, lookup_block(emu));
+
+    // LAZY_EFLAGS のときは読まれたときに計算される
+    assert(is_less(emu));
+    assert(is_less_or_equal(emu));
+    assert(!is_zero(emu));
+    assert(!is_carry(emu));
+    assert(is_sign(emu));
+    assert(!is_overflow(emu));
+    assert(get_eflags(emu) == SF);
+
+    set_carry(emu, TRUE);
+    assert(emu->eflags == (SF | CF));
+
+    set_eflags(emu, ZF);
+    assert(is_zero(emu));
+    assert(is_less_or_equal(emu));
+    assert(!is_less(emu));
+
+    destroy_block_cache(emu->block_cache);
+}
+
+void test_fused(void)
+{
+    Emulator* emu;
+    Block* block;
+
+// macro for "cmp dword [esi], byte b; jle +4". test branch taken and "CF=c, ZF=z, SF=s, OF=o".
+#define TEST_CMP_JLE(a, b, taken, c, z, s, o) \
+    do { \
+        emu = init_emu(); \
+        memcpy(emu->memory + emu->eip, "\x83\x3e\x00\x7e\x04", 5); \
+        emu->memory[emu->eip + 2] = (b); \
+        emu->registers[ESI] = 0x100; \
+        set_memory32(emu, 0x100, (a)); \
+        emu->block_cache = create_block_cache(); \
+        block = lookup_block(emu); \
+        assert(block->count == 1); \
+        execute_block(emu, block); \
+        assert(emu->eip == ((taken) ? 0x7c09 : 0x7c05)); \
+        assert(is_carry(emu) == (c)); \
+        assert(is_zero(emu) == (z)); \
+        assert(is_sign(emu) == (s)); \
+        assert(is_overflow(emu) == (o)); \
+        destroy_block_cache(emu->block_cache); \
+    } while (0)
+
+    TEST_CMP_JLE(5, 4, 0, 0, 0, 0, 0);
+    TEST_CMP_JLE(5, 5, 1, 0, 1, 0, 0);
+    TEST_CMP_JLE(5, 6, 1, 1, 0, 1, 0);
+    TEST_CMP_JLE(-3, -4, 0, 0, 0, 0, 0);
+    TEST_CMP_JLE(0x80000000, 1, 1, 0, 0, 0, 1);
+
+#undef TEST_CMP_JLE
+
+    // cmp al, 1; jl +4 は AL を 8bit の符号付きで比べる(0x80 は -128)
+    emu = init_emu();
+    memcpy(emu->memory + emu->eip, "\x3c\x01\x7c\x04", 4);
+    emu->registers[EAX] = 0x80;
+    emu->block_cache = create_block_cache();
+    block = lookup_block(emu);
+    assert(block->count == 1);
+    execute_block(emu, block);
+    assert(emu->eip == 0x7c08);
+    assert(is_overflow(emu));
+    assert(!is_sign(emu));
+    destroy_block_cache(emu->block_cache);
+}
+
+/* テスト用のデバイス(最後に書き込まれた値を読み出す) */
+static uint32_t latch_value;
+static uint32_t latch_offset;
+
+static uint32_t latch_read(void* opaque, uint32_t offset, int size)
+{
+    latch_offset = offset;
+    return latch_value;
+}
+
+static void latch_write(void* opaque, uint32_t offset, uint32_t value, int size)
+{
+    latch_offset = offset;
+    latch_value = value;
+}
+
+void test_bus(void)
+{
+    Emulator* emu = init_emu();
+    uint8_t rom[16] = { 0x78, 0x56, 0x34, 0x12 };
+
+    init_memory_bus(emu, 0x10000);
+    assert(emu->ram_limit == 0x10000);
+
+    assert(map_mmio(emu, 0x8000, 0x100, latch_read, latch_write, NULL));
+    assert(map_rom(emu, 0xf000, sizeof(rom), rom));
+
+    /* デバイスより前だけを直接読み書きする */
+    assert(emu->ram_limit == 0x8000);
+
+    set_memory32(emu, 0x7ffc, 0xaabbccdd);
+    assert(get_memory32(emu, 0x7ffc) == 0xaabbccdd);
+
+    set_memory32(emu, 0x8010, 0xcafebabe);
+    assert(latch_value == 0xcafebabe);
+    assert(latch_offset == 0x10);
+    assert(emu->memory[0x8010] == 0);
+    assert(get_memory32(emu, 0x8020) == 0xcafebabe);
+    assert(latch_offset == 0x20);
+
+    /* ROM への書き込みは無視する */
+    set_memory32(emu, 0xf000, 0);
+    assert(get_memory32(emu, 0xf000) == 0x12345678);
+    assert(get_memory8(emu, 0xf002) == 0x34);
+
+    /* RAM とデバイスにまたがるアクセスは1バイトずつ */
+    latch_value = 0x11;
+    assert(get_memory32(emu, 0x7ffe) == 0x1111aabb);
+
+    /* スタックもバスを通る */
+    emu->registers[ESP] = 0x8100;
+    push32(emu, 0x01020304);
+    assert(latch_value == 0x01020304);
+    assert(pop32(emu) == 0x01020304);
+    assert(emu->registers[ESP] == 0x8100);
+
+    destroy_memory_bus(emu);
+}
+
+void test_paging(void)
+{
+    static sigjmp_buf jmp;
+    static Emulator* emu;
+    uint32_t* pd;
+    uint32_t* pt;
+
+    emu = init_emu();
+    pd = (uint32_t*)(emu->memory + 0x20000);
+    pt = (uint32_t*)(emu->memory + 0x21000);
+
+    /* 線形アドレス 0x400000 から 2ページを 0x30000, 0x31000 に対応させる */
+    pd[1] = 0x21000 | PTE_PRESENT | PTE_WRITABLE;
+    pt[0] = 0x30000 | PTE_PRESENT | PTE_WRITABLE;
+    pt[1] = 0x31000 | PTE_PRESENT;
+
+    /* mov cr3, eax; mov eax, cr0 */
+    emu->memory[0x7c00] = 0x0F;
+    emu->memory[0x7c01] = 0x22;
+    emu->memory[0x7c02] = 0xD8;
+    emu->memory[0x7c03] = 0x0F;
+    emu->memory[0x7c04] = 0x20;
+    emu->memory[0x7c05] = 0xC0;
+    set_register32(emu, EAX, 0x20000);
+    emu->isa->instructions[0x0F](emu);
+    assert(emu->cr3 == 0x20000);
+    assert(emu->eip == 0x7c03);
+
+    /* 恒等写像していないのでコードを読む前にページングを有効にしない */
+    set_control_register(emu, 0, CR0_PE);
+    emu->isa->instructions[0x0F](emu);
+    assert(get_register32(emu, EAX) == CR0_PE);
+
+    set_control_register(emu, 0, CR0_PE | CR0_PG);
+
+    set_memory32(emu, 0x400010, 0xdeadbeef);
+    assert(*(uint32_t*)(emu->memory + 0x30010) == 0xdeadbeef);
+    assert(get_memory32(emu, 0x400010) == 0xdeadbeef);
+    assert(emu->tlb_misses == 1);
+    assert(emu->tlb_hits == 1);
+    assert(pd[1] & PTE_ACCESSED);
+    assert(pt[0] & PTE_DIRTY);
+
+    /* ページをまたぐ書き込み(CR0.WP でなければ書き込み禁止でも書ける) */
+    set_memory32(emu, 0x400ffe, 0x11223344);
+    assert(emu->memory[0x30fff] == 0x33);
+    assert(emu->memory[0x31000] == 0x22);
+    assert(get_memory32(emu, 0x400ffe) == 0x11223344);
+
+    /* invlpg するまでは古い変換を使う */
+    pt[0] = 0x32000 | PTE_PRESENT | PTE_WRITABLE;
+    assert(get_memory32(emu, 0x400010) == 0xdeadbeef);
+    invalidate_page(emu, 0x400010);
+    assert(get_memory32(emu, 0x400010) == 0);
+
+    /* CR3 を書き換えると TLB を全て捨てる */
+    emu->tlb_misses = 0;
+    set_control_register(emu, 3, 0x20000);
+    get_memory32(emu, 0x400010);
+    assert(emu->tlb_misses == 1);
+
+    /* 存在しないページ */
+    if (sigsetjmp(jmp, 1) == 0) {
+        catch_guest_fault(emu, &jmp);
+        get_memory8(emu, 0x800004);
+        emu->fault_address = 0;
+    }
+    catch_guest_fault(NULL, NULL);
+    assert(emu->fault_address == 0x800004);
+    assert(emu->cr2 == 0x800004);
+
+    /* CR0.WP なら書き込み禁止のページに書き込めない */
+    set_control_register(emu, 0, CR0_PE | CR0_PG | CR0_WP);
+    if (sigsetjmp(jmp, 1) == 0) {
+        catch_guest_fault(emu, &jmp);
+        set_memory8(emu, 0x401000, 0);
+        emu->fault_address = 0;
+    }
+    catch_guest_fault(NULL, NULL);
+    assert(emu->cr2 == 0x401000);
 }
 
+void test_smc(void)
+{
+    Emulator* emu = init_emu();
+    Block* block;
+
+    // 7c00: mov eax, 7
+    // 7c05: inc ecx; mov [0x7d01], eax; cmp ecx, 100; jl 7c05
+    // 7c10: jmp 7d00
+    memcpy(emu->memory + 0x7c00,
+           "\xb8\x07\x00\x00\x00\x41\xa3\x01\x7d\x00\x00\x83\xf9\x64\x7c\xf5"
+           "\xe9\xeb\x00\x00\x00", 21);
+    // 7d00: mov edx, 1; ud2
+    memcpy(emu->memory + 0x7d00, "\xba\x01\x00\x00\x00\x0f\x0b", 7);
+    emu->block_cache = create_block_cache();
+
+    // 書き換えられる側のブロックを先にキャッシュしておく
+    emu->eip = 0x7d00;
+    block = lookup_block(emu);
+    assert(block->instructions[0].imm == 1);
+    assert(IS_CODE_PAGE(emu->block_cache, 0x7d01));
+
+    // 同じページでもコードのない範囲への書き込みではブロックを捨てない
+    set_memory32(emu, 0x7e00, 0);
+    assert(emu->block_cache->smc_writes == 0);
+    assert(lookup_block(emu) == block && block->count == 1);
+
+    emu->eip = 0x7c00;
+    while (emu->eip != 0x7d05) {
+        execute_block(emu, lookup_block(emu));
+
+        // ループの途中(JIT なら変換済みのコードの実行中)でもう一度キャッシュする
+        if (emu->registers[ECX] == 80 && emu->eip == 0x7c05) {
+            emu->eip = 0x7d00;
+            lookup_block(emu);
+            emu->eip = 0x7c05;
+        }
+    }
+
+#ifdef ENABLE_JIT
+    emu->eip = 0x7c05;
+    assert(lookup_block(emu)->native != NULL);
+#endif
+    assert(emu->registers[ECX] == 100);
+    assert(emu->registers[EDX] == 7);
+    assert(emu->block_cache->smc_writes == 2);
+    assert(emu->block_cache->smc_invalidations == 2);
+
+    // ブロックの中で後ろの命令を書き換えたときは、書き込んだ命令でブロックを
+    // 終えて書き換え後の命令を実行する
+    // 7c00: mov byte [0x7c08], 5; mov edx, 1; jmp 7c00
+    memcpy(emu->memory + 0x7c00,
+           "\xc6\x05\x08\x7c\x00\x00\x05\xba\x01\x00\x00\x00\xeb\xf2", 14);
+    flush_block_cache(emu->block_cache);
+    emu->retired = 0;
+    emu->eip = 0x7c00;
+    execute_block(emu, lookup_block(emu));
+    assert(emu->eip == 0x7c07);
+    assert(emu->retired == 1);
+    execute_block(emu, lookup_block(emu));
+    assert(emu->registers[EDX] == 5);
+    assert(emu->eip == 0x7c00);
+    assert(emu->retired == 3);
+    assert(emu->block_cache->smc_invalidations == 3);
+
+    // 変換済みのコードの実行中でも同じ(ECX が 80 になったら書き換える)
+    // 7c00: inc ecx; mov [ebx], al; mov edx, 1; cmp ecx, 100; jl 7c00
+    memcpy(emu->memory + 0x7c00,
+           "\x41\x88\x03\xba\x01\x00\x00\x00\x83\xf9\x64\x7c\xf3", 13);
+    flush_block_cache(emu->block_cache);
+    emu->registers[EAX] = 5;
+    emu->registers[EBX] = 0x100;
+    emu->registers[ECX] = 0;
+    emu->retired = 0;
+    emu->eip = 0x7c00;
+    while (emu->registers[ECX] != 81 || emu->eip != 0x7c00) {
+        block = lookup_block(emu);
+        if (emu->registers[ECX] == 80 && emu->eip == 0x7c00) {
+#ifdef ENABLE_JIT
+            assert(block->native != NULL);
+#endif
+            emu->registers[EBX] = 0x7c04;
+        }
+        execute_block(emu, block);
+    }
+    assert(emu->registers[EDX] == 5);
+    assert(emu->retired == 81 * 5);
+
+    // 実行中でないブロックを書き換えても、実行中のブロックは最後まで実行する
+    // 7c00: mov [0x7d01], eax; mov ecx, 1; jmp 7c00
+    memcpy(emu->memory + 0x7c00, "\xa3\x01\x7d\x00\x00\xb9\x01\x00\x00\x00\xeb\xf4", 12);
+    flush_block_cache(emu->block_cache);
+    emu->eip = 0x7d00;
+    lookup_block(emu);
+    emu->retired = 0;
+    emu->registers[ECX] = 0;
+    emu->eip = 0x7c00;
+    execute_block(emu, lookup_block(emu));
+    assert(emu->eip == 0x7c00);
+    assert(emu->registers[ECX] == 1);
+    assert(emu->retired == 3);
+
+    // 書き込んだ分岐命令の飛び先が同じブロックの途中でも、命令数は
+    // 書き込んだ命令までで数える
+    // 7c00: mov eax, 1; 7c05: inc eax; 7c06: call 7c05(戻り先を 7c08 に積む)
+    memcpy(emu->memory + 0x7c00, "\xb8\x01\x00\x00\x00\x40\xe8\xfa\xff\xff\xff", 11);
+    flush_block_cache(emu->block_cache);
+    emu->retired = 0;
+    emu->registers[ESP] = 0x7c0c;
+    emu->eip = 0x7c00;
+    execute_block(emu, lookup_block(emu));
+    assert(emu->eip == 0x7c05);
+    assert(emu->registers[EAX] == 2);
+    assert(emu->retired == 3);
+
+    destroy_block_cache(emu->block_cache);
+}
+
+void test_trace(void)
+{
+    const char* filename = "test_trace.bin";
+    Emulator* emu = init_emu();
+    Trace* trace;
+    Instruction insn[2];
+    uint32_t before[REGISTERS_COUNT];
+    TraceHeader header;
+    TraceRecord records[5];
+    FILE* file;
+    int i;
+
+    // mov ecx, 3; push ecx; add eax, ecx; rep movsb
+    memcpy(emu->memory + emu->eip, "\xb9\x03\x00\x00\x00\x51\x01\xc8\xf3\xa4", 10);
+    emu->registers[EAX] = 1;
+    emu->registers[ESI] = 0x100;
+    emu->registers[EDI] = 0x200;
+
+    trace = open_trace(filename, emu);
+    assert(trace != NULL);
+
+    for (i = 0; i < 4; i++) {
+        uint32_t eip = emu->eip;
+        decode_instruction(emu, eip, &insn[0]);
+        end_instructions(&insn[1]);
+        memcpy(before, emu->registers, sizeof(before));
+        execute_instructions(emu, insn);
+        trace_instruction(trace, emu, &insn[0], eip, before);
+    }
+
+    // int 3 の受け付け(戻り先と EFLAGS を積む)
+    memcpy(before, emu->registers, sizeof(before));
+    emu->int_index = 3;
+    interrupt(emu);
+    trace_interrupt(trace, emu, 0x7c0a, before);
+
+    close_trace(trace);
+
+    file = fopen(filename, "rb");
+    assert(file != NULL);
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    assert(fread(records, sizeof(TraceRecord), 5, file) == 5);
+    assert(fgetc(file) == EOF);
+    fclose(file);
+    remove(filename);
+
+    assert(memcmp(header.magic, TRACE_MAGIC, 8) == 0);
+    assert(header.eip == 0x7c00);
+    assert(header.registers[EAX] == 1);
+
+    assert(records[0].eip == 0x7c00);
+    assert(records[0].opecode == 0xb9);
+    assert(records[0].changed == 1 << ECX);
+    assert(records[0].values[0] == 3);
+
+    assert(records[1].eip == 0x7c05);
+    assert(records[1].changed == 1 << ESP);
+    assert(records[1].values[0] == 0x7bfc);
+
+    assert(records[2].opecode == 0x01);
+    assert(records[2].flags & TRACE_HAS_MODRM);
+    assert(records[2].modrm == 0xc8);
+    assert(records[2].changed == 1 << EAX);
+    assert(records[2].values[0] == 4);
+
+    // 文字列命令が変える3つのレジスタは全て記録する
+    assert(records[3].eip == 0x7c08);
+    assert(records[3].changed == (1 << ECX | 1 << ESI | 1 << EDI));
+    assert(!(records[3].flags & TRACE_MORE_REGS));
+    assert(records[3].values[0] == 0);
+    assert(records[3].values[1] == 0x103);
+    assert(records[3].values[2] == 0x203);
+
+    assert(records[4].eip == 0x7c0a);
+    assert(records[4].flags == TRACE_INTERRUPT);
+    assert(records[4].changed == 1 << ESP);
+    assert(records[4].values[0] == 0x7bf4);
+}
+
+void test_profile(void)
+{
+    const char* filename = "test_profile.txt";
+    Emulator* emu = init_emu();
+    Profiler* profiler = create_profiler(NULL, 100);
+    char line[256];
+    FILE* file;
+
+    assert(profiler != NULL);
+    assert(next_sample(profiler) == 100);
+
+    // 0x7c20 から呼ばれた関数が 0x7c10 から呼んだ関数の中で止まっている
+    set_memory32(emu, 0x7000, 0x7100);
+    set_memory32(emu, 0x7004, 0x7c11);
+    set_memory32(emu, 0x7100, 0);
+    set_memory32(emu, 0x7104, 0x7c21);
+    emu->registers[EBP] = 0x7000;
+    emu->eip = 0x7c30;
+
+    emu->retired = 105;
+    profile_sample(profiler, emu);
+    assert(next_sample(profiler) == 205);
+    profile_sample(profiler, emu);
+
+    // フレームのないところで止まっている
+    emu->registers[EBP] = 0;
+    emu->eip = 0x7c40;
+    profile_sample(profiler, emu);
+
+    assert(write_profile(profiler, filename));
+    destroy_profiler(profiler);
+
+    file = fopen(filename, "r");
+    assert(file != NULL);
+    assert(fgets(line, sizeof(line), file) != NULL);
+    assert(strcmp(line, "0x00007c20;0x00007c10;0x00007c30 2\n") == 0);
+    assert(fgets(line, sizeof(line), file) != NULL);
+    assert(strcmp(line, "0x00007c40 1\n") == 0);
+    assert(fgets(line, sizeof(line), file) == NULL);
+    fclose(file);
+    remove(filename);
+}
+
+static void library_write(void* opaque, uint16_t offset, uint32_t value, int size)
+{
+    uint8_t* output = opaque;
+
+    output[0] = value;
+}
+
+typedef struct {
+    uint16_t offset;
+    uint32_t value;
+    int size;
+} TestPort;
+
+static uint32_t test_port_read(void* opaque, uint16_t offset, int size)
+{
+    TestPort* port = opaque;
+
+    port->offset = offset;
+    port->size = size;
+    return port->value;
+}
+
+static void test_port_write(void* opaque, uint16_t offset, uint32_t value, int size)
+{
+    TestPort* port = opaque;
+
+    port->offset = offset;
+    port->value = value;
+    port->size = size;
+}
+
+void test_io(void)
+{
+    static Emulator other;
+    Emulator* emu = init_emu();
+    TestPort a = { 0, 0x12345678, 0 };
+    TestPort b = { 0, 0xabcd, 0 };
+    TestPort c = { 0, 0x55, 0 };
+    int i;
+
+    /* デバイスがなければ読み込みは 0 */
+    assert(io_in8(emu, 0x60) == 0);
+    io_out8(emu, 0x60, 1);
+
+    init_io_ports(emu);
+    init_io_ports(&other);
+
+    assert(map_io_ports(emu, 0x40, 4, test_port_read, test_port_write, &a));
+    assert(map_io_ports(emu, 0x42, 1, test_port_read, test_port_write, &b));
+    assert(map_io_ports(&other, 0x40, 4, test_port_read, test_port_write, &c));
+    assert(!map_io_ports(emu, 0xfff0, 0x20, test_port_read, test_port_write, &a));
+
+    /* 幅ごとの読み書きと、後から割り当てたデバイスの優先 */
+    assert(io_in(emu, 0x41, 4) == 0x12345678);
+    assert(a.offset == 1 && a.size == 4);
+    assert(io_in(emu, 0x42, 2) == 0xabcd);
+    assert(b.offset == 0 && b.size == 2);
+    io_out(emu, 0x43, 0xbeef, 2);
+    assert(a.offset == 3 && a.value == 0xbeef && a.size == 2);
+    assert(io_in(emu, 0x44, 1) == 0);
+
+    /* in al, dx / out dx, al は1バイトで読み書きする */
+    set_register32(emu, EDX, 0x40);
+    set_register8(emu, AL, 0x99);
+    emu->memory[0x7c00] = 0xEE;
+    emu->memory[0x7c01] = 0xEC;
+    emu->isa->instructions[0xEE](emu);
+    assert(a.value == 0x99 && a.size == 1);
+    a.value = 0x12345677;
+    emu->isa->instructions[0xEC](emu);
+    assert(get_register8(emu, AL) == 0x77);
+
+    /* インスタンスごとに別のデバイスを持つ */
+    assert(io_in(&other, 0x42, 1) == 0x55);
+    assert(b.size == 2);
+
+    /* 一杯になるまで割り当てられる */
+    for (i = 3; i < IO_MAX_DEVICES; i++) {
+        assert(map_io_ports(emu, 0x100 + i, 1, NULL, NULL, NULL));
+    }
+    assert(!map_io_ports(emu, 0x200, 1, NULL, NULL, NULL));
+
+    destroy_io_ports(&other);
+    destroy_io_ports(emu);
+}
+
+/* fd から読める分を読む(なければ 0 を返す) */
+static int read_available(int fd, char* buffer, int size)
+{
+    int n = read(fd, buffer, size - 1);
+
+    n = n < 0 ? 0 : n;
+    buffer[n] = '\0';
+    return n;
+}
+
+void test_serial(void)
+{
+    Emulator* emu = init_emu();
+    Serial* serial;
+    int out[2], in[2];
+    char buffer[SERIAL_BUFFER_SIZE + 16];
+    int i;
+
+    assert(pipe(out) == 0 && pipe(in) == 0);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+    init_io_ports(emu);
+    serial = create_serial(in[0], out[1]);
+    assert(serial->line_mode == FALSE);
+    assert(map_serial(emu, serial, 0x03f8, SERIAL_COM1_IRQ));
+
+    /* 改行では書き出さない */
+    io_out8(emu, 0x03f8, 'a');
+    io_out8(emu, 0x03f8, '\n');
+    assert(read_available(out[0], buffer, sizeof(buffer)) == 0);
+
+    /* 入力を読むときに書き出す */
+    assert(write(in[1], "x", 1) == 1);
+    assert(io_in8(emu, 0x03f8) == 'x');
+    assert(read_available(out[0], buffer, sizeof(buffer)) == 2);
+    assert(strcmp(buffer, "a\n") == 0);
+
+    /* 行単位のモードでは改行で書き出す */
+    serial->line_mode = TRUE;
+    io_out8(emu, 0x03f8, 'b');
+    assert(read_available(out[0], buffer, sizeof(buffer)) == 0);
+    io_out8(emu, 0x03f8, '\n');
+    assert(read_available(out[0], buffer, sizeof(buffer)) == 2);
+
+    /* 一杯になったら書き出す */
+    serial->line_mode = FALSE;
+    for (i = 0; i < SERIAL_BUFFER_SIZE + 1; i++) {
+        io_out8(emu, 0x03f8, 'c');
+    }
+    assert(read_available(out[0], buffer, sizeof(buffer)) == SERIAL_BUFFER_SIZE);
+
+    /* 破棄するときに残りを書き出す */
+    destroy_serial(serial);
+    assert(read_available(out[0], buffer, sizeof(buffer)) == 1);
+
+    destroy_io_ports(emu);
+    close(out[0]);
+    close(out[1]);
+    close(in[0]);
+    close(in[1]);
+}
+
+void test_uart(void)
+{
+    Emulator* emu = init_emu();
+    Serial* serial;
+    int out[2], in[2];
+    int i;
+
+    assert(pipe(out) == 0 && pipe(in) == 0);
+
+    init_io_ports(emu);
+    serial = create_serial(in[0], out[1]);
+    assert(map_serial(emu, serial, 0x03f8, SERIAL_COM1_IRQ));
+
+    assert(io_in8(emu, 0x03f8 + UART_LSR) == (UART_LSR_THRE | UART_LSR_TEMT));
+    assert(io_in8(emu, 0x03f8 + UART_IIR) == (UART_IIR_FIFO | UART_IIR_NONE));
+
+    /* 分周比のレジスタ */
+    io_out8(emu, 0x03f8 + UART_LCR, UART_LCR_DLAB);
+    io_out8(emu, 0x03f8 + UART_DATA, 0x0c);
+    io_out8(emu, 0x03f8 + UART_IER, 0x00);
+    assert(serial->divisor == 12);
+    io_out8(emu, 0x03f8 + UART_LCR, 0x03);
+
+    /* 受信データが届くと IRQ 4 を要求する */
+    io_out8(emu, 0x03f8 + UART_IER, UART_IER_RX);
+    assert(emu->irq_lines == 0);
+    assert(write(in[1], "ab", 2) == 2);
+    for (i = 0; i < 1000 && !(io_in8(emu, 0x03f8 + UART_LSR) & UART_LSR_DR); i++) {
+        usleep(1000);
+    }
+    assert(io_in8(emu, 0x03f8 + UART_LSR) & UART_LSR_DR);
+    assert(emu->irq_lines == 1 << SERIAL_COM1_IRQ);
+    assert(io_in8(emu, 0x03f8 + UART_IIR) == (UART_IIR_FIFO | UART_IIR_RX));
+
+    /* IF が立っているときだけ IRQ_VECTOR_BASE + 4 のハンドラに入る */
+    set_memory32(emu, (IRQ_VECTOR_BASE + SERIAL_COM1_IRQ) * 4, 0x9000);
+    interrupt(emu);
+    assert(emu->eip == 0x7c00);
+    emu->memory[0x7c00] = 0xFB;
+    emu->isa->instructions[0xFB](emu);
+    assert(is_interrupt(emu));
+    interrupt(emu);
+    assert(emu->eip == 0x9000);
+    assert(!is_interrupt(emu));
+    assert(get_memory32(emu, 0x7bf8) == 0x7c01);
+    interrupt(emu);
+    assert(emu->eip == 0x9000);
+
+    /* 読み終えると要求を取り下げる */
+    for (i = 0; i < 1000 && __atomic_load_n(&serial->fifo_count, __ATOMIC_ACQUIRE) < 2; i++) {
+        usleep(1000);
+    }
+    assert(io_in8(emu, 0x03f8) == 'a');
+    assert(emu->irq_lines != 0);
+    assert(io_in8(emu, 0x03f8) == 'b');
+    assert(emu->irq_lines == 0);
+
+    /* iretd で戻ると IF も戻る */
+    emu->memory[0x9000] = 0xCF;
+    emu->isa->instructions[0xCF](emu);
+    assert(emu->eip == 0x7c01);
+    assert(is_interrupt(emu));
+    assert(get_register32(emu, ESP) == 0x7c00);
+    emu->memory[0x7c01] = 0xFA;
+    emu->isa->instructions[0xFA](emu);
+    assert(!is_interrupt(emu));
+
+    /* THR の割り込みは許可するとすぐに起き、IIR を読むと消える */
+    io_out8(emu, 0x03f8 + UART_IER, UART_IER_THR);
+    assert(emu->irq_lines == 1 << SERIAL_COM1_IRQ);
+    assert(io_in8(emu, 0x03f8 + UART_IIR) == (UART_IIR_FIFO | UART_IIR_THR));
+    assert(emu->irq_lines == 0);
+    assert(io_in8(emu, 0x03f8 + UART_IIR) == (UART_IIR_FIFO | UART_IIR_NONE));
+
+    /* ソフトウェア割り込みは IF に関係なく int_index のベクタに入る */
+    set_memory32(emu, 0x21 * 4, 0xa000);
+    emu->int_index = 0x21;
+    interrupt(emu);
+    assert(emu->eip == 0xa000);
+    assert(emu->int_index == -1);
+
+    /* 入力の終わりの後は 0xff */
+    close(in[1]);
+    assert(io_in8(emu, 0x03f8) == 0xff);
+
+    destroy_serial(serial);
+    destroy_io_ports(emu);
+    close(out[0]);
+    close(out[1]);
+    close(in[0]);
+}
+
+static int event_log[8];
+static int event_count;
+
+static void log_event(Emulator* emu, void* opaque)
+{
+    event_log[event_count++] = (int)(intptr_t)opaque;
+
+    /* 処理関数の中で予約したイベントも時刻を過ぎていれば実行する */
+    if ((intptr_t)opaque == 1) {
+        schedule_event(emu, emu->retired, log_event, (void*)(intptr_t)5);
+    }
+}
+
+void test_scheduler(void)
+{
+    Emulator* emu = init_emu();
+
+    init_scheduler(emu);
+    event_count = 0;
+    assert(emu->next_event == UINT64_MAX);
+
+    assert(schedule_event(emu, 300, log_event, (void*)3));
+    assert(schedule_event(emu, 100, log_event, (void*)1));
+    assert(schedule_event(emu, 200, log_event, (void*)2));
+    assert(schedule_event(emu, 300, log_event, (void*)4));
+    assert(schedule_event(emu, 250, log_event, (void*)6));
+    assert(emu->next_event == 100);
+
+    cancel_event(emu, log_event, (void*)6);
+
+    emu->retired = 99;
+    run_events(emu);
+    assert(event_count == 0);
+
+    emu->retired = 150;
+    run_events(emu);
+    assert(event_count == 2);
+    assert(event_log[0] == 1 && event_log[1] == 5);
+    assert(emu->next_event == 200);
+
+    /* 同じ時刻のイベントは予約した順 */
+    emu->retired = 1000;
+    run_events(emu);
+    assert(event_count == 5);
+    assert(event_log[2] == 2 && event_log[3] == 3 && event_log[4] == 4);
+    assert(emu->next_event == UINT64_MAX);
+
+    while (schedule_event(emu, 2000, log_event, (void*)7)) {
+    }
+    assert(emu->scheduler->count == SCHEDULER_MAX_EVENTS);
+    clear_events(emu);
+    assert(emu->next_event == UINT64_MAX);
+
+    destroy_scheduler(emu);
+}
+
+void test_pit(void)
+{
+    static const uint8_t code[] = {
+        0xBA, 0x43, 0x00, 0x00, 0x00, /* 7c00: mov edx, 0x43 */
+        0xB0, 0x34,                   /* 7c05: mov al, 0x34(カウンタ 0, モード 2) */
+        0xEE,                         /* 7c07: out dx, al */
+        0xBA, 0x40, 0x00, 0x00, 0x00, /* 7c08: mov edx, 0x40 */
+        0xB0, 0xA9,                   /* 7c0d: mov al, 0xa9 */
+        0xEE,                         /* 7c0f: out dx, al */
+        0xB0, 0x04,                   /* 7c10: mov al, 0x04(初期値 1193 = 1ms) */
+        0xEE,                         /* 7c12: out dx, al */
+        0xFB,                         /* 7c13: sti */
+        0x83, 0xFB, 0x03,             /* 7c14: cmp ebx, 3 */
+        0x75, 0xFB,                   /* 7c17: jnz 7c14 */
+        0xE9, 0xE2, 0x83, 0xFF, 0xFF, /* 7c19: jmp 0 */
+    };
+    static const uint8_t handler[] = {
+        0x43,                         /* inc ebx */
+        0xCF,                         /* iretd */
+    };
+    Emulator* emu = init_emu();
+    Pit* pit = create_pit();
+    uint64_t period = 1193 * VIRTUAL_HZ / PIT_HZ;
+    uint16_t count;
+    PX86Registers regs;
+
+    init_io_ports(emu);
+    init_scheduler(emu);
+    assert(map_pit(emu, pit, PIT_PORT, PIT_IRQ));
+
+    /* カウンタ 0 をモード 2、初期値 1193 にする */
+    io_out8(emu, PIT_PORT + PIT_CONTROL, 0x34);
+    io_out8(emu, PIT_PORT, 1193 & 0xff);
+    assert(emu->next_event == UINT64_MAX);
+    io_out8(emu, PIT_PORT, 1193 >> 8);
+    assert(emu->next_event == period);
+
+    /* 半分の時刻でラッチして読む */
+    emu->retired = period / 2;
+    io_out8(emu, PIT_PORT + PIT_CONTROL, 0x00);
+    emu->retired = period - 1;
+    count = io_in8(emu, PIT_PORT);
+    count |= io_in8(emu, PIT_PORT) << 8;
+    assert(count >= 1193 / 2 - 1 && count <= 1193 / 2 + 1);
+
+    /* 0 になると IRQ 0 を1回要求して、初期値から数えなおす */
+    emu->retired = period;
+    run_events(emu);
+    assert(emu->irq_pulses == 1 << PIT_IRQ);
+    assert(emu->next_event == period * 2);
+    set_memory32(emu, (IRQ_VECTOR_BASE + PIT_IRQ) * 4, 0x9000);
+    set_interrupt(emu, TRUE);
+    interrupt(emu);
+    assert(emu->eip == 0x9000);
+    assert(emu->irq_pulses == 0);
+    assert(!has_interrupt(emu));
+
+    /* モード 0 は1回だけ */
+    io_out8(emu, PIT_PORT + PIT_CONTROL, 0x30);
+    io_out8(emu, PIT_PORT, 10);
+    io_out8(emu, PIT_PORT, 0);
+    emu->retired += 1000;
+    run_events(emu);
+    assert(emu->irq_pulses == 1 << PIT_IRQ);
+    assert(emu->next_event == UINT64_MAX);
+
+    destroy_pit(pit);
+    destroy_scheduler(emu);
+    destroy_io_ports(emu);
+
+    /* ゲストがタイマーの割り込みを3回受ける */
+    emu = px86_create(-1, -1);
+    assert(emu != NULL);
+    assert(px86_write_memory(emu, 0x7c00, code, sizeof(code)) == 0);
+    assert(px86_write_memory(emu, 0x9000, handler, sizeof(handler)) == 0);
+    set_memory32(emu, (IRQ_VECTOR_BASE + PIT_IRQ) * 4, 0x9000);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EBX] == 3);
+    assert(virtual_time(emu) >= period * 3);
+    assert(virtual_time(emu) < period * 3 + 100);
+    px86_destroy(emu);
+}
+
+/* 少し遅れて入力を書き込むスレッド(ゲストが hlt で眠ってから届く) */
+static void* delayed_input(void* arg)
+{
+    int fd = *(int*)arg;
+
+    usleep(20000);
+    if (write(fd, "A", 1) != 1) {
+        perror("write");
+    }
+    return NULL;
+}
+
+void test_hlt(void)
+{
+    static const uint8_t timer[] = {
+        0xBA, 0x43, 0x00, 0x00, 0x00, /* 7c00: mov edx, 0x43 */
+        0xB0, 0x34,                   /* 7c05: mov al, 0x34(カウンタ 0, モード 2) */
+        0xEE,                         /* 7c07: out dx, al */
+        0xBA, 0x40, 0x00, 0x00, 0x00, /* 7c08: mov edx, 0x40 */
+        0xB0, 0xA9,                   /* 7c0d: mov al, 0xa9 */
+        0xEE,                         /* 7c0f: out dx, al */
+        0xB0, 0x04,                   /* 7c10: mov al, 0x04(初期値 1193 = 1ms) */
+        0xEE,                         /* 7c12: out dx, al */
+        0xFB,                         /* 7c13: sti */
+        0xF4,                         /* 7c14: hlt */
+        0x83, 0xFB, 0x03,             /* 7c15: cmp ebx, 3 */
+        0x75, 0xFA,                   /* 7c18: jnz 7c14 */
+        0xE9, 0xE1, 0x83, 0xFF, 0xFF, /* 7c1a: jmp 0 */
+    };
+    static const uint8_t timer_handler[] = {
+        0x43,                         /* inc ebx */
+        0xCF,                         /* iretd */
+    };
+    static const uint8_t input[] = {
+        0xBA, 0xF9, 0x03, 0x00, 0x00, /* 7c00: mov edx, 0x3f9 */
+        0xB0, 0x01,                   /* 7c05: mov al, 1(受信で割り込む) */
+        0xEE,                         /* 7c07: out dx, al */
+        0xFB,                         /* 7c08: sti */
+        0xF4,                         /* 7c09: hlt */
+        0xE9, 0xF1, 0x83, 0xFF, 0xFF, /* 7c0a: jmp 0 */
+    };
+    static const uint8_t input_handler[] = {
+        0xBA, 0xF8, 0x03, 0x00, 0x00, /* mov edx, 0x3f8 */
+        0xEC,                         /* in al, dx */
+        0x89, 0xC3,                   /* mov ebx, eax */
+        0xCF,                         /* iretd */
+    };
+    static const uint8_t cli_hlt[] = { 0xFA, 0xF4 };
+    static const uint8_t sti_hlt[] = { 0xFB, 0xF4 };
+    uint64_t period = 1193 * VIRTUAL_HZ / PIT_HZ;
+    Emulator* emu = px86_create(-1, -1);
+    PX86Registers regs;
+    Serial* serial;
+    pthread_t writer;
+    int fds[2];
+
+    /* タイマーの割り込みを hlt で待つ間は仮想時間を進めるだけ */
+    assert(emu != NULL);
+    assert(px86_write_memory(emu, 0x7c00, timer, sizeof(timer)) == 0);
+    assert(px86_write_memory(emu, 0x9000, timer_handler, sizeof(timer_handler)) == 0);
+    set_memory32(emu, (IRQ_VECTOR_BASE + PIT_IRQ) * 4, 0x9000);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EBX] == 3);
+    assert(px86_retired(emu) < 100);
+    assert(virtual_time(emu) >= period * 3);
+    assert(virtual_time(emu) < period * 3 + 100);
+
+    /* cli; hlt はもう起きない */
+    px86_reset(emu);
+    assert(px86_write_memory(emu, 0x7c00, cli_hlt, sizeof(cli_hlt)) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_HALTED);
+    assert(emu->halted);
+
+    /* 割り込みを許可していても、割り込むものがなければ止まる */
+    px86_reset(emu);
+    assert(px86_write_memory(emu, 0x7c00, sti_hlt, sizeof(sti_hlt)) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_HALTED);
+
+    /* 入力を待つ間は眠り、届いたら受信の割り込みで起きる */
+    px86_reset(emu);
+    assert(pipe(fds) == 0);
+    serial = create_serial(fds[0], STDOUT_FILENO);
+    assert(map_serial(emu, serial, SERIAL_COM1_PORT, SERIAL_COM1_IRQ));
+    assert(px86_write_memory(emu, 0x7c00, input, sizeof(input)) == 0);
+    assert(px86_write_memory(emu, 0x9000, input_handler, sizeof(input_handler)) == 0);
+    set_memory32(emu, (IRQ_VECTOR_BASE + SERIAL_COM1_IRQ) * 4, 0x9000);
+    assert(pthread_create(&writer, NULL, delayed_input, &fds[1]) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 1000) == PX86_EXITED);
+    pthread_join(writer, NULL);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EBX] == 'A');
+
+    /* 入力が終わればもう起きない */
+    px86_reset(emu);
+    close(fds[1]);
+    assert(px86_write_memory(emu, 0x7c00, input, sizeof(input)) == 0);
+    assert(px86_write_memory(emu, 0x9000, input_handler, sizeof(input_handler)) == 0);
+    set_memory32(emu, (IRQ_VECTOR_BASE + SERIAL_COM1_IRQ) * 4, 0x9000);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 1000) == PX86_HALTED);
+
+    destroy_serial(serial);
+    close(fds[0]);
+    px86_destroy(emu);
+}
+
+void test_idle_loop(void)
+{
+    static const uint8_t flag[] = {
+        0xBA, 0x43, 0x00, 0x00, 0x00, /* 7c00: mov edx, 0x43 */
+        0xB0, 0x34,                   /* 7c05: mov al, 0x34(カウンタ 0, モード 2) */
+        0xEE,                         /* 7c07: out dx, al */
+        0xBA, 0x40, 0x00, 0x00, 0x00, /* 7c08: mov edx, 0x40 */
+        0xB0, 0xA9,                   /* 7c0d: mov al, 0xa9 */
+        0xEE,                         /* 7c0f: out dx, al */
+        0xB0, 0x04,                   /* 7c10: mov al, 0x04(初期値 1193 = 1ms) */
+        0xEE,                         /* 7c12: out dx, al */
+        0xFB,                         /* 7c13: sti */
+        0x83, 0x3D, 0x00, 0x80, 0x00, 0x00, 0x00, /* 7c14: cmp dword [0x8000], 0 */
+        0x74, 0xF7,                   /* 7c1b: je 7c14 */
+        0xE9, 0xDE, 0x83, 0xFF, 0xFF, /* 7c1d: jmp 0 */
+    };
+    static const uint8_t flag_handler[] = {
+        0xC7, 0x05, 0x00, 0x80, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, /* mov dword [0x8000], 1 */
+        0xCF,                         /* iretd */
+    };
+    static const uint8_t lsr[] = {
+        0xBA, 0xFD, 0x03, 0x00, 0x00, /* 7c00: mov edx, 0x3fd */
+        0xEC,                         /* 7c05: in al, dx */
+        0x24, 0x01,                   /* 7c06: and al, 1 */
+        0x74, 0xFB,                   /* 7c08: jz 7c05 */
+        0xBA, 0xF8, 0x03, 0x00, 0x00, /* 7c0a: mov edx, 0x3f8 */
+        0xEC,                         /* 7c0f: in al, dx */
+        0x89, 0xC3,                   /* 7c10: mov ebx, eax */
+        0xE9, 0xE9, 0x83, 0xFF, 0xFF, /* 7c12: jmp 0 */
+    };
+    static const uint8_t counter[] = {
+        0xBA, 0x40, 0x00, 0x00, 0x00, /* 7c00: mov edx, 0x40 */
+        0xEC,                         /* 7c05: in al, dx */
+        0xEB, 0xFD,                   /* 7c06: jmp 7c05 */
+    };
+    static const uint8_t store[] = {
+        0x89, 0x18,                   /* 7c00: mov [eax], ebx */
+        0xEB, 0xFC,                   /* 7c02: jmp 7c00 */
+    };
+    static const uint8_t loop[] = { 0xEB, 0xFE };   /* jmp $ */
+    uint64_t period = 1193 * VIRTUAL_HZ / PIT_HZ;
+    Emulator* emu = px86_create(-1, -1);
+    PX86Registers regs;
+    Block* block;
+    Serial* serial;
+    pthread_t writer;
+    int fds[2];
+
+    /* 先頭に戻る分岐で終わり、書き込まないブロックが候補になる */
+    assert(emu != NULL);
+    assert(px86_write_memory(emu, 0x7c00, flag, sizeof(flag)) == 0);
+    emu->eip = 0x7c14;
+    block = lookup_block(emu);
+    assert(block->idle == (IDLE_LOOP | IDLE_READS_MEMORY));
+    emu->eip = 0x7c00;
+    assert(lookup_block(emu)->idle == 0);
+
+    assert(px86_write_memory(emu, 0x7c00, lsr, sizeof(lsr)) == 0);
+    emu->eip = 0x7c05;
+    assert(lookup_block(emu)->idle == IDLE_LOOP);
+
+    assert(px86_write_memory(emu, 0x7c00, store, sizeof(store)) == 0);
+    emu->eip = 0x7c00;
+    assert(lookup_block(emu)->idle == 0);
+
+    /* 割り込みハンドラが立てるフラグを待つ間は仮想時間を進めるだけ */
+    px86_reset(emu);
+    assert(px86_write_memory(emu, 0x7c00, flag, sizeof(flag)) == 0);
+    assert(px86_write_memory(emu, 0x9000, flag_handler, sizeof(flag_handler)) == 0);
+    set_memory32(emu, (IRQ_VECTOR_BASE + PIT_IRQ) * 4, 0x9000);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    assert(px86_retired(emu) < 100);
+    assert(virtual_time(emu) >= period);
+    assert(virtual_time(emu) < period + 100);
+
+    /* LSR を読み続けるループは入力が届くまで眠る */
+    px86_reset(emu);
+    assert(pipe(fds) == 0);
+    serial = create_serial(fds[0], STDOUT_FILENO);
+    assert(map_serial(emu, serial, SERIAL_COM1_PORT, SERIAL_COM1_IRQ));
+    assert(px86_write_memory(emu, 0x7c00, lsr, sizeof(lsr)) == 0);
+    assert(pthread_create(&writer, NULL, delayed_input, &fds[1]) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 1000) == PX86_EXITED);
+    pthread_join(writer, NULL);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EBX] == 'A');
+    assert(px86_retired(emu) < 100);
+    destroy_serial(serial);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* 時間とともに変わるカウンタを読むループは実行し続ける */
+    px86_reset(emu);
+    assert(px86_write_memory(emu, 0x7c00, counter, sizeof(counter)) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 10) == PX86_TIMEOUT);
+    assert(px86_retired(emu) > 1000);
+
+    /* 抜けられないループ(命令数を指定すれば数え続ける) */
+    px86_reset(emu);
+    assert(px86_write_memory(emu, 0x7c00, loop, sizeof(loop)) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_HALTED);
+    assert(px86_run(emu, 1000, PX86_NO_STOP, 0) == PX86_COUNT);
+
+    px86_destroy(emu);
+}
+
+void test_library(void)
+{
+    static const uint8_t code[] = {
+        0xB8, 0x05, 0x00, 0x00, 0x00, /* 7c00: mov eax, 5 */
+        0x01, 0xC0,                   /* 7c05: add eax, eax */
+        0x01, 0xC0,                   /* 7c07: add eax, eax */
+        0x01, 0xC0,                   /* 7c09: add eax, eax */
+        0xBA, 0xF8, 0x03, 0x00, 0x00, /* 7c0b: mov edx, 0x3f8 */
+        0xEE,                         /* 7c10: out dx, al */
+        0xE9, 0xEA, 0x83, 0xFF, 0xFF, /* 7c11: jmp 0 */
+    };
+    static const uint8_t loop[] = { 0xEB, 0xFE };   /* jmp $ */
+    static const uint8_t ud2[] = { 0x0F, 0x0B };
+    uint8_t output[2] = { 0, 0 };
+    Emulator* emu = px86_create(-1, -1);
+    Emulator* other = px86_create(-1, -1);
+    PX86Registers regs;
+    uint8_t buffer[2];
+
+    assert(emu != NULL && other != NULL);
+    assert(px86_write_memory(emu, 0x7c00, code, sizeof(code)) == 0);
+    assert(px86_write_memory(emu, MEMORY_SIZE - 1, code, 2) == -1);
+    assert(px86_map_io(emu, 0x03f8, 1, NULL, library_write, &output[0]) == 0);
+    assert(px86_map_io(other, 0x03f8, 1, NULL, library_write, &output[1]) == 0);
+
+    /* 命令数でブロックの途中で止まる */
+    assert(px86_run(emu, 2, PX86_NO_STOP, 0) == PX86_COUNT);
+    px86_get_registers(emu, &regs);
+    assert(regs.eip == 0x7c07);
+    assert(regs.registers[EAX] == 10);
+    assert(px86_retired(emu) == 2);
+
+    assert(px86_step(emu) == PX86_COUNT);
+    assert(px86_retired(emu) == 3);
+
+    assert(px86_run(emu, 0, 0x7c10, 0) == PX86_STOPPED);
+    px86_get_registers(emu, &regs);
+    assert(regs.registers[EAX] == 40);
+
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    assert(output[0] == 40 && output[1] == 0);
+    assert(px86_retired(emu) == 7);
+
+    /* もう1つのインスタンスは別の状態を持つ */
+    assert(px86_read_memory(other, 0x7c00, buffer, 2) == 0);
+    assert(buffer[0] == 0 && buffer[1] == 0);
+    regs.registers[EAX] = 3;
+    regs.eip = 0x7c09;
+    assert(px86_write_memory(other, 0x7c00, code, sizeof(code)) == 0);
+    px86_set_registers(other, &regs);
+    assert(px86_run(other, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    assert(output[1] == 6);
+
+    /* 止まらないループは時間切れで止まる */
+    px86_reset(emu);
+    assert(px86_read_memory(emu, 0x7c00, buffer, 2) == 0);
+    assert(buffer[0] == 0);
+    assert(px86_write_memory(emu, 0x7c00, loop, sizeof(loop)) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 10) == PX86_TIMEOUT);
+    px86_get_registers(emu, &regs);
+    assert(regs.eip == 0x7c00);
+
+    /* 書き換えたコードを実行する */
+    assert(px86_write_memory(emu, 0x7c00, ud2, sizeof(ud2)) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_NOT_IMPLEMENTED);
+
+    px86_destroy(other);
+    px86_destroy(emu);
+}
+
+void test_console(void)
+{
+    static const uint8_t code[] = {
+        0xBA, 0xF8, 0x03, 0x00, 0x00, /* 7c00: mov edx, 0x3f8 */
+        0xB0, 0x78,                   /* 7c05: mov al, 'x' */
+        0xEE,                         /* 7c07: out dx, al */
+        0xEC,                         /* 7c08: in al, dx */
+        0xE9, 0xF2, 0x83, 0xFF, 0xFF, /* 7c09: jmp 0 */
+    };
+    Emulator* emu;
+    PX86Registers regs;
+    char buffer[4];
+    int fds[2];
+
+    /* 渡したファイルディスクリプタに書き出し、入力がなければ 0xff を読む */
+    assert(pipe(fds) == 0);
+    emu = px86_create(-1, fds[1]);
+    assert(emu != NULL);
+    assert(px86_write_memory(emu, 0x7c00, code, sizeof(code)) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    px86_get_registers(emu, &regs);
+    assert((regs.registers[EAX] & 0xff) == 0xff);
+    assert(read(fds[0], buffer, sizeof(buffer)) == 1 && buffer[0] == 'x');
+    px86_destroy(emu);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* コンソールをつながなければ出力は捨てる */
+    emu = px86_create(-1, -1);
+    assert(emu != NULL);
+    assert(px86_write_memory(emu, 0x7c00, code, sizeof(code)) == 0);
+    assert(px86_run(emu, 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    px86_get_registers(emu, &regs);
+    assert((regs.registers[EAX] & 0xff) == 0xff);
+    px86_destroy(emu);
+}
+
+#ifdef OPCODE_STATS
+void test_stats(void)
+{
+    Emulator* emu = init_emu();
+    uint64_t mov = emu->opcode_stats[0xb9].count;
+    uint64_t add = emu->opcode_stats[STATS_GROUP + 0].count;
+    uint64_t sub = emu->opcode_stats[STATS_GROUP + 5].count;
+    uint64_t cr = emu->opcode_stats[STATS_TWO_BYTE + 0x20].count;
+
+    emu->block_cache = create_block_cache();
+
+    // mov ecx, 3; add ecx, 1; add ecx, 1; sub ecx, 1; mov eax, cr0; ret
+    memcpy(emu->memory + emu->eip,
+           "\xb9\x03\x00\x00\x00\x83\xc1\x01\x83\xc1\x01\x83\xe9\x01\x0f\x20\xc0\xc3", 18);
+    execute_block(emu, lookup_block(emu));
+
+    assert(emu->registers[ECX] == 4);
+    assert(emu->opcode_stats[0xb9].count == mov + 1);
+    assert(emu->opcode_stats[STATS_GROUP + 0].count == add + 2);
+    assert(emu->opcode_stats[STATS_GROUP + 5].count == sub + 1);
+    assert(emu->opcode_stats[STATS_TWO_BYTE + 0x20].count == cr + 1);
+    assert(stats_index(0xff, 0, 6) == STATS_GROUP + 2 * 8 + 6);
+
+    destroy_block_cache(emu->block_cache);
+}
+#endif
+
+#ifdef RAM_GUARD_PAGES
+void test_ram(void)
+{
+    static sigjmp_buf jmp;
+    static Emulator* emu;
+    static uint8_t* memory;
+
+    emu = init_emu();
+    memory = create_ram(MEMORY_SIZE);
+    emu->memory = memory;
+
+    assert(memory != NULL);
+
+    set_memory32(emu, MEMORY_SIZE - 4, 0x12345678);
+    assert(get_memory32(emu, MEMORY_SIZE - 4) == 0x12345678);
+
+    if (sigsetjmp(jmp, 1) == 0) {
+        catch_guest_fault(emu, &jmp);
+        set_memory8(emu, MEMORY_SIZE + 0x10, 1);
+        emu->fault_address = 0;
+    }
+    catch_guest_fault(NULL, NULL);
+
+    assert(emu->fault_address == MEMORY_SIZE + 0x10);
+
+    if (sigsetjmp(jmp, 1) == 0) {
+        catch_guest_fault(emu, &jmp);
+        get_memory8(emu, 0xffffffff);
+        emu->fault_address = 0;
+    }
+    catch_guest_fault(NULL, NULL);
+
+    assert(emu->fault_address == 0xffffffff);
+
+    destroy_ram(memory, MEMORY_SIZE);
+
+    /* ゲストのメモリの外での SIGBUS(長さ 0 のファイルの mmap)は捕まえずに
+     * そのシグナルで落ちる(繰り返しフォルトし続けない) */
+    {
+        const char* filename = "test_sigbus.bin";
+        int status;
+        pid_t pid = fork();
+
+        assert(pid >= 0);
+        if (pid == 0) {
+            int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+            volatile uint8_t* host = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+
+            alarm(5);
+            catch_guest_fault(emu, &jmp);
+            if (host != MAP_FAILED) {
+                status = host[0];
+            }
+            _exit(0);
+        }
+        assert(waitpid(pid, &status, 0) == pid);
+        remove(filename);
+        assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGBUS);
+    }
+}
+#endif
+
+#ifdef ENABLE_JIT
+void test_jit(void)
+{
+    Emulator* emu = init_emu();
+    Block* block;
+
+    // loop: add eax, ecx; push eax; pop ebx; mov [ebp-4], ebx; inc ecx;
+    //       cmp ecx, 100 (83 /7); jl loop
+    memcpy(emu->memory + emu->eip,
+           "\x01\xc8\x50\x5b\x89\x5d\xfc\x41\x83\xf9\x64\x7c\xf3\x42", 14);
+    emu->registers[EBP] = 0x100;
+    emu->block_cache = create_block_cache();
+
+    while (emu->eip != 0x7c0d) {
+        block = lookup_block(emu);
+        execute_block(emu, block);
+    }
+
+    assert(block->native != NULL);
+    assert(block->native_count == 6);
+    assert(emu->registers[EAX] == 4950);
+    assert(emu->registers[EBX] == 4950);
+    assert(emu->registers[ECX] == 100);
+    assert(emu->registers[ESP] == 0x7c00);
+    assert(get_memory32(emu, 0xfc) == 4950);
+    assert((emu->eflags & ZF) != 0);
+    assert((emu->eflags & CF) == 0);
+
+    destroy_block_cache(emu->block_cache);
+}
+#endif
+
+#ifdef LOOP_IDIOMS
+void test_idiom(void)
+{
+    /* gcc -m32 -O0 の memcpy(8000), strlen(8035), memset(805c) */
+    static const uint8_t functions[] = {
+        0x55, 0x89, 0xe5, 0x83, 0xec, 0x10, 0xc7, 0x45, 0xfc, 0x00, 0x00, 0x00,
+        0x00, 0xeb, 0x19, 0x8b, 0x55, 0xfc, 0x8b, 0x45, 0x0c, 0x01, 0xd0, 0x8b,
+        0x4d, 0xfc, 0x8b, 0x55, 0x08, 0x01, 0xca, 0x0f, 0xb6, 0x00, 0x88, 0x02,
+        0x83, 0x45, 0xfc, 0x01, 0x8b, 0x45, 0xfc, 0x3b, 0x45, 0x10, 0x7c, 0xdf,
+        0x8b, 0x45, 0x08, 0xc9, 0xc3, 0x55, 0x89, 0xe5, 0x83, 0xec, 0x10, 0xc7,
+        0x45, 0xfc, 0x00, 0x00, 0x00, 0x00, 0xeb, 0x04, 0x83, 0x45, 0xfc, 0x01,
+        0x8b, 0x55, 0x08, 0x8b, 0x45, 0xfc, 0x01, 0xd0, 0x0f, 0xb6, 0x00, 0x84,
+        0xc0, 0x75, 0xed, 0x8b, 0x45, 0xfc, 0xc9, 0xc3, 0x55, 0x89, 0xe5, 0x83,
+        0xec, 0x10, 0xc7, 0x45, 0xfc, 0x00, 0x00, 0x00, 0x00, 0xeb, 0x11, 0x8b,
+        0x55, 0xfc, 0x8b, 0x45, 0x08, 0x01, 0xd0, 0x8b, 0x55, 0x0c, 0x88, 0x10,
+        0x83, 0x45, 0xfc, 0x01, 0x8b, 0x45, 0xfc, 0x3b, 0x45, 0x10, 0x7c, 0xe7,
+        0x90, 0x90, 0xc9, 0xc3,
+    };
+    static const uint8_t program[] = {
+        0x68, 0x00, 0x01, 0x00, 0x00, /* 7c00: push 0x100 */
+        0x68, 0x00, 0x00, 0x01, 0x00, /* 7c05: push 0x10000 */
+        0x68, 0x00, 0x00, 0x02, 0x00, /* 7c0a: push 0x20000 */
+        0xE8, 0xEC, 0x03, 0x00, 0x00, /* 7c0f: call memcpy */
+        0x83, 0xC4, 0x0C,             /* 7c14: add esp, 12 */
+        0x68, 0x00, 0x00, 0x01, 0x00, /* 7c17: push 0x10000 */
+        0xE8, 0x14, 0x04, 0x00, 0x00, /* 7c1c: call strlen */
+        0x83, 0xC4, 0x04,             /* 7c21: add esp, 4 */
+        0x89, 0xC3,                   /* 7c24: mov ebx, eax */
+        0x6A, 0x50,                   /* 7c26: push 0x50 */
+        0x6A, 0x41,                   /* 7c28: push 'A' */
+        0x68, 0x00, 0x00, 0x03, 0x00, /* 7c2a: push 0x30000 */
+        0xE8, 0x28, 0x04, 0x00, 0x00, /* 7c2f: call memset */
+        0x83, 0xC4, 0x0C,             /* 7c34: add esp, 12 */
+        0x6A, 0x40,                   /* 7c37: push 0x40 */
+        0x68, 0x00, 0x00, 0x01, 0x00, /* 7c39: push 0x10000 */
+        0x68, 0x01, 0x00, 0x01, 0x00, /* 7c3e: push 0x10001(1バイト後ろに重なる) */
+        0xE8, 0xB8, 0x03, 0x00, 0x00, /* 7c43: call memcpy */
+        0x83, 0xC4, 0x0C,             /* 7c48: add esp, 12 */
+        0xE9, 0xB0, 0x83, 0xFF, 0xFF, /* 7c4b: jmp 0 */
+    };
+    static uint8_t text[300];
+    static uint8_t memory[2][MEMORY_SIZE];
+    PX86Registers regs[2];
+    Emulator* emu[2];
+    uint64_t retired;
+    uint32_t i;
+    int j;
+
+    for (i = 0; i < sizeof(text); i++) {
+        text[i] = i % 255 + 1;
+    }
+
+    /* ブロックごとに実行した結果と、1命令ずつ実行した結果が同じになる */
+    for (j = 0; j < 2; j++) {
+        emu[j] = px86_create(-1, -1);
+        assert(emu[j] != NULL);
+        assert(px86_write_memory(emu[j], 0x7c00, program, sizeof(program)) == 0);
+        assert(px86_write_memory(emu[j], 0x8000, functions, sizeof(functions)) == 0);
+        assert(px86_write_memory(emu[j], 0x10000, text, sizeof(text)) == 0);
+    }
+
+    assert(px86_run(emu[0], 0, PX86_NO_STOP, 0) == PX86_EXITED);
+    while (px86_step(emu[1]) == PX86_COUNT) {
+    }
+
+    for (j = 0; j < 2; j++) {
+        px86_get_registers(emu[j], &regs[j]);
+        assert(px86_read_memory(emu[j], 0, memory[j], MEMORY_SIZE) == 0);
+    }
+    assert(memcmp(&regs[0], &regs[1], sizeof(PX86Registers)) == 0);
+    assert(memcmp(memory[0], memory[1], MEMORY_SIZE) == 0);
+    assert(regs[0].registers[EBX] == sizeof(text));
+    assert(memory[0][0x10001] == text[0] && memory[0][0x10040] == text[0]);
+    assert(memory[0][0x10041] == text[0x41]);
+    assert(memcmp(memory[0] + 0x20000, text, 0x100) == 0);
+    assert(memory[0][0x3004f] == 'A' && memory[0][0x30050] == 0);
+
+    /* 最後の1周以外をまとめて実行した(まとめた周回も命令数に数える) */
+    assert(emu[0]->block_cache->idiom_hits[IDIOM_MEMCPY] == 2);
+    assert(emu[0]->block_cache->idiom_iterations[IDIOM_MEMCPY] == 0xff + 0x3f);
+    assert(emu[0]->block_cache->idiom_hits[IDIOM_STRLEN] == 1);
+    assert(emu[0]->block_cache->idiom_iterations[IDIOM_STRLEN] == sizeof(text) - 1);
+    assert(emu[0]->block_cache->idiom_hits[IDIOM_MEMSET] == 1);
+    assert(emu[0]->block_cache->idiom_iterations[IDIOM_MEMSET] == 0x4f);
+    assert(emu[1]->block_cache->idiom_hits[IDIOM_MEMCPY] == 0);
+    assert(px86_retired(emu[0]) == px86_retired(emu[1]));
+    retired = px86_retired(emu[0]);
+
+    px86_destroy(emu[0]);
+    px86_destroy(emu[1]);
+
+    /* 命令数を指定した実行は、まとめて実行してもちょうどで止まる */
+    for (j = 0; j < 2; j++) {
+        emu[j] = px86_create(-1, -1);
+        assert(emu[j] != NULL);
+        assert(px86_write_memory(emu[j], 0x7c00, program, sizeof(program)) == 0);
+        assert(px86_write_memory(emu[j], 0x8000, functions, sizeof(functions)) == 0);
+        assert(px86_write_memory(emu[j], 0x10000, text, sizeof(text)) == 0);
+    }
+
+    assert(px86_run(emu[0], retired / 2, PX86_NO_STOP, 0) == PX86_COUNT);
+    for (i = 0; i < retired / 2; i++) {
+        assert(px86_step(emu[1]) == PX86_COUNT);
+    }
+
+    for (j = 0; j < 2; j++) {
+        px86_get_registers(emu[j], &regs[j]);
+        assert(px86_read_memory(emu[j], 0, memory[j], MEMORY_SIZE) == 0);
+    }
+    assert(memcmp(&regs[0], &regs[1], sizeof(PX86Registers)) == 0);
+    assert(memcmp(memory[0], memory[1], MEMORY_SIZE) == 0);
+    assert(px86_retired(emu[0]) == retired / 2);
+    assert(emu[0]->block_cache->idiom_hits[IDIOM_MEMCPY] > 0);
+
+    px86_destroy(emu[0]);
+    px86_destroy(emu[1]);
+}
+#endif
+
 int main(void)
 {
-    init_instructions();
+    init_instructions(&isa);
 
     RUN(test_basic_functions);
     RUN(test_parse_modrm);
+    RUN(test_sib);
     RUN(test_set_rm8);
     RUN(test_set_rm32);
     RUN(test_get_rm8);
@@ -1015,6 +3040,41 @@ int main(void)
     RUN(test_eb);
     RUN(test_f7);
     RUN(test_ff);
+    RUN(test_alu);
+    RUN(test_shift);
+    RUN(test_imul);
+    RUN(test_movzx);
+    RUN(test_jcc);
+    RUN(test_string);
+    RUN(test_block);
+    RUN(test_eflags);
+    RUN(test_fused);
+    RUN(test_bus);
+    RUN(test_paging);
+    RUN(test_smc);
+    RUN(test_trace);
+    RUN(test_profile);
+    RUN(test_io);
+    RUN(test_serial);
+    RUN(test_uart);
+    RUN(test_scheduler);
+    RUN(test_pit);
+    RUN(test_hlt);
+    RUN(test_idle_loop);
+    RUN(test_library);
+    RUN(test_console);
+#ifdef OPCODE_STATS
+    RUN(test_stats);
+#endif
+#ifdef RAM_GUARD_PAGES
+    RUN(test_ram);
+#endif
+#ifdef ENABLE_JIT
+    RUN(test_jit);
+#endif
+#ifdef LOOP_IDIOMS
+    RUN(test_idiom);
+#endif
 
     print_result();
 }
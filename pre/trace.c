@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "trace.h"
+#include "emulator_function.h"
+
+/* 書き出し用のスレッドがバッファが空のときに待つ時間(ナノ秒) */
+#define TRACE_FLUSH_INTERVAL 1000000
+
+/* エミュレータのスレッドが書き込み、書き出し用のスレッドが読み出す
+ * リングバッファ(1対1なのでロックを使わない) */
+struct Trace {
+    /* 次に書き込む位置(エミュレータのスレッドだけが進める) */
+    _Atomic uint32_t head;
+
+    TraceRecord records[TRACE_BUFFER_SIZE];
+
+    /* 次に読み出す位置(書き出し用のスレッドだけが進める) */
+    _Atomic uint32_t tail;
+
+    /* 記録の終わり */
+    atomic_int stop;
+
+    FILE* file;
+    pthread_t thread;
+};
+
+static void* flush_thread(void* arg)
+{
+    Trace* trace = arg;
+    struct timespec interval = { 0, TRACE_FLUSH_INTERVAL };
+
+    for (;;) {
+        /* stop を先に読むので、それまでに書き込まれたレコードは必ず書き出す */
+        int stop = atomic_load_explicit(&trace->stop, memory_order_acquire);
+        uint32_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        uint32_t index = tail & (TRACE_BUFFER_SIZE - 1);
+        uint32_t count = head - tail;
+
+        if (count == 0) {
+            if (stop) {
+                break;
+            }
+            nanosleep(&interval, NULL);
+            continue;
+        }
+
+        /* バッファの終端で折り返す前の分だけ書き出す */
+        if (index + count > TRACE_BUFFER_SIZE) {
+            count = TRACE_BUFFER_SIZE - index;
+        }
+        fwrite(&trace->records[index], sizeof(TraceRecord), count, trace->file);
+
+        atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+    }
+
+    return NULL;
+}
+
+Trace* open_trace(const char* filename, Emulator* emu)
+{
+    Trace* trace;
+    TraceHeader header;
+
+    trace = calloc(1, sizeof(Trace));
+    if (trace == NULL) {
+        return NULL;
+    }
+
+    trace->file = fopen(filename, "wb");
+    if (trace->file == NULL) {
+        free(trace);
+        return NULL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(TraceRecord);
+    header.eip = emu->eip;
+    header.eflags = get_eflags(emu);
+    memcpy(header.registers, emu->registers, sizeof(header.registers));
+    fwrite(&header, sizeof(header), 1, trace->file);
+
+    if (pthread_create(&trace->thread, NULL, flush_thread, trace) != 0) {
+        fclose(trace->file);
+        free(trace);
+        return NULL;
+    }
+
+    return trace;
+}
+
+void close_trace(Trace* trace)
+{
+    atomic_store_explicit(&trace->stop, 1, memory_order_release);
+    pthread_join(trace->thread, NULL);
+
+    fclose(trace->file);
+    free(trace);
+}
+
+/* 空いているレコードを取り出し、変わったレジスタと EFLAGS を入れる
+ * (書き終えたら commit_record で書き出し用のスレッドに渡す) */
+static TraceRecord* begin_record(Trace* trace, Emulator* emu, uint32_t eip,
+                                 const uint32_t* before)
+{
+    uint32_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    TraceRecord* record;
+    int count = 0;
+    int i;
+
+    /* 一杯なら書き出されるのを待つ */
+    while (head - atomic_load_explicit(&trace->tail, memory_order_acquire)
+           == TRACE_BUFFER_SIZE) {
+        sched_yield();
+    }
+
+    record = &trace->records[head & (TRACE_BUFFER_SIZE - 1)];
+    record->eip = eip;
+    record->opecode = 0;
+    record->modrm = 0;
+    record->changed = 0;
+    record->flags = 0;
+    record->eflags = get_eflags(emu);
+    memset(record->values, 0, sizeof(record->values));
+
+    for (i = 0; i < REGISTERS_COUNT; i++) {
+        if (emu->registers[i] == before[i]) {
+            continue;
+        }
+
+        record->changed |= 1 << i;
+        if (count < TRACE_VALUES) {
+            record->values[count++] = emu->registers[i];
+        } else {
+            record->flags |= TRACE_MORE_REGS;
+        }
+    }
+
+    return record;
+}
+
+static void commit_record(Trace* trace)
+{
+    uint32_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+void trace_instruction(Trace* trace, Emulator* emu, Instruction* insn,
+                       uint32_t eip, const uint32_t* before)
+{
+    TraceRecord* record = begin_record(trace, emu, eip, before);
+
+    record->opecode = insn->opecode;
+    if (insn->format & OPF_MODRM) {
+        ModRM* modrm = &insn->modrm;
+        record->modrm = modrm->mod << 6 | modrm->reg_index << 3 | modrm->rm;
+        record->flags |= TRACE_HAS_MODRM;
+    }
+
+    commit_record(trace);
+}
+
+void trace_interrupt(Trace* trace, Emulator* emu, uint32_t eip, const uint32_t* before)
+{
+    TraceRecord* record = begin_record(trace, emu, eip, before);
+
+    record->flags |= TRACE_INTERRUPT;
+    commit_record(trace);
+}
@@ -0,0 +1,73 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "instruction.h"
+
+/* トレースファイルの先頭の識別子 */
+#define TRACE_MAGIC "PX86TRC1"
+
+/* リングバッファに置けるレコード数(2のべき乗) */
+#define TRACE_BUFFER_SIZE (1 << 16)
+
+/* TraceRecord.flags */
+#define TRACE_HAS_MODRM (1 << 0) /* modrm が有効 */
+#define TRACE_MORE_REGS (1 << 1) /* TRACE_VALUES より多くのレジスタが変わった */
+#define TRACE_INTERRUPT (1 << 2) /* 命令ではなく割り込みの受け付け(opecode, modrm は 0) */
+
+/* 1レコードに記録するレジスタの値の数(文字列命令は ECX, ESI, EDI を変える) */
+#define TRACE_VALUES 3
+
+/* トレースファイルのヘッダ(実行開始時のレジスタ) */
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t eip;
+    uint32_t eflags;
+    uint32_t registers[REGISTERS_COUNT];
+} TraceHeader;
+
+/* 1命令分のレコード(固定長)
+ *
+ * changed は値が変わった汎用レジスタのビットマスク(1 << EAX など)で、
+ * values に番号の小さいレジスタから順に変更後の値を TRACE_VALUES 個まで入れる。
+ */
+typedef struct {
+    uint32_t eip;
+    uint8_t opecode;
+    uint8_t modrm;
+    uint8_t changed;
+    uint8_t flags;
+    uint32_t eflags;
+    uint32_t values[TRACE_VALUES];
+} TraceRecord;
+
+typedef struct Trace Trace;
+
+/* トレースファイルを作り、書き出し用のスレッドを起動する
+ *
+ * 開けなければ NULL を返す。
+ */
+Trace* open_trace(const char* filename, Emulator* emu);
+
+/* バッファに残っているレコードを全て書き出して閉じる */
+void close_trace(Trace* trace);
+
+/* 実行した命令を記録する
+ *
+ * eip は命令のアドレス、before は実行前の汎用レジスタ。
+ * バッファが一杯なら書き出し用のスレッドが空けるまで待つ。
+ */
+void trace_instruction(Trace* trace, Emulator* emu, Instruction* insn,
+                       uint32_t eip, const uint32_t* before);
+
+/* 割り込みの受け付け(interrupt)を記録する
+ *
+ * eip は受け付ける前の EIP(戻り先)、before は受け付ける前の汎用レジスタ。
+ * 飛び先は次のレコードの eip になる。
+ */
+void trace_interrupt(Trace* trace, Emulator* emu, uint32_t eip, const uint32_t* before);
+
+#endif
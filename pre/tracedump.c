@@ -0,0 +1,107 @@
+/* px86 -t で記録したトレースファイルを読みやすい形で出力する */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+static const char* registers_name[] = {
+    "EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"
+};
+
+/* unknown は値が分からなくなったレジスタのビットマスク */
+static void print_record(TraceRecord* record, uint32_t* registers, uint32_t* unknown)
+{
+    int count = 0;
+    int i;
+
+    if (record->flags & TRACE_INTERRUPT) {
+        printf("EIP = %08X, Interrupt", record->eip);
+    } else {
+        printf("EIP = %08X, Code = %02X", record->eip, record->opecode);
+    }
+    if (record->flags & TRACE_HAS_MODRM) {
+        printf(", ModRM = %02X", record->modrm);
+    }
+
+    for (i = 0; i < REGISTERS_COUNT; i++) {
+        if (!(record->changed & (1 << i))) {
+            continue;
+        }
+
+        if (count < TRACE_VALUES) {
+            registers[i] = record->values[count++];
+            *unknown &= ~(1 << i);
+            printf(", %s = %08X", registers_name[i], registers[i]);
+        } else {
+            /* TRACE_VALUES 個より後の値は記録されていない */
+            *unknown |= 1 << i;
+            printf(", %s = ?", registers_name[i]);
+        }
+    }
+
+    printf(", EFLAGS = %08X\n", record->eflags);
+
+    if (record->flags & TRACE_MORE_REGS) {
+        printf("    (? は変わったが値を記録していないレジスタ。1レコードに記録するのは"
+               "%d 個までで、次に記録されるまで値は不明)\n", TRACE_VALUES);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    FILE* file;
+    TraceHeader header;
+    TraceRecord record;
+    uint32_t registers[REGISTERS_COUNT];
+    uint32_t unknown = 0;
+    unsigned long count = 0;
+    int i;
+
+    if (argc != 2) {
+        printf("usage: tracedump filename\n");
+        return 1;
+    }
+
+    file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        printf("%s ファイルを開けません\n", argv[1]);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.record_size != sizeof(TraceRecord)) {
+        printf("%s はトレースファイルではありません\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    memcpy(registers, header.registers, sizeof(registers));
+    for (i = 0; i < REGISTERS_COUNT; i++) {
+        printf("%s = %08x\n", registers_name[i], registers[i]);
+    }
+    printf("EIP = %08x\n\n", header.eip);
+
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        print_record(&record, registers, &unknown);
+        if (!(record.flags & TRACE_INTERRUPT)) {
+            count++;
+        }
+    }
+
+    /* 最後まで実行したときのレジスタ */
+    printf("\n%lu instructions\n", count);
+    for (i = 0; i < REGISTERS_COUNT; i++) {
+        if (unknown & (1 << i)) {
+            printf("%s = ? (値が記録されていない)\n", registers_name[i]);
+        } else {
+            printf("%s = %08x\n", registers_name[i], registers[i]);
+        }
+    }
+    fclose(file);
+
+    return 0;
+}